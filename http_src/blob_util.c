@@ -0,0 +1,326 @@
+/*
+ * blob_util.c
+ *
+ * Functions that implement a content-addressed store of upload
+ * bodies, so identical uploads share one copy of their bytes.
+ * A body is hashed with SHA-256 while it is written to a temp
+ * file in the store. If a blob with that digest exists, the temp
+ * file is discarded, usually before its pages are written back,
+ * and the upload becomes a hard link to the existing blob.
+ *
+ * Blobs are stored as <store>/<first 2 hex digits>/<64 hex digits>.
+ * A blob that is no longer linked into the content directory has
+ * a link count of 1, and is removed by a sweeper thread that scans
+ * the store at startup and periodically after that.
+ *
+ *  @since 2021-05-01
+ */
+
+#define _GNU_SOURCE  /* for O_DIRECTORY, O_NOFOLLOW */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <openssl/evp.h>
+#include "http_server.h"
+#include "file_util.h"
+#include "blob_util.h"
+
+/** Seconds between sweeps of the blob store */
+#define BLOB_SWEEP_SECONDS 300
+
+/** I/O priority of the sweeper: idle class (linux/ioprio.h) */
+#define SWEEP_IOPRIO ((3 << 13) | 0)
+
+/** Path of the blob store directory */
+static char blobStore[MAXPATHLEN];
+
+/**
+ * Lock that keeps the sweeper from removing a blob between
+ * the time an upload finds it and the time it is linked
+ */
+static pthread_mutex_t blobLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Test whether a name is a blob name: 2*BLOB_DIGEST_LEN hex digits.
+ *
+ * @param name the name
+ * @return true if the name is a blob name
+ */
+static bool isBlobName(const char *name) {
+    size_t n = strspn(name, "0123456789abcdef");
+    return (n == 2*BLOB_DIGEST_LEN) && (name[n] == '\0');
+}
+
+/**
+ * Remove the blobs in a subdirectory of the store that are
+ * not linked into the content directory.
+ *
+ * @param dirFd the descriptor of the subdirectory
+ * @return the number of blobs removed
+ */
+static int sweepBlobDir(int dirFd) {
+    DIR *dir = fdopendir(dirFd);
+    if (dir == NULL) {
+        close(dirFd);
+        return 0;
+    }
+    int count = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (!isBlobName(ent->d_name)) {
+            continue;
+        }
+        struct stat sb;
+        pthread_mutex_lock(&blobLock);
+        if (   (fstatat(dirFd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0)
+            && S_ISREG(sb.st_mode) && (sb.st_nlink == 1)
+            && (unlinkat(dirFd, ent->d_name, 0) == 0)) {
+            count++;
+        }
+        pthread_mutex_unlock(&blobLock);
+    }
+    closedir(dir);
+    return count;
+}
+
+/**
+ * Sweeper thread: removes unreferenced blobs from the store
+ * at idle I/O priority, at startup and then periodically.
+ *
+ * @param arg unused
+ * @return never returns
+ */
+static void *sweepThread(void *arg) {
+    (void)arg;
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, SWEEP_IOPRIO);
+    for (;;) {
+        int count = 0;
+        DIR *store = opendir(blobStore);
+        if (store != NULL) {
+            struct dirent *ent;
+            while ((ent = readdir(store)) != NULL) {
+                if (   (strlen(ent->d_name) == 2)
+                    && (strspn(ent->d_name, "0123456789abcdef") == 2)) {
+                    int dirFd = openat(dirfd(store), ent->d_name,
+                                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                    if (dirFd >= 0) {
+                        count += sweepBlobDir(dirFd);
+                    }
+                }
+            }
+            closedir(store);
+        }
+        if (server.debug && count > 0) {
+            fprintf(stderr, "removed %d unreferenced blobs\n", count);
+        }
+        sleep(BLOB_SWEEP_SECONDS);
+    }
+    return NULL;
+}
+
+/**
+ * Initialize the blob store directory. Blobs are hard linked
+ * into the content directory, so the store must be on the
+ * same file system. Temp files left by an earlier run are
+ * removed, and the sweeper thread is started.
+ *
+ * @param blobDir the blob store directory
+ * @param contentBase the content base directory
+ * @return true if the blob store can be used
+ */
+bool initBlobStore(const char *blobDir, const char *contentBase) {
+    struct stat blobSb, contentSb;
+    if (   (strlen(blobDir) >= sizeof(blobStore) - 2*BLOB_DIGEST_LEN - 8)
+        || (mkdirs(blobDir, 0755) != 0)
+        || (stat(blobDir, &blobSb) != 0)
+        || (stat(contentBase, &contentSb) != 0)
+        || (blobSb.st_dev != contentSb.st_dev)) {
+        return false;
+    }
+    strcpy(blobStore, blobDir);
+
+    // remove uploads interrupted by a restart
+    DIR *dir = opendir(blobStore);
+    if (dir != NULL) {
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            if (strncmp(ent->d_name, ".upload.", 8) == 0) {
+                unlinkat(dirfd(dir), ent->d_name, 0);
+            }
+        }
+        closedir(dir);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sweepThread, NULL) != 0) {
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+/**
+ * Start an upload to the blob store: create a temp file for
+ * the body and reserve space for it if the length is known.
+ *
+ * @param blob the upload
+ * @param len the body length or -1 if unknown
+ * @return 0 if successful, or the errno of the failure
+ */
+int beginBlob(BlobUpload *blob, long long len) {
+    char uploadPath[MAXPATHLEN];
+    snprintf(uploadPath, sizeof(uploadPath), "%s/upload", blobStore);
+    blob->stream = NULL;
+    blob->md = NULL;
+    blob->reused = false;
+    if ((blob->fd = createTempFile(uploadPath, blob->tempPath)) < 0) {
+        return errno;
+    }
+    fchmod(blob->fd, DEFFILEMODE & ~server.file_mask);  // blobs are served as content
+    int err = (len > 0) ? preallocateFile(blob->fd, (off_t)len) : 0;
+    if (err == 0) {
+        blob->md = EVP_MD_CTX_new();
+        blob->stream = fdopen(blob->fd, "w");
+        if (   (blob->md == NULL) || (blob->stream == NULL)
+            || (EVP_DigestInit_ex(blob->md, EVP_sha256(), NULL) != 1)) {
+            err = ENOMEM;
+        }
+    }
+    if (err != 0) {
+        abortBlob(blob);
+        closeBlob(blob);
+    }
+    return err;
+}
+
+/**
+ * Body sink that hashes the next bytes of an upload
+ * and writes them to its temp file.
+ *
+ * @param ctx the upload
+ * @param bytes the body bytes
+ * @param len the number of bytes
+ * @return 0 if successful, -1 if error
+ */
+int blobSink(void *ctx, const char *bytes, size_t len) {
+    BlobUpload *blob = ctx;
+    if (EVP_DigestUpdate(blob->md, bytes, len) != 1) {
+        return -1;
+    }
+    return (fwrite(bytes, sizeof(char), len, blob->stream) < len) ? -1 : 0;
+}
+
+/**
+ * Finish an upload: if a blob with the same digest is stored,
+ * the temp file is discarded and the existing blob is used,
+ * otherwise the temp file becomes the blob. The blob is then
+ * hard linked at the file path, replacing any file there.
+ *
+ * @param blob the upload
+ * @param filePath the path of the uploaded file
+ * @return 0 if successful, -1 if error
+ */
+int storeBlob(BlobUpload *blob, const char *filePath) {
+    unsigned int mdLen;
+    if (   (EVP_DigestFinal_ex(blob->md, blob->digest, &mdLen) != 1)
+        || (fflush(blob->stream) != 0)) {
+        return -1;
+    }
+
+    // name the blob by its digest
+    char blobPath[MAXPATHLEN];
+    int n = snprintf(blobPath, sizeof(blobPath), "%s/%02x/", blobStore, blob->digest[0]);
+    mkdir(blobPath, 0755);  // may already exist
+    for (int i = 0; i < BLOB_DIGEST_LEN; i++) {
+        n += sprintf(blobPath + n, "%02x", blob->digest[i]);
+    }
+
+    // keep the first blob with a digest; one whose size differs
+    // is replaced, but the bytes of a blob are not verified
+    pthread_mutex_lock(&blobLock);
+    if (link(blob->tempPath, blobPath) != 0) {
+        struct stat blobSb, tempSb;
+        if (errno != EEXIST || fstat(blob->fd, &tempSb) != 0) {
+            pthread_mutex_unlock(&blobLock);
+            return -1;
+        }
+        if (stat(blobPath, &blobSb) == 0 && blobSb.st_size == tempSb.st_size) {
+            blob->reused = true;
+        } else if (rename(blob->tempPath, blobPath) != 0) {
+            pthread_mutex_unlock(&blobLock);
+            return -1;
+        }
+    }
+
+    // link under a free hidden name, then rename over the file path
+    char linkPath[MAXPATHLEN];
+    int linkFd = createTempFile(filePath, linkPath);
+    if (linkFd < 0) {
+        pthread_mutex_unlock(&blobLock);
+        return -1;
+    }
+    close(linkFd);
+    unlink(linkPath);
+    int status = link(blobPath, linkPath);
+    if (status != 0 && errno == EMLINK && blob->reused) {
+        blob->reused = false;  // blob has too many links: keep this copy
+        status = link(blob->tempPath, linkPath);
+    }
+    pthread_mutex_unlock(&blobLock);  // blob is now linked into the content
+    if (status != 0) {
+        return -1;
+    }
+    if (rename(linkPath, filePath) != 0) {
+        unlink(linkPath);
+        return -1;
+    }
+    unlink(blob->tempPath);
+    return 0;
+}
+
+/**
+ * Abandon an upload and remove its temp file.
+ *
+ * @param blob the upload
+ */
+void abortBlob(BlobUpload *blob) {
+    unlink(blob->tempPath);
+}
+
+/**
+ * Close an upload after it was stored or abandoned.
+ *
+ * @param blob the upload
+ */
+void closeBlob(BlobUpload *blob) {
+    if (blob->stream != NULL) {
+        fclose(blob->stream);
+    } else if (blob->fd >= 0) {
+        close(blob->fd);
+    }
+    blob->stream = NULL;
+    blob->fd = -1;
+    EVP_MD_CTX_free(blob->md);
+    blob->md = NULL;
+}
+
+/**
+ * Format the digest of a stored upload as a Digest header
+ * value (RFC 3230), such as "sha-256=X48E9q...".
+ *
+ * @param blob the upload
+ * @param buf the buffer of BLOB_DIGEST_HEADER bytes
+ * @return the buffer
+ */
+char *getBlobDigestHeader(const BlobUpload *blob, char *buf) {
+    strcpy(buf, "sha-256=");
+    EVP_EncodeBlock((unsigned char*)buf + 8, blob->digest, BLOB_DIGEST_LEN);
+    return buf;
+}
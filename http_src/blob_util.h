@@ -0,0 +1,105 @@
+/*
+ * blob_util.h
+ *
+ * Functions that implement a content-addressed store of upload
+ * bodies, so identical uploads share one copy of their bytes.
+ *
+ *  @since 2021-05-01
+ */
+
+#ifndef BLOB_UTIL_H_
+#define BLOB_UTIL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <openssl/evp.h>
+
+/** Length of a SHA-256 digest in bytes */
+#define BLOB_DIGEST_LEN 32
+
+/** Size of a buffer for a Digest header value: "sha-256=" and base64 */
+#define BLOB_DIGEST_HEADER (8 + 4*((BLOB_DIGEST_LEN+2)/3) + 1)
+
+/** Upload body being written to the blob store */
+typedef struct BlobUpload {
+    char tempPath[MAXPATHLEN];  /** temp file in the blob store */
+    int fd;                     /** descriptor of temp file */
+    FILE *stream;               /** stream of temp file */
+    EVP_MD_CTX *md;             /** digest of body so far */
+    unsigned char digest[BLOB_DIGEST_LEN];  /** SHA-256 of the body */
+    bool reused;                /** true if an existing blob was linked */
+} BlobUpload;
+
+/**
+ * Initialize the blob store directory. Blobs are hard linked
+ * into the content directory, so the store must be on the
+ * same file system. Temp files left by an earlier run are
+ * removed, and the sweeper thread is started.
+ *
+ * @param blobDir the blob store directory
+ * @param contentBase the content base directory
+ * @return true if the blob store can be used
+ */
+bool initBlobStore(const char *blobDir, const char *contentBase);
+
+/**
+ * Start an upload to the blob store: create a temp file for
+ * the body and reserve space for it if the length is known.
+ *
+ * @param blob the upload
+ * @param len the body length or -1 if unknown
+ * @return 0 if successful, or the errno of the failure
+ */
+int beginBlob(BlobUpload *blob, long long len);
+
+/**
+ * Body sink that hashes the next bytes of an upload
+ * and writes them to its temp file.
+ *
+ * @param ctx the upload
+ * @param bytes the body bytes
+ * @param len the number of bytes
+ * @return 0 if successful, -1 if error
+ */
+int blobSink(void *ctx, const char *bytes, size_t len);
+
+/**
+ * Finish an upload: if a blob with the same digest is stored,
+ * the temp file is discarded and the existing blob is used,
+ * otherwise the temp file becomes the blob. The blob is then
+ * hard linked at the file path, replacing any file there.
+ *
+ * @param blob the upload
+ * @param filePath the path of the uploaded file
+ * @return 0 if successful, -1 if error
+ */
+int storeBlob(BlobUpload *blob, const char *filePath);
+
+/**
+ * Abandon an upload and remove its temp file.
+ *
+ * @param blob the upload
+ */
+void abortBlob(BlobUpload *blob);
+
+/**
+ * Close an upload after it was stored or abandoned.
+ *
+ * @param blob the upload
+ */
+void closeBlob(BlobUpload *blob);
+
+/**
+ * Format the digest of a stored upload as a Digest header
+ * value (RFC 3230), such as "sha-256=X48E9q...".
+ *
+ * @param blob the upload
+ * @param buf the buffer of BLOB_DIGEST_HEADER bytes
+ * @return the buffer
+ */
+char *getBlobDigestHeader(const BlobUpload *blob, char *buf);
+
+#endif /* BLOB_UTIL_H_ */
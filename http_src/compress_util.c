@@ -0,0 +1,460 @@
+/*
+ * compress_util.c
+ *
+ * Functions that compress response content on the fly. Content of
+ * a configured media type is compressed with zlib when the client
+ * accepts gzip or deflate. The compressed length is not known until
+ * the content is sent, so compressed responses are chunked.
+ *
+ * Setting up a zlib compressor allocates about 256KB of state, so
+ * each request thread keeps one compressor for each coding and
+ * resets it for the next response.
+ *
+ *  @since 2021-05-05
+ */
+
+#define _GNU_SOURCE  /* for fopencookie() */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/xattr.h>
+#include <zlib.h>
+#include "properties.h"
+#include "compress_util.h"
+
+/** Maximum number of compressible media types */
+#define MAX_COMPRESS_TYPES 64
+
+/** Size of the input buffer of a compressing stream */
+#define COMPRESS_STREAM_BUFSIZ 16384
+
+/** Size of the compressed output buffer */
+#define COMPRESS_OUT_BUFSIZ 16384
+
+/** Extended attribute with the content coding of a file stored encoded */
+#define CODING_XATTR "user.http.content-encoding"
+
+/** Storage for the compressible media types */
+static char typeList[MAX_PROP_VAL];
+
+/** Compressible media types; a type followed by "/" and "*" matches all subtypes */
+static const char *compressTypes[MAX_COMPRESS_TYPES];
+
+/** Number of compressible media types */
+static size_t numCompressTypes = 0;
+
+/** zlib compression level */
+static int compressLevel = Z_DEFAULT_COMPRESSION;
+
+/** Smallest content length that is compressed */
+static size_t compressMinSize = 0;
+
+/** Compressor of a request thread for one coding */
+typedef struct Compressor {
+    z_stream zs;                /** zlib stream; reset for each response */
+    bool inUse;                 /** true while a stream is open */
+    FILE *ostream;              /** output stream of the open stream */
+    unsigned char out[COMPRESS_OUT_BUFSIZ];  /** compressed output */
+} Compressor;
+
+/** Compressors of this thread by coding; live as long as the thread */
+static _Thread_local Compressor *compressors[CODING_DEFLATE + 1];
+
+/**
+ * Initialize response compression.
+ *
+ * @param types the compressible media types separated by spaces;
+ *   a type followed by "/" and "*" matches all subtypes; empty disables compression
+ * @param level the zlib compression level from 1 to 9
+ * @param minSize the smallest content length that is compressed
+ * @return true if the settings are valid
+ */
+bool initCompression(const char *types, int level, size_t minSize) {
+    if (level < 1 || level > 9 || strlen(types) >= sizeof(typeList)) {
+        return false;
+    }
+    strcpy(typeList, types);
+    numCompressTypes = 0;
+    char *saveptr;
+    for (char *type = strtok_r(typeList, " \t,", &saveptr); type != NULL; type = strtok_r(NULL, " \t,", &saveptr)) {
+        if (numCompressTypes == MAX_COMPRESS_TYPES) {
+            return false;
+        }
+        compressTypes[numCompressTypes++] = type;
+    }
+    compressLevel = level;
+    compressMinSize = minSize;
+    return true;
+}
+
+/**
+ * Determines whether content of a media type is compressed.
+ *
+ * @param mediaType the media type
+ * @return true if compression is enabled for the media type
+ */
+bool isCompressibleType(const char *mediaType) {
+    size_t typeLen = strcspn(mediaType, "; \t");  // ignore parameters
+    for (size_t i = 0; i < numCompressTypes; i++) {
+        const char *type = compressTypes[i];
+        size_t len = strlen(type);
+        if (len >= 2 && strcmp(type + len - 2, "/*") == 0) {  // match type and '/'
+            if (typeLen > len - 1 && strncasecmp(mediaType, type, len - 1) == 0) {
+                return true;
+            }
+        } else if (typeLen == len && strncasecmp(mediaType, type, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Determines whether content of a media type and length is
+ * compressed: the media type is compressible and the content
+ * is not too small.
+ *
+ * @param mediaType the media type
+ * @param len the content length or -1 if not known
+ * @return true if the content is compressed
+ */
+bool isCompressibleContent(const char *mediaType, long long len) {
+    return isCompressibleType(mediaType) && (len < 0 || (unsigned long long)len >= compressMinSize);
+}
+
+/**
+ * Get the content coding named by a Content-Encoding value.
+ *
+ * @param name the coding name
+ * @param coding storage for the content coding
+ * @return true if the coding is supported
+ */
+bool parseContentCoding(const char *name, ContentCoding *coding) {
+    if (strcasecmp(name, "gzip") == 0 || strcasecmp(name, "x-gzip") == 0) {
+        *coding = CODING_GZIP;
+    } else if (strcasecmp(name, "deflate") == 0) {
+        *coding = CODING_DEFLATE;
+    } else if (strcasecmp(name, "identity") == 0) {
+        *coding = CODING_IDENTITY;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Get the qualities of gzip and deflate in the Accept-Encoding
+ * header of a request. A coding that is not listed has the
+ * quality of "*" if present, otherwise 0.
+ *
+ * @param requestHeaders the request headers
+ * @param gzipQ storage for the quality of gzip
+ * @param deflateQ storage for the quality of deflate
+ */
+static void getCodingQualities(Properties *requestHeaders, double *gzipQ, double *deflateQ) {
+    *gzipQ = *deflateQ = 0.0;
+    char accept[MAX_PROP_VAL];
+    if (findProperty(requestHeaders, 0, "Accept-Encoding", accept) == SIZE_MAX) {
+        return;
+    }
+    double anyQ = -1.0;
+    *gzipQ = *deflateQ = -1.0;
+    char *saveptr;
+    for (char *coding = strtok_r(accept, ",", &saveptr); coding != NULL; coding = strtok_r(NULL, ",", &saveptr)) {
+        // split coding from parameters
+        char *params = strchr(coding, ';');
+        if (params != NULL) {
+            *params++ = '\0';
+        }
+        double q = 1.0;
+        char *qp = (params != NULL) ? strstr(params, "q=") : NULL;
+        if (qp != NULL) {
+            q = strtod(qp+2, NULL);
+        }
+        char *name = coding + strspn(coding, " \t");
+        name[strcspn(name, " \t")] = '\0';
+
+        ContentCoding named;
+        if (strcmp(name, "*") == 0) {
+            anyQ = q;
+        } else if (parseContentCoding(name, &named)) {
+            if (named == CODING_GZIP) {
+                *gzipQ = q;
+            } else if (named == CODING_DEFLATE) {
+                *deflateQ = q;
+            }
+        }
+    }
+    if (*gzipQ < 0.0) {
+        *gzipQ = anyQ;
+    }
+    if (*deflateQ < 0.0) {
+        *deflateQ = anyQ;
+    }
+}
+
+/**
+ * Get the content coding accepted by the Accept-Encoding header
+ * of a request.
+ *
+ * @param requestHeaders the request headers
+ * @return the accepted content coding
+ */
+static ContentCoding acceptedCoding(Properties *requestHeaders) {
+    double gzipQ, deflateQ;
+    getCodingQualities(requestHeaders, &gzipQ, &deflateQ);
+    if (gzipQ > 0.0 && gzipQ >= deflateQ) {
+        return CODING_GZIP;
+    }
+    return (deflateQ > 0.0) ? CODING_DEFLATE : CODING_IDENTITY;
+}
+
+/**
+ * Determines whether the Accept-Encoding header of a request
+ * accepts a content coding.
+ *
+ * @param requestHeaders the request headers
+ * @param coding the content coding
+ * @return true if the coding is accepted
+ */
+bool isCodingAccepted(Properties *requestHeaders, ContentCoding coding) {
+    double gzipQ, deflateQ;
+    getCodingQualities(requestHeaders, &gzipQ, &deflateQ);
+    return (coding == CODING_IDENTITY)
+        || (coding == CODING_GZIP && gzipQ > 0.0)
+        || (coding == CODING_DEFLATE && deflateQ > 0.0);
+}
+
+/**
+ * Get the content coding of a response. Content is compressed if
+ * its media type is compressible, it is not too small, and the
+ * Accept-Encoding header of the request accepts gzip or deflate.
+ * gzip is preferred if both are accepted with the same quality.
+ *
+ * @param requestHeaders the request headers
+ * @param mediaType the media type of the content
+ * @param len the content length or -1 if not known
+ * @return the content coding
+ */
+ContentCoding getResponseCoding(Properties *requestHeaders, const char *mediaType, long long len) {
+    return isCompressibleContent(mediaType, len) ? acceptedCoding(requestHeaders) : CODING_IDENTITY;
+}
+
+/**
+ * Get the content coding of a file stored encoded, recorded
+ * in an extended attribute of the file.
+ *
+ * @param filePath the file path
+ * @return the content coding; the identity coding if none
+ */
+ContentCoding getFileCoding(const char *filePath) {
+    char name[16];
+    ssize_t n = getxattr(filePath, CODING_XATTR, name, sizeof(name)-1);
+    ContentCoding coding;
+    if (n <= 0) {
+        return CODING_IDENTITY;
+    }
+    name[n] = '\0';
+    return parseContentCoding(name, &coding) ? coding : CODING_IDENTITY;
+}
+
+/**
+ * Get the content coding of an open file stored encoded,
+ * recorded in an extended attribute of the file.
+ *
+ * @param fd the file descriptor
+ * @return the content coding; the identity coding if none
+ */
+ContentCoding getOpenFileCoding(int fd) {
+    char name[16];
+    ssize_t n = fgetxattr(fd, CODING_XATTR, name, sizeof(name)-1);
+    ContentCoding coding;
+    if (n <= 0) {
+        return CODING_IDENTITY;
+    }
+    name[n] = '\0';
+    return parseContentCoding(name, &coding) ? coding : CODING_IDENTITY;
+}
+
+/**
+ * Record the content coding of a file stored encoded.
+ *
+ * @param fd the file descriptor
+ * @param coding the content coding
+ * @return 0 if successful, -1 with errno set if error
+ */
+int setFileCoding(int fd, ContentCoding coding) {
+    const char *name = contentCodingName(coding);
+    if (name == NULL) {
+        return 0;
+    }
+    return fsetxattr(fd, CODING_XATTR, name, strlen(name), 0);
+}
+
+/**
+ * Determines whether files in a directory can record their
+ * content coding.
+ *
+ * @param dirPath the directory path
+ * @return true if extended attributes are supported
+ */
+bool supportsFileCoding(const char *dirPath) {
+    char name[16];
+    return getxattr(dirPath, CODING_XATTR, name, sizeof(name)) >= 0 || errno == ENODATA;
+}
+
+/**
+ * Get the Content-Encoding name of a content coding.
+ *
+ * @param coding the content coding
+ * @return the name, or NULL for the identity coding
+ */
+const char *contentCodingName(ContentCoding coding) {
+    switch (coding) {
+    case CODING_GZIP:
+        return "gzip";
+    case CODING_DEFLATE:
+        return "deflate";
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * Make the ETag of a coded representation from the ETag of the
+ * content, so caches do not confuse the coded and identity bodies.
+ *
+ * @param etag the ETag of the content
+ * @param coding the content coding
+ * @param buf buffer for the ETag of the coded representation
+ * @return buf
+ */
+char *makeCodingETag(const char *etag, ContentCoding coding, char *buf) {
+    const char *name = contentCodingName(coding);
+    size_t len = strlen(etag);
+    if (name == NULL || len < 2 || etag[len-1] != '"') {
+        return strcpy(buf, etag);
+    }
+    // insert the coding name before the closing quote
+    sprintf(buf, "%.*s-%s\"", (int)(len-1), etag, name);
+    return buf;
+}
+
+/**
+ * Write the output of the compressor to its output stream.
+ *
+ * @param comp the compressor
+ * @param flush the zlib flush mode
+ * @return 0 if successful, -1 if error
+ */
+static int deflateToStream(Compressor *comp, int flush) {
+    int status;
+    do {
+        comp->zs.next_out = comp->out;
+        comp->zs.avail_out = sizeof(comp->out);
+        status = deflate(&comp->zs, flush);
+        if (status == Z_STREAM_ERROR) {
+            return -1;
+        }
+        size_t n = sizeof(comp->out) - comp->zs.avail_out;
+        if (n > 0 && fwrite(comp->out, sizeof(char), n, comp->ostream) < n) {
+            return -1;
+        }
+    } while (comp->zs.avail_out == 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+    return 0;
+}
+
+/**
+ * Write function of a compressing stream: compresses the bytes
+ * flushed from the stream buffer.
+ *
+ * @param cookie the compressor
+ * @param buf the bytes to write
+ * @param size the number of bytes
+ * @return the number of bytes written or -1 if error
+ */
+static ssize_t compressedStreamWrite(void *cookie, const char *buf, size_t size) {
+    Compressor *comp = cookie;
+    comp->zs.next_in = (unsigned char *)buf;
+    comp->zs.avail_in = (uInt)size;
+    return (deflateToStream(comp, Z_NO_FLUSH) == 0) ? (ssize_t)size : -1;
+}
+
+/**
+ * Close function of a compressing stream: writes the end of the
+ * compressed content and releases the compressor for reuse.
+ *
+ * @param cookie the compressor
+ * @return 0 if successful, -1 if error
+ */
+static int compressedStreamClose(void *cookie) {
+    Compressor *comp = cookie;
+    comp->zs.next_in = NULL;
+    comp->zs.avail_in = 0;
+    int status = deflateToStream(comp, Z_FINISH);
+    deflateReset(&comp->zs);
+    comp->ostream = NULL;
+    comp->inUse = false;
+    return status;
+}
+
+/**
+ * Get the compressor of this thread for a coding, creating it
+ * on first use.
+ *
+ * @param coding the content coding
+ * @return the compressor or NULL if error
+ */
+static Compressor *getCompressor(ContentCoding coding) {
+    Compressor *comp = compressors[coding];
+    if (comp == NULL) {
+        comp = calloc(1, sizeof(Compressor));
+        if (comp == NULL) {
+            return NULL;
+        }
+        // window bits 15 with 16 added for a gzip wrapper
+        int windowBits = (coding == CODING_GZIP) ? 15 + 16 : 15;
+        if (deflateInit2(&comp->zs, compressLevel, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(comp);
+            return NULL;
+        }
+        compressors[coding] = comp;
+    }
+    return comp;
+}
+
+/**
+ * Open a stream that compresses content and writes it to an
+ * output stream. Each request thread reuses its own compressor
+ * for each coding. Closing the returned stream writes the end of
+ * the compressed content but does not close ostream.
+ *
+ * @param ostream the output stream, usually a chunked stream
+ * @param coding the content coding; not the identity coding
+ * @return the compressing stream or NULL if error
+ */
+FILE *openCompressedStream(FILE *ostream, ContentCoding coding) {
+    if (coding != CODING_GZIP && coding != CODING_DEFLATE) {
+        return NULL;
+    }
+    Compressor *comp = getCompressor(coding);
+    if (comp == NULL || comp->inUse) {
+        return NULL;
+    }
+    cookie_io_functions_t compressedFuncs = {
+        .read = NULL,
+        .write = compressedStreamWrite,
+        .seek = NULL,
+        .close = compressedStreamClose
+    };
+    FILE *compressedStream = fopencookie(comp, "w", compressedFuncs);
+    if (compressedStream != NULL) {
+        comp->inUse = true;
+        comp->ostream = ostream;
+        setvbuf(compressedStream, NULL, _IOFBF, COMPRESS_STREAM_BUFSIZ);
+    }
+    return compressedStream;
+}
@@ -0,0 +1,152 @@
+/*
+ * compress_util.h
+ *
+ * Functions that compress response content on the fly.
+ *
+ *  @since 2021-05-05
+ */
+
+#ifndef COMPRESS_UTIL_H_
+#define COMPRESS_UTIL_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "properties.h"
+
+/** Content coding of a response body */
+typedef enum ContentCoding {
+    CODING_IDENTITY,            /** not compressed */
+    CODING_GZIP,                /** gzip format (RFC 1952) */
+    CODING_DEFLATE              /** zlib format (RFC 1950) */
+} ContentCoding;
+
+/**
+ * Initialize response compression.
+ *
+ * @param types the compressible media types separated by spaces;
+ *   a type followed by "/" and "*" matches all subtypes; empty disables compression
+ * @param level the zlib compression level from 1 to 9
+ * @param minSize the smallest content length that is compressed
+ * @return true if the settings are valid
+ */
+bool initCompression(const char *types, int level, size_t minSize);
+
+/**
+ * Determines whether content of a media type is compressed.
+ *
+ * @param mediaType the media type
+ * @return true if compression is enabled for the media type
+ */
+bool isCompressibleType(const char *mediaType);
+
+/**
+ * Determines whether content of a media type and length is
+ * compressed: the media type is compressible and the content
+ * is not too small.
+ *
+ * @param mediaType the media type
+ * @param len the content length or -1 if not known
+ * @return true if the content is compressed
+ */
+bool isCompressibleContent(const char *mediaType, long long len);
+
+/**
+ * Get the content coding of a response. Content is compressed if
+ * its media type is compressible, it is not too small, and the
+ * Accept-Encoding header of the request accepts gzip or deflate.
+ * gzip is preferred if both are accepted with the same quality.
+ *
+ * @param requestHeaders the request headers
+ * @param mediaType the media type of the content
+ * @param len the content length or -1 if not known
+ * @return the content coding
+ */
+ContentCoding getResponseCoding(Properties *requestHeaders, const char *mediaType, long long len);
+
+/**
+ * Determines whether the Accept-Encoding header of a request
+ * accepts a content coding.
+ *
+ * @param requestHeaders the request headers
+ * @param coding the content coding
+ * @return true if the coding is accepted
+ */
+bool isCodingAccepted(Properties *requestHeaders, ContentCoding coding);
+
+/**
+ * Get the content coding named by a Content-Encoding value.
+ *
+ * @param name the coding name
+ * @param coding storage for the content coding
+ * @return true if the coding is supported
+ */
+bool parseContentCoding(const char *name, ContentCoding *coding);
+
+/**
+ * Get the content coding of a file stored encoded, recorded
+ * in an extended attribute of the file.
+ *
+ * @param filePath the file path
+ * @return the content coding; the identity coding if none
+ */
+ContentCoding getFileCoding(const char *filePath);
+
+/**
+ * Get the content coding of an open file stored encoded,
+ * recorded in an extended attribute of the file.
+ *
+ * @param fd the file descriptor
+ * @return the content coding; the identity coding if none
+ */
+ContentCoding getOpenFileCoding(int fd);
+
+/**
+ * Record the content coding of a file stored encoded.
+ *
+ * @param fd the file descriptor
+ * @param coding the content coding
+ * @return 0 if successful, -1 with errno set if error
+ */
+int setFileCoding(int fd, ContentCoding coding);
+
+/**
+ * Determines whether files in a directory can record their
+ * content coding.
+ *
+ * @param dirPath the directory path
+ * @return true if extended attributes are supported
+ */
+bool supportsFileCoding(const char *dirPath);
+
+/**
+ * Get the Content-Encoding name of a content coding.
+ *
+ * @param coding the content coding
+ * @return the name, or NULL for the identity coding
+ */
+const char *contentCodingName(ContentCoding coding);
+
+/**
+ * Make the ETag of a coded representation from the ETag of the
+ * content, so caches do not confuse the coded and identity bodies.
+ *
+ * @param etag the ETag of the content
+ * @param coding the content coding
+ * @param buf buffer for the ETag of the coded representation
+ * @return buf
+ */
+char *makeCodingETag(const char *etag, ContentCoding coding, char *buf);
+
+/**
+ * Open a stream that compresses content and writes it to an
+ * output stream. Each request thread reuses its own compressor
+ * for each coding. Closing the returned stream writes the end of
+ * the compressed content but does not close ostream.
+ *
+ * @param ostream the output stream, usually a chunked stream
+ * @param coding the content coding; not the identity coding
+ * @return the compressing stream or NULL if error
+ */
+FILE *openCompressedStream(FILE *ostream, ContentCoding coding);
+
+#endif /* COMPRESS_UTIL_H_ */
@@ -0,0 +1,437 @@
+/*
+ * content_util.c
+ *
+ * Functions that open request paths beneath the content directory.
+ * The content directory is opened once, and request paths are
+ * opened relative to it with openat2() and RESOLVE_BENEATH, so the
+ * kernel refuses ".." components and symbolic links that would
+ * resolve outside it. Kernels without openat2() fall back to
+ * openat(); request URIs with ".." components are rejected before
+ * they reach a handler, but symbolic links are then followed.
+ *
+ * Open descriptors of recently used directories are cached, so a
+ * file is opened by walking only its last component. A cached
+ * directory is used while its stat cache properties match those
+ * it was opened with. A directory that is removed, replaced or
+ * changed is opened again.
+ *
+ *  @since 2021-05-08
+ */
+
+#define _GNU_SOURCE  /* for O_PATH and strchrnul() */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#endif
+#include "hashmap.h"
+#include "file_util.h"
+#include "statcache_util.h"
+#include "content_util.h"
+
+/** Most directories kept open in the directory cache */
+#define CONTENT_DIR_CACHE_SIZE 256
+
+/** Times openat2() is retried if a rename races with it */
+#define OPENAT2_RETRIES 4
+
+/** An open directory shared by the cache and requests */
+struct ContentDir {
+    int fd;                     /** O_PATH directory descriptor */
+    dev_t dev;                  /** device of the directory when opened */
+    ino_t ino;                  /** inode of the directory when opened */
+    struct timespec ctim;       /** change time of the directory when opened */
+    int refs;                   /** references from cache and requests */
+};
+
+/** The content base directory */
+static char contentRoot[MAXPATHLEN];
+
+/** Length of the content base directory path */
+static size_t contentRootLen = 0;
+
+/** The content directory, never released */
+static ContentDir rootDir = { .fd = -1 };
+
+/** true if the kernel supports openat2() */
+static bool hasOpenat2 = false;
+
+/** Guards the directory cache */
+static pthread_mutex_t dirLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Open directories by path relative to the content directory */
+static HashMap *dirCache = NULL;
+
+/**
+ * Open a path relative to a directory without leaving the directory.
+ *
+ * @param dirFd the directory descriptor
+ * @param path the relative path
+ * @param flags the open() flags
+ * @return the file descriptor, or -1 with errno set if error
+ */
+static int openBeneath(int dirFd, const char *path, int flags) {
+#if defined(__linux__) && defined(SYS_openat2)
+    if (hasOpenat2) {
+        struct open_how how = {
+            .flags = (uint64_t)(flags | O_CLOEXEC),
+            .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS
+        };
+        for (int i = 0; ; i++) {
+            int fd = (int)syscall(SYS_openat2, dirFd, path, &how, sizeof(how));
+            if (fd >= 0 || errno != EAGAIN || i == OPENAT2_RETRIES) {
+                return fd;
+            }
+        }
+    }
+#endif
+    return openat(dirFd, path, flags | O_CLOEXEC);
+}
+
+/**
+ * Get the path of a content path relative to the content directory.
+ *
+ * @param filePath the content path, starting with the content base
+ * @return the relative path without leading '/', or NULL with errno
+ *   set to EXDEV if not a content path
+ */
+static const char *relativeContentPath(const char *filePath) {
+    if (   (strncmp(filePath, contentRoot, contentRootLen) != 0)
+        || (filePath[contentRootLen] != '/' && filePath[contentRootLen] != '\0')) {
+        errno = EXDEV;
+        return NULL;
+    }
+    const char *relPath = filePath + contentRootLen;
+    while (*relPath == '/') {
+        relPath++;
+    }
+    return relPath;
+}
+
+/**
+ * Drop a reference to a directory, closing it with the last one.
+ * Caller must hold dirLock.
+ *
+ * @param dir the directory
+ */
+static void dropContentDir(ContentDir *dir) {
+    if (dir != &rootDir && --dir->refs == 0) {
+        close(dir->fd);
+        free(dir);
+    }
+}
+
+/**
+ * Visitor that evicts directories until the cache
+ * has room for another one.
+ *
+ * @param key the relative directory path
+ * @param value the directory
+ * @param ctx not used
+ * @return true if the directory was evicted
+ */
+static bool evictContentDir(const char *key, void *value, void *ctx) {
+    (void)key;
+    (void)ctx;
+    if (sizeHashMap(dirCache) < CONTENT_DIR_CACHE_SIZE) {
+        return false;
+    }
+    dropContentDir(value);
+    return true;
+}
+
+/**
+ * Open the content directory that request paths are resolved in.
+ *
+ * @param contentBase the content base directory
+ * @return true if the content directory was opened
+ */
+bool initContentRoot(const char *contentBase) {
+    contentRootLen = strlen(contentBase);
+    while (contentRootLen > 1 && contentBase[contentRootLen-1] == '/') {
+        contentRootLen--;
+    }
+    if (contentRootLen >= sizeof(contentRoot)) {
+        return false;
+    }
+    memcpy(contentRoot, contentBase, contentRootLen);
+    contentRoot[contentRootLen] = '\0';
+    dirCache = newHashMap(64);
+    rootDir.fd = open(contentRoot, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dirCache == NULL || rootDir.fd < 0) {
+        return false;
+    }
+#if defined(__linux__) && defined(SYS_openat2)
+    // probe for openat2(), added in Linux 5.6
+    hasOpenat2 = true;
+    int fd = openBeneath(rootDir.fd, ".", O_PATH | O_DIRECTORY);
+    if (fd >= 0) {
+        close(fd);
+    } else {
+        hasOpenat2 = false;
+    }
+#endif
+    return true;
+}
+
+/**
+ * Determines whether a request URI stays beneath the content
+ * directory: it starts with '/' and has no ".." components.
+ *
+ * @param uri the decoded request URI
+ * @return true if the URI names a path beneath the content directory
+ */
+bool isContentUri(const char *uri) {
+    if (*uri != '/') {
+        return false;
+    }
+    for (const char *p = uri; (p = strstr(p, "..")) != NULL; p += 2) {
+        if (p[-1] == '/' && (p[2] == '/' || p[2] == '\0')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Determines whether a request URI names a hidden path: one with a
+ * component that is a temp file name. The server writes files in
+ * progress, such as uploads and their sidecars, under temp names
+ * next to their targets, so those names are not listed or served.
+ * Other names that start with '.' are served as usual.
+ *
+ * @param uri the decoded request URI
+ * @return true if the URI has a temp file name component
+ */
+bool isHiddenUri(const char *uri) {
+    for (const char *p = uri; (p = strstr(p, "/.")) != NULL; p++) {
+        size_t len = strcspn(p+1, "/");
+        if (isTempFileName(p+1, len)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Get an open directory of the content from the directory cache,
+ * opening it beneath the content directory if it is not cached
+ * or has changed. The directory must be released with
+ * releaseContentDir().
+ *
+ * @param dirPath the content path of the directory
+ * @return the directory, or NULL with errno set if error
+ */
+ContentDir *acquireContentDir(const char *dirPath) {
+    const char *relPath = relativeContentPath(dirPath);
+    if (relPath == NULL) {
+        return NULL;
+    }
+    char key[MAXPATHLEN];
+    size_t keyLen = strlen(relPath);
+    while (keyLen > 0 && relPath[keyLen-1] == '/') {
+        keyLen--;
+    }
+    if (keyLen == 0) {
+        return &rootDir;
+    }
+    if (keyLen >= sizeof(key)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    memcpy(key, relPath, keyLen);
+    key[keyLen] = '\0';
+
+    // the cached directory is current if it still has the same properties
+    struct stat sb;
+    if (cachedStat(dirPath, &sb) != 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&dirLock);
+    ContentDir *dir = getHashMap(dirCache, key);
+    if (dir != NULL) {
+        if (   (dir->ino == sb.st_ino) && (dir->dev == sb.st_dev)
+            && (dir->ctim.tv_sec == sb.st_ctim.tv_sec) && (dir->ctim.tv_nsec == sb.st_ctim.tv_nsec)) {
+            dir->refs++;
+            pthread_mutex_unlock(&dirLock);
+            return dir;
+        }
+        removeHashMap(dirCache, key);
+        dropContentDir(dir);
+    }
+    pthread_mutex_unlock(&dirLock);
+
+    dir = malloc(sizeof(ContentDir));
+    if (dir == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct stat fdSb;
+    dir->fd = openBeneath(rootDir.fd, key, O_PATH | O_DIRECTORY);
+    if (dir->fd < 0 || fstat(dir->fd, &fdSb) != 0) {
+        int err = errno;
+        if (dir->fd >= 0) {
+            close(dir->fd);
+        }
+        free(dir);
+        errno = err;
+        return NULL;
+    }
+    dir->dev = sb.st_dev;
+    dir->ino = sb.st_ino;
+    dir->ctim = sb.st_ctim;
+    dir->refs = 1;
+
+    // cache it unless it was replaced since its properties were read
+    if (fdSb.st_ino == sb.st_ino && fdSb.st_dev == sb.st_dev) {
+        pthread_mutex_lock(&dirLock);
+        if (getHashMap(dirCache, key) == NULL) {
+            forEachHashMap(dirCache, evictContentDir, NULL);
+            if (putHashMap(dirCache, key, dir, NULL)) {
+                dir->refs++;
+            }
+        }
+        pthread_mutex_unlock(&dirLock);
+    }
+    return dir;
+}
+
+/**
+ * Get the descriptor of an open content directory, for use
+ * with openat(), renameat(), unlinkat() and fstatat().
+ *
+ * @param dir the directory
+ * @return the O_PATH directory descriptor
+ */
+int contentDirFd(const ContentDir *dir) {
+    return dir->fd;
+}
+
+/**
+ * Release a directory returned by acquireContentDir().
+ *
+ * @param dir the directory
+ */
+void releaseContentDir(ContentDir *dir) {
+    if (dir != &rootDir) {
+        pthread_mutex_lock(&dirLock);
+        dropContentDir(dir);
+        pthread_mutex_unlock(&dirLock);
+    }
+}
+
+/**
+ * Open a content path without leaving the content directory:
+ * neither ".." nor a symbolic link may resolve outside it.
+ * The directory of the path is opened from the directory cache.
+ *
+ * @param filePath the content path, starting with the content base
+ * @param flags the open() flags
+ * @return the file descriptor, or -1 with errno set if error;
+ *   EXDEV if the path resolves outside the content directory
+ */
+int openContent(const char *filePath, int flags) {
+    const char *relPath = relativeContentPath(filePath);
+    if (relPath == NULL) {
+        return -1;
+    }
+
+    // split the last component, which may end with '/'
+    size_t len = strlen(relPath);
+    while (len > 0 && relPath[len-1] == '/') {
+        len--;
+    }
+    const char *name = relPath + len;
+    while (name > relPath && name[-1] != '/') {
+        name--;
+    }
+    if (len == 0) {
+        return openBeneath(rootDir.fd, ".", flags);
+    }
+    char dirPath[MAXPATHLEN];
+    snprintf(dirPath, sizeof(dirPath), "%.*s", (int)(name - filePath), filePath);
+    ContentDir *dir = acquireContentDir(dirPath);
+    if (dir == NULL) {
+        return -1;
+    }
+    int fd = openBeneath(dir->fd, name, flags);
+    if (fd < 0 && errno == EXDEV && dir != &rootDir) {
+        // a symbolic link may lead out of the directory but not the content
+        fd = openBeneath(rootDir.fd, relPath, flags);
+    }
+    int err = errno;
+    releaseContentDir(dir);
+    errno = err;
+    return fd;
+}
+
+/**
+ * Make the directories of a content path that do not exist. Each
+ * directory is made in its parent opened beneath the content
+ * directory, so none is made outside it.
+ *
+ * @param dirPath the content path of the directory
+ * @param mode mode if a directory is made
+ * @return 0 if successful, -1 with errno set if error
+ */
+int mkdirsContent(const char *dirPath, mode_t mode) {
+    // most uploads are to directories that exist
+    ContentDir *dir = acquireContentDir(dirPath);
+    if (dir != NULL) {
+        releaseContentDir(dir);
+        return 0;
+    }
+    const char *relPath = relativeContentPath(dirPath);
+    if (relPath == NULL) {
+        return -1;
+    }
+    char path[MAXPATHLEN];
+    if (strlen(relPath) >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(path, relPath);
+
+    // each directory is made in its parent, opened from the content directory
+    int parentFd = rootDir.fd;
+    int status = 0;
+    bool made = false;
+    for (char *name = path; status == 0 && *name != '\0'; ) {
+        char *end = strchrnul(name, '/');
+        bool last = (*end == '\0');
+        *end = '\0';
+        if (*name != '\0') {
+            int rc = mkdirat(parentFd, name, mode);
+            made |= (rc == 0);
+            int fd = (rc == 0 || errno == EEXIST) ? openBeneath(rootDir.fd, path, O_PATH | O_DIRECTORY) : -1;
+            if (parentFd != rootDir.fd) {
+                close(parentFd);
+            }
+            parentFd = fd;
+            status = (fd < 0) ? -1 : 0;
+        }
+        if (!last) {
+            *end = '/';
+        }
+        name = last ? end : end + 1;
+    }
+    int err = errno;
+    if (parentFd >= 0 && parentFd != rootDir.fd) {
+        close(parentFd);
+    }
+    if (made) {
+        invalidateStat(dirPath);
+    }
+    errno = err;
+    return status;
+}
@@ -0,0 +1,98 @@
+/*
+ * content_util.h
+ *
+ * Functions that open request paths beneath the content directory,
+ * so a request cannot reach files outside it.
+ *
+ *  @since 2021-05-08
+ */
+
+#ifndef CONTENT_UTIL_H_
+#define CONTENT_UTIL_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/** An open directory beneath the content directory */
+typedef struct ContentDir ContentDir;
+
+/**
+ * Open the content directory that request paths are resolved in.
+ *
+ * @param contentBase the content base directory
+ * @return true if the content directory was opened
+ */
+bool initContentRoot(const char *contentBase);
+
+/**
+ * Determines whether a request URI stays beneath the content
+ * directory: it starts with '/' and has no ".." components.
+ *
+ * @param uri the decoded request URI
+ * @return true if the URI names a path beneath the content directory
+ */
+bool isContentUri(const char *uri);
+
+/**
+ * Determines whether a request URI names a hidden path: one with a
+ * component that is a temp file name. The server writes files in
+ * progress, such as uploads and their sidecars, under temp names
+ * next to their targets, so those names are not listed or served.
+ * Other names that start with '.' are served as usual.
+ *
+ * @param uri the decoded request URI
+ * @return true if the URI has a temp file name component
+ */
+bool isHiddenUri(const char *uri);
+
+/**
+ * Open a content path without leaving the content directory:
+ * neither ".." nor a symbolic link may resolve outside it.
+ * The directory of the path is opened from the directory cache.
+ *
+ * @param filePath the content path, starting with the content base
+ * @param flags the open() flags
+ * @return the file descriptor, or -1 with errno set if error;
+ *   EXDEV if the path resolves outside the content directory
+ */
+int openContent(const char *filePath, int flags);
+
+/**
+ * Get an open directory of the content from the directory cache,
+ * opening it beneath the content directory if it is not cached
+ * or has changed. The directory must be released with
+ * releaseContentDir().
+ *
+ * @param dirPath the content path of the directory
+ * @return the directory, or NULL with errno set if error
+ */
+ContentDir *acquireContentDir(const char *dirPath);
+
+/**
+ * Get the descriptor of an open content directory, for use
+ * with openat(), renameat(), unlinkat() and fstatat().
+ *
+ * @param dir the directory
+ * @return the O_PATH directory descriptor
+ */
+int contentDirFd(const ContentDir *dir);
+
+/**
+ * Release a directory returned by acquireContentDir().
+ *
+ * @param dir the directory
+ */
+void releaseContentDir(ContentDir *dir);
+
+/**
+ * Make the directories of a content path that do not exist. Each
+ * directory is made in its parent opened beneath the content
+ * directory, so none is made outside it.
+ *
+ * @param dirPath the content path of the directory
+ * @param mode mode if a directory is made
+ * @return 0 if successful, -1 with errno set if error
+ */
+int mkdirsContent(const char *dirPath, mode_t mode);
+
+#endif /* CONTENT_UTIL_H_ */
@@ -0,0 +1,1398 @@
+/*
+ * dir_util.c
+ *
+ * Functions for generating directory listings.
+ *
+ *  @since 2021-04-24
+ */
+
+#define _GNU_SOURCE  /* for fopencookie() */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "http_server.h"
+#include "file_util.h"
+#include "hashmap.h"
+#include "string_util.h"
+#include "time_util.h"
+#include "segment_util.h"
+#include "content_util.h"
+#include "dir_util.h"
+
+/** Size of the buffer for reading directory entries */
+#define DIR_SCAN_BUFSIZ (256*1024)
+
+/** Properties of a directory entry shown in a listing */
+typedef struct ListEntry {
+    const char *name;           /** entry name */
+    bool isDir;                 /** true if entry is a directory */
+    unsigned long long ino;     /** inode number */
+    long long size;             /** size in bytes */
+    struct timespec mtime;      /** modification time */
+} ListEntry;
+
+/** Writes the parts of a listing in one format */
+typedef struct ListFormatter {
+    bool parentRow;             /** true if listing shows the parent entry */
+    int (*header)(FILE *ostream, const char *filePath);
+    int (*row)(FILE *ostream, const ListEntry *entry, size_t rowNum);
+    int (*footer)(FILE *ostream, const ListOptions *next);
+} ListFormatter;
+
+/** Reads the entries of an open directory in large batches */
+typedef struct DirScan {
+    int fd;                     /** the directory descriptor */
+    bool failed;                /** true if reading the directory failed */
+#if defined(__linux__)
+    char *buf;                  /** buffer of linux_dirent64 records */
+    size_t len;                 /** number of bytes in buffer */
+    size_t pos;                 /** offset of next record */
+#else
+    DIR *dir;                   /** the directory stream */
+#endif
+} DirScan;
+
+#if defined(__linux__)
+/** Directory entry record returned by getdents64 */
+struct linux_dirent64 {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+/** Maximum number of entries in all cached directory indexes */
+#define DIR_INDEX_MAX_ENTRIES (1024*1024)
+
+/** Identifies the state of a directory that a cached item was made from */
+typedef struct DirIdentity {
+    dev_t dev;                  /** device of directory */
+    ino_t ino;                  /** inode of directory */
+    struct timespec mtime;      /** modification time of directory */
+    struct timespec ctime;      /** change time of directory */
+    unsigned long generation;   /** invalidation count when made */
+} DirIdentity;
+
+/** An entry of a directory index */
+typedef struct IndexEntry {
+    size_t nameOff;             /** offset of name in index names */
+    bool isDir;                 /** true if entry is a directory */
+    unsigned long long ino;     /** inode number */
+    long long size;             /** size in bytes */
+    struct timespec mtime;      /** modification time */
+} IndexEntry;
+
+/** Entries of a directory sorted by name, shared by the cache and requests */
+typedef struct DirIndex {
+    DirIdentity id;             /** directory state of index */
+    bool hasParent;             /** true if listing has parent entry */
+    ListEntry parent;           /** parent directory entry */
+    char *names;                /** entry names */
+    size_t namesLen;            /** bytes used in names */
+    IndexEntry *entries;        /** entries in name order */
+    size_t nentries;            /** number of entries */
+    size_t *order[LIST_SORT_SIZE+1];  /** entry order by sort key or NULL if not built */
+    int refs;                   /** references from cache and requests */
+} DirIndex;
+
+/** A rendered listing of a directory shared by the cache and requests */
+struct ListingBody {
+    DirIdentity id;             /** directory state of listing */
+    char *bytes;                /** the listing */
+    size_t len;                 /** length of the listing */
+    int refs;                   /** references from cache and requests */
+};
+
+/** Guards the listing cache */
+static pthread_mutex_t listingLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Cached listings by directory path */
+static HashMap *listingCache = NULL;
+
+/** Invalidation count by directory path */
+static HashMap *listingGenerations = NULL;
+
+/** Total bytes of cached listings */
+static size_t listingCacheBytes = 0;
+
+/** Cached directory indexes by directory path */
+static HashMap *indexCache = NULL;
+
+/** Total entries of cached directory indexes */
+static size_t indexCacheEntries = 0;
+
+/** Distinguishes ETags of this server run from earlier runs */
+static unsigned long listingNonce = 0;
+
+/**
+ * Make the query of the next page of a paginated listing.
+ *
+ * @param next the listing options of the next page
+ * @param query buffer for the query of MAXBUF bytes
+ * @return the query
+ */
+static char *nextPageQuery(const ListOptions *next, char *query) {
+    static const char *sortNames[] = {"name", "name", "mtime", "size"};
+    static const char *formatNames[] = {"", "format=json&", "format=ndjson&"};
+    snprintf(query, MAXBUF, "?%ssort=%s&order=%s&offset=%zu&limit=%zu",
+             formatNames[next->format], sortNames[next->sort],
+             next->descending ? "desc" : "asc", next->offset, next->limit);
+    return query;
+}
+
+/**
+ * Write the header of the html listing page.
+ *
+ * @param ostream the output stream
+ * @param filePath the directory path
+ * @return 0 if successful, -1 if error
+ */
+static int writeHtmlHeader(FILE *ostream, const char *filePath) {
+    int n = fprintf(ostream, "<html>\n"
+                    "<head>\n"
+                    "  <title>%s</title>\n"
+                    "</head>\n"
+                    "<body>\n"
+                    "  <h1>%s</h1>\n"
+                    "  <table>\n"
+                    "  <tr>\n"
+                    "    <th valign=\"top\"></th>\n"
+                    "    <th>Name</th>\n"
+                    "    <th>Last modified</th>\n"
+                    "    <th>Size</th>\n"
+                    "    <th>Description</th>\n"
+                    "  </tr>\n"
+                    "  <tr>\n"
+                    "    <td colspan=\"5\"><hr></td>\n"
+                    "  </tr>", filePath, filePath);
+    return (n < 0) ? -1 : 0;
+}
+
+/**
+ * Write one table row of the html listing page.
+ *
+ * @param ostream the output stream
+ * @param entry the entry properties
+ * @param rowNum the number of rows before this one
+ * @return 0 if successful, -1 if error
+ */
+static int writeHtmlRow(FILE *ostream, const ListEntry *entry, size_t rowNum) {
+    (void)rowNum;
+    char time[MAXBUF];
+    milliTimeToRFC_1123_Date_Time(entry->mtime.tv_sec, time);
+    const char *name = entry->name;
+    bool isDir = entry->isDir;
+    long long size = entry->size;
+
+    int n;
+    if (strcmp(name, "..") == 0) {
+        n = fprintf(ostream, "<tr>\n"
+                          "    <td>&#x23ce</td>\n"
+                          "    <td><a href=\"%s\">Parent Directory</a></td>\n"
+                          "    <td align=\"right\">%s</td>\n"
+                          "    <td align=\"right\">%lld</td>\n"
+                          "    <td></td>\n"
+                          "  </tr>", name, time, size);
+    } else {
+        n = fprintf(ostream, "<tr>\n<td></td>\n"
+                          "    <td><a href=\"%s%s\">%s</a></td>\n"
+                          "    <td align=\"right\">%s</td>\n"
+                          "    <td align=\"right\">%lld</td>\n"
+                          "    <td></td>\n"
+                          "  </tr>", name, isDir ? "/" : "", name, time, size);
+    }
+    return (n < 0) ? -1 : 0;
+}
+
+/**
+ * Write the footer of the html listing page, with a link
+ * to the next page if the listing is paginated.
+ *
+ * @param ostream the output stream
+ * @param next the listing options of the next page or NULL if none
+ * @return 0 if successful, -1 if error
+ */
+static int writeHtmlFooter(FILE *ostream, const ListOptions *next) {
+    if (next != NULL) {
+        char query[MAXBUF];
+        int n = fprintf(ostream, "<tr>\n<td></td>\n"
+                        "    <td><a href=\"%s\">Next page</a></td>\n"
+                        "    <td></td>\n"
+                        "    <td></td>\n"
+                        "    <td></td>\n"
+                        "  </tr>", nextPageQuery(next, query));
+        if (n < 0) {
+            return -1;
+        }
+    }
+    int n = fprintf(ostream, "  <tr><td colspan=\"5\"><hr></td></tr>\n"
+                    "</body>\n"
+                    "</html>");
+    return (n < 0) ? -1 : 0;
+}
+
+/**
+ * Write a string as a quoted JSON string.
+ *
+ * @param ostream the output stream
+ * @param str the string
+ * @return 0 if successful, -1 if error
+ */
+static int writeJsonString(FILE *ostream, const char *str) {
+    char buf[6*strlen(str)+3];
+    size_t len = quoteJsonString(str, strlen(str), buf);
+    return (fwrite(buf, sizeof(char), len, ostream) < len) ? -1 : 0;
+}
+
+/**
+ * Write a directory entry as a JSON object with its name,
+ * type, size, modification time in seconds since the epoch,
+ * and the ETag that a GET of the entry returns. The object
+ * is formatted in a buffer and written with one call.
+ *
+ * @param ostream the output stream
+ * @param entry the entry properties
+ * @param prefix characters to write before the object
+ * @param suffix characters to write after the object
+ * @return 0 if successful, -1 if error
+ */
+static int writeJsonEntry(FILE *ostream, const ListEntry *entry, const char *prefix, const char *suffix) {
+    char etag[MAXBUF];
+    makeFileETag(entry->ino, entry->size, &entry->mtime, etag);
+    char buf[6*NAME_MAX + 4*MAXBUF];
+    size_t n = strlen(prefix);
+    memcpy(buf, prefix, n);
+    memcpy(buf + n, "{\"name\":", 8);
+    n += 8;
+    n += quoteJsonString(entry->name, strlen(entry->name), buf + n);
+    n += snprintf(buf + n, sizeof(buf) - n, ",\"type\":\"%s\",\"size\":%lld,\"mtime\":%lld,\"etag\":",
+                  entry->isDir ? "dir" : "file", entry->size, (long long)entry->mtime.tv_sec);
+    n += quoteJsonString(etag, strlen(etag), buf + n);
+    n += snprintf(buf + n, sizeof(buf) - n, "}%s", suffix);
+    return (fwrite(buf, sizeof(char), n, ostream) < n) ? -1 : 0;
+}
+
+/**
+ * Write the header of a JSON listing.
+ *
+ * @param ostream the output stream
+ * @param filePath the directory path
+ * @return 0 if successful, -1 if error
+ */
+static int writeJsonHeader(FILE *ostream, const char *filePath) {
+    (void)filePath;
+    return (fputs("{\"entries\":[", ostream) == EOF) ? -1 : 0;
+}
+
+/**
+ * Write one entry of a JSON listing.
+ *
+ * @param ostream the output stream
+ * @param entry the entry properties
+ * @param rowNum the number of rows before this one
+ * @return 0 if successful, -1 if error
+ */
+static int writeJsonRow(FILE *ostream, const ListEntry *entry, size_t rowNum) {
+    return writeJsonEntry(ostream, entry, (rowNum == 0) ? "\n" : ",\n", "");
+}
+
+/**
+ * Write the footer of a JSON listing, with the query of the
+ * next page if the listing is paginated.
+ *
+ * @param ostream the output stream
+ * @param next the listing options of the next page or NULL if none
+ * @return 0 if successful, -1 if error
+ */
+static int writeJsonFooter(FILE *ostream, const ListOptions *next) {
+    if (fputs("\n]", ostream) == EOF) {
+        return -1;
+    }
+    if (next != NULL) {
+        char query[MAXBUF];
+        if (fputs(",\"next\":", ostream) == EOF || writeJsonString(ostream, nextPageQuery(next, query)) != 0) {
+            return -1;
+        }
+    }
+    return (fputs("}\n", ostream) == EOF) ? -1 : 0;
+}
+
+/**
+ * Write the header of an NDJSON listing.
+ *
+ * @param ostream the output stream
+ * @param filePath the directory path
+ * @return 0 if successful, -1 if error
+ */
+static int writeNdjsonHeader(FILE *ostream, const char *filePath) {
+    (void)ostream;
+    (void)filePath;
+    return 0;
+}
+
+/**
+ * Write one entry of an NDJSON listing as a line.
+ *
+ * @param ostream the output stream
+ * @param entry the entry properties
+ * @param rowNum the number of rows before this one
+ * @return 0 if successful, -1 if error
+ */
+static int writeNdjsonRow(FILE *ostream, const ListEntry *entry, size_t rowNum) {
+    (void)rowNum;
+    return writeJsonEntry(ostream, entry, "", "\n");
+}
+
+/**
+ * Write the footer of an NDJSON listing: a last line with only
+ * the query of the next page if the listing is paginated.
+ *
+ * @param ostream the output stream
+ * @param next the listing options of the next page or NULL if none
+ * @return 0 if successful, -1 if error
+ */
+static int writeNdjsonFooter(FILE *ostream, const ListOptions *next) {
+    if (next == NULL) {
+        return 0;
+    }
+    char query[MAXBUF];
+    if (fputs("{\"next\":", ostream) == EOF || writeJsonString(ostream, nextPageQuery(next, query)) != 0) {
+        return -1;
+    }
+    return (fputs("}\n", ostream) == EOF) ? -1 : 0;
+}
+
+/** Listing formatters by ListFormat */
+static const ListFormatter listFormatters[] = {
+    [LIST_FORMAT_HTML] = {true, writeHtmlHeader, writeHtmlRow, writeHtmlFooter},
+    [LIST_FORMAT_JSON] = {false, writeJsonHeader, writeJsonRow, writeJsonFooter},
+    [LIST_FORMAT_NDJSON] = {false, writeNdjsonHeader, writeNdjsonRow, writeNdjsonFooter}
+};
+
+/**
+ * Open a directory for scanning.
+ *
+ * @param scan the scan
+ * @param filePath the directory path
+ * @return true if successful, false if error
+ */
+static bool openDirScan(DirScan *scan, const char *filePath) {
+    scan->fd = openContent(filePath, O_RDONLY | O_DIRECTORY);
+    if (scan->fd < 0) {
+        return false;
+    }
+    scan->failed = false;
+#if defined(__linux__)
+    scan->len = scan->pos = 0;
+    scan->buf = malloc(DIR_SCAN_BUFSIZ);
+    if (scan->buf == NULL) {
+        close(scan->fd);
+        return false;
+    }
+#else
+    scan->dir = fdopendir(dup(scan->fd));
+    if (scan->dir == NULL) {
+        close(scan->fd);
+        return false;
+    }
+#endif
+    return true;
+}
+
+/**
+ * Get the next entry of a directory scan.
+ *
+ * @param scan the scan
+ * @param type storage for the DT_ entry type
+ *   (DT_UNKNOWN if the file system does not report it)
+ * @return the entry name or NULL at end of directory or if error
+ */
+static const char *nextDirScan(DirScan *scan, unsigned char *type) {
+#if defined(__linux__)
+    if (scan->pos >= scan->len) {  // read next batch of entries
+        long nread = syscall(SYS_getdents64, scan->fd, scan->buf, DIR_SCAN_BUFSIZ);
+        if (nread <= 0) {
+            scan->failed = (nread < 0);
+            return NULL;
+        }
+        scan->len = (size_t)nread;
+        scan->pos = 0;
+    }
+    struct linux_dirent64 *de = (struct linux_dirent64 *)(scan->buf + scan->pos);
+    scan->pos += de->d_reclen;
+    *type = de->d_type;
+    return de->d_name;
+#else
+    errno = 0;
+    struct dirent *de = readdir(scan->dir);
+    if (de == NULL) {
+        scan->failed = (errno != 0);
+        return NULL;
+    }
+    *type = de->d_type;
+    return de->d_name;
+#endif
+}
+
+/**
+ * Determines whether a directory entry is not listed: "." and
+ * the temp files of uploads in progress. The ".." entry is
+ * listed as the parent.
+ *
+ * @param name the entry name
+ * @return true if the entry is not listed
+ */
+static bool isHiddenEntry(const char *name) {
+    return (strcmp(name, ".") == 0) || isTempFileName(name, strlen(name));
+}
+
+/**
+ * Close a directory scan.
+ *
+ * @param scan the scan
+ */
+static void closeDirScan(DirScan *scan) {
+#if defined(__linux__)
+    free(scan->buf);
+#else
+    closedir(scan->dir);
+#endif
+    close(scan->fd);
+}
+
+/**
+ * Get the listing properties of a directory entry relative to the
+ * directory descriptor, so the kernel does not walk the full path.
+ * Only the inode, size and modification time are requested; the entry
+ * type is trusted from the directory entry unless it is unknown
+ * or a symbolic link that has to be followed.
+ *
+ * @param dirfd the directory descriptor
+ * @param name the entry name
+ * @param type the DT_ entry type from the directory entry
+ * @param entry storage for the entry properties
+ * @return true if successful, false if the entry cannot be read
+ */
+static bool statListEntry(int dirfd, const char *name, unsigned char type, ListEntry *entry) {
+    bool knownType = (type != DT_UNKNOWN) && (type != DT_LNK);
+    entry->name = name;
+#if defined(STATX_SIZE)
+    struct statx stx;
+    unsigned int mask = STATX_INO | STATX_SIZE | STATX_MTIME | (knownType ? 0 : STATX_TYPE);
+    if (statx(dirfd, name, AT_NO_AUTOMOUNT, mask, &stx) != 0) {
+        return false;
+    }
+    entry->isDir = knownType ? (type == DT_DIR) : S_ISDIR(stx.stx_mode);
+    entry->ino = stx.stx_ino;
+    entry->size = (long long)stx.stx_size;
+    entry->mtime = (struct timespec){.tv_sec = stx.stx_mtime.tv_sec, .tv_nsec = stx.stx_mtime.tv_nsec};
+#else
+    struct stat sb;
+    if (fstatat(dirfd, name, &sb, 0) != 0) {
+        return false;
+    }
+    entry->isDir = knownType ? (type == DT_DIR) : S_ISDIR(sb.st_mode);
+    entry->ino = sb.st_ino;
+    entry->size = (long long)sb.st_size;
+    entry->mtime = sb.st_mtim;
+#endif
+    return true;
+}
+
+/**
+ * Get the listing properties of a body in the segment store. Its
+ * record number stands in for the inode number, as in its ETag.
+ *
+ * @param segmentEntry the body
+ * @param entry storage for the entry properties
+ */
+static void segmentListEntry(const SegmentDirEntry *segmentEntry, ListEntry *entry) {
+    entry->name = segmentEntry->name;
+    entry->isDir = false;
+    entry->ino = segmentEntry->seq;
+    entry->size = (long long)segmentEntry->length;
+    entry->mtime = segmentEntry->mtime;
+}
+
+/**
+ * Determines whether a directory path is the content root.
+ *
+ * @param filePath the directory path ending with '/'
+ * @return true if the path is the content root
+ */
+static bool isRootDir(const char *filePath) {
+    char rootPath[MAXPATHLEN];
+    snprintf(rootPath, sizeof(rootPath), "%s/", server.content_base);
+    return (strcmp(filePath, rootPath) == 0);
+}
+
+/**
+ * Stream a listing of a directory in directory order.
+ * Rows are written as directory entries are read, so memory
+ * use does not depend on the number of entries.
+ *
+ * @param filePath the directory path ending with '/'
+ * @param fmt the listing formatter
+ * @param ostream the output stream
+ * @return 0 if successful, -1 if error
+ */
+static int streamList(const char *filePath, const ListFormatter *fmt, FILE *ostream) {
+    bool isRoot = isRootDir(filePath);
+
+    DirScan scan;
+    if (!openDirScan(&scan, filePath)) {
+        return -1;
+    }
+
+    int status = fmt->header(ostream, filePath);
+    size_t rowNum = 0;
+    const char *name;
+    unsigned char type;
+    while ((status == 0) && (name = nextDirScan(&scan, &type)) != NULL) {  // get entry
+        // exclude "." and the temp files of uploads in progress
+        if (isHiddenEntry(name)) {
+            continue;
+        }
+
+        // exclude ".." of rootPath or if format has no parent
+        if ((isRoot || !fmt->parentRow) && strcmp(name, "..") == 0) {
+            continue; // root dir
+        }
+
+        // get properties of entry relative to directory
+        ListEntry entry;
+        if (!statListEntry(scan.fd, name, type, &entry)) {
+            continue;  // removed since read
+        }
+
+        status = fmt->row(ostream, &entry, rowNum++);
+    }
+    if (scan.failed) {  // listing is incomplete
+        status = -1;
+    }
+    closeDirScan(&scan);
+
+    // bodies in the segment store are listed with the files
+    SegmentDirEntry *segmentEntries;
+    size_t nsegmentEntries = listSegmentDir(filePath, &segmentEntries);
+    for (size_t i = 0; status == 0 && i < nsegmentEntries; i++) {
+        ListEntry entry;
+        segmentListEntry(&segmentEntries[i], &entry);
+        status = fmt->row(ostream, &entry, rowNum++);
+    }
+    free(segmentEntries);
+
+    // process the footer
+    if (status == 0) {
+        status = fmt->footer(ostream, NULL);
+    }
+    return status;
+}
+
+/**
+ * Free a directory index.
+ *
+ * @param index the index
+ */
+static void freeDirIndex(DirIndex *index) {
+    for (int i = 0; i <= LIST_SORT_SIZE; i++) {
+        free(index->order[i]);
+    }
+    free(index->names);
+    free(index->entries);
+    free(index);
+}
+
+/**
+ * Compare index entries by name for qsort_r().
+ *
+ * @param a the first entry
+ * @param b the second entry
+ * @param names the index names
+ * @return <0, 0, >0 if a is before, same, or after b
+ */
+static int compareEntryNames(const void *a, const void *b, void *names) {
+    const IndexEntry *ea = a, *eb = b;
+    return strcmp((char*)names + ea->nameOff, (char*)names + eb->nameOff);
+}
+
+/**
+ * Compare entry positions by modification time for qsort_r();
+ * ties keep name order.
+ *
+ * @param a the first position
+ * @param b the second position
+ * @param entries the index entries
+ * @return <0, 0, >0 if a is before, same, or after b
+ */
+static int compareEntryMtimes(const void *a, const void *b, void *entries) {
+    size_t ia = *(const size_t*)a, ib = *(const size_t*)b;
+    const IndexEntry *ea = (IndexEntry*)entries + ia, *eb = (IndexEntry*)entries + ib;
+    if (ea->mtime.tv_sec != eb->mtime.tv_sec) {
+        return (ea->mtime.tv_sec < eb->mtime.tv_sec) ? -1 : 1;
+    }
+    if (ea->mtime.tv_nsec != eb->mtime.tv_nsec) {
+        return (ea->mtime.tv_nsec < eb->mtime.tv_nsec) ? -1 : 1;
+    }
+    return (ia < ib) ? -1 : (ia > ib);
+}
+
+/**
+ * Compare entry positions by size for qsort_r();
+ * ties keep name order.
+ *
+ * @param a the first position
+ * @param b the second position
+ * @param entries the index entries
+ * @return <0, 0, >0 if a is before, same, or after b
+ */
+static int compareEntrySizes(const void *a, const void *b, void *entries) {
+    size_t ia = *(const size_t*)a, ib = *(const size_t*)b;
+    const IndexEntry *ea = (IndexEntry*)entries + ia, *eb = (IndexEntry*)entries + ib;
+    if (ea->size != eb->size) {
+        return (ea->size < eb->size) ? -1 : 1;
+    }
+    return (ia < ib) ? -1 : (ia > ib);
+}
+
+/**
+ * Append an entry to a directory index, growing its names and entries.
+ *
+ * @param index the index
+ * @param entry the entry
+ * @param namesCap the capacity of the index names
+ * @param entriesCap the capacity of the index entries
+ * @return true if added, false if no space
+ */
+static bool addIndexEntry(DirIndex *index, const ListEntry *entry, size_t *namesCap, size_t *entriesCap) {
+    size_t nameLen = strlen(entry->name) + 1;
+    if (index->namesLen + nameLen > *namesCap) {
+        *namesCap = 2*(index->namesLen + nameLen) + 4096;
+        char *names = realloc(index->names, *namesCap);
+        if (names == NULL) {
+            return false;
+        }
+        index->names = names;
+    }
+    if (index->nentries == *entriesCap) {
+        *entriesCap = 2*(*entriesCap) + 256;
+        IndexEntry *entries = realloc(index->entries, *entriesCap*sizeof(IndexEntry));
+        if (entries == NULL) {
+            return false;
+        }
+        index->entries = entries;
+    }
+    memcpy(index->names + index->namesLen, entry->name, nameLen);
+    index->entries[index->nentries++] = (IndexEntry){
+        .nameOff = index->namesLen, .isDir = entry->isDir, .ino = entry->ino,
+        .size = entry->size, .mtime = entry->mtime
+    };
+    index->namesLen += nameLen;
+    return true;
+}
+
+/**
+ * Read all entries of a directory into a new index sorted by name.
+ *
+ * @param filePath the directory path ending with '/'
+ * @return the index or NULL if error
+ */
+static DirIndex *buildDirIndex(const char *filePath) {
+    DirScan scan;
+    if (!openDirScan(&scan, filePath)) {
+        return NULL;
+    }
+    DirIndex *index = calloc(1, sizeof(DirIndex));
+    if (index == NULL) {
+        closeDirScan(&scan);
+        return NULL;
+    }
+    index->refs = 1;
+    bool isRoot = isRootDir(filePath);
+
+    size_t namesCap = 0, entriesCap = 0;
+    bool ok = true;
+    const char *name;
+    unsigned char type;
+    while (ok && (name = nextDirScan(&scan, &type)) != NULL) {
+        if (isHiddenEntry(name)) {
+            continue;
+        }
+        ListEntry entry;
+        if (!statListEntry(scan.fd, name, type, &entry)) {
+            continue;  // removed since read
+        }
+        if (strcmp(name, "..") == 0) {  // parent is not sorted or paged
+            if (!isRoot) {
+                index->hasParent = true;
+                index->parent = entry;
+                index->parent.name = "..";
+            }
+            continue;
+        }
+
+        ok = addIndexEntry(index, &entry, &namesCap, &entriesCap);
+    }
+    ok = ok && !scan.failed;
+    closeDirScan(&scan);
+
+    // bodies in the segment store are listed with the files
+    SegmentDirEntry *segmentEntries;
+    size_t nsegmentEntries = listSegmentDir(filePath, &segmentEntries);
+    for (size_t i = 0; ok && i < nsegmentEntries; i++) {
+        ListEntry entry;
+        segmentListEntry(&segmentEntries[i], &entry);
+        ok = addIndexEntry(index, &entry, &namesCap, &entriesCap);
+    }
+    free(segmentEntries);
+    if (!ok) {
+        freeDirIndex(index);
+        return NULL;
+    }
+
+    // sort entries by name
+    if (index->nentries > 0) {
+        qsort_r(index->entries, index->nentries, sizeof(IndexEntry), compareEntryNames, index->names);
+    }
+    return index;
+}
+
+/**
+ * Get the order of index entries for a sort key, sorting
+ * the index by that key the first time it is requested.
+ *
+ * @param index the index
+ * @param sort the sort key
+ * @return the entry positions in sort order,
+ *   or NULL for name order (or if no space)
+ */
+static const size_t *dirIndexOrder(DirIndex *index, ListSort sort) {
+    if (sort != LIST_SORT_MTIME && sort != LIST_SORT_SIZE) {
+        return NULL;  // entries are in name order
+    }
+    pthread_mutex_lock(&listingLock);
+    size_t *order = index->order[sort];
+    pthread_mutex_unlock(&listingLock);
+    if (order != NULL || index->nentries == 0) {
+        return order;
+    }
+
+    // sort positions outside lock
+    order = malloc(index->nentries*sizeof(size_t));
+    if (order == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < index->nentries; i++) {
+        order[i] = i;
+    }
+    qsort_r(order, index->nentries, sizeof(size_t),
+            (sort == LIST_SORT_MTIME) ? compareEntryMtimes : compareEntrySizes, index->entries);
+
+    // keep order built first by a concurrent request
+    pthread_mutex_lock(&listingLock);
+    if (index->order[sort] == NULL) {
+        index->order[sort] = order;
+    } else {
+        free(order);
+        order = index->order[sort];
+    }
+    pthread_mutex_unlock(&listingLock);
+    return order;
+}
+
+/**
+ * Generate a listing of a page of directory entries
+ * in sort order from the directory index.
+ *
+ * @param filePath the directory path ending with '/'
+ * @param index the directory index
+ * @param opts the listing options
+ * @param fmt the listing formatter
+ * @param ostream the output stream
+ * @return 0 if successful, -1 if error
+ */
+static int indexList(const char *filePath, DirIndex *index, const ListOptions *opts,
+                     const ListFormatter *fmt, FILE *ostream) {
+    const size_t *order = dirIndexOrder(index, opts->sort);
+    size_t first = (opts->offset < index->nentries) ? opts->offset : index->nentries;
+    size_t count = index->nentries - first;
+    if (count > opts->limit) {
+        count = opts->limit;
+    }
+
+    int status = fmt->header(ostream, filePath);
+    size_t rowNum = 0;
+    if (status == 0 && index->hasParent && fmt->parentRow) {
+        status = fmt->row(ostream, &index->parent, rowNum++);
+    }
+    for (size_t n = first; status == 0 && n < first + count; n++) {
+        size_t pos = opts->descending ? index->nentries - 1 - n : n;
+        const IndexEntry *ie = &index->entries[(order != NULL) ? order[pos] : pos];
+        ListEntry entry = {
+            .name = index->names + ie->nameOff, .isDir = ie->isDir, .ino = ie->ino,
+            .size = ie->size, .mtime = ie->mtime
+        };
+        status = fmt->row(ostream, &entry, rowNum++);
+    }
+    if (status == 0) {
+        ListOptions next = *opts;
+        next.offset = first + count;
+        status = fmt->footer(ostream, (first + count < index->nentries) ? &next : NULL);
+    }
+    return status;
+}
+
+/**
+ * Make the cache key for a directory path by collapsing repeated
+ * path separators and ensuring a trailing separator.
+ *
+ * @param dirPath the directory path
+ * @param key buffer for the key of MAXPATHLEN bytes
+ * @return the key
+ */
+static char *listingKey(const char *dirPath, char *key) {
+    size_t n = 0;
+    for (const char *p = dirPath; *p != '\0' && n < MAXPATHLEN-2; p++) {
+        if (*p == '/' && n > 0 && key[n-1] == '/') {
+            continue;
+        }
+        key[n++] = *p;
+    }
+    if (n == 0 || key[n-1] != '/') {
+        key[n++] = '/';
+    }
+    key[n] = '\0';
+    return key;
+}
+
+/**
+ * Make the variant name of listing options: empty for the
+ * default listing, otherwise a token that is unique for the
+ * entries selected by the options.
+ *
+ * @param opts the listing options
+ * @param variant buffer for the variant of MAXBUF bytes
+ * @return the variant
+ */
+static char *listingVariant(const ListOptions *opts, char *variant) {
+    int n = 0;
+    if (opts->format != LIST_FORMAT_HTML) {
+        n = snprintf(variant, MAXBUF, "f%d", (int)opts->format);
+    }
+    if (isStreamingList(opts)) {
+        variant[n] = '\0';
+    } else {
+        snprintf(variant + n, MAXBUF - n, "s%d%c%zx.%zx", (int)opts->sort,
+                 opts->descending ? 'd' : 'a', opts->offset, opts->limit);
+    }
+    return variant;
+}
+
+/**
+ * Make the listing cache key of a directory and listing options.
+ *
+ * @param filePath the directory path
+ * @param opts the listing options
+ * @param key buffer for the key of MAXPATHLEN+MAXBUF bytes
+ * @return the key
+ */
+static char *listingVariantKey(const char *filePath, const ListOptions *opts, char *key) {
+    char variant[MAXBUF];
+    listingKey(filePath, key);
+    if (*listingVariant(opts, variant) != '\0') {
+        strcat(key, "?");
+        strcat(key, variant);
+    }
+    return key;
+}
+
+/**
+ * Initialize the listing cache on first use.
+ * Caller must hold listingLock.
+ *
+ * @return true if the cache is available
+ */
+static bool initListingCache(void) {
+    if (listingCache == NULL) {
+        listingCache = newHashMap(64);
+        listingGenerations = newHashMap(64);
+        indexCache = newHashMap(64);
+        listingNonce = (unsigned long)time(NULL);
+    }
+    return (listingCache != NULL) && (listingGenerations != NULL) && (indexCache != NULL);
+}
+
+/**
+ * Get the invalidation count for a directory.
+ * Caller must hold listingLock.
+ *
+ * @param key the directory key
+ * @return the invalidation count
+ */
+static unsigned long listingGeneration(const char *key) {
+    return (unsigned long)(uintptr_t)getHashMap(listingGenerations, key);
+}
+
+/**
+ * Drop a reference to a listing, freeing it with the last one.
+ * Caller must hold listingLock.
+ *
+ * @param listing the listing
+ */
+static void dropListing(ListingBody *listing) {
+    if (--listing->refs == 0) {
+        free(listing->bytes);
+        free(listing);
+    }
+}
+
+/**
+ * Drop a reference to a directory index, freeing it with the
+ * last one. Caller must hold listingLock.
+ *
+ * @param index the index
+ */
+static void dropDirIndex(DirIndex *index) {
+    if (--index->refs == 0) {
+        freeDirIndex(index);
+    }
+}
+
+/**
+ * Make the identity of the current state of a directory.
+ *
+ * @param sb the directory properties
+ * @param generation the invalidation count
+ * @param id storage for the identity
+ */
+static void makeDirIdentity(const struct stat *sb, unsigned long generation, DirIdentity *id) {
+    *id = (DirIdentity){
+        .dev = sb->st_dev, .ino = sb->st_ino,
+        .mtime = sb->st_mtim, .ctime = sb->st_ctim,
+        .generation = generation
+    };
+}
+
+/**
+ * Determines whether a cached item was made from the
+ * current state of its directory.
+ *
+ * @param id the identity of the cached item
+ * @param sb the current directory properties
+ * @param generation the current invalidation count
+ * @return true if the item is current
+ */
+static bool isCurrentDir(const DirIdentity *id, const struct stat *sb, unsigned long generation) {
+    return    (id->dev == sb->st_dev)
+           && (id->ino == sb->st_ino)
+           && (id->mtime.tv_sec == sb->st_mtim.tv_sec)
+           && (id->mtime.tv_nsec == sb->st_mtim.tv_nsec)
+           && (id->ctime.tv_sec == sb->st_ctim.tv_sec)
+           && (id->ctime.tv_nsec == sb->st_ctim.tv_nsec)
+           && (id->generation == generation);
+}
+
+/**
+ * Visitor that evicts cached directory indexes until the
+ * cache has room for the requested number of entries.
+ *
+ * @param key the directory key
+ * @param value the index
+ * @param ctx pointer to the number of entries needed
+ * @return true if the index was evicted
+ */
+static bool evictDirIndex(const char *key, void *value, void *ctx) {
+    (void)key;
+    size_t needed = *(size_t*)ctx;
+    if (indexCacheEntries + needed <= DIR_INDEX_MAX_ENTRIES) {
+        return false;
+    }
+    DirIndex *index = value;
+    indexCacheEntries -= index->nentries;
+    dropDirIndex(index);
+    return true;
+}
+
+/**
+ * Get the sorted index of a directory, from the cache if it
+ * is current, otherwise by reading the directory. The index
+ * must be released with releaseDirIndex().
+ *
+ * @param filePath the directory path ending with '/'
+ * @param sb the current directory properties
+ * @return the index or NULL if error
+ */
+static DirIndex *acquireDirIndex(const char *filePath, const struct stat *sb) {
+    char key[MAXPATHLEN];
+    listingKey(filePath, key);
+
+    pthread_mutex_lock(&listingLock);
+    if (!initListingCache()) {
+        pthread_mutex_unlock(&listingLock);
+        return NULL;
+    }
+    unsigned long generation = listingGeneration(key);
+    DirIndex *index = getHashMap(indexCache, key);
+    if (index != NULL) {
+        if (isCurrentDir(&index->id, sb, generation)) {
+            index->refs++;
+            pthread_mutex_unlock(&listingLock);
+            return index;
+        }
+        removeHashMap(indexCache, key);  // stale: remove from cache
+        indexCacheEntries -= index->nentries;
+        dropDirIndex(index);
+    }
+    pthread_mutex_unlock(&listingLock);
+
+    // read directory outside lock
+    index = buildDirIndex(filePath);
+    if (index == NULL) {
+        return NULL;
+    }
+    makeDirIdentity(sb, generation, &index->id);
+
+    // cache index unless invalidated while reading
+    pthread_mutex_lock(&listingLock);
+    if (listingGeneration(key) == generation && index->nentries <= DIR_INDEX_MAX_ENTRIES) {
+        size_t needed = index->nentries;
+        forEachHashMap(indexCache, evictDirIndex, &needed);
+        DirIndex *old = NULL;
+        if (putHashMap(indexCache, key, index, (void**)&old)) {
+            index->refs++;
+            indexCacheEntries += index->nentries;
+            if (old != NULL) {
+                indexCacheEntries -= old->nentries;
+                dropDirIndex(old);
+            }
+        }
+    }
+    pthread_mutex_unlock(&listingLock);
+    return index;
+}
+
+/**
+ * Release an index returned by acquireDirIndex().
+ *
+ * @param index the index
+ */
+static void releaseDirIndex(DirIndex *index) {
+    pthread_mutex_lock(&listingLock);
+    dropDirIndex(index);
+    pthread_mutex_unlock(&listingLock);
+}
+
+/**
+ * Determines whether listing options select all entries in
+ * directory order, so the listing can be streamed.
+ *
+ * @param opts the listing options
+ * @return true if the listing can be streamed
+ */
+bool isStreamingList(const ListOptions *opts) {
+    return (opts->sort == LIST_SORT_NONE) && (opts->offset == 0) && (opts->limit == SIZE_MAX);
+}
+
+/**
+ * Generate a listing of a directory to an output stream.
+ * The default listing is streamed in directory order, so memory
+ * use does not depend on the number of entries. Sorted or paged
+ * listings are generated from a cached index of the directory
+ * that is sorted once per sort key.
+ *
+ * @param filePath the directory path ending with '/'
+ * @param sb the directory properties
+ * @param opts the listing options
+ * @param ostream the output stream
+ * @return 0 if successful, -1 if error
+ */
+int generateList(const char *filePath, const struct stat *sb, const ListOptions *opts, FILE *ostream) {
+    const ListFormatter *fmt = &listFormatters[opts->format];
+    if (isStreamingList(opts)) {
+        return streamList(filePath, fmt, ostream);
+    }
+    DirIndex *index = acquireDirIndex(filePath, sb);
+    if (index == NULL) {
+        return -1;
+    }
+    int status = indexList(filePath, index, opts, fmt, ostream);
+    releaseDirIndex(index);
+    return status;
+}
+
+/**
+ * Get the ETag of the listing of a directory. The ETag changes
+ * when the directory inode, mtime or ctime changes, or when the
+ * listing is invalidated by invalidateListing().
+ *
+ * @param filePath the directory path ending with '/'
+ * @param sb the directory properties
+ * @param opts the listing options
+ * @param etag buffer for the quoted ETag of MAXBUF bytes
+ * @return the ETag
+ */
+char *getListingETag(const char *filePath, const struct stat *sb, const ListOptions *opts, char *etag) {
+    char key[MAXPATHLEN];
+    listingKey(filePath, key);
+    char variant[MAXBUF];
+    listingVariant(opts, variant);
+
+    pthread_mutex_lock(&listingLock);
+    unsigned long generation = initListingCache() ? listingGeneration(key) : 0;
+    unsigned long nonce = listingNonce;
+    pthread_mutex_unlock(&listingLock);
+
+    snprintf(etag, MAXBUF, "\"%llx-%llx.%lx-%llx.%lx-%lx-%lx%s%s\"",
+             (unsigned long long)sb->st_ino,
+             (unsigned long long)sb->st_mtim.tv_sec, (unsigned long)sb->st_mtim.tv_nsec,
+             (unsigned long long)sb->st_ctim.tv_sec, (unsigned long)sb->st_ctim.tv_nsec,
+             generation, nonce, (*variant != '\0') ? "-" : "", variant);
+    return etag;
+}
+
+/**
+ * Get the cached listing of a directory if it is current.
+ * The listing must be released with releaseListing().
+ *
+ * @param filePath the directory path ending with '/'
+ * @param sb the current directory properties
+ * @param opts the listing options
+ * @return the listing or NULL if not cached
+ */
+ListingBody *acquireListing(const char *filePath, const struct stat *sb, const ListOptions *opts) {
+    char dirKey[MAXPATHLEN];
+    listingKey(filePath, dirKey);
+    char key[MAXPATHLEN+MAXBUF];
+    listingVariantKey(filePath, opts, key);
+
+    pthread_mutex_lock(&listingLock);
+    ListingBody *listing = NULL;
+    if (initListingCache()) {
+        listing = getHashMap(listingCache, key);
+        if (listing != NULL) {
+            if (isCurrentDir(&listing->id, sb, listingGeneration(dirKey))) {
+                listing->refs++;
+            } else {  // stale: remove from cache
+                removeHashMap(listingCache, key);
+                listingCacheBytes -= listing->len;
+                dropListing(listing);
+                listing = NULL;
+            }
+        }
+    }
+    pthread_mutex_unlock(&listingLock);
+    return listing;
+}
+
+/**
+ * Release a listing returned by acquireListing().
+ *
+ * @param listing the listing
+ */
+void releaseListing(ListingBody *listing) {
+    pthread_mutex_lock(&listingLock);
+    dropListing(listing);
+    pthread_mutex_unlock(&listingLock);
+}
+
+/**
+ * Get the bytes of a listing.
+ *
+ * @param listing the listing
+ * @return the bytes of the listing
+ */
+const char *listingBytes(const ListingBody *listing) {
+    return listing->bytes;
+}
+
+/**
+ * Get the length of a listing.
+ *
+ * @param listing the listing
+ * @return the number of bytes in the listing
+ */
+size_t listingLength(const ListingBody *listing) {
+    return listing->len;
+}
+
+/**
+ * Invalidate the cached listings, index and ETags of a directory.
+ * Called by handlers that change the directory contents.
+ *
+ * @param dirPath the directory path with or without trailing '/'
+ */
+void invalidateListing(const char *dirPath) {
+    char key[MAXPATHLEN];
+    listingKey(dirPath, key);
+
+    pthread_mutex_lock(&listingLock);
+    if (initListingCache()) {
+        // cached variants of the listing are removed when next requested
+        ListingBody *listing = removeHashMap(listingCache, key);
+        if (listing != NULL) {
+            listingCacheBytes -= listing->len;
+            dropListing(listing);
+        }
+        DirIndex *index = removeHashMap(indexCache, key);
+        if (index != NULL) {
+            indexCacheEntries -= index->nentries;
+            dropDirIndex(index);
+        }
+        unsigned long generation = listingGeneration(key) + 1;
+        putHashMap(listingGenerations, key, (void*)(uintptr_t)generation, NULL);
+    }
+    pthread_mutex_unlock(&listingLock);
+}
+
+/**
+ * Visitor that evicts cached listings until the
+ * cache has room for the requested number of bytes.
+ *
+ * @param key the directory key
+ * @param value the listing
+ * @param ctx pointer to the number of bytes needed
+ * @return true if the listing was evicted
+ */
+static bool evictListing(const char *key, void *value, void *ctx) {
+    (void)key;
+    size_t needed = *(size_t*)ctx;
+    if (listingCacheBytes + needed <= server.listing_cache_size) {
+        return false;
+    }
+    ListingBody *listing = value;
+    listingCacheBytes -= listing->len;
+    dropListing(listing);
+    return true;
+}
+
+/** Captures bytes written to a stream while passing them on */
+typedef struct ListingCapture {
+    FILE *ostream;      /** the downstream output stream */
+    char *bytes;        /** captured bytes or NULL if over limit */
+    size_t len;         /** number of captured bytes */
+    size_t capacity;    /** capacity of bytes */
+    size_t limit;       /** maximum bytes to capture */
+} ListingCapture;
+
+/**
+ * Write function of a capture stream.
+ *
+ * @param cookie the capture
+ * @param buf the bytes to write
+ * @param size the number of bytes
+ * @return the number of bytes written or -1 if error
+ */
+static ssize_t captureWrite(void *cookie, const char *buf, size_t size) {
+    ListingCapture *capture = cookie;
+    if (capture->bytes != NULL) {
+        if (capture->len + size > capture->limit) {  // too large to cache
+            free(capture->bytes);
+            capture->bytes = NULL;
+        } else {
+            if (capture->len + size > capture->capacity) {
+                size_t capacity = 2*(capture->len + size);
+                char *bytes = realloc(capture->bytes, capacity);
+                if (bytes == NULL) {
+                    free(capture->bytes);
+                }
+                capture->bytes = bytes;
+                capture->capacity = capacity;
+            }
+            if (capture->bytes != NULL) {
+                memcpy(capture->bytes + capture->len, buf, size);
+                capture->len += size;
+            }
+        }
+    }
+    return (fwrite(buf, sizeof(char), size, capture->ostream) < size) ? -1 : (ssize_t)size;
+}
+
+/**
+ * Generate a listing of a directory to an output stream,
+ * and add it to the listing cache if it is small enough.
+ *
+ * @param filePath the directory path ending with '/'
+ * @param sb the directory properties before generating
+ * @param opts the listing options
+ * @param ostream the output stream
+ * @return 0 if successful, -1 if error
+ */
+int generateCachedList(const char *filePath, const struct stat *sb, const ListOptions *opts, FILE *ostream) {
+    char dirKey[MAXPATHLEN];
+    listingKey(filePath, dirKey);
+    char key[MAXPATHLEN+MAXBUF];
+    listingVariantKey(filePath, opts, key);
+
+    size_t limit = server.listing_cache_size / 4;  // no listing may take over the cache
+    if (limit == 0) {
+        return generateList(filePath, sb, opts, ostream);
+    }
+    pthread_mutex_lock(&listingLock);
+    bool cacheable = initListingCache();
+    unsigned long generation = cacheable ? listingGeneration(dirKey) : 0;
+    pthread_mutex_unlock(&listingLock);
+    if (!cacheable) {
+        return generateList(filePath, sb, opts, ostream);
+    }
+
+    // capture listing as it is written
+    ListingCapture capture = {.ostream = ostream, .limit = limit, .capacity = 4096};
+    capture.bytes = malloc(capture.capacity);
+    cookie_io_functions_t captureFuncs = {.write = captureWrite};
+    FILE *captureStream = fopencookie(&capture, "w", captureFuncs);
+    if (captureStream == NULL) {
+        free(capture.bytes);
+        return generateList(filePath, sb, opts, ostream);
+    }
+    setvbuf(captureStream, NULL, _IONBF, 0);  // ostream does the buffering
+    int status = generateList(filePath, sb, opts, captureStream);
+    fclose(captureStream);
+    if (status != 0 || capture.bytes == NULL) {
+        free(capture.bytes);
+        return status;
+    }
+
+    ListingBody *listing = malloc(sizeof(ListingBody));
+    if (listing == NULL) {
+        free(capture.bytes);
+        return status;
+    }
+    *listing = (ListingBody){.bytes = capture.bytes, .len = capture.len, .refs = 1};
+    makeDirIdentity(sb, generation, &listing->id);
+
+    // store listing unless invalidated while generating
+    pthread_mutex_lock(&listingLock);
+    if (listingGeneration(dirKey) == generation) {
+        size_t needed = listing->len;
+        forEachHashMap(listingCache, evictListing, &needed);
+        ListingBody *old = NULL;
+        if (putHashMap(listingCache, key, listing, (void**)&old)) {
+            listingCacheBytes += listing->len;
+            listing = old;
+            if (old != NULL) {
+                listingCacheBytes -= old->len;
+            }
+        }
+    }
+    if (listing != NULL) {
+        dropListing(listing);
+    }
+    pthread_mutex_unlock(&listingLock);
+    return status;
+}
@@ -0,0 +1,134 @@
+/*
+ * dir_util.h
+ *
+ * Functions for generating directory listings.
+ *
+ *  @since 2021-04-24
+ */
+
+#ifndef DIR_UTIL_H_
+#define DIR_UTIL_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+/** Sort keys of listing entries */
+typedef enum ListSort {
+    LIST_SORT_NONE,             /** directory order */
+    LIST_SORT_NAME,             /** entry name */
+    LIST_SORT_MTIME,            /** modification time */
+    LIST_SORT_SIZE              /** size in bytes */
+} ListSort;
+
+/** Formats of listings */
+typedef enum ListFormat {
+    LIST_FORMAT_HTML,           /** html page */
+    LIST_FORMAT_JSON,           /** JSON object with an array of entries */
+    LIST_FORMAT_NDJSON          /** one JSON object per entry per line */
+} ListFormat;
+
+/** Options that select the format and entries of a listing */
+typedef struct ListOptions {
+    ListFormat format;          /** listing format */
+    ListSort sort;              /** sort key */
+    bool descending;            /** true to reverse the sort order */
+    size_t offset;              /** index of first entry in sort order */
+    size_t limit;               /** maximum number of entries or SIZE_MAX */
+} ListOptions;
+
+/** A rendered listing of a directory from the listing cache */
+typedef struct ListingBody ListingBody;
+
+/**
+ * Determines whether listing options select all entries in
+ * directory order, so the listing can be streamed.
+ *
+ * @param opts the listing options
+ * @return true if the listing can be streamed
+ */
+bool isStreamingList(const ListOptions *opts);
+
+/**
+ * Generate a listing of a directory to an output stream.
+ * The default listing is streamed in directory order, so memory
+ * use does not depend on the number of entries. Sorted or paged
+ * listings are generated from a cached index of the directory
+ * that is sorted once per sort key.
+ *
+ * @param filePath the directory path ending with '/'
+ * @param sb the directory properties
+ * @param opts the listing options
+ * @param ostream the output stream
+ * @return 0 if successful, -1 if error
+ */
+int generateList(const char *filePath, const struct stat *sb, const ListOptions *opts, FILE *ostream);
+
+/**
+ * Generate a listing of a directory to an output stream,
+ * and add it to the listing cache if it is small enough.
+ *
+ * @param filePath the directory path ending with '/'
+ * @param sb the directory properties before generating
+ * @param opts the listing options
+ * @param ostream the output stream
+ * @return 0 if successful, -1 if error
+ */
+int generateCachedList(const char *filePath, const struct stat *sb, const ListOptions *opts, FILE *ostream);
+
+/**
+ * Get the ETag of the listing of a directory. The ETag changes
+ * when the directory inode, mtime or ctime changes, or when the
+ * listing is invalidated by invalidateListing().
+ *
+ * @param filePath the directory path ending with '/'
+ * @param sb the directory properties
+ * @param opts the listing options
+ * @param etag buffer for the quoted ETag of MAXBUF bytes
+ * @return the ETag
+ */
+char *getListingETag(const char *filePath, const struct stat *sb, const ListOptions *opts, char *etag);
+
+/**
+ * Get the cached listing of a directory if it is current.
+ * The listing must be released with releaseListing().
+ *
+ * @param filePath the directory path ending with '/'
+ * @param sb the current directory properties
+ * @param opts the listing options
+ * @return the listing or NULL if not cached
+ */
+ListingBody *acquireListing(const char *filePath, const struct stat *sb, const ListOptions *opts);
+
+/**
+ * Release a listing returned by acquireListing().
+ *
+ * @param listing the listing
+ */
+void releaseListing(ListingBody *listing);
+
+/**
+ * Get the bytes of a listing.
+ *
+ * @param listing the listing
+ * @return the bytes of the listing
+ */
+const char *listingBytes(const ListingBody *listing);
+
+/**
+ * Get the length of a listing.
+ *
+ * @param listing the listing
+ * @return the number of bytes in the listing
+ */
+size_t listingLength(const ListingBody *listing);
+
+/**
+ * Invalidate the cached listings, index and ETags of a directory.
+ * Called by handlers that change the directory contents.
+ *
+ * @param dirPath the directory path with or without trailing '/'
+ */
+void invalidateListing(const char *dirPath);
+
+#endif /* DIR_UTIL_H_ */
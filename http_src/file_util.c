@@ -7,10 +7,22 @@
  *  @author: Philip Gust
  */
 
+#define _GNU_SOURCE  /* for splice(), pipe2(), fallocate() and mkostemp() */
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
-#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
 #include "http_server.h"
 #include "file_util.h"
 #include "time_util.h"
@@ -29,102 +41,6 @@ FILE *tmpStringFile(const char *contentStr) {
 	return tmpstream;
 }
 
-char* generateList(const char *filePath) {
-    // get root path
-     char rootPath[MAXBUF];
-     strcpy(rootPath, server.content_base);
-     strcat(rootPath, "/");
-
-    char contentStr[200000];
-    // process the header of the html
-    char header[5000];
-    sprintf(header, "<html>\n"
-                    "<head>\n"
-                    "  <title>%s</title>\n"
-                    "</head>\n"
-                    "<body>\n"
-                    "  <h1>%s</h1>\n"
-                    "  <table>\n"
-                    "  <tr>\n"
-                    "    <th valign=\"top\"></th>\n"
-                    "    <th>Name</th>\n"
-                    "    <th>Last modified</th>\n"
-                    "    <th>Size</th>\n"
-                    "    <th>Description</th>\n"
-                    "  </tr>\n"
-                    "  <tr>\n"
-                    "    <td colspan=\"5\"><hr></td>\n"
-                    "  </tr>", filePath, filePath);
-    strcpy(contentStr, header);
-
-
-    struct dirent *de; // Pointer for directory entry
-    DIR *dr = opendir(filePath);
-
-    while ((de = readdir(dr)) != NULL) {  // get entry
-        char childRow[20000];
-        char *name = de->d_name;
-
-        // exclude ".";
-        if (strcmp(name, ".") == 0) {
-            continue;
-        }
-
-        // exclude ".." of rootPath;
-        if (strcmp(filePath, rootPath) == 0 && strcmp(name, "..") == 0) {
-            continue; // root dir
-        }
-
-        // get filePath of entry
-        char path[MAXBUF];
-        strcpy(path, filePath);
-        strcat(path, name); // "dir filepath + name -> child path
-        char locate[MAXBUF];
-        strcpy(locate, name);
-        if (de->d_type == DT_DIR) {
-            strcat(path, "/");
-            strcat(locate, "/");
-        }
-
-        // get properties
-        struct stat sb;
-        stat(path, &sb);
-        int size = sb.st_size;
-        time_t timer = sb.st_mtime;
-        char time[MAXBUF];
-        milliTimeToRFC_1123_Date_Time(timer, time);
-
-        // process the table row of the html
-        if (strcmp(name, "..") == 0) {
-            sprintf(childRow, "<tr>\n"
-                              "    <td>&#x23ce</td>\n"
-                              "    <td><a href=\"%s\">Parent Directory</a></td>\n"
-                              "    <td align=\"right\">%s</td>\n"
-                              "    <td align=\"right\">%d</td>\n"
-                              "    <td></td>\n"
-                              "  </tr>", name, time, size);
-        } else {
-            sprintf(childRow, "<tr>\n<td></td>\n"
-                              "    <td><a href=\"%s\">%s</a></td>\n"
-                              "    <td align=\"right\">%s</td>\n"
-                              "    <td align=\"right\">%d</td>\n"
-                              "    <td></td>\n"
-                              "  </tr>", locate, name, time, size);  ////name, name, time, size
-        }
-
-        // copy it to the contentStr
-        strcat(contentStr, childRow);
-    }
-    closedir(dr);
-    // process the footer
-    char footer[2048];
-    sprintf(footer, "  <tr><td colspan=\"5\"><hr></td></tr>\n"
-                    "</body>\n"
-                    "</html>");
-    strcat(contentStr, footer);
-    return contentStr;
-}
-
 /**
  * This function calls fstat() on the file descriptor of the
  * specified stream.
@@ -139,6 +55,9 @@ int fileStat(FILE *stream, struct stat *buf) {
 }
 
 
+/** Size of the buffer used to copy between streams */
+#define COPY_BUFSIZ (64*1024)
+
 /**
  * Copy bytes from input stream to output stream
  * @param istream the input stream
@@ -147,18 +66,389 @@ int fileStat(FILE *stream, struct stat *buf) {
  * @param return 0 if successful or -1 if error
  */
 int copyFileStreamBytes(FILE *istream, FILE *ostream, int nbytes) {
-	char *buf[MAXBUF];
-    while ((nbytes > 0) && !feof(istream)) {
-    	int ntoread = (nbytes < MAXBUF) ? nbytes : MAXBUF;
-        size_t nread = fread(buf, sizeof(char), ntoread, istream);
-        if (nread > 0) {
-			if (fwrite(buf, sizeof(char), nread, ostream) < nread) {
+	char buf[COPY_BUFSIZ];
+	while (nbytes > 0) {
+		size_t ntoread = ((size_t)nbytes < sizeof(buf)) ? (size_t)nbytes : sizeof(buf);
+		size_t nread = fread(buf, sizeof(char), ntoread, istream);
+		if (nread == 0) {
+			return ferror(istream) ? -1 : 0;
+		}
+		if (fwrite(buf, sizeof(char), nread, ostream) < nread) {
+			return -1;
+		}
+		nbytes -= (int)nread;
+	}
+	return 0;
+}
+
+/**
+ * Write all bytes of an I/O vector to a file descriptor, repeating
+ * the writev() after a partial write or an interrupt. The entries
+ * of iov are updated as bytes are written.
+ *
+ * @param fd the output file descriptor
+ * @param iov the I/O vector
+ * @param iovcnt the number of entries
+ * @return 0 if successful, -1 with errno set if error
+ */
+int writevFully(int fd, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t n = writev(fd, iov, iovcnt);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return -1;
+		}
+		// skip the entries written and advance into a partial one
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= (ssize_t)iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= (size_t)n;
+		}
+	}
+	return 0;
+}
+
+#if defined(__linux__)
+/** Capacity requested for the pipe between socket and file */
+#define SPLICE_PIPE_SIZE (1024*1024)
+
+/** Pipe used by this thread to splice request bodies, or -1 */
+static _Thread_local int splicePipe[2] = {-1, -1};
+
+/** Capacity of this thread's splice pipe */
+static _Thread_local size_t splicePipeSize = 0;
+#endif
+
+#if defined(__GLIBC__)
+#ifndef _IO_IN_BACKUP
+#define _IO_IN_BACKUP 0x100  /* from glibc libio.h: reading ungetc() pushback */
+#endif
+#endif
+
+/**
+ * Returns the number of bytes already read into the buffer of
+ * an input stream that have not been consumed by the caller.
+ *
+ * @param stream the input stream
+ * @return the number of buffered bytes, or SIZE_MAX if unknown
+ */
+static size_t freadahead(FILE *stream) {
+#if defined(__GLIBC__)
+	if (stream->_IO_write_ptr > stream->_IO_write_base) {
+		return 0;  // in write mode
+	}
+	size_t n = stream->_IO_read_end - stream->_IO_read_ptr;
+	if (stream->_flags & _IO_IN_BACKUP) {
+		n += stream->_IO_save_end - stream->_IO_save_base;
+	}
+	return n;
+#else
+	(void)stream;
+	return SIZE_MAX;
+#endif
+}
+
+#if defined(__linux__)
+/**
+ * Close the splice pipe of this thread, discarding
+ * any bytes left in it.
+ */
+static void closeSplicePipe(void) {
+	close(splicePipe[0]);
+	close(splicePipe[1]);
+	splicePipe[0] = splicePipe[1] = -1;
+}
+
+/**
+ * Open the splice pipe of this thread if not already open.
+ *
+ * @return true if the pipe is open
+ */
+static bool openSplicePipe(void) {
+	if (splicePipe[0] >= 0) {
+		return true;
+	}
+	if (pipe2(splicePipe, O_CLOEXEC) != 0) {
+		return false;
+	}
+	// a larger pipe moves more pages per splice; keep default if not permitted
+	int size = fcntl(splicePipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	if (size < 0) {
+		size = fcntl(splicePipe[1], F_GETPIPE_SZ);
+	}
+	splicePipeSize = (size > 0) ? (size_t)size : 65536;
+	return true;
+}
+
+/**
+ * Move bytes from a descriptor to a file descriptor through the
+ * splice pipe of this thread, without copying them to user space.
+ *
+ * @param infd the input descriptor
+ * @param outfd the output file descriptor
+ * @param nbytes the number of bytes to move
+ * @return nbytes if successful, 0 if infd cannot be spliced
+ *   before any bytes were moved, or -1 if error
+ */
+static ssize_t spliceBytes(int infd, int outfd, size_t nbytes) {
+	if (!openSplicePipe()) {
+		return 0;
+	}
+	size_t remaining = nbytes;
+	while (remaining > 0) {
+		size_t want = (remaining < splicePipeSize) ? remaining : splicePipeSize;
+		ssize_t nin = splice(infd, NULL, splicePipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (nin < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nin < 0 && errno == EINVAL && remaining == nbytes) {
+			return 0;  // not spliceable: caller copies instead
+		}
+		if (nin <= 0) {  // error or end of input before all bytes
+			closeSplicePipe();
+			return -1;
+		}
+		// drain pipe to file
+		for (ssize_t nout = 0; nout < nin; ) {
+			ssize_t n = splice(splicePipe[0], NULL, outfd, NULL, nin - nout, SPLICE_F_MOVE);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n <= 0) {
+				closeSplicePipe();
+				return -1;
+			}
+			nout += n;
+		}
+		remaining -= nin;
+	}
+	return (ssize_t)nbytes;
+}
+#endif
+
+/**
+ * Copy bytes from input stream to output file stream. On Linux,
+ * bytes the input stream has already buffered are copied, and the
+ * rest are spliced from the input descriptor to the output file
+ * through a pipe, so the body of an upload is not copied through
+ * user space. Otherwise, or if the input cannot be spliced, the
+ * bytes are copied with copyFileStreamBytes().
+ *
+ * @param istream the input stream
+ * @param ostream the output file stream
+ * @param nbytes the number of bytes to copy
+ * @return 0 if successful, -1 if error or end of input before nbytes
+ */
+int spliceFileStreamBytes(FILE *istream, FILE *ostream, size_t nbytes) {
+#if defined(__linux__)
+	size_t buffered = freadahead(istream);
+	if (buffered != SIZE_MAX) {
+		// copy bytes already read from input
+		if (buffered > nbytes) {
+			buffered = nbytes;
+		}
+		if (buffered > 0) {
+			if (copyFileStreamBytes(istream, ostream, (int)buffered) != 0) {
 				return -1;
 			}
-			nbytes -= nread;
+			nbytes -= buffered;
+		}
+		if (fflush(ostream) != 0) {
+			return -1;
+		}
+		if (nbytes == 0) {
+			return 0;
+		}
+		ssize_t n = spliceBytes(fileno(istream), fileno(ostream), nbytes);
+		if (n != 0) {
+			return (n < 0) ? -1 : 0;
+		}
+	}
+#endif
+	while (nbytes > 0) {  // copy through stdio in steps of at most INT_MAX
+		int n = (nbytes > (size_t)INT_MAX) ? INT_MAX : (int)nbytes;
+		if (copyFileStreamBytes(istream, ostream, n) != 0 || ferror(istream) || feof(istream)) {
+			return -1;
+		}
+		nbytes -= n;
+	}
+	return 0;
+}
+
+/**
+ * Send bytes at an offset of a file descriptor to an output stream.
+ * On Linux, the stream is flushed and the bytes are sent with
+ * sendfile(), so they are not copied through user space. Otherwise,
+ * or if the output cannot take sendfile(), they are read with
+ * pread() and written to the stream. The file offset is not changed,
+ * so descriptors can be shared by threads.
+ *
+ * @param fd the input file descriptor
+ * @param offset the offset of the first byte
+ * @param ostream the output stream
+ * @param nbytes the number of bytes to send
+ * @return 0 if successful, -1 if error or end of file before nbytes
+ */
+int sendFileBytes(int fd, off_t offset, FILE *ostream, size_t nbytes) {
+#if defined(__linux__)
+	int outfd = fileno(ostream);  // -1 if a cookie stream
+	if (fflush(ostream) != 0) {
+		return -1;
+	}
+	while (outfd >= 0 && nbytes > 0) {
+		ssize_t n = sendfile(outfd, fd, &offset, nbytes);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+			break;  // not supported: copy instead
 		}
-    }
-    return 0;
+		if (n <= 0) {
+			return -1;
+		}
+		nbytes -= (size_t)n;
+	}
+#endif
+	char buf[COPY_BUFSIZ];
+	while (nbytes > 0) {
+		ssize_t n = pread(fd, buf, (nbytes < sizeof(buf)) ? nbytes : sizeof(buf), offset);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0 || fwrite(buf, sizeof(char), (size_t)n, ostream) < (size_t)n) {
+			return -1;
+		}
+		offset += n;
+		nbytes -= (size_t)n;
+	}
+	return 0;
+}
+
+/**
+ * Read the next available bytes of an input stream: first any
+ * bytes the stream has buffered, otherwise what one read() of
+ * the descriptor returns, so the caller does not block waiting
+ * for a full buffer.
+ *
+ * @param istream the input stream
+ * @param buf the buffer
+ * @param len the size of the buffer
+ * @return the number of bytes read, 0 at end of input, or -1 if error
+ */
+ssize_t readAvailable(FILE *istream, char *buf, size_t len) {
+	size_t buffered = freadahead(istream);
+	if (buffered == SIZE_MAX) {  // unknown: never read past what is available
+		buffered = 1;
+	}
+	if (buffered > 0) {
+		size_t n = fread(buf, sizeof(char), (buffered < len) ? buffered : len, istream);
+		return (n > 0) ? (ssize_t)n : (ferror(istream) ? -1 : 0);
+	}
+	ssize_t n;
+	while ((n = read(fileno(istream), buf, len)) < 0 && errno == EINTR) {
+	}
+	return n;
+}
+
+/**
+ * Create and open a hidden temp file in the directory of a file
+ * path, so it can later replace the file with rename().
+ *
+ * @param filePath the file path
+ * @param tempPath buffer for the temp file path of MAXPATHLEN bytes
+ * @return the descriptor of the temp file, or -1 with errno set if error
+ */
+int createTempFile(const char *filePath, char *tempPath) {
+	const char *name = strrchr(filePath, '/');
+	size_t dirLen = (name == NULL) ? 0 : (size_t)(name+1 - filePath);
+	name = (name == NULL) ? filePath : name+1;
+	int n = snprintf(tempPath, MAXPATHLEN, "%.*s.%s.XXXXXX", (int)dirLen, filePath, name);
+	if (n < 0 || n >= MAXPATHLEN) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return mkostemp(tempPath, O_CLOEXEC);
+}
+
+/**
+ * Determines whether n characters are all ones that mkstemp()
+ * uses to make a name unique.
+ *
+ * @param s the characters
+ * @param n the number of characters
+ * @return true if all are letters or digits
+ */
+static bool isTempChars(const char *s, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		char c = s[i];
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Determines whether a file name is one the server gives to files
+ * it is writing: ".<name>.XXXXXX" from createTempFile(), and the
+ * ".rdm_file_XXXXXX.json" names reserved for form upload sidecars.
+ *
+ * @param name the file name, which need not be terminated
+ * @param len the length of the name
+ * @return true if the name is a temp file name
+ */
+bool isTempFileName(const char *name, size_t len) {
+	if (len == 0 || name[0] != '.') {
+		return false;
+	}
+	if (len == 21 && strncmp(name, ".rdm_file_", 10) == 0 && strncmp(name+16, ".json", 5) == 0) {
+		return isTempChars(name+10, 6);
+	}
+	return (len >= 9) && (name[len-7] == '.') && isTempChars(name+len-6, 6);
+}
+
+/**
+ * Allocate disk blocks for the first nbytes of a file, so writing
+ * them does not run out of space and the file is less fragmented.
+ * File systems that do not support preallocation are not an error.
+ *
+ * @param fd the file descriptor
+ * @param nbytes the number of bytes
+ * @return 0 if successful or not supported, otherwise the errno value
+ */
+int preallocateFile(int fd, off_t nbytes) {
+#if defined(__linux__)
+	// fallocate() fails rather than writing zeros like posix_fallocate()
+	if (fallocate(fd, 0, 0, nbytes) != 0) {
+		return (errno == EOPNOTSUPP || errno == ENOSYS) ? 0 : errno;
+	}
+#else
+	(void)fd;
+	(void)nbytes;
+#endif
+	return 0;
+}
+
+/**
+ * Determines whether the file system of a directory has room
+ * for a number of bytes, as available to unprivileged users.
+ *
+ * @param dirPath the directory path
+ * @param nbytes the number of bytes
+ * @return true if there is room or it cannot be determined
+ */
+bool hasFreeSpace(const char *dirPath, off_t nbytes) {
+	struct statvfs vfs;
+	if (statvfs(dirPath, &vfs) != 0) {
+		return true;
+	}
+	return (unsigned long long)nbytes <= (unsigned long long)vfs.f_bavail * vfs.f_frsize;
 }
 
 /**
@@ -232,6 +522,22 @@ char *makeFilePath(const char *path, const char *name, char *filepath) {
 	return filepath;
 }
 
+/**
+ * Make the ETag of a file from its inode, size and modification
+ * time. GET responses and directory listings use the same ETag.
+ *
+ * @param ino the inode number
+ * @param size the file size
+ * @param mtime the modification time
+ * @param etag buffer for the quoted ETag of MAXBUF bytes
+ * @return the ETag
+ */
+char *makeFileETag(unsigned long long ino, long long size, const struct timespec *mtime, char *etag) {
+	snprintf(etag, MAXBUF, "\"%llx-%llx-%llx.%lx\"", ino, (unsigned long long)size,
+			 (unsigned long long)mtime->tv_sec, (unsigned long)mtime->tv_nsec);
+	return etag;
+}
+
 /**
  * Make directories specified by path.
  *
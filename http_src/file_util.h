@@ -10,8 +10,11 @@
 #ifndef FILE_UTIL_H_
 #define FILE_UTIL_H_
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 /**
  * This function creates a temporary stream for this string.
@@ -37,10 +40,108 @@ int fileStat(FILE *stream, struct stat *buf);
  * @param istream the input stream
  * @param ostream the output stream
  * @param nbytes the number of bytes to send
- * @param return 0 if successful
+ * @param return 0 if successful or -1 if error
  */
 int copyFileStreamBytes(FILE *istream, FILE *ostream, int nbytes);
 
+/**
+ * Copy bytes from input stream to output file stream. On Linux,
+ * bytes the input stream has already buffered are copied, and the
+ * rest are spliced from the input descriptor to the output file
+ * through a pipe, so the body of an upload is not copied through
+ * user space. Otherwise, or if the input cannot be spliced, the
+ * bytes are copied with copyFileStreamBytes().
+ *
+ * @param istream the input stream
+ * @param ostream the output file stream
+ * @param nbytes the number of bytes to copy
+ * @return 0 if successful, -1 if error or end of input before nbytes
+ */
+int spliceFileStreamBytes(FILE *istream, FILE *ostream, size_t nbytes);
+
+/**
+ * Send bytes at an offset of a file descriptor to an output stream.
+ * On Linux, the stream is flushed and the bytes are sent with
+ * sendfile(), so they are not copied through user space. Otherwise,
+ * or if the output cannot take sendfile(), they are read with
+ * pread() and written to the stream. The file offset is not changed,
+ * so descriptors can be shared by threads.
+ *
+ * @param fd the input file descriptor
+ * @param offset the offset of the first byte
+ * @param ostream the output stream
+ * @param nbytes the number of bytes to send
+ * @return 0 if successful, -1 if error or end of file before nbytes
+ */
+int sendFileBytes(int fd, off_t offset, FILE *ostream, size_t nbytes);
+
+/**
+ * Write all bytes of an I/O vector to a file descriptor, repeating
+ * the writev() after a partial write or an interrupt. The entries
+ * of iov are updated as bytes are written.
+ *
+ * @param fd the output file descriptor
+ * @param iov the I/O vector
+ * @param iovcnt the number of entries
+ * @return 0 if successful, -1 with errno set if error
+ */
+int writevFully(int fd, struct iovec *iov, int iovcnt);
+
+/**
+ * Read the next available bytes of an input stream: first any
+ * bytes the stream has buffered, otherwise what one read() of
+ * the descriptor returns, so the caller does not block waiting
+ * for a full buffer.
+ *
+ * @param istream the input stream
+ * @param buf the buffer
+ * @param len the size of the buffer
+ * @return the number of bytes read, 0 at end of input, or -1 if error
+ */
+ssize_t readAvailable(FILE *istream, char *buf, size_t len);
+
+/**
+ * Create and open a hidden temp file in the directory of a file
+ * path, so it can later replace the file with rename().
+ *
+ * @param filePath the file path
+ * @param tempPath buffer for the temp file path of MAXPATHLEN bytes
+ * @return the descriptor of the temp file, or -1 with errno set if error
+ */
+int createTempFile(const char *filePath, char *tempPath);
+
+/**
+ * Determines whether a file name is one the server gives to files
+ * it is writing: ".<name>.XXXXXX" from createTempFile(), and the
+ * ".rdm_file_XXXXXX.json" names reserved for form upload sidecars.
+ *
+ * @param name the file name, which need not be terminated
+ * @param len the length of the name
+ * @return true if the name is a temp file name
+ */
+bool isTempFileName(const char *name, size_t len);
+
+/**
+ * Allocate disk blocks for the first nbytes of a file, so writing
+ * them does not run out of space and the file is less fragmented.
+ * File systems that do not support preallocation are not an error.
+ *
+ * @param fd the file descriptor
+ * @param nbytes the number of bytes
+ * @return 0 if successful or not supported, otherwise the errno value
+ */
+int preallocateFile(int fd, off_t nbytes);
+
+/**
+ * Determines whether the file system of a directory has room
+ * for a number of bytes, as available to unprivileged users.
+ *
+ * @param dirPath the directory path
+ * @param nbytes the number of bytes
+ * @return true if there is room or it cannot be determined
+ */
+bool hasFreeSpace(const char *dirPath, off_t nbytes);
+
 /**
  * Returns path component of the file path without trailing
  * path separator. If no path component, returns NULL.
@@ -82,6 +183,18 @@ char *getExtension(const char *filePath, char *extension);
  */
 char *makeFilePath(const char *path, const char *name, char *filepath);
 
+/**
+ * Make the ETag of a file from its inode, size and modification
+ * time. GET responses and directory listings use the same ETag.
+ *
+ * @param ino the inode number
+ * @param size the file size
+ * @param mtime the modification time
+ * @param etag buffer for the quoted ETag of MAXBUF bytes
+ * @return the ETag
+ */
+char *makeFileETag(unsigned long long ino, long long size, const struct timespec *mtime, char *etag);
+
 /**
  * Make directories specified by path.
  *
@@ -91,6 +204,4 @@ char *makeFilePath(const char *path, const char *name, char *filepath);
  */
 int mkdirs(const char *path, mode_t mode);
 
-char *generateList(const char *filePath);
-
 #endif /* FILE_UTIL_H_ */
@@ -0,0 +1,245 @@
+/*
+ * hashmap.c
+ *
+ * Functions that implement a hash map with string keys.
+ *
+ *  @since 2021-04-25
+ */
+#include "hashmap.h"
+
+#include <string.h>
+#include <stdint.h>
+
+/** An entry in a hash bucket chain */
+typedef struct HashEntry {
+	struct HashEntry* next;  /**> next entry in bucket */
+	uint64_t hash;           /**> hash of key */
+	char* key;               /**> copy of key */
+	void* value;             /**> value */
+} HashEntry;
+
+/** Hash map from string keys to pointer values */
+struct HashMap {
+	HashEntry** buckets;     /**> bucket chains */
+	size_t nbuckets;         /**> number of buckets (power of 2) */
+	size_t size;             /**> number of entries */
+};
+
+/**
+ * Returns FNV-1a hash of a string.
+ *
+ * @param key the string
+ * @return the hash of the string
+ */
+static uint64_t hashKey(const char* key) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (const unsigned char* p = (const unsigned char*)key; *p != '\0'; p++) {
+		hash ^= *p;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * Double the number of buckets when the map is more
+ * than 3/4 full. The map is unchanged if no space.
+ *
+ * @param map the map
+ */
+static void ensureBuckets(HashMap* map) {
+	if (map->size*4 < map->nbuckets*3) {
+		return;
+	}
+	size_t nbuckets = map->nbuckets*2;
+	HashEntry** buckets = calloc(nbuckets, sizeof(HashEntry*));
+	if (buckets == NULL) {  // out of memory: keep longer chains
+		return;
+	}
+
+	// rehash entries into new buckets
+	for (size_t i = 0; i < map->nbuckets; i++) {
+		HashEntry* entry = map->buckets[i];
+		while (entry != NULL) {
+			HashEntry* next = entry->next;
+			size_t b = entry->hash & (nbuckets-1);
+			entry->next = buckets[b];
+			buckets[b] = entry;
+			entry = next;
+		}
+	}
+	free(map->buckets);
+	map->buckets = buckets;
+	map->nbuckets = nbuckets;
+}
+
+/**
+ * Create new HashMap with initial capacity.
+ * A HashMap is not synchronized; callers provide locking.
+ *
+ * @param capacity initial number of buckets
+ * @return the new instance or NULL if no space
+ */
+HashMap* newHashMap(size_t capacity) {
+	HashMap* map = malloc(sizeof(HashMap));
+	if (map == NULL) {
+		return NULL;
+	}
+
+	// number of buckets is a power of 2, and at least 16
+	size_t nbuckets = 16;
+	while (nbuckets < capacity) {
+		nbuckets <<= 1;
+	}
+	*map = (HashMap){.nbuckets = nbuckets};
+	map->buckets = calloc(nbuckets, sizeof(HashEntry*));
+	if (map->buckets == NULL) {
+		free(map);
+		return NULL;
+	}
+	return map;
+}
+
+/**
+ * Delete a HashMap.
+ *
+ * @param map the map
+ * @param freeValue function to free each value or NULL
+ */
+void deleteHashMap(HashMap* map, void (*freeValue)(void*)) {
+	for (size_t i = 0; i < map->nbuckets; i++) {
+		HashEntry* entry = map->buckets[i];
+		while (entry != NULL) {
+			HashEntry* next = entry->next;
+			if (freeValue != NULL) {
+				freeValue(entry->value);
+			}
+			free(entry->key);
+			free(entry);
+			entry = next;
+		}
+	}
+	free(map->buckets);
+	free(map);
+}
+
+/**
+ * Get the value for a key.
+ *
+ * @param map the map
+ * @param key the key
+ * @return the value or NULL if not found
+ */
+void* getHashMap(HashMap* map, const char* key) {
+	uint64_t hash = hashKey(key);
+	for (HashEntry* entry = map->buckets[hash & (map->nbuckets-1)]; entry != NULL; entry = entry->next) {
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			return entry->value;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Put a value for a key. The key is copied.
+ *
+ * @param map the map
+ * @param key the key
+ * @param value the value
+ * @param oldValue storage for value replaced by this one
+ *   (NULL if none); may be NULL
+ * @return true if the value was stored, false if no space
+ */
+bool putHashMap(HashMap* map, const char* key, void* value, void** oldValue) {
+	uint64_t hash = hashKey(key);
+	size_t b = hash & (map->nbuckets-1);
+	for (HashEntry* entry = map->buckets[b]; entry != NULL; entry = entry->next) {
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			if (oldValue != NULL) {
+				*oldValue = entry->value;
+			}
+			entry->value = value;
+			return true;
+		}
+	}
+
+	// add new entry to front of bucket chain
+	HashEntry* entry = malloc(sizeof(HashEntry));
+	if (entry == NULL) {
+		return false;
+	}
+	entry->key = strdup(key);
+	if (entry->key == NULL) {
+		free(entry);
+		return false;
+	}
+	entry->hash = hash;
+	entry->value = value;
+	entry->next = map->buckets[b];
+	map->buckets[b] = entry;
+	map->size++;
+	if (oldValue != NULL) {
+		*oldValue = NULL;
+	}
+
+	ensureBuckets(map);
+	return true;
+}
+
+/**
+ * Remove the value for a key.
+ *
+ * @param map the map
+ * @param key the key
+ * @return the removed value or NULL if not found
+ */
+void* removeHashMap(HashMap* map, const char* key) {
+	uint64_t hash = hashKey(key);
+	for (HashEntry** link = &map->buckets[hash & (map->nbuckets-1)]; *link != NULL; link = &(*link)->next) {
+		HashEntry* entry = *link;
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			void* value = entry->value;
+			*link = entry->next;
+			free(entry->key);
+			free(entry);
+			map->size--;
+			return value;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Gets number of entries in map.
+ *
+ * @param map the map
+ * @return number of entries in map
+ */
+size_t sizeHashMap(HashMap* map) {
+	return map->size;
+}
+
+/**
+ * Visit each entry of the map. The visitor returns true
+ * to remove the entry it was passed; the visitor is then
+ * responsible for freeing the value.
+ *
+ * @param map the map
+ * @param visit the visitor function
+ * @param ctx context passed to the visitor
+ */
+void forEachHashMap(HashMap* map, bool (*visit)(const char* key, void* value, void* ctx), void* ctx) {
+	for (size_t i = 0; i < map->nbuckets; i++) {
+		HashEntry** link = &map->buckets[i];
+		while (*link != NULL) {
+			HashEntry* entry = *link;
+			if (visit(entry->key, entry->value, ctx)) {
+				*link = entry->next;
+				free(entry->key);
+				free(entry);
+				map->size--;
+			} else {
+				link = &entry->next;
+			}
+		}
+	}
+}
@@ -0,0 +1,83 @@
+/*
+ * hashmap.h
+ *
+ * Functions that implement a hash map with string keys.
+ *
+ *  @since 2021-04-25
+ */
+
+#ifndef HASHMAP_H_
+#define HASHMAP_H_
+#include <stdbool.h>
+#include <stdlib.h>
+
+/** Hash map from string keys to pointer values */
+typedef struct HashMap HashMap;
+
+/**
+ * Create new HashMap with initial capacity.
+ * A HashMap is not synchronized; callers provide locking.
+ *
+ * @param capacity initial number of buckets
+ * @return the new instance or NULL if no space
+ */
+HashMap* newHashMap(size_t capacity);
+
+/**
+ * Delete a HashMap.
+ *
+ * @param map the map
+ * @param freeValue function to free each value or NULL
+ */
+void deleteHashMap(HashMap* map, void (*freeValue)(void*));
+
+/**
+ * Get the value for a key.
+ *
+ * @param map the map
+ * @param key the key
+ * @return the value or NULL if not found
+ */
+void* getHashMap(HashMap* map, const char* key);
+
+/**
+ * Put a value for a key. The key is copied.
+ *
+ * @param map the map
+ * @param key the key
+ * @param value the value
+ * @param oldValue storage for value replaced by this one
+ *   (NULL if none); may be NULL
+ * @return true if the value was stored, false if no space
+ */
+bool putHashMap(HashMap* map, const char* key, void* value, void** oldValue);
+
+/**
+ * Remove the value for a key.
+ *
+ * @param map the map
+ * @param key the key
+ * @return the removed value or NULL if not found
+ */
+void* removeHashMap(HashMap* map, const char* key);
+
+/**
+ * Gets number of entries in map.
+ *
+ * @param map the map
+ * @return number of entries in map
+ */
+size_t sizeHashMap(HashMap* map);
+
+/**
+ * Visit each entry of the map. The visitor returns true
+ * to remove the entry it was passed; the visitor is then
+ * responsible for freeing the value.
+ *
+ * @param map the map
+ * @param visit the visitor function
+ * @param ctx context passed to the visitor
+ */
+void forEachHashMap(HashMap* map, bool (*visit)(const char* key, void* value, void* ctx), void* ctx);
+
+#endif /* HASHMAP_H_ */
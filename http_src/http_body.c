@@ -0,0 +1,393 @@
+/*
+ * http_body.c
+ *
+ * Functions for decoding HTTP request bodies.
+ *
+ *  @since 2021-04-26
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+#include "file_util.h"
+#include "http_body.h"
+
+/** Value of hex digit plus one by character, 0 if not a hex digit */
+static const uint8_t hexDigits[256] = {
+    ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,
+    ['5'] = 6,  ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+/**
+ * Initialize a chunked body decoder.
+ *
+ * @param dec the decoder
+ * @param maxChunk the maximum size of one chunk
+ * @param trailers properties for trailer fields or NULL to discard them
+ */
+void initChunkDecoder(ChunkDecoder *dec, uint64_t maxChunk, Properties *trailers) {
+    dec->state = CHUNK_SIZE_START;
+    dec->chunkLen = dec->remaining = dec->total = 0;
+    dec->maxChunk = maxChunk;
+    dec->lineLen = dec->trailerLen = 0;
+    dec->trailers = trailers;
+}
+
+/**
+ * Determines whether a decoder has reached the end of the body.
+ *
+ * @param dec the decoder
+ * @return true if the final chunk and trailers were decoded
+ */
+bool isChunkDecoderDone(const ChunkDecoder *dec) {
+    return dec->state == CHUNK_DONE;
+}
+
+/**
+ * End the chunk-size line: start the chunk payload,
+ * or the trailer section after the last chunk.
+ *
+ * @param dec the decoder
+ */
+static void endChunkSizeLine(ChunkDecoder *dec) {
+    dec->lineLen = 0;
+    dec->remaining = dec->chunkLen;
+    dec->state = (dec->chunkLen == 0) ? CHUNK_TRAILER : CHUNK_DATA;
+}
+
+/**
+ * End a trailer line: an empty line ends the body, otherwise
+ * the "name: value" field is saved if the decoder keeps trailers.
+ *
+ * @param dec the decoder
+ * @return true if the line is valid
+ */
+static bool endTrailerLine(ChunkDecoder *dec) {
+    size_t len = dec->lineLen;
+    if (len > 0 && dec->line[len-1] == '\r') {
+        len--;
+    }
+    dec->line[len] = '\0';
+    dec->lineLen = 0;
+    if (len == 0) {
+        dec->state = CHUNK_DONE;
+        return true;
+    }
+    char *p = strchr(dec->line, ':');
+    if (p == NULL || p == dec->line) {
+        return false;
+    }
+    if (dec->trailers != NULL) {
+        for (*p++ = '\0'; *p == ' ' || *p == '\t'; p++) {}  // skip leading value whitespace
+        putProperty(dec->trailers, dec->line, p);
+    }
+    return true;
+}
+
+/**
+ * Decode the next bytes of a chunked body. Input may be split
+ * anywhere; the decoder resumes where the last call stopped.
+ * Runs of payload are passed to the sink without copying.
+ * Decoding stops at the end of the body, so bytes after it
+ * are not consumed.
+ *
+ * @param dec the decoder
+ * @param buf the input bytes
+ * @param len the number of input bytes
+ * @param sink the payload sink
+ * @param ctx the sink context
+ * @return the number of input bytes consumed, or -1 if the body
+ *   is malformed or the sink fails
+ */
+ssize_t decodeChunks(ChunkDecoder *dec, const char *buf, size_t len, BodySink sink, void *ctx) {
+    const char *p = buf, *end = buf + len;
+    while (p < end && dec->state != CHUNK_DONE) {
+        unsigned char c = (unsigned char)*p;
+        switch (dec->state) {
+        case CHUNK_SIZE_START:
+            if (hexDigits[c] == 0) {
+                dec->state = CHUNK_ERROR;
+                return -1;
+            }
+            dec->chunkLen = hexDigits[c] - 1;
+            dec->lineLen = 1;
+            dec->state = CHUNK_SIZE;
+            p++;
+            break;
+
+        case CHUNK_SIZE:
+            if (hexDigits[c] != 0) {
+                dec->chunkLen = (dec->chunkLen << 4) | (uint64_t)(hexDigits[c] - 1);
+                if (dec->chunkLen > dec->maxChunk) {
+                    dec->state = CHUNK_ERROR;
+                    return -1;
+                }
+                dec->lineLen++;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                dec->state = CHUNK_EXT;
+            } else if (c == '\r') {
+                dec->state = CHUNK_SIZE_LF;
+            } else if (c == '\n') {  // tolerate bare LF
+                endChunkSizeLine(dec);
+            } else {
+                dec->state = CHUNK_ERROR;
+                return -1;
+            }
+            p++;
+            break;
+
+        case CHUNK_EXT: {  // extensions are ignored
+            const char *eol = memchr(p, '\n', end - p);
+            size_t n = (eol == NULL) ? (size_t)(end - p) : (size_t)(eol - p);
+            dec->lineLen += n;
+            if (dec->lineLen > MAX_CHUNK_LINE) {
+                dec->state = CHUNK_ERROR;
+                return -1;
+            }
+            p += n;
+            if (eol != NULL) {
+                endChunkSizeLine(dec);
+                p++;
+            }
+            break;
+        }
+
+        case CHUNK_SIZE_LF:
+            if (c != '\n') {
+                dec->state = CHUNK_ERROR;
+                return -1;
+            }
+            endChunkSizeLine(dec);
+            p++;
+            break;
+
+        case CHUNK_DATA: {  // hand payload to sink in place
+            size_t n = (dec->remaining < (uint64_t)(end - p)) ? (size_t)dec->remaining : (size_t)(end - p);
+            if (sink(ctx, p, n) != 0) {
+                dec->state = CHUNK_ERROR;
+                return -1;
+            }
+            p += n;
+            dec->remaining -= n;
+            dec->total += n;
+            if (dec->remaining == 0) {
+                dec->state = CHUNK_DATA_CR;
+            }
+            break;
+        }
+
+        case CHUNK_DATA_CR:
+            if (c == '\r') {
+                dec->state = CHUNK_DATA_LF;
+            } else if (c == '\n') {  // tolerate bare LF
+                dec->state = CHUNK_SIZE_START;
+            } else {
+                dec->state = CHUNK_ERROR;
+                return -1;
+            }
+            p++;
+            break;
+
+        case CHUNK_DATA_LF:
+            if (c != '\n') {
+                dec->state = CHUNK_ERROR;
+                return -1;
+            }
+            dec->state = CHUNK_SIZE_START;
+            p++;
+            break;
+
+        case CHUNK_TRAILER: {
+            const char *eol = memchr(p, '\n', end - p);
+            size_t n = (eol == NULL) ? (size_t)(end - p) : (size_t)(eol - p);
+            dec->trailerLen += n + 1;
+            if (   (dec->lineLen + n >= sizeof(dec->line))
+                || (dec->trailerLen > MAX_CHUNK_TRAILERS)) {
+                dec->state = CHUNK_ERROR;
+                return -1;
+            }
+            memcpy(dec->line + dec->lineLen, p, n);
+            dec->lineLen += n;
+            p += n;
+            if (eol != NULL) {
+                p++;
+                if (!endTrailerLine(dec)) {
+                    dec->state = CHUNK_ERROR;
+                    return -1;
+                }
+            }
+            break;
+        }
+
+        default:  // CHUNK_ERROR
+            return -1;
+        }
+    }
+    return p - buf;
+}
+
+/**
+ * Decode a chunked body from an input stream to a sink.
+ * The stream is read in large blocks of what is available;
+ * bytes read past the end of the body are discarded.
+ *
+ * @param istream the chunk transfer-encoded input stream
+ * @param sink the payload sink
+ * @param ctx the sink context
+ * @param trailers properties for trailer fields or NULL to discard them
+ * @return number of payload bytes decoded or -1 if error
+ */
+long long decodeChunkedStream(FILE *istream, BodySink sink, void *ctx, Properties *trailers) {
+    ChunkDecoder dec;
+    initChunkDecoder(&dec, MAX_CHUNK_SIZE, trailers);
+    char buf[BODY_READ_BUFSIZ];
+    while (!isChunkDecoderDone(&dec)) {
+        ssize_t nread = readAvailable(istream, buf, sizeof(buf));
+        if (nread <= 0) {
+            return -1;  // unexpected end of input
+        }
+        if (decodeChunks(&dec, buf, (size_t)nread, sink, ctx) < 0) {
+            return -1;
+        }
+    }
+    return (long long)dec.total;
+}
+
+/**
+ * Read a body of known length from an input stream to a sink.
+ *
+ * @param istream the input stream
+ * @param len the length of the body
+ * @param sink the body sink
+ * @param ctx the sink context
+ * @return 0 if successful, -1 if error or end of input before len bytes
+ */
+int readBodyStream(FILE *istream, uint64_t len, BodySink sink, void *ctx) {
+    char buf[BODY_READ_BUFSIZ];
+    while (len > 0) {
+        size_t want = (len < sizeof(buf)) ? (size_t)len : sizeof(buf);
+        ssize_t nread = readAvailable(istream, buf, want);
+        if (nread <= 0 || sink(ctx, buf, (size_t)nread) != 0) {
+            return -1;
+        }
+        len -= (uint64_t)nread;
+    }
+    return 0;
+}
+
+/** Body sink that inflates an encoded body and passes it on */
+typedef struct InflateSink {
+    BodySink sink;              /** next sink */
+    void *ctx;                  /** context of next sink */
+    z_stream zs;                /** zlib stream */
+    uint64_t in;                /** encoded bytes consumed so far, over all gzip members */
+    uint64_t out;               /** decoded bytes so far */
+    unsigned maxRatio;          /** maximum ratio of decoded to encoded bytes or 0 */
+    bool ended;                 /** true if the encoded data is complete */
+    bool tooLarge;              /** true if the ratio was exceeded */
+    unsigned char buf[BODY_READ_BUFSIZ];  /** decoded bytes */
+} InflateSink;
+
+/**
+ * Body sink that inflates the bytes of a gzip or zlib encoded
+ * body and passes the decoded bytes on. Concatenated gzip members
+ * are decoded one after another.
+ *
+ * @param ctx the inflate sink
+ * @param bytes the encoded bytes
+ * @param len the number of bytes
+ * @return 0 if successful, -1 if the encoding is invalid, the ratio
+ *   is exceeded, or the next sink fails
+ */
+static int inflateSink(void *ctx, const char *bytes, size_t len) {
+    InflateSink *inf = ctx;
+    inf->zs.next_in = (unsigned char *)bytes;
+    inf->zs.avail_in = (uInt)len;
+    do {
+        if (inf->ended) {  // next gzip member
+            if (inflateReset(&inf->zs) != Z_OK) {
+                return -1;
+            }
+            inf->ended = false;
+        }
+        inf->zs.next_out = inf->buf;
+        inf->zs.avail_out = sizeof(inf->buf);
+        uInt availIn = inf->zs.avail_in;
+        int status = inflate(&inf->zs, Z_NO_FLUSH);
+        inf->in += availIn - inf->zs.avail_in;  // total_in restarts with each member
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+            return -1;
+        }
+        inf->ended = (status == Z_STREAM_END);
+        size_t n = sizeof(inf->buf) - inf->zs.avail_out;
+        inf->out += n;
+        if (   (inf->maxRatio > 0) && (inf->out > INFLATE_RATIO_SLACK)
+            && (inf->out / inf->maxRatio > inf->in)) {
+            inf->tooLarge = true;
+            return -1;
+        }
+        if (n > 0 && inf->sink(inf->ctx, (const char *)inf->buf, n) != 0) {
+            return -1;
+        }
+        if (status == Z_BUF_ERROR && n == 0) {
+            break;  // needs more input
+        }
+        // a full buffer may leave decoded bytes pending
+    } while (inf->zs.avail_in > 0 || (inf->zs.avail_out == 0 && !inf->ended));
+    return 0;
+}
+
+/**
+ * Read a request body to a sink, undoing its chunked transfer coding
+ * if its length is not known, and its gzip or deflate content coding
+ * if inflate is true. An encoded body that decodes to more than
+ * maxRatio times its encoded length, beyond INFLATE_RATIO_SLACK
+ * bytes, is rejected as a decompression bomb.
+ *
+ * @param istream the input stream
+ * @param len the body length or -1 if chunked
+ * @param inflate true to decode the content coding
+ * @param maxRatio the maximum ratio of decoded to encoded bytes or 0 if none
+ * @param sink the decoded body sink
+ * @param ctx the sink context
+ * @param tooLarge storage for whether the ratio was exceeded
+ * @return number of decoded bytes or -1 if error
+ */
+long long readDecodedBody(FILE *istream, long long len, bool inflate, unsigned maxRatio,
+                          BodySink sink, void *ctx, bool *tooLarge) {
+    *tooLarge = false;
+    if (!inflate) {
+        if (len < 0) {
+            return decodeChunkedStream(istream, sink, ctx, NULL);
+        }
+        return (readBodyStream(istream, (uint64_t)len, sink, ctx) == 0) ? len : -1;
+    }
+
+    InflateSink inf = {.sink = sink, .ctx = ctx, .maxRatio = maxRatio};
+    // window bits 15 with 32 added to detect a gzip or zlib header
+    if (inflateInit2(&inf.zs, 15 + 32) != Z_OK) {
+        return -1;
+    }
+    long long status = (len < 0)
+        ? decodeChunkedStream(istream, inflateSink, &inf, NULL)
+        : readBodyStream(istream, (uint64_t)len, inflateSink, &inf);
+    inflateEnd(&inf.zs);
+    *tooLarge = inf.tooLarge;
+    // a truncated encoding is an incomplete body
+    return (status < 0 || !inf.ended) ? -1 : (long long)inf.out;
+}
+
+/**
+ * Body sink that writes to an output stream.
+ *
+ * @param ctx the output stream
+ * @param bytes the body bytes
+ * @param len the number of bytes
+ * @return 0 if successful, -1 if error
+ */
+int fileStreamSink(void *ctx, const char *bytes, size_t len) {
+    return (fwrite(bytes, sizeof(char), len, (FILE*)ctx) < len) ? -1 : 0;
+}
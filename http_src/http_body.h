@@ -0,0 +1,157 @@
+/*
+ * http_body.h
+ *
+ * Functions for decoding HTTP request bodies.
+ *
+ *  @since 2021-04-26
+ */
+
+#ifndef HTTP_BODY_H_
+#define HTTP_BODY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "properties.h"
+
+/** Size of the buffer for reading request bodies */
+#define BODY_READ_BUFSIZ (64*1024)
+
+/** Maximum size of one chunk of a chunked body */
+#define MAX_CHUNK_SIZE ((uint64_t)1 << 32)
+
+/** Maximum length of a chunk-size line including extensions */
+#define MAX_CHUNK_LINE 4096
+
+/** Maximum total length of the trailer section */
+#define MAX_CHUNK_TRAILERS 8192
+
+/** Decoded bytes of an encoded body allowed regardless of its ratio */
+#define INFLATE_RATIO_SLACK (1024*1024)
+
+/**
+ * Consumes a run of decoded body bytes. The bytes are
+ * only valid for the duration of the call.
+ *
+ * @param ctx the sink context
+ * @param bytes the body bytes
+ * @param len the number of bytes
+ * @return 0 if successful, -1 if error
+ */
+typedef int (*BodySink)(void *ctx, const char *bytes, size_t len);
+
+/** States of a chunked body decoder */
+typedef enum ChunkState {
+    CHUNK_SIZE_START,           /** first hex digit of chunk size */
+    CHUNK_SIZE,                 /** more hex digits of chunk size */
+    CHUNK_EXT,                  /** chunk extensions after size */
+    CHUNK_SIZE_LF,              /** LF ending chunk-size line */
+    CHUNK_DATA,                 /** chunk payload */
+    CHUNK_DATA_CR,              /** CR after chunk payload */
+    CHUNK_DATA_LF,              /** LF after chunk payload */
+    CHUNK_TRAILER,              /** trailer field line or final empty line */
+    CHUNK_DONE,                 /** end of body */
+    CHUNK_ERROR                 /** malformed body */
+} ChunkState;
+
+/** Resumable decoder of a chunked transfer-encoded body */
+typedef struct ChunkDecoder {
+    ChunkState state;           /** current state */
+    uint64_t chunkLen;          /** size of current chunk */
+    uint64_t remaining;         /** payload bytes left in current chunk */
+    uint64_t total;             /** payload bytes decoded so far */
+    uint64_t maxChunk;          /** maximum size of one chunk */
+    size_t lineLen;             /** bytes in current size or trailer line */
+    size_t trailerLen;          /** bytes in trailer section */
+    Properties *trailers;       /** trailer fields or NULL to discard */
+    char line[MAX_PROP_NAME+MAX_PROP_VAL];  /** current trailer line */
+} ChunkDecoder;
+
+/**
+ * Initialize a chunked body decoder.
+ *
+ * @param dec the decoder
+ * @param maxChunk the maximum size of one chunk
+ * @param trailers properties for trailer fields or NULL to discard them
+ */
+void initChunkDecoder(ChunkDecoder *dec, uint64_t maxChunk, Properties *trailers);
+
+/**
+ * Decode the next bytes of a chunked body. Input may be split
+ * anywhere; the decoder resumes where the last call stopped.
+ * Runs of payload are passed to the sink without copying.
+ * Decoding stops at the end of the body, so bytes after it
+ * are not consumed.
+ *
+ * @param dec the decoder
+ * @param buf the input bytes
+ * @param len the number of input bytes
+ * @param sink the payload sink
+ * @param ctx the sink context
+ * @return the number of input bytes consumed, or -1 if the body
+ *   is malformed or the sink fails
+ */
+ssize_t decodeChunks(ChunkDecoder *dec, const char *buf, size_t len, BodySink sink, void *ctx);
+
+/**
+ * Determines whether a decoder has reached the end of the body.
+ *
+ * @param dec the decoder
+ * @return true if the final chunk and trailers were decoded
+ */
+bool isChunkDecoderDone(const ChunkDecoder *dec);
+
+/**
+ * Decode a chunked body from an input stream to a sink.
+ *
+ * @param istream the chunk transfer-encoded input stream
+ * @param sink the payload sink
+ * @param ctx the sink context
+ * @param trailers properties for trailer fields or NULL to discard them
+ * @return number of payload bytes decoded or -1 if error
+ */
+long long decodeChunkedStream(FILE *istream, BodySink sink, void *ctx, Properties *trailers);
+
+/**
+ * Read a body of known length from an input stream to a sink.
+ *
+ * @param istream the input stream
+ * @param len the length of the body
+ * @param sink the body sink
+ * @param ctx the sink context
+ * @return 0 if successful, -1 if error or end of input before len bytes
+ */
+int readBodyStream(FILE *istream, uint64_t len, BodySink sink, void *ctx);
+
+/**
+ * Read a request body to a sink, undoing its chunked transfer coding
+ * if its length is not known, and its gzip or deflate content coding
+ * if inflate is true. An encoded body that decodes to more than
+ * maxRatio times its encoded length, beyond INFLATE_RATIO_SLACK
+ * bytes, is rejected as a decompression bomb.
+ *
+ * @param istream the input stream
+ * @param len the body length or -1 if chunked
+ * @param inflate true to decode the content coding
+ * @param maxRatio the maximum ratio of decoded to encoded bytes or 0 if none
+ * @param sink the decoded body sink
+ * @param ctx the sink context
+ * @param tooLarge storage for whether the ratio was exceeded
+ * @return number of decoded bytes or -1 if error
+ */
+long long readDecodedBody(FILE *istream, long long len, bool inflate, unsigned maxRatio,
+                          BodySink sink, void *ctx, bool *tooLarge);
+
+/**
+ * Body sink that writes to an output stream.
+ *
+ * @param ctx the output stream
+ * @param bytes the body bytes
+ * @param len the number of bytes
+ * @return 0 if successful, -1 if error
+ */
+int fileStreamSink(void *ctx, const char *bytes, size_t len);
+
+#endif /* HTTP_BODY_H_ */
@@ -7,6 +7,8 @@
  *  @author: Xiaoli Ou
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <string.h>
@@ -19,6 +21,15 @@
 #include "properties.h"
 #include "string_util.h"
 #include "file_util.h"
+#include "dir_util.h"
+#include "quota_util.h"
+#include "trash_util.h"
+#include "segment_util.h"
+#include "upload_util.h"
+#include "precompress_util.h"
+#include "statcache_util.h"
+#include "content_util.h"
+#include "mapcache_util.h"
 #include "time_util.h"
 #include "http_server.h"
 #include "http_util.h"
@@ -39,28 +50,102 @@ void do_delete(FILE *stream, const char *uri, Properties *requestHeaders, Proper
     resolveUri(uri, filePath);
     FILE *contentStream = NULL;
 
-    // ensure file exists
+    // listing of parent directory changes if deleted
+    char entryPath[MAXPATHLEN], parentPath[MAXPATHLEN];
+    strcpy(entryPath, filePath);
+    while (strendswith(entryPath, "/")) {
+        entryPath[strlen(entryPath)-1] = '\0';
+    }
+    if (getPath(entryPath, parentPath) == NULL) {
+        strcpy(parentPath, server.content_base);
+    }
+
+    // a body in the segment store has no file
+    unsigned long long segmentLen;
+    if (!strendswith(filePath, "/")) {
+        if (removeSegmentEntry(filePath, &segmentLen) == 0) {
+            releaseQuota(filePath, segmentLen);
+            invalidateListing(parentPath);
+            sendResponseStatus(stream, Http_OK, NULL);
+            sendResponseHeaders(stream, responseHeaders);
+            return;
+        } else if (errno != ENOENT) {
+            sendStatusResponse(stream, Http_InternalServerError, NULL, responseHeaders);
+            return;
+        }
+    }
+
+    // an unfinished resumable upload is cancelled with its file
+    off_t stagedLen;
+    bool cancelled = !strendswith(filePath, "/") && (cancelStagedUpload(filePath, &stagedLen) == 0);
+    if (cancelled) {
+        releaseQuota(filePath, (unsigned long long)stagedLen);
+    }
+
+    // the content directory itself is never deleted
+    if (strcmp(entryPath, server.content_base) == 0) {
+        sendStatusResponse(stream, Http_MethodNotAllowed, NULL, responseHeaders);
+        return;
+    }
+
+    // ensure file exists in its directory beneath the content directory;
+    // the name keeps a trailing '/' so only a directory matches it
+    const char *name = filePath + strlen(parentPath) + 1;
+    ContentDir *dir = acquireContentDir(parentPath);
     struct stat sb;
-    if (stat(filePath, &sb) != 0) {
-        sendStatusResponse(stream, Http_NotFound, NULL, responseHeaders);
+    if (dir == NULL || fstatat(contentDirFd(dir), name, &sb, 0) != 0) {
+        if (dir != NULL) {
+            releaseContentDir(dir);
+        }
+        if (cancelled) {
+            sendResponseStatus(stream, Http_OK, NULL);
+            sendResponseHeaders(stream, responseHeaders);
+        } else {
+            sendStatusResponse(stream, Http_NotFound, NULL, responseHeaders);
+        }
         return;
     }
+
     // directory path ends with '/'
     if (S_ISDIR(sb.st_mode) && strendswith(filePath, "/")) {
-        if (rmdir(filePath) == 0) { // dir is empty and has been deleted successfully
+        // bodies in the segment store make a directory not empty
+        bool hasSegments = (countSegmentTree(entryPath, NULL) > 0);
+        if (!hasSegments && unlinkat(contentDirFd(dir), name, AT_REMOVEDIR) == 0) { // dir is empty and has been deleted successfully
+            invalidateStatTree(entryPath);
+            invalidateMappedFiles(entryPath);
+            invalidateListing(filePath);
+            invalidateListing(parentPath);
             sendResponseStatus(stream, Http_OK, NULL);  // send response
             sendResponseHeaders(stream, responseHeaders);  // Send response headers
+        } else if (   (hasSegments || errno == ENOTEMPTY || errno == EEXIST)
+                   && (server.trash_dir != NULL)
+                   && (unlinkat(contentDirFd(dir), name, AT_REMOVEDIR) == 0 || moveToTrash(entryPath) == 0)) {
+            // tree is gone from the content; its space is reclaimed later
+            removeSegmentTree(entryPath, &segmentLen);
+            releaseQuota(entryPath, segmentLen);
+            invalidateStatTree(entryPath);
+            invalidateMappedFiles(entryPath);
+            invalidateListing(filePath);
+            invalidateListing(parentPath);
+            sendResponseStatus(stream, Http_Accepted, NULL);
+            sendResponseHeaders(stream, responseHeaders);
         } else {
             sendStatusResponse(stream, Http_MethodNotAllowed, NULL, responseHeaders);
         }
     } else if (!S_ISREG(sb.st_mode)) { // error if not regular file
         sendStatusResponse(stream, Http_NotFound, NULL, responseHeaders);
     } else { // delete file in server
-        if (unlink(filePath) == 0) {  // delete successfully
+        if (unlinkat(contentDirFd(dir), name, 0) == 0) {  // delete successfully
+            releaseQuota(filePath, (unsigned long long)sb.st_size);
+            invalidateStat(filePath);
+            invalidateMappedFiles(filePath);
+            removePrecompressed(filePath);
+            invalidateListing(parentPath);
             sendResponseStatus(stream, Http_OK, NULL);  // send response
             sendResponseHeaders(stream, responseHeaders);  // Send response headers
         } else {
             sendStatusResponse(stream, Http_MethodNotAllowed, NULL, responseHeaders);
         }
     }
+    releaseContentDir(dir);
 }
\ No newline at end of file
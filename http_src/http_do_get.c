@@ -9,82 +9,372 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <sys/stat.h>
 #include <sys/param.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "media_util.h"
+#include "compress_util.h"
+#include "precompress_util.h"
 #include "properties.h"
 #include "string_util.h"
 #include "file_util.h"
+#include "dir_util.h"
+#include "segment_util.h"
+#include "statcache_util.h"
+#include "content_util.h"
+#include "mapcache_util.h"
+#include "upload_util.h"
+#include "http_body.h"
 #include "time_util.h"
 #include "http_server.h"
 #include "http_util.h"
 #include "http_codes.h"
 #include "http_do_get.h"
 
+/**
+ * Parse an unsigned count from a query parameter value.
+ *
+ * @param val the parameter value
+ * @param count storage for the count
+ * @return true if the value is a valid count
+ */
+static bool parseCount(const char *val, size_t *count) {
+    if (*val < '0' || *val > '9') {  // strtoull accepts sign and space
+        return false;
+    }
+    char *end;
+    unsigned long long n = strtoull(val, &end, 10);
+    if (*end != '\0' || n > SIZE_MAX) {
+        return false;
+    }
+    *count = (size_t)n;
+    return true;
+}
 
 /**
- * Handle GET or HEAD request.
+ * Get the listing format preferred by the Accept header of a
+ * request. The acceptable format with the highest quality wins;
+ * html wins if no JSON format is acceptable.
+ *
+ * @param requestHeaders the request headers
+ * @return the listing format
+ */
+static ListFormat acceptedListFormat(Properties *requestHeaders) {
+    char accept[MAX_PROP_VAL];
+    if (findProperty(requestHeaders, 0, "Accept", accept) == SIZE_MAX) {
+        return LIST_FORMAT_HTML;
+    }
+    ListFormat format = LIST_FORMAT_HTML;
+    double bestQ = 0.0;
+    char *saveptr;
+    for (char *range = strtok_r(accept, ",", &saveptr); range != NULL; range = strtok_r(NULL, ",", &saveptr)) {
+        // split media type from parameters
+        char *params = strchr(range, ';');
+        if (params != NULL) {
+            *params++ = '\0';
+        }
+        double q = 1.0;
+        char *qp = (params != NULL) ? strstr(params, "q=") : NULL;
+        if (qp != NULL) {
+            q = strtod(qp+2, NULL);
+        }
+        char *type = range + strspn(range, " \t");
+        type[strcspn(type, " \t")] = '\0';
+
+        ListFormat rangeFormat;
+        if (strcasecmp(type, "application/json") == 0) {
+            rangeFormat = LIST_FORMAT_JSON;
+        } else if (   strcasecmp(type, "application/x-ndjson") == 0
+                   || strcasecmp(type, "application/ndjson") == 0) {
+            rangeFormat = LIST_FORMAT_NDJSON;
+        } else if (   strcasecmp(type, "text/html") == 0
+                   || strcasecmp(type, "text/*") == 0
+                   || strcasecmp(type, "*/*") == 0) {
+            rangeFormat = LIST_FORMAT_HTML;
+        } else {
+            continue;
+        }
+        if (q > bestQ) {
+            bestQ = q;
+            format = rangeFormat;
+        }
+    }
+    return format;
+}
+
+/**
+ * Get listing options from the Accept header and the "format",
+ * "sort", "order", "offset" and "limit" query parameters of a
+ * request. Paging without a sort
+ * key pages through entries sorted by name, so that pages are
+ * stable while the directory is unchanged.
+ *
+ * @param requestHeaders the request headers
+ * @param opts storage for the listing options
+ * @return true if the options are valid
+ */
+static bool getListOptions(Properties *requestHeaders, ListOptions *opts) {
+    *opts = (ListOptions){
+        .format = acceptedListFormat(requestHeaders),
+        .sort = LIST_SORT_NONE, .offset = 0, .limit = SIZE_MAX
+    };
+    char query[MAX_PROP_VAL];
+    if (findProperty(requestHeaders, 0, "?", query) == SIZE_MAX) {
+        return true;
+    }
+    Properties *queryProps = newProperties();
+    decodeQuery(query, queryProps);
+
+    bool valid = true;
+    char val[MAX_PROP_VAL];
+    if (findProperty(queryProps, 0, "format", val) != SIZE_MAX) {  // overrides Accept
+        if (strcasecmp(val, "html") == 0) {
+            opts->format = LIST_FORMAT_HTML;
+        } else if (strcasecmp(val, "json") == 0) {
+            opts->format = LIST_FORMAT_JSON;
+        } else if (strcasecmp(val, "ndjson") == 0) {
+            opts->format = LIST_FORMAT_NDJSON;
+        } else {
+            valid = false;
+        }
+    }
+    if (findProperty(queryProps, 0, "sort", val) != SIZE_MAX) {
+        if (strcasecmp(val, "name") == 0) {
+            opts->sort = LIST_SORT_NAME;
+        } else if (strcasecmp(val, "mtime") == 0) {
+            opts->sort = LIST_SORT_MTIME;
+        } else if (strcasecmp(val, "size") == 0) {
+            opts->sort = LIST_SORT_SIZE;
+        } else {
+            valid = false;
+        }
+    }
+    if (findProperty(queryProps, 0, "order", val) != SIZE_MAX) {
+        if (strcasecmp(val, "desc") == 0) {
+            opts->descending = true;
+        } else if (strcasecmp(val, "asc") != 0) {
+            valid = false;
+        }
+    }
+    if (findProperty(queryProps, 0, "offset", val) != SIZE_MAX) {
+        valid = valid && parseCount(val, &opts->offset);
+    }
+    if (findProperty(queryProps, 0, "limit", val) != SIZE_MAX) {
+        valid = valid && parseCount(val, &opts->limit) && opts->limit > 0;
+    }
+    if (opts->sort == LIST_SORT_NONE && (opts->offset != 0 || opts->limit != SIZE_MAX || opts->descending)) {
+        opts->sort = LIST_SORT_NAME;
+    }
+    deleteProperties(queryProps);
+    return valid;
+}
+
+/**
+ * Choose the content coding of a response and record it in the
+ * response headers. If the content is compressed, the ETag becomes
+ * the ETag of the compressed representation, and the body must be
+ * chunked because the compressed length is not known until sent.
+ *
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @param mediaType the media type of the content
+ * @param len the content length or -1 if not known
+ * @param etag the ETag of the content; replaced by the ETag of
+ *   the representation sent
+ * @return the content coding
+ */
+static ContentCoding setResponseCoding(Properties *requestHeaders, Properties *responseHeaders,
+                                       const char *mediaType, long long len, char *etag) {
+    if (!isCompressibleType(mediaType)) {
+        return CODING_IDENTITY;
+    }
+    // the body depends on Accept-Encoding even if it is not compressed;
+    // a separate Vary header combines with one already present
+    putProperty(responseHeaders, "Vary", "Accept-Encoding");
+
+    ContentCoding coding = getResponseCoding(requestHeaders, mediaType, len);
+    if (coding != CODING_IDENTITY) {
+        char codingETag[MAXBUF];
+        strcpy(etag, makeCodingETag(etag, coding, codingETag));
+        putProperty(responseHeaders, "Content-Encoding", contentCodingName(coding));
+    }
+    return coding;
+}
+
+/**
+ * Open the streams that send compressed content as the chunked
+ * body of a response.
  *
  * @param stream the socket stream
- * @param uri the request URI
+ * @param coding the content coding
+ * @param streams storage for the chunked and compressing streams
+ * @return the compressing stream, or NULL if error
+ */
+static FILE *openCodedBody(FILE *stream, ContentCoding coding, FILE *streams[2]) {
+    streams[0] = openChunkedStream(stream);
+    streams[1] = (streams[0] != NULL) ? openCompressedStream(streams[0], coding) : NULL;
+    return streams[1];
+}
+
+/**
+ * Close the streams that send compressed content, which ends
+ * the compressed content and the chunked body.
+ *
+ * @param streams the chunked and compressing streams
+ */
+static void closeCodedBody(FILE *streams[2]) {
+    if (streams[1] != NULL) {
+        fclose(streams[1]);
+    }
+    if (streams[0] != NULL) {
+        fclose(streams[0]);
+    }
+}
+
+/**
+ * Send a file that was uploaded with a content coding and kept
+ * as sent. It is sent as is to a client that accepts its coding,
+ * and decoded for other clients.
+ *
+ * @param stream the socket stream
+ * @param fd the file descriptor
+ * @param sb the file properties
+ * @param coding the content coding of the file
  * @param requestHeaders the request headers
  * @param responseHeaders the response headers
- * @param sendContent send content (GET)
+ * @param sendContent true to send the body
  */
-static void do_get_or_head(FILE *stream, const char *uri, Properties *requestHeaders, Properties *responseHeaders, bool sendContent) {
-	// get path to URI in file system
-	char filePath[MAXPATHLEN];
-	resolveUri(uri, filePath);
-	FILE *contentStream = NULL;
+static void sendEncodedFile(FILE *stream, int fd, const struct stat *sb, ContentCoding coding,
+                            Properties *requestHeaders, Properties *responseHeaders, bool sendContent) {
+    putProperty(responseHeaders, "Vary", "Accept-Encoding");
+    bool decode = !isCodingAccepted(requestHeaders, coding);
 
-	// ensure file exists
-	struct stat sb;
-	if (stat(filePath, &sb) != 0) { // works for dir and file
-	    // If the directory does not exist, return a "404 "Not Found" response
-		sendStatusResponse(stream, Http_NotFound, NULL, responseHeaders);
-		return;
-	}
-	// directory path ends with '/'
-	if (S_ISDIR(sb.st_mode) && strendswith(filePath, "/")) {
-		// generates the directory listing and returns it as the body of the response
-        contentStream = tmpStringFile(generateList(filePath));
-        // get property
-        struct stat sbList;
-        fileStat(contentStream, &sbList);
-        // record the last-modified date/time
-        char time[MAXBUF];
-        time_t timer = sb.st_mtime;
-        putProperty(responseHeaders,"Last-Modified",
-                    milliTimeToRFC_1123_Date_Time(timer, time));
+    // the file is the coded representation of its content
+    char etag[MAXBUF], codingETag[MAXBUF];
+    makeFileETag(sb->st_ino, sb->st_size, &sb->st_mtim, etag);
+    putProperty(responseHeaders, "ETag", decode ? etag : makeCodingETag(etag, coding, codingETag));
+    if (matchesIfNoneMatch(requestHeaders, decode ? etag : codingETag)) {
+        sendResponseStatus(stream, Http_NotModified, NULL);
+        sendResponseHeaders(stream, responseHeaders);
+        return;
+    }
 
-        // get mime type of file
-        char mediaType[MAX_PROP_VAL];
-        getMediaType(filePath, mediaType);
-        if (strcmp(mediaType, "text/directory") == 0) {
-            // some browsers interpret text/directory as a VCF file
-            strcpy(mediaType,"text/html");
+    char buf[MAXBUF];
+    if (decode) {  // decoded length is not known until it is sent
+        putProperty(responseHeaders, "Transfer-Encoding", "chunked");
+    } else {
+        putProperty(responseHeaders, "Content-Encoding", contentCodingName(coding));
+        sprintf(buf, "%lld", (long long)sb->st_size);
+        putProperty(responseHeaders, "Content-Length", buf);
+    }
+    sendResponseStatus(stream, Http_OK, NULL);
+    sendResponseHeaders(stream, responseHeaders);
+    if (!sendContent) {
+        return;
+    }
+    if (!decode) {
+        sendFileBytes(fd, 0, stream, (size_t)sb->st_size);
+        return;
+    }
+    int streamFd = dup(fd);
+    FILE *contentStream = (streamFd < 0) ? NULL : fdopen(streamFd, "r");
+    if (contentStream == NULL) {
+        if (streamFd >= 0) {
+            close(streamFd);
         }
-        putProperty(responseHeaders, "Content-type", mediaType);
+        return;
+    }
+    FILE *chunkedStream = openChunkedStream(stream);
+    if (chunkedStream != NULL) {
+        bool bomb;
+        if (readDecodedBody(contentStream, (long long)sb->st_size, true, 0, fileStreamSink, chunkedStream, &bomb) < 0) {
+            abortResponse(stream);
+        }
+        fclose(chunkedStream);
+    }
+    fclose(contentStream);
+}
 
-        // Send response headers
-        sendResponseStatus(stream, Http_OK, NULL);
+/**
+ * Send a body stored in the segment store. The body is sent
+ * from its segment with sendfile() at its offset.
+ *
+ * @param stream the socket stream
+ * @param filePath the file path of the body
+ * @param entry the location of the body
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @param sendContent true to send the body
+ */
+static void sendSegmentEntry(FILE *stream, const char *filePath, const SegmentEntry *entry,
+                             Properties *requestHeaders, Properties *responseHeaders, bool sendContent) {
+    char buf[MAXBUF];
+    putProperty(responseHeaders, "Last-Modified",
+                milliTimeToRFC_1123_Date_Time(entry->mtime.tv_sec, buf));
+
+    char mediaType[MAX_PROP_VAL];
+    getMediaType(filePath, mediaType);
+    putProperty(responseHeaders, "Content-type", mediaType);
+
+    // a body is never rewritten in place, so its record number identifies it
+    char etag[MAXBUF];
+    makeFileETag(entry->seq, (long long)entry->length, &entry->mtime, etag);
+    ContentCoding coding = setResponseCoding(requestHeaders, responseHeaders,
+                                             mediaType, (long long)entry->length, etag);
+    putProperty(responseHeaders, "ETag", etag);
+    if (matchesIfNoneMatch(requestHeaders, etag)) {
+        sendResponseStatus(stream, Http_NotModified, NULL);
         sendResponseHeaders(stream, responseHeaders);
-        // copy the html file as the steam
-        copyFileStreamBytes(contentStream, stream, (size_t)sbList.st_size);
-        fclose(contentStream);
-		return;
-	} else if (!S_ISREG(sb.st_mode)) { // error if not regular file
-		sendStatusResponse(stream, Http_NotFound, NULL, responseHeaders);
-		return;
-	}
+        return;
+    }
+
+    if (coding == CODING_IDENTITY) {
+        sprintf(buf, "%zu", entry->length);
+        putProperty(responseHeaders, "Content-Length", buf);
+    } else {
+        putProperty(responseHeaders, "Transfer-Encoding", "chunked");
+    }
+    sendResponseStatus(stream, Http_OK, NULL);
+    sendResponseHeaders(stream, responseHeaders);
+    if (!sendContent) {
+        return;
+    }
+    if (coding == CODING_IDENTITY) {
+        sendFileBytes(entry->fd, entry->offset, stream, entry->length);
+    } else {
+        FILE *streams[2];
+        FILE *codedStream = openCodedBody(stream, coding, streams);
+        if (codedStream != NULL && sendFileBytes(entry->fd, entry->offset, codedStream, entry->length) != 0) {
+            abortResponse(stream);
+        }
+        closeCodedBody(streams);
+    }
+}
 
+/**
+ * Send a regular file opened beneath the content directory.
+ *
+ * @param stream the socket stream
+ * @param filePath the file path
+ * @param fd the file descriptor
+ * @param sb the file properties
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @param sendContent true to send the body
+ */
+static void sendContentFile(FILE *stream, const char *filePath, int fd, const struct stat *sb,
+                            Properties *requestHeaders, Properties *responseHeaders, bool sendContent) {
 	// record the last-modified date/time
     char buf[MAXBUF];
-	time_t timer = sb.st_mtime;
+	time_t timer = sb->st_mtime;
 	putProperty(responseHeaders,"Last-Modified",
 				milliTimeToRFC_1123_Date_Time(timer, buf));
 
@@ -97,13 +387,42 @@ static void do_get_or_head(FILE *stream, const char *uri, Properties *requestHea
 	}
 	putProperty(responseHeaders, "Content-type", mediaType);
 
+    // a file kept as uploaded with a content coding is sent as is or decoded
+    ContentCoding storedCoding = getOpenFileCoding(fd);
+    if (storedCoding != CODING_IDENTITY) {
+        sendEncodedFile(stream, fd, sb, storedCoding, requestHeaders, responseHeaders, sendContent);
+        return;
+    }
+
+    // same ETag as the entry in a directory listing
+    char etag[MAXBUF];
+    makeFileETag(sb->st_ino, sb->st_size, &sb->st_mtim, etag);
+    ContentCoding coding = setResponseCoding(requestHeaders, responseHeaders,
+                                             mediaType, (long long)sb->st_size, etag);
+    putProperty(responseHeaders, "ETag", etag);
+    if (matchesIfNoneMatch(requestHeaders, etag)) {
+        sendResponseStatus(stream, Http_NotModified, NULL);
+        sendResponseHeaders(stream, responseHeaders);
+        return;
+    }
+
     // get file length
-    size_t contentLen = (size_t)sb.st_size;
+    size_t contentLen = (size_t)sb->st_size;
+
+    // a current gzip copy is sent as is instead of compressing the file
+    struct stat gzSb;
+    int gzFd = (coding == CODING_GZIP) ? openPrecompressed(filePath, sb, &gzSb) : -1;
 
     // set content length or chunked transfer encoding if requested
     // char buf[MAXBUF];
     bool chunked = false;
-    if ( (findProperty(requestHeaders, 0, "Transfer-Encoding", buf) != SIZE_MAX)
+    if (gzFd >= 0) {
+        sprintf(buf, "%lld", (long long)gzSb.st_size);
+        putProperty(responseHeaders, "Content-Length", buf);
+    } else if (coding != CODING_IDENTITY) {
+        // compressed length is not known until it is sent
+        putProperty(responseHeaders, "Transfer-Encoding", "chunked");
+    } else if ( (findProperty(requestHeaders, 0, "Transfer-Encoding", buf) != SIZE_MAX)
            && (strcmp(buf, "chunked") == 0)
            && sendContent) { // only chunk if sending content
         // record transfer encoding
@@ -122,17 +441,204 @@ static void do_get_or_head(FILE *stream, const char *uri, Properties *requestHea
 	sendResponseHeaders(stream, responseHeaders);
 
 	// send content for GET
-	if (sendContent) {
-		contentStream = fopen(filePath, "r");
-        if (chunked) {
-            copyToChunkedFileStreamBytes(contentStream, stream, contentLen);
+	if (gzFd >= 0) {
+        if (sendContent) {
+            sendFileBytes(gzFd, 0, stream, (size_t)gzSb.st_size);
+        }
+        close(gzFd);
+	} else if (sendContent) {
+        if (coding != CODING_IDENTITY) {
+            FILE *streams[2];
+            FILE *codedStream = openCodedBody(stream, coding, streams);
+            if (codedStream != NULL && sendFileBytes(fd, 0, codedStream, contentLen) != 0) {
+                abortResponse(stream);
+            }
+            closeCodedBody(streams);
+        } else if (chunked) {
+            FILE *chunkedStream = openChunkedStream(stream);
+            if (chunkedStream != NULL) {
+                if (sendFileBytes(fd, 0, chunkedStream, contentLen) != 0) {
+                    abortResponse(stream);
+                }
+                fclose(chunkedStream);
+            }
         } else {
-            copyFileStreamBytes(contentStream, stream, contentLen);
+            // a mid-sized file is sent from a mapping shared by requests
+            MappedFile *map = acquireMappedFile(filePath, fd, sb);
+            if (map != NULL) {
+                sendMappedBytes(map, 0, stream, contentLen);
+                releaseMappedFile(map);
+            } else {
+                sendFileBytes(fd, 0, stream, contentLen);
+            }
         }
-		fclose(contentStream);
 	}
 }
 
+/**
+ * Handle GET or HEAD request.
+ *
+ * @param stream the socket stream
+ * @param uri the request URI
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @param sendContent send content (GET)
+ */
+static void do_get_or_head(FILE *stream, const char *uri, Properties *requestHeaders, Properties *responseHeaders, bool sendContent) {
+	// get path to URI in file system
+	char filePath[MAXPATHLEN];
+	resolveUri(uri, filePath);
+	FILE *contentStream = NULL;
+
+	// HEAD reports the bytes received by an unfinished resumable upload
+	off_t stagedOffset = sendContent ? -1 : getStagedOffset(filePath);
+	if (stagedOffset >= 0) {
+		char offsetBuf[MAXBUF];
+		sprintf(offsetBuf, "%lld", (long long)stagedOffset);
+		putProperty(responseHeaders, "Upload-Offset", offsetBuf);
+	}
+
+	// small POST bodies are served from the segment store
+	SegmentEntry entry;
+	if (openSegmentEntry(filePath, &entry)) {
+		sendSegmentEntry(stream, filePath, &entry, requestHeaders, responseHeaders, sendContent);
+		close(entry.fd);
+		return;
+	}
+
+	// ensure file exists
+	struct stat sb;
+	if (cachedStat(filePath, &sb) != 0) { // works for dir and file
+	    // If the directory does not exist, return a "404 "Not Found" response
+		sendStatusResponse(stream, Http_NotFound, NULL, responseHeaders);
+		return;
+	}
+	// directory path ends with '/'
+	if (S_ISDIR(sb.st_mode) && strendswith(filePath, "/")) {
+        // the directory must be beneath the content directory
+        ContentDir *dir = acquireContentDir(filePath);
+        if (dir == NULL) {
+            sendStatusResponse(stream, Http_NotFound, NULL, responseHeaders);
+            return;
+        }
+        releaseContentDir(dir);
+
+        // get sort and page of listing
+        ListOptions opts;
+        if (!getListOptions(requestHeaders, &opts)) {
+            sendStatusResponse(stream, Http_BadRequest, NULL, responseHeaders);
+            return;
+        }
+
+        // record the last-modified date/time
+        char time[MAXBUF];
+        time_t timer = sb.st_mtime;
+        putProperty(responseHeaders,"Last-Modified",
+                    milliTimeToRFC_1123_Date_Time(timer, time));
+
+        // get mime type of listing format
+        char mediaType[MAX_PROP_VAL];
+        if (opts.format == LIST_FORMAT_JSON) {
+            strcpy(mediaType, "application/json");
+        } else if (opts.format == LIST_FORMAT_NDJSON) {
+            strcpy(mediaType, "application/x-ndjson");
+        } else {
+            getMediaType(filePath, mediaType);
+            if (strcmp(mediaType, "text/directory") == 0) {
+                // some browsers interpret text/directory as a VCF file
+                strcpy(mediaType,"text/html");
+            }
+        }
+        putProperty(responseHeaders, "Content-type", mediaType);
+        putProperty(responseHeaders, "Vary", "Accept");
+
+        // listing ETag is known without generating the listing; listings
+        // are compressed regardless of length so the ETag does not depend
+        // on whether the listing is cached
+        char etag[MAXBUF];
+        getListingETag(filePath, &sb, &opts, etag);
+        ContentCoding coding = setResponseCoding(requestHeaders, responseHeaders, mediaType, -1, etag);
+        putProperty(responseHeaders, "ETag", etag);
+        if (matchesIfNoneMatch(requestHeaders, etag)) {
+            sendResponseStatus(stream, Http_NotModified, NULL);
+            sendResponseHeaders(stream, responseHeaders);
+            return;
+        }
+
+        // send cached listing if directory has not changed
+        ListingBody *listing = acquireListing(filePath, &sb, &opts);
+        if (listing != NULL && coding != CODING_IDENTITY) {
+            putProperty(responseHeaders, "Transfer-Encoding", "chunked");
+            sendResponseStatus(stream, Http_OK, NULL);
+            sendResponseHeaders(stream, responseHeaders);
+            if (sendContent) {
+                FILE *streams[2];
+                FILE *codedStream = openCodedBody(stream, coding, streams);
+                if (codedStream != NULL) {
+                    fwrite(listingBytes(listing), sizeof(char), listingLength(listing), codedStream);
+                }
+                closeCodedBody(streams);
+            }
+            releaseListing(listing);
+            return;
+        }
+        if (listing != NULL) {
+            char lenBuf[MAXBUF];
+            sprintf(lenBuf, "%zu", listingLength(listing));
+            putProperty(responseHeaders, "Content-Length", lenBuf);
+            sendResponseStatus(stream, Http_OK, NULL);
+            sendResponseHeaders(stream, responseHeaders);
+            if (sendContent) {
+                fwrite(listingBytes(listing), sizeof(char), listingLength(listing), stream);
+            }
+            releaseListing(listing);
+            return;
+        }
+
+        // listing length is not known until it is generated
+        putProperty(responseHeaders, "Transfer-Encoding", "chunked");
+
+        // Send response headers
+        sendResponseStatus(stream, Http_OK, NULL);
+        sendResponseHeaders(stream, responseHeaders);
+
+        // generate the directory listing as the chunked body of the response
+        if (sendContent && coding != CODING_IDENTITY) {
+            FILE *streams[2];
+            contentStream = openCodedBody(stream, coding, streams);
+            if (contentStream != NULL && generateCachedList(filePath, &sb, &opts, contentStream) != 0) {
+                abortResponse(stream);  // not ended as if complete
+            }
+            closeCodedBody(streams);
+        } else if (sendContent) {
+            contentStream = openChunkedStream(stream);
+            if (contentStream != NULL) {
+                if (generateCachedList(filePath, &sb, &opts, contentStream) != 0) {
+                    abortResponse(stream);  // not ended as if complete
+                }
+                fclose(contentStream);
+            }
+        }
+		return;
+	} else if (!S_ISREG(sb.st_mode)) { // error if not regular file
+		sendStatusResponse(stream, Http_NotFound, NULL, responseHeaders);
+		return;
+	}
+
+	// open the file beneath the content directory; its properties
+	// may have changed since they were cached
+	int fd = openContent(filePath, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		sendStatusResponse(stream, Http_NotFound, NULL, responseHeaders);
+		return;
+	}
+	sendContentFile(stream, filePath, fd, &sb, requestHeaders, responseHeaders, sendContent);
+	close(fd);
+}
+
 /**
  * Handle GET request.
  *
@@ -7,10 +7,17 @@
 *
 */
 
+#define _GNU_SOURCE  /* for open_memstream() */
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 //#include <AppleTextureEncoder.h>
 //#include <AppleEXR.h>
@@ -21,7 +28,498 @@
 #include "file_util.h"
 #include "http_server.h"
 #include "http_util.h"
+#include "http_body.h"
+#include "multipart.h"
+#include "dir_util.h"
+#include "sync_util.h"
+#include "quota_util.h"
+#include "blob_util.h"
+#include "segment_util.h"
+#include "precompress_util.h"
+#include "statcache_util.h"
+#include "content_util.h"
 
+/** Maximum bytes of form field values kept in the JSON sidecar */
+#define MAX_FORM_FIELDS (64*1024)
+
+/** Maximum number of parts in a multipart/form-data body */
+#define MAX_FORM_PARTS 1000
+
+/** Stores the parts of a multipart/form-data body as they are parsed */
+typedef struct FormUpload {
+    char basePath[MAXPATHLEN];  /** path of upload without extension */
+    int nparts;                 /** number of parts so far */
+    bool tooLarge;              /** true if fields or parts exceed limits */
+    FILE *partStream;           /** current file part or NULL if field */
+    char tempPath[MAXPATHLEN];  /** temp path of current file part */
+    char partName[MAX_PROP_VAL];  /** JSON-quoted field name of current part */
+    char *value;                /** value of current field */
+    size_t valueLen;            /** length of value */
+    size_t fieldsLen;           /** total length of field values */
+    long long partSize;         /** bytes in current part */
+    FILE *fields;               /** JSON array members of fields */
+    char *fieldsBuf;            /** buffer of fields stream */
+    size_t fieldsBufLen;        /** length of fields buffer */
+    FILE *files;                /** JSON array members of files */
+    char *filesBuf;             /** buffer of files stream */
+    size_t filesBufLen;         /** length of files buffer */
+    char **saved;               /** paths of stored file parts */
+    int nsaved;                 /** number of stored file parts */
+    unsigned long long storedBytes;  /** bytes of stored file parts */
+} FormUpload;
+
+/**
+ * Make a file name from a client-supplied file name: only the last
+ * path component is kept, and characters other than letters,
+ * digits, '.', '-' and '_' are replaced by '_'.
+ *
+ * @param filename the client file name
+ * @param name buffer for the name of MAXBUF bytes
+ * @return the name
+ */
+static char *safeFileName(const char *filename, char *name) {
+    const char *p = filename + strlen(filename);
+    while (p > filename && p[-1] != '/' && p[-1] != '\\') {
+        p--;
+    }
+    size_t n = 0;
+    for (; *p != '\0' && n < MAXBUF-1; p++) {
+        char c = *p;
+        bool safe = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+                 || c == '.' || c == '-' || c == '_';
+        name[n++] = safe ? c : '_';
+    }
+    name[n] = '\0';
+    if (n == 0 || strspn(name, ".") == n) {  // empty, "." or ".."
+        strcpy(name, "part");
+    }
+    return name;
+}
+
+/**
+ * Start a part: a file part is written to a temp file next to
+ * its final path; a field value is collected in memory.
+ *
+ * @param ctx the upload
+ * @param part the part headers
+ * @return 0 if successful, -1 if error
+ */
+static int beginFormPart(void *ctx, const MultipartPart *part) {
+    FormUpload *upload = ctx;
+    if (++upload->nparts > MAX_FORM_PARTS) {
+        upload->tooLarge = true;
+        return -1;
+    }
+    quoteJsonString(part->name, strnlen(part->name, MULTIPART_MAX_HEADER), upload->partName);
+    upload->partSize = 0;
+    upload->valueLen = 0;
+    if (part->filename == NULL) {
+        return 0;
+    }
+
+    char name[MAXBUF], partPath[MAXPATHLEN];
+    snprintf(partPath, sizeof(partPath), "%s-%d-%s",
+             upload->basePath, upload->nparts, safeFileName(part->filename, name));
+    int fd = createTempFile(partPath, upload->tempPath);
+    if (fd < 0) {
+        return -1;
+    }
+    upload->partStream = fdopen(fd, "w");
+    if (upload->partStream == NULL) {
+        close(fd);
+        unlink(upload->tempPath);
+        return -1;
+    }
+
+    // record file part; size is added when it ends
+    char quoted[6*MULTIPART_MAX_HEADER+3];
+    fprintf(upload->files, "%s{\"name\":%s", (upload->nsaved > 0) ? "," : "", upload->partName);
+    quoteJsonString(part->filename, strlen(part->filename), quoted);
+    fprintf(upload->files, ",\"filename\":%s", quoted);
+    if (part->contentType != NULL) {
+        quoteJsonString(part->contentType, strlen(part->contentType), quoted);
+        fprintf(upload->files, ",\"contentType\":%s", quoted);
+    }
+    const char *stored = strrchr(partPath, '/');
+    stored = (stored == NULL) ? partPath : stored+1;
+    quoteJsonString(stored, strlen(stored), quoted);
+    fprintf(upload->files, ",\"path\":%s", quoted);
+
+    char **saved = realloc(upload->saved, (upload->nsaved+1)*sizeof(char*));
+    if (saved == NULL) {
+        return -1;
+    }
+    upload->saved = saved;
+    if ((saved[upload->nsaved] = strdup(partPath)) == NULL) {
+        return -1;
+    }
+    upload->nsaved++;
+    return 0;
+}
+
+/**
+ * Store the next bytes of the current part.
+ *
+ * @param ctx the upload
+ * @param bytes the part bytes
+ * @param len the number of bytes
+ * @return 0 if successful, -1 if error
+ */
+static int formPartData(void *ctx, const char *bytes, size_t len) {
+    FormUpload *upload = ctx;
+    upload->partSize += len;
+    if (upload->partStream != NULL) {
+        return (fwrite(bytes, sizeof(char), len, upload->partStream) < len) ? -1 : 0;
+    }
+    if (upload->fieldsLen + upload->valueLen + len > MAX_FORM_FIELDS) {
+        upload->tooLarge = true;
+        return -1;
+    }
+    memcpy(upload->value + upload->valueLen, bytes, len);
+    upload->valueLen += len;
+    return 0;
+}
+
+/**
+ * End the current part: a file part is renamed into place;
+ * a field is added to the JSON sidecar.
+ *
+ * @param ctx the upload
+ * @return 0 if successful, -1 if error
+ */
+static int endFormPart(void *ctx) {
+    FormUpload *upload = ctx;
+    if (upload->partStream == NULL) {
+        char *quoted = malloc(6*upload->valueLen+3);
+        if (quoted == NULL) {
+            return -1;
+        }
+        quoteJsonString(upload->value, upload->valueLen, quoted);
+        fprintf(upload->fields, "%s{\"name\":%s,\"value\":%s}",
+                (ftell(upload->fields) > 0) ? "," : "",
+                upload->partName, quoted);
+        free(quoted);
+        upload->fieldsLen += upload->valueLen;
+        return 0;
+    }
+    int status = (fclose(upload->partStream) == 0) ? 0 : -1;
+    upload->partStream = NULL;
+    if (status == 0 && rename(upload->tempPath, upload->saved[upload->nsaved-1]) != 0) {
+        status = -1;
+    }
+    if (status != 0) {
+        unlink(upload->tempPath);
+        return -1;
+    }
+    fprintf(upload->files, ",\"size\":%lld}", upload->partSize);
+    upload->storedBytes += (unsigned long long)upload->partSize;
+    return 0;
+}
+
+/** Handler that stores form parts */
+static const MultipartHandler formHandler = {beginFormPart, formPartData, endFormPart};
+
+/** Parser of the current upload for the body sink */
+typedef struct FormSink {
+    MultipartParser *parser;    /** the parser */
+} FormSink;
+
+/**
+ * Body sink that feeds the multipart parser.
+ *
+ * @param ctx the form sink
+ * @param bytes the body bytes
+ * @param len the number of bytes
+ * @return 0 if successful, -1 if error
+ */
+static int formBodySink(void *ctx, const char *bytes, size_t len) {
+    return feedMultipart(((FormSink*)ctx)->parser, bytes, len);
+}
+
+/**
+ * Make the stored file parts and the sidecar of an upload durable.
+ *
+ * @param upload the upload
+ * @param sidecarFd descriptor of the sidecar
+ * @param dirPath the directory of the upload
+ * @return 0 if successful, -1 if error
+ */
+static int commitFormUpload(const FormUpload *upload, int sidecarFd, const char *dirPath) {
+    if (server.durability == DURABILITY_NONE) {
+        return 0;
+    }
+    int *fds = malloc((upload->nsaved+1) * sizeof(int));
+    if (fds == NULL) {
+        return -1;
+    }
+    int status = 0, nfds = 0;
+    fds[nfds++] = sidecarFd;
+    for (int i = 0; i < upload->nsaved && status == 0; i++) {
+        if ((fds[nfds] = open(upload->saved[i], O_RDONLY | O_CLOEXEC)) < 0) {
+            status = -1;
+        } else {
+            nfds++;
+        }
+    }
+    if (status == 0) {
+        status = commitFiles(fds, (size_t)nfds, dirPath);
+    }
+    for (int i = 1; i < nfds; i++) {
+        close(fds[i]);
+    }
+    free(fds);
+    return status;
+}
+
+/**
+ * Store a multipart/form-data body in one pass: each file part is
+ * written to its own file as it arrives, and the fields and a list
+ * of the stored files are written to a JSON sidecar. Memory use is
+ * bounded by the parser buffer and the limit on field values.
+ *
+ * The quota reserved for a body of known length is settled to
+ * the bytes actually stored; a chunked body is charged as it arrives.
+ *
+ * @param stream the socket stream
+ * @param dirPath the directory for the upload
+ * @param boundary the multipart boundary
+ * @param len the body length or -1 if chunked
+ * @param inflate true to decode a gzip or deflate encoded body
+ * @param reserved the quota reserved for the body
+ * @param sidecarPath buffer for the path of the sidecar of MAXPATHLEN bytes
+ * @return Http_Created if successful, otherwise the error status
+ */
+static enum HttpCode storeFormUpload(FILE *stream, const char *dirPath, const char *boundary, long long len,
+                                     bool inflate, unsigned long long reserved, char *sidecarPath) {
+    // reserve a hidden name; the visible sidecar appears only when complete
+    char hiddenPath[MAXPATHLEN];
+    snprintf(hiddenPath, sizeof(hiddenPath), "%s/.rdm_file_XXXXXX.json", dirPath);
+    int sidecarFd = mkstemps(hiddenPath, 5);
+    if (sidecarFd < 0) {
+        releaseQuota(dirPath, reserved);
+        return Http_InternalServerError;
+    }
+    snprintf(sidecarPath, MAXPATHLEN, "%s/%s", dirPath, strrchr(hiddenPath, '/')+2);
+
+    FormUpload upload = {.partStream = NULL};
+    snprintf(upload.basePath, sizeof(upload.basePath), "%.*s",
+             (int)(strlen(sidecarPath) - strlen(".json")), sidecarPath);
+    upload.value = malloc(MAX_FORM_FIELDS);
+    upload.fields = open_memstream(&upload.fieldsBuf, &upload.fieldsBufLen);
+    upload.files = open_memstream(&upload.filesBuf, &upload.filesBufLen);
+    FormSink sink = {newMultipartParser(boundary, &formHandler, &upload)};
+
+    enum HttpCode status = Http_Created;
+    if (upload.value == NULL || upload.fields == NULL || upload.files == NULL || sink.parser == NULL) {
+        status = Http_InternalServerError;
+    } else if (len < 0 || inflate) {  // limits are checked as the body arrives
+        LimitSink limit;
+        initLimitSink(&limit, formBodySink, &sink, dirPath, server.max_body_size);
+        bool bomb;
+        if (   (readDecodedBody(stream, len, inflate, server.max_inflate_ratio, limitSink, &limit, &bomb) < 0)
+            || !isMultipartDone(sink.parser)) {
+            status = (upload.tooLarge || limit.tooLarge || bomb) ? Http_PayloadTooLarge
+                   : limit.noSpace ? Http_InsufficientStorage : Http_BadRequest;
+        }
+        reserved += limit.reserved;
+    } else {
+        if (readBodyStream(stream, (uint64_t)len, formBodySink, &sink) != 0 || !isMultipartDone(sink.parser)) {
+            status = upload.tooLarge ? Http_PayloadTooLarge : Http_BadRequest;
+        }
+    }
+    if (upload.partStream != NULL) {  // body ended inside a file part
+        fclose(upload.partStream);
+        unlink(upload.tempPath);
+    }
+    if (upload.fields != NULL) {
+        fclose(upload.fields);
+    }
+    if (upload.files != NULL) {
+        fclose(upload.files);
+    }
+
+    // write sidecar, then make it visible without replacing another upload
+    FILE *sidecar = fdopen(sidecarFd, "w");
+    if (status == Http_Created) {
+        int n = fprintf(sidecar, "{\"fields\":[%s],\"files\":[%s]}\n", upload.fieldsBuf, upload.filesBuf);
+        upload.storedBytes += (n > 0) ? (unsigned long long)n : 0;
+        if (n < 0 || fflush(sidecar) != 0 || link(hiddenPath, sidecarPath) != 0) {
+            status = Http_InternalServerError;
+        } else if (commitFormUpload(&upload, sidecarFd, dirPath) != 0) {
+            unlink(sidecarPath);
+            status = Http_InternalServerError;
+        }
+    }
+    if (sidecar != NULL) {
+        fclose(sidecar);
+    } else {
+        close(sidecarFd);
+    }
+    unlink(hiddenPath);
+
+    // keep quota only for what was stored
+    releaseQuota(dirPath, (status == Http_Created) ? reserved - MIN(upload.storedBytes, reserved) : reserved);
+
+    // remove stored parts of a failed upload
+    for (int i = 0; i < upload.nsaved; i++) {
+        if (status != Http_Created) {
+            unlink(upload.saved[i]);
+        } else {
+            invalidateStat(upload.saved[i]);
+            refreshPrecompressed(upload.saved[i]);
+        }
+        free(upload.saved[i]);
+    }
+    free(upload.saved);
+    free(upload.fieldsBuf);
+    free(upload.filesBuf);
+    free(upload.value);
+    if (sink.parser != NULL) {
+        deleteMultipartParser(sink.parser);
+    }
+    return status;
+}
+
+/**
+ * Store a raw POST body in the blob store and link it at a file
+ * name reserved in the upload directory, so identical bodies share
+ * one blob. The body is hashed as it arrives, and the response has
+ * its digest.
+ *
+ * @param stream the socket stream
+ * @param dirPath the directory for the upload
+ * @param fileName the reserved file name
+ * @param len the body length or -1 if chunked
+ * @param inflate true to decode a gzip or deflate encoded body
+ * @param reserved the quota reserved for the body
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ */
+static void postBlob(FILE *stream, const char *dirPath, const char *fileName, long long len, bool inflate,
+                     unsigned long long reserved, Properties *requestHeaders, Properties *responseHeaders) {
+    BlobUpload blob;
+    int err = beginBlob(&blob, inflate ? -1 : len);
+    if (err != 0) {
+        unlink(fileName);
+        releaseQuota(dirPath, reserved);
+        sendStatusResponse(stream,
+                           (err == ENOSPC || err == EDQUOT || err == EFBIG)
+                               ? Http_InsufficientStorage : Http_InternalServerError,
+                           NULL, responseHeaders);
+        return;
+    }
+    if (!sendContinue(stream, requestHeaders, responseHeaders)) {
+        abortBlob(&blob);
+        closeBlob(&blob);
+        unlink(fileName);
+        releaseQuota(dirPath, reserved);
+        return;
+    }
+
+    int status;
+    enum HttpCode error = Http_BadRequest;
+    if (len == -1 || inflate) {  // limits are checked as the body arrives
+        LimitSink limit;
+        initLimitSink(&limit, blobSink, &blob, dirPath, server.max_body_size);
+        bool bomb;
+        status = (readDecodedBody(stream, len, inflate, server.max_inflate_ratio, limitSink, &limit, &bomb) < 0) ? -1 : 0;
+        releaseQuota(dirPath, limit.reserved - limit.total);  // keep only what was stored
+        reserved = limit.total;
+        error = (limit.tooLarge || bomb) ? Http_PayloadTooLarge
+              : limit.noSpace ? Http_InsufficientStorage : Http_BadRequest;
+    } else {
+        status = readBodyStream(stream, (uint64_t)len, blobSink, &blob);
+    }
+    if (status == 0 && storeBlob(&blob, fileName) != 0) {
+        status = -1;
+        error = Http_InternalServerError;
+    }
+    if (status != 0) {
+        abortBlob(&blob);
+        closeBlob(&blob);
+        unlink(fileName);
+        releaseQuota(dirPath, reserved);
+        sendStatusResponse(stream, error, NULL, responseHeaders);
+        return;
+    }
+    invalidateStat(fileName);
+    invalidateListing(dirPath);
+
+    // a new blob and the link to it must both be durable
+    char blobDir[MAXPATHLEN];
+    snprintf(blobDir, sizeof(blobDir), "%s/%02x", server.blob_store, blob.digest[0]);
+    status = blob.reused ? 0 : commitFiles(&blob.fd, 1, blobDir);
+    if (status == 0) {
+        status = commitFiles(NULL, 0, dirPath);
+    }
+    if (status != 0) {
+        closeBlob(&blob);
+        sendStatusResponse(stream, Http_InternalServerError, NULL, responseHeaders);
+        return;
+    }
+
+    // identical bodies share an inode, so they also share an ETag
+    char buf[MAX_PROP_VAL];
+    struct stat sb;
+    if (stat(fileName, &sb) == 0) {
+        putProperty(responseHeaders, "ETag", makeFileETag(sb.st_ino, sb.st_size, &sb.st_mtim, buf));
+    }
+    putProperty(responseHeaders, "Digest", getBlobDigestHeader(&blob, buf));
+    putProperty(responseHeaders, "Content-Location", fileName);
+    closeBlob(&blob);
+    refreshPrecompressed(fileName);
+    sendStatusResponse(stream, Http_Created, NULL, responseHeaders);
+}
+
+/**
+ * Store a small raw POST body in the segment store under a
+ * new file name in the upload directory. The body is read into
+ * memory, so it is appended to the log in one write.
+ *
+ * @param stream the socket stream
+ * @param dirPath the directory for the upload
+ * @param fileName the file name template ending in "XXXXXX" and a suffix
+ * @param suffixLen the length of the suffix
+ * @param len the body length
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ */
+static void postSegment(FILE *stream, const char *dirPath, char *fileName, int suffixLen, long long len,
+                        Properties *requestHeaders, Properties *responseHeaders) {
+    char *body = malloc((len > 0) ? (size_t)len : 1);
+    if (body == NULL) {
+        releaseQuota(dirPath, (unsigned long long)len);
+        sendStatusResponse(stream, Http_InternalServerError, NULL, responseHeaders);
+        return;
+    }
+    if (!sendContinue(stream, requestHeaders, responseHeaders)) {
+        free(body);
+        releaseQuota(dirPath, (unsigned long long)len);
+        return;
+    }
+    if (fread(body, sizeof(char), (size_t)len, stream) < (size_t)len) {  // incomplete body
+        free(body);
+        releaseQuota(dirPath, (unsigned long long)len);
+        sendStatusResponse(stream, Http_BadRequest, NULL, responseHeaders);
+        return;
+    }
+    int err = appendSegmentBody(fileName, suffixLen, body, (size_t)len);
+    free(body);
+    if (err != 0 && err != EIO) {  // EIO: appended but not durable
+        releaseQuota(dirPath, (unsigned long long)len);
+    } else {
+        invalidateListing(dirPath);
+    }
+    if (err != 0) {
+        sendStatusResponse(stream,
+                           (err == ENOSPC || err == EDQUOT || err == EFBIG)
+                               ? Http_InsufficientStorage : Http_InternalServerError,
+                           NULL, responseHeaders);
+        return;
+    }
+    putProperty(responseHeaders, "Content-Location", fileName);
+    sendStatusResponse(stream, Http_Created, NULL, responseHeaders);
+}
 
 /**
  *
@@ -35,25 +533,19 @@ void do_post(FILE *stream, const char *uri, Properties *requestHeaders, Properti
     char filePath[MAXPATHLEN];
     resolveUri(uri, filePath);
     FILE *putStream = NULL;
-    char buf[MAXBUF];
+    char buf[MAX_PROP_VAL];
 
-    if (findProperty(requestHeaders, 0, "Content-Length", buf) == SIZE_MAX
-        && findProperty(requestHeaders, 0, "Transfer-Encoding", buf) == SIZE_MAX)
-    {
-        sendStatusResponse(stream, Http_LengthRequired, NULL, responseHeaders);
+    long long len;  // -1 if chunked
+    int lenStatus = getRequestBodyLength(requestHeaders, &len);
+    if (lenStatus != Http_OK) {
+        sendStatusResponse(stream, lenStatus, NULL, responseHeaders);
         return;
     }
-    int len = atoi(buf);
-    if (findProperty(requestHeaders, 0, "Transfer-Encoding", buf) != SIZE_MAX)
-    {
-        if(strcmp(buf,"chunked")==0){
-            len=-1;
-            putProperty(responseHeaders, "Transfer-Encoding", "chunked");
-        }
-        else{
-            sendStatusResponse(stream, Http_MethodNotAllowed, NULL, responseHeaders);
-            return;
-        }
+    ContentCoding coding;
+    int codingStatus = getRequestContentCoding(requestHeaders, &coding);
+    if (codingStatus != Http_OK) {
+        sendStatusResponse(stream, codingStatus, NULL, responseHeaders);
+        return;
     }
 
     if (strendswith(filePath, "/"))
@@ -62,48 +554,156 @@ void do_post(FILE *stream, const char *uri, Properties *requestHeaders, Properti
         return;
     }
     putProperty(responseHeaders, "Location", filePath);
-    if (mkdirs(filePath, 0755) < 0)
+    if (mkdirsContent(filePath, 0755) < 0)
     {
         sendStatusResponse(stream, Http_MethodNotAllowed, NULL, responseHeaders);
         return;
     }
 
 
+    if (findProperty(requestHeaders, 0, "Content-Type", buf) == SIZE_MAX) {
+        *buf = '\0';
+    }
+    bool isForm = (strncasecmp(buf, "multipart/form-data", strlen("multipart/form-data")) == 0);
+
+    // an encoded body is decoded unless a raw body is kept as sent;
+    // its decoded length is not known
+    bool inflating = (coding != CODING_IDENTITY) && (isForm || !server.keep_encoded_uploads);
+    long long storedLen = inflating ? -1 : len;
+
+    // a body of known length must fit the directory quotas
+    unsigned long long reserved = (storedLen > 0) ? (unsigned long long)storedLen : 0;
+    if (!reserveQuota(filePath, reserved)) {
+        sendStatusResponse(stream, Http_PayloadTooLarge, NULL, responseHeaders);
+        return;
+    }
+
+    // store form parts as separate files and fields as JSON
+    if (isForm) {
+        char boundary[MULTIPART_MAX_BOUNDARY+1];
+        if (!getMultipartBoundary(buf, boundary)) {
+            releaseQuota(filePath, reserved);
+            sendStatusResponse(stream, Http_BadRequest, NULL, responseHeaders);
+            return;
+        }
+        if (storedLen > 0 && !hasFreeSpace(filePath, (off_t)storedLen)) {
+            releaseQuota(filePath, reserved);
+            sendStatusResponse(stream, Http_InsufficientStorage, NULL, responseHeaders);
+            return;
+        }
+        if (!sendContinue(stream, requestHeaders, responseHeaders)) {
+            releaseQuota(filePath, reserved);
+            return;
+        }
+        char sidecarPath[MAXPATHLEN];
+        enum HttpCode status = storeFormUpload(stream, filePath, boundary, len, inflating, reserved, sidecarPath);
+        if (status == Http_Created) {
+            invalidateStat(sidecarPath);
+            invalidateListing(filePath);
+            putProperty(responseHeaders, "Content-Location", sidecarPath);
+        }
+        sendStatusResponse(stream, status, NULL, responseHeaders);
+        return;
+    }
+
     char fileName[MAXPATHLEN];
     strcpy(fileName, filePath);
     //rename the file
-    strcat(fileName, "/rdm_file_XXX");
-    int tempFile;
-    findProperty(requestHeaders, 0, "Content-Type", buf);
+    strcat(fileName, "/rdm_file_XXXXXX");
+    int suffixLen;
 
-    // transfer file types
-    if (strcmp(buf, "multipart/form-data") == 0)
-    {
-        strcat(fileName, ".mime");
-        tempFile = mkstemps(fileName, 6);
-    }
-    else if (strcmp(buf, "text/plain") == 0)
+    // transfer file types; suffix length excludes the template
+    if (strcmp(buf, "text/plain") == 0)
     {
         strcat(fileName, ".txt");
-        tempFile = mkstemps(fileName, 5);
+        suffixLen = 4;
     }
     else if (strcmp(buf, "application/x-www-form-urlencoded") == 0)
     {
         strcat(fileName, ".urlencoded");
-        tempFile = mkstemps(fileName, 13);
+        suffixLen = 11;
     }
     else {
         strcat(fileName, ".bin");
-        tempFile = mkstemps(fileName, 5);
+        suffixLen = 4;
+    }
+    if (coding == CODING_IDENTITY && isSegmentBody(len)) {  // small bodies share segment files
+        postSegment(stream, filePath, fileName, suffixLen, len, requestHeaders, responseHeaders);
+        return;
+    }
+    int tempFile = mkstemps(fileName, suffixLen);
+    if (tempFile < 0) {
+        releaseQuota(filePath, reserved);
+        sendStatusResponse(stream, Http_InternalServerError, NULL, responseHeaders);
+        return;
+    }
+    // the name is reserved; the body goes to the blob store, unless it is
+    // kept encoded: bodies that share a blob would share its recorded coding
+    bool keepEncoded = (coding != CODING_IDENTITY) && !inflating;
+    if (server.blob_store != NULL && !keepEncoded) {
+        close(tempFile);
+        postBlob(stream, filePath, fileName, len, inflating, reserved, requestHeaders, responseHeaders);
+        return;
+    }
+
+    if (storedLen > 0) {  // reserve space up front to fail before the body is sent
+        int err = preallocateFile(tempFile, (off_t)storedLen);
+        if (err == ENOSPC || err == EDQUOT || err == EFBIG) {
+            close(tempFile);
+            unlink(fileName);
+            releaseQuota(filePath, reserved);
+            sendStatusResponse(stream, Http_InsufficientStorage, NULL, responseHeaders);
+            return;
+        }
+    }
+    if (!sendContinue(stream, requestHeaders, responseHeaders)) {
+        close(tempFile);
+        unlink(fileName);
+        releaseQuota(filePath, reserved);
+        return;
     }
 
     putStream = fdopen(tempFile, "w");
-    if (len==-1) {
-        copyFromChunkedFileStreamBytes(stream, putStream);
+    long long copyStatus;
+    enum HttpCode copyError = Http_BadRequest;
+    if (storedLen==-1) {  // limits are checked as the body arrives
+        LimitSink limit;
+        initLimitSink(&limit, fileStreamSink, putStream, filePath, server.max_body_size);
+        bool bomb;
+        copyStatus = readDecodedBody(stream, len, inflating, server.max_inflate_ratio, limitSink, &limit, &bomb);
+        releaseQuota(filePath, limit.reserved - limit.total);  // keep only what was stored
+        reserved = limit.total;
+        copyError = (limit.tooLarge || bomb) ? Http_PayloadTooLarge
+                  : limit.noSpace ? Http_InsufficientStorage : Http_BadRequest;
     } else {
-        copyFileStreamBytes(stream, putStream,len);
+        copyStatus = spliceFileStreamBytes(stream, putStream, (size_t)len);
+    }
+    if (fflush(putStream) != 0) {
+        copyStatus = -1;
+        copyError = (errno == ENOSPC || errno == EDQUOT) ? Http_InsufficientStorage : Http_InternalServerError;
     }
+    // a body kept as sent is tagged with its coding
+    if (copyStatus >= 0 && keepEncoded && setFileCoding(tempFile, coding) != 0) {
+        copyStatus = -1;
+        copyError = Http_InternalServerError;
+    }
+    if (copyStatus < 0) {  // incomplete body
+        fclose(putStream);
+        unlink(fileName);
+        releaseQuota(filePath, reserved);
+        sendStatusResponse(stream, copyError, NULL, responseHeaders);
+        return;
+    }
+    invalidateStat(fileName);
+    invalidateListing(filePath);
+    int commitStatus = commitFiles(&tempFile, 1, filePath);
     fclose(putStream);
+    if (commitStatus != 0) {
+        sendStatusResponse(stream, Http_InternalServerError, NULL, responseHeaders);
+        return;
+    }
+    refreshPrecompressed(fileName);
+    putProperty(responseHeaders, "Content-Location", fileName);
     sendStatusResponse(stream, Http_Created, NULL, responseHeaders);
 }
 
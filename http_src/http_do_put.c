@@ -8,11 +8,14 @@
 */
 
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stddef.h>
 #include <string.h>
 #include "http_server.h"
 #include "http_do_put.h"
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/param.h>
 #include "http_util.h"
@@ -21,9 +24,195 @@
 #include "media_util.h"
 #include "properties.h"
 #include "string_util.h"
+#include "dir_util.h"
+#include "sync_util.h"
+#include "quota_util.h"
+#include "segment_util.h"
+#include "upload_util.h"
+#include "precompress_util.h"
+#include "statcache_util.h"
+#include "content_util.h"
+#include "mapcache_util.h"
+#include "http_body.h"
 
 
 
+/**
+ * Replace a file with a complete upload. The upload is renamed over
+ * the file in its directory opened beneath the content directory,
+ * keeping the mode of an existing file, and is made as durable as
+ * configured before it is acknowledged.
+ *
+ * @param fd the descriptor of the upload
+ * @param tempPath the path of the upload
+ * @param filePath the file path
+ * @param dirPath the directory of the file
+ * @return Http_Created or Http_OK if successful, Http_MethodNotAllowed
+ *   if the upload could not replace the file, or Http_InternalServerError
+ *   if it replaced the file but could not be made durable
+ */
+static enum HttpCode installUpload(int fd, const char *tempPath, const char *filePath, const char *dirPath) {
+    // keep mode of existing file, or the default mode of a new file
+    ContentDir *dir = acquireContentDir(dirPath);
+    if (dir == NULL) {
+        return Http_MethodNotAllowed;
+    }
+    char name[MAXPATHLEN];
+    getName(filePath, name);
+    enum HttpCode status;
+    struct stat sb;
+    off_t oldSize = 0;
+    if (fstatat(contentDirFd(dir), name, &sb, 0) != 0) {
+        status=Http_Created;
+        fchmod(fd, DEFFILEMODE & ~server.file_mask);
+    } else {
+        status=Http_OK;
+        fchmod(fd, sb.st_mode & ALLPERMS);
+        oldSize = S_ISREG(sb.st_mode) ? sb.st_size : 0;
+    }
+
+    // readers see the old or the new version, never a partial one
+    int renamed = renameat(AT_FDCWD, tempPath, contentDirFd(dir), name);
+    releaseContentDir(dir);
+    if (renamed != 0) {
+        return Http_MethodNotAllowed;
+    }
+    releaseQuota(filePath, (unsigned long long)oldSize);  // replaced version
+
+    // the file replaces a body in the segment store
+    unsigned long long segmentLen;
+    if (removeSegmentEntry(filePath, &segmentLen) == 0) {
+        releaseQuota(filePath, segmentLen);
+        status = Http_OK;
+    }
+    invalidateStat(filePath);
+    invalidateMappedFiles(filePath);
+    refreshPrecompressed(filePath);
+    invalidateListing(dirPath);
+
+    // acknowledge only once the upload is as durable as configured
+    if (commitFiles(&fd, 1, dirPath) != 0) {
+        return Http_InternalServerError;
+    }
+    return status;
+}
+
+/**
+ * Store one range of a resumable upload. The range is added to the
+ * staged upload of the file, and when the last range arrives the
+ * staged upload replaces the file. A range may start at or before
+ * the bytes received so far, which are reported in the Upload-Offset
+ * header of the response and of a HEAD request, so a client whose
+ * connection dropped resumes from there instead of starting over.
+ * A range whose total length differs from the staged upload is
+ * rejected with 409 Conflict.
+ *
+ * @param stream the socket stream
+ * @param filePath the file path
+ * @param dirPath the directory of the file
+ * @param len the body length or -1 if chunked
+ * @param first the first byte position of the range
+ * @param last the last byte position of the range
+ * @param total the length of the complete upload
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ */
+static void putRange(FILE *stream, const char *filePath, const char *dirPath, long long len,
+                     long long first, long long last, long long total,
+                     Properties *requestHeaders, Properties *responseHeaders) {
+    if (server.upload_dir == NULL || len != last - first + 1) {
+        sendStatusResponse(stream, Http_BadRequest, NULL, responseHeaders);
+        return;
+    }
+    StagedUpload upload;
+    int err = openStagedUpload(filePath, (off_t)total, &upload);
+    if (err != 0) {  // another request is adding to the upload
+        sendStatusResponse(stream, (err == EWOULDBLOCK) ? Http_Conflict : Http_InternalServerError,
+                           NULL, responseHeaders);
+        return;
+    }
+    char buf[MAXBUF];
+    if (upload.total != (off_t)total) {  // range of a different upload of the file
+        sprintf(buf, "%lld", (long long)upload.offset);
+        putProperty(responseHeaders, "Upload-Offset", buf);
+        closeStagedUpload(&upload);
+        sendStatusResponse(stream, Http_Conflict, NULL, responseHeaders);
+        return;
+    }
+    if (first > upload.offset) {  // client must resume from the bytes received
+        if (upload.offset == 0) {
+            unlink(upload.path);  // nothing was staged
+        }
+        sprintf(buf, "%lld", (long long)upload.offset);
+        putProperty(responseHeaders, "Upload-Offset", buf);
+        closeStagedUpload(&upload);
+        sendStatusResponse(stream, Http_RangeNotSatisfiable, NULL, responseHeaders);
+        return;
+    }
+
+    // bytes from the first position on are replaced by the range
+    if (!reserveQuota(filePath, (unsigned long long)len)) {
+        closeStagedUpload(&upload);
+        sendStatusResponse(stream, Http_PayloadTooLarge, NULL, responseHeaders);
+        return;
+    }
+    off_t discarded = upload.offset - (off_t)first;
+    if ((err = resumeStagedUpload(&upload, (off_t)first, (off_t)total)) != 0) {
+        closeStagedUpload(&upload);
+        releaseQuota(filePath, (unsigned long long)len);
+        sendStatusResponse(stream,
+                           (err == ENOSPC || err == EDQUOT || err == EFBIG)
+                               ? Http_InsufficientStorage : Http_InternalServerError,
+                           NULL, responseHeaders);
+        return;
+    }
+    releaseQuota(filePath, (unsigned long long)discarded);
+    if (!sendContinue(stream, requestHeaders, responseHeaders)) {
+        closeStagedUpload(&upload);
+        releaseQuota(filePath, (unsigned long long)len);
+        return;
+    }
+
+    // bytes that arrive before a dropped connection are kept
+    int fd = dup(upload.fd);
+    FILE *putStream = (fd < 0) ? NULL : fdopen(fd, "w");
+    enum HttpCode status = Http_BadRequest;
+    int copyStatus = -1;
+    if (putStream == NULL) {
+        status = Http_InternalServerError;
+        if (fd >= 0) {
+            close(fd);
+        }
+    } else {
+        copyStatus = spliceFileStreamBytes(stream, putStream, (size_t)len);
+        if (fflush(putStream) != 0) {
+            copyStatus = -1;
+            status = (errno == ENOSPC || errno == EDQUOT) ? Http_InsufficientStorage : Http_InternalServerError;
+        }
+        fclose(putStream);
+    }
+    struct stat sb;
+    off_t received = (fstat(upload.fd, &sb) == 0) ? sb.st_size : (off_t)first;
+    releaseQuota(filePath, (unsigned long long)(len - (received - first)));  // keep what was stored
+    sprintf(buf, "%lld", (long long)received);
+    putProperty(responseHeaders, "Upload-Offset", buf);
+
+    if (copyStatus == 0 && received < total) {
+        status = Http_NoContent;  // more ranges to come
+    } else if (copyStatus == 0 && received == total) {
+        status = installUpload(upload.fd, upload.path, filePath, dirPath);
+    } else if (copyStatus == 0) {
+        status = Http_InternalServerError;
+    }
+    closeStagedUpload(&upload);
+    if (status == Http_NoContent || status == Http_Created || status == Http_OK) {
+        sendResponseStatus(stream, status, NULL);
+        sendResponseHeaders(stream, responseHeaders);
+    } else {
+        sendStatusResponse(stream, status, NULL, responseHeaders);
+    }
+}
+
 /**
  *
  * @param stream HTTP socket stream
@@ -39,22 +228,23 @@ void do_put(FILE *stream, const char *uri, Properties *requestHeaders, Propertie
     enum HttpCode status;
     char buf[MAXBUF];
 
-    if (findProperty(requestHeaders, 0, "Content-Length", buf) == SIZE_MAX
-    && findProperty(requestHeaders, 0, "Transfer-Encoding", buf) == SIZE_MAX) {
-        sendStatusResponse(stream, Http_LengthRequired, NULL, responseHeaders);
+    long long len;  // -1 if chunked
+    int lenStatus = getRequestBodyLength(requestHeaders, &len);
+    if (lenStatus != Http_OK) {
+        sendStatusResponse(stream, lenStatus, NULL, responseHeaders);
         return;
     }
-    int len = atoi(buf);
-    if (findProperty(requestHeaders, 0, "Transfer-Encoding", buf) != SIZE_MAX)
-    {
-        if(strcmp(buf,"chunked")==0){
-            len=-1;
-            putProperty(responseHeaders, "Transfer-Encoding", "chunked");
-        }
-        else{
-            sendStatusResponse(stream, Http_MethodNotAllowed, NULL, responseHeaders);
-            return;
-        }
+    long long first, last, total;  // first is -1 if not a partial body
+    int rangeStatus = getRequestContentRange(requestHeaders, &first, &last, &total);
+    if (rangeStatus != Http_OK) {
+        sendStatusResponse(stream, rangeStatus, NULL, responseHeaders);
+        return;
+    }
+    ContentCoding coding;
+    int codingStatus = getRequestContentCoding(requestHeaders, &coding);
+    if (codingStatus != Http_OK) {
+        sendStatusResponse(stream, codingStatus, NULL, responseHeaders);
+        return;
     }
     getMediaType(filePath, buf);
 
@@ -67,34 +257,118 @@ void do_put(FILE *stream, const char *uri, Properties *requestHeaders, Propertie
         return;
     }
     putProperty(responseHeaders, "Location", filePath);
+    struct stat sb;
+    if (cachedStat(filePath, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+        sendStatusResponse(stream, Http_MethodNotAllowed, NULL, responseHeaders);
+        return;
+    }
 
 
     char path[MAXPATHLEN];
     getPath(filePath, path);
-    if (mkdirs(path, 0755) < 0) {
+    if (mkdirsContent(path, 0755) < 0) {
         sendStatusResponse(stream, Http_MethodNotAllowed, NULL, responseHeaders);
         return;
     }
 
+    // a range of a resumable upload is added to its staged file;
+    // a range of an encoded body cannot be decoded on its own
+    if (first >= 0 && coding != CODING_IDENTITY) {
+        sendStatusResponse(stream, Http_UnsupportedMediaType, NULL, responseHeaders);
+        return;
+    } else if (first >= 0) {
+        putRange(stream, filePath, path, len, first, last, total, requestHeaders, responseHeaders);
+        return;
+    }
 
-    struct stat sb;
-    if (stat(filePath, &sb) != 0) {
-        status=Http_Created;
-    } else {
-        status=Http_OK;
+
+    // an encoded body is decoded unless kept as sent; its decoded length is not known
+    bool inflating = (coding != CODING_IDENTITY) && !server.keep_encoded_uploads;
+    long long storedLen = inflating ? -1 : len;
+
+    // a body of known length must fit the directory quotas
+    unsigned long long reserved = (storedLen > 0) ? (unsigned long long)storedLen : 0;
+    if (!reserveQuota(filePath, reserved)) {
+        sendStatusResponse(stream, Http_PayloadTooLarge, NULL, responseHeaders);
+        return;
     }
-    sendResponseStatus(stream,status,NULL);
 
-    putStream = fopen(filePath, "w");
-    if (len==-1) {
-        copyFromChunkedFileStreamBytes(stream, putStream);
+    // write body to a temp file in the target directory
+    char tempPath[MAXPATHLEN];
+    int tempFd = createTempFile(filePath, tempPath);
+    if (tempFd < 0) {
+        releaseQuota(filePath, reserved);
+        sendStatusResponse(stream, Http_InternalServerError, NULL, responseHeaders);
+        return;
+    }
+    if (storedLen > 0) {  // reserve space up front to fail early and limit fragmentation
+        int err = preallocateFile(tempFd, (off_t)storedLen);
+        if (err == ENOSPC || err == EDQUOT || err == EFBIG) {
+            close(tempFd);
+            unlink(tempPath);
+            releaseQuota(filePath, reserved);
+            sendStatusResponse(stream, Http_InsufficientStorage, NULL, responseHeaders);
+            return;
+        }
+    }
+
+    // the upload will be accepted: ask the client for the body
+    if (!sendContinue(stream, requestHeaders, responseHeaders)) {
+        close(tempFd);
+        unlink(tempPath);
+        releaseQuota(filePath, reserved);
+        return;
+    }
+    putStream = fdopen(tempFd, "w");
+    if (putStream == NULL) {
+        close(tempFd);
+        unlink(tempPath);
+        releaseQuota(filePath, reserved);
+        sendStatusResponse(stream, Http_InternalServerError, NULL, responseHeaders);
+        return;
+    }
+    long long copyStatus;
+    enum HttpCode copyError = Http_BadRequest;
+    if (storedLen==-1) {  // limits are checked as the body arrives
+        LimitSink limit;
+        initLimitSink(&limit, fileStreamSink, putStream, filePath, server.max_body_size);
+        bool bomb;
+        copyStatus = readDecodedBody(stream, len, inflating, server.max_inflate_ratio, limitSink, &limit, &bomb);
+        releaseQuota(filePath, limit.reserved - limit.total);  // keep only what was stored
+        reserved = limit.total;
+        copyError = (limit.tooLarge || bomb) ? Http_PayloadTooLarge
+                  : limit.noSpace ? Http_InsufficientStorage : Http_BadRequest;
     }
     else {
-        copyFileStreamBytes(stream, putStream,len);
+        copyStatus = spliceFileStreamBytes(stream, putStream, (size_t)len);
+    }
+    if (fflush(putStream) != 0) {
+        copyStatus = -1;
+        copyError = (errno == ENOSPC || errno == EDQUOT) ? Http_InsufficientStorage : Http_InternalServerError;
     }
 
+    // a body kept as sent is tagged with its coding
+    if (copyStatus >= 0 && !inflating && setFileCoding(tempFd, coding) != 0) {
+        copyStatus = -1;
+        copyError = Http_InternalServerError;
+    }
+    if (copyStatus < 0) {
+        fclose(putStream);
+        unlink(tempPath);  // old version is untouched
+        releaseQuota(filePath, reserved);
+        sendStatusResponse(stream, copyError, NULL, responseHeaders);
+        return;
+    }
+    status = installUpload(tempFd, tempPath, filePath, path);
+    if (status == Http_MethodNotAllowed) {
+        unlink(tempPath);
+        releaseQuota(filePath, reserved);
+    }
     fclose(putStream);
+    if (status != Http_Created && status != Http_OK) {
+        sendStatusResponse(stream, status, NULL, responseHeaders);
+        return;
+    }
+    sendResponseStatus(stream,status,NULL);
     sendResponseHeaders(stream, responseHeaders);
 }
-
-
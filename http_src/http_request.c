@@ -7,6 +7,7 @@
  *  @author: Philip Gust
  */
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -25,23 +26,111 @@
 #include "properties.h"
 #include "string_util.h"
 #include "file_util.h"
+#include "content_util.h"
+#include "mapcache_util.h"
 #include "http_do_put.h"
+/** A parsed request waiting to be dispatched to a method handler */
+typedef struct Request {
+	int sock_fd;                    /** the socket descriptor */
+	FILE *stream;                   /** the socket stream */
+	char method[MAXBUF];            /** the request method */
+	char uri[MAXBUF];               /** the decoded request URI */
+	Properties *requestHeaders;     /** the request headers */
+	Properties *responseHeaders;    /** the response headers */
+} Request;
+
+/**
+ * Close the request socket stream and free the request.
+ *
+ * @param req the request
+ */
+static void close_request(Request *req) {
+	// delete headers
+	if (req->requestHeaders != NULL) {
+		deleteProperties(req->requestHeaders);
+	}
+	deleteProperties(req->responseHeaders);
+
+	// close socket stream; also closes the socket
+	fflush(req->stream);
+	releaseMappedSends(fileno(req->stream));
+	fclose(req->stream);
+	free(req);
+}
+
+/**
+ * Determines whether a request is long-running and should be
+ * processed in the bulk lane of the thread pool: uploads with
+ * a body larger than the bulk threshold or of unknown length,
+ * and directory listings.
+ *
+ * @param req the request
+ * @return true if request belongs in the bulk lane
+ */
+static bool is_bulk_request(Request *req) {
+	if (strcasecmp(req->method, "PUT") == 0 || strcasecmp(req->method, "POST") == 0) {
+		char buf[MAX_PROP_VAL];
+		if (findProperty(req->requestHeaders, 0, "Transfer-Encoding", buf) != SIZE_MAX) {
+			return true;  // length not known in advance
+		}
+		if (findProperty(req->requestHeaders, 0, "Content-Length", buf) != SIZE_MAX) {
+			return strtoull(buf, NULL, 10) > server.bulk_threshold;
+		}
+		return false;
+	}
+	if (strcasecmp(req->method, "GET") == 0) {
+		return strendswith(req->uri, "/");  // directory listing
+	}
+	return false;
+}
+
+/**
+ * Dispatch a parsed request to its method handler,
+ * then close the request.
+ *
+ * @param arg the request
+ */
+static void dispatch_request(void *arg) {
+	Request *req = arg;
+	FILE *stream = req->stream;
+	const char *method = req->method;
+	const char *uri = req->uri;
+	Properties *requestHeaders = req->requestHeaders;
+	Properties *responseHeaders = req->responseHeaders;
+
+    // dispatch based on method
+    if (strcasecmp(method, "GET") == 0) {
+        do_get(stream, uri, requestHeaders, responseHeaders);
+    } else 	if (strcasecmp(method, "HEAD") == 0) {
+        do_head(stream, uri, requestHeaders, responseHeaders);
+    } else if (strcasecmp(method, "DELETE") == 0) {
+        do_delete(stream, uri, requestHeaders, responseHeaders);
+    } else if (strcasecmp(method, "PUT") == 0) {
+        do_put(stream, uri, requestHeaders, responseHeaders);
+    }else if (strcasecmp(method, "POST") == 0) {
+        do_post(stream, uri, requestHeaders, responseHeaders);
+    } else {
+        sendStatusResponse(stream, Http_NotImplemented, NULL, responseHeaders);
+    }
+
+	close_request(req);
+}
+
 /**
  *  Process an http request.
  *  @param sock_fd the socket descriptor
  */
-
 void process_request(int sock_fd) {
 	char buf[MAXBUF];
 	char request[MAXBUF];
-	char method[MAXBUF];
-	char uri[MAXBUF], encUri[MAXBUF];
+	char encUri[MAXBUF];
 	char version[MAXBUF];
 
 	// open socket aFILE *stream
 	FILE *stream = fdopen(sock_fd, "r+");
 	if (stream == NULL) {
 		perror("fdopen");
+		close(sock_fd);
 		return;
 	}
 	// turn off buffering to also allow direct use of socket
@@ -49,13 +138,23 @@ void process_request(int sock_fd) {
 
 	// get header line
 	if (fgets(request, MAXBUF, stream) == NULL) {
+		fclose(stream);
 		return;
 	}
 	// eliminate newline from request
 	trim_newline(request);
 
+	Request *req = calloc(1, sizeof(Request));
+	if (req == NULL) {
+		fclose(stream);
+		return;
+	}
+	req->sock_fd = sock_fd;
+	req->stream = stream;
+
 	// initialize request headers
 	Properties *responseHeaders = newProperties();
+	req->responseHeaders = responseHeaders;
 	// name of server
 	putProperty(responseHeaders, "Server", server.server_name);
 
@@ -67,16 +166,18 @@ void process_request(int sock_fd) {
 
 
 	// parse header
-	if (sscanf(request, "%s %s %s", method, encUri, version) != 3) {
+	if (sscanf(request, "%s %s %s", req->method, encUri, version) != 3) {
 		if (server.debug) {
 			fprintf(stderr, "request header incomplete: %s\n", request);
 		}
 		sendStatusResponse(stream, Http_BadRequest, NULL, responseHeaders);
+		close_request(req);
 		return;
 	}
 
 	// initialize request headers
 	Properties *requestHeaders = newProperties();
+	req->requestHeaders = requestHeaders;
 	readRequestHeaders(stream, requestHeaders);
 	if (server.debug) {
 		debugRequest(request, requestHeaders);
@@ -90,42 +191,46 @@ void process_request(int sock_fd) {
 	}
 
 	// unescape URI
-	if (unescapeUri(encUri, uri) == NULL) {
+	if (unescapeUri(encUri, req->uri) == NULL) {
 		if (server.debug) {
 			fprintf(stderr, "request header invalid URI encoding %s\n", request);
 		}
 		sendStatusResponse(stream, Http_BadRequest, NULL, responseHeaders);
+		close_request(req);
 		return;
 	}
 
-    // dispatch based on method
-    // what method should be for list directory
-    if (strcasecmp(method, "GET") == 0) {
-        do_get(stream, uri, requestHeaders, responseHeaders);
-    } else 	if (strcasecmp(method, "HEAD") == 0) {
-        do_head(stream, uri, requestHeaders, responseHeaders);
-    } else if (strcasecmp(method, "DELETE") == 0) {
-        do_delete(stream, uri, requestHeaders, responseHeaders);
-    } else if (strcasecmp(method, "PUT") == 0) {
-        do_put(stream, uri, requestHeaders, responseHeaders);
-    }else if (strcasecmp(method, "POST") == 0) {
-        do_post(stream, uri, requestHeaders, responseHeaders);
-    } else {
-        sendStatusResponse(stream, Http_NotImplemented, NULL, responseHeaders);
-    }
+	// a path that leaves the content directory is never resolved
+	if (!isContentUri(req->uri)) {
+		if (server.debug) {
+			fprintf(stderr, "request header URI outside content %s\n", request);
+		}
+		sendStatusResponse(stream, Http_BadRequest, NULL, responseHeaders);
+		close_request(req);
+		return;
+	}
 
-	// delete headers
-	deleteProperties(requestHeaders);
-	deleteProperties(responseHeaders);
+	// hidden names are reserved for files the server is writing
+	if (isHiddenUri(req->uri)) {
+		sendStatusResponse(stream, Http_NotFound, NULL, responseHeaders);
+		close_request(req);
+		return;
+	}
 
-	// close socket stream
-	fflush(stream);
-	fclose(stream);
-	close(sock_fd);
+	// hand long-running requests to the bulk lane so they
+	// do not hold the threads that serve small requests
+	if (   (server.thpool != NULL)
+		&& is_bulk_request(req)
+		&& (thpool_add_work_prio(server.thpool, dispatch_request, req, THPOOL_PRIO_LOW) == 0)) {
+		return;
+	}
+	dispatch_request(req);
 }
 
+/**
+ * Thread pool job that processes an http request.
+ * @param sock_fd the pointer-encoded socket descriptor
+ */
 void process_request_helper(void* sock_fd) {
-    int a = (int)sock_fd;
-    process_request(sock_fd);
+    process_request((int)(intptr_t)sock_fd);
 }
-
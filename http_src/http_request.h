@@ -15,6 +15,11 @@
  *  @param sock_fd the socket descriptor
  */
 void process_request(int sock_fd);
+
+/**
+ * Thread pool job that processes an http request.
+ * @param sock_fd the pointer-encoded socket descriptor
+ */
 void process_request_helper(void* sock_fd);
 
 #endif /* HTTP_REQUEST_H_ */
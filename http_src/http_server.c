@@ -14,6 +14,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <pthread.h>
+#include <signal.h>
 
 #include "file_util.h"
 #include "time_util.h"
@@ -23,9 +24,37 @@
 #include "http_server.h"
 #include "media_util.h"
 #include "thpool.h"
+#include "quota_util.h"
+#include "blob_util.h"
+#include "trash_util.h"
+#include "segment_util.h"
+#include "statcache_util.h"
+#include "content_util.h"
+#include "mapcache_util.h"
+#include "upload_util.h"
+#include "compress_util.h"
+#include "precompress_util.h"
 
 
 #define DEFAULT_HTTP_PORT 8080
+#define DEFAULT_NUM_THREADS 4
+#define DEFAULT_RESERVED_THREADS 1
+#define DEFAULT_BULK_THRESHOLD (1024*1024)
+#define DEFAULT_LISTING_CACHE_SIZE (16*1024*1024)
+#define DEFAULT_CHUNK_SIZE (64*1024)
+#define DEFAULT_STAT_CACHE_SIZE 32768
+#define DEFAULT_STAT_CACHE_TTL 5000
+#define DEFAULT_STAT_CACHE_NEGATIVE_TTL 1000
+#define DEFAULT_MAP_CACHE_SIZE 0
+#define DEFAULT_MAP_MIN_FILE_SIZE (64*1024)
+#define DEFAULT_MAP_MAX_FILE_SIZE (4*1024*1024)
+#define DEFAULT_GROUP_COMMIT_WINDOW 0
+#define DEFAULT_SEGMENT_SIZE (64*1024*1024)
+#define DEFAULT_SEGMENT_MAX_BODY (64*1024)
+#define DEFAULT_COMPRESS_TYPES "text/* application/json application/x-ndjson application/javascript application/xml image/svg+xml"
+#define DEFAULT_COMPRESS_LEVEL 6
+#define DEFAULT_COMPRESS_MIN_SIZE 1024
+#define DEFAULT_MAX_INFLATE_RATIO 100
 
 /** http server configuration */
 struct http_server_conf server;
@@ -95,11 +124,312 @@ static bool process_config(const char* configFileName) {
 			}
 		}
 
+		// initialize the request thread pool size
+		server.num_threads = DEFAULT_NUM_THREADS;
+		char threadsProp[MAX_PROP_VAL];
+		if (findProperty(httpConfig, 0, "Threads", threadsProp) != SIZE_MAX) {
+			if (   (sscanf(threadsProp, "%d", &server.num_threads) != 1)
+				|| (server.num_threads < 1)) {
+				fprintf(stderr, "Invalid threads %s\n", threadsProp);
+				status = false;
+				break;
+			}
+		}
+
+		// threads reserved for small requests while bulk transfers run
+		server.reserved_threads = DEFAULT_RESERVED_THREADS;
+		char reservedProp[MAX_PROP_VAL];
+		if (findProperty(httpConfig, 0, "ReservedThreads", reservedProp) != SIZE_MAX) {
+			if (   (sscanf(reservedProp, "%d", &server.reserved_threads) != 1)
+				|| (server.reserved_threads < 0)
+				|| (server.reserved_threads >= server.num_threads)) {
+				fprintf(stderr, "Invalid reserved threads %s\n", reservedProp);
+				status = false;
+				break;
+			}
+		}
+
+		// request bodies larger than this are processed in the bulk lane
+		server.bulk_threshold = DEFAULT_BULK_THRESHOLD;
+		char bulkProp[MAX_PROP_VAL];
+		if (findProperty(httpConfig, 0, "BulkThreshold", bulkProp) != SIZE_MAX) {
+			if (sscanf(bulkProp, "%zu", &server.bulk_threshold) != 1) {
+				fprintf(stderr, "Invalid bulk threshold %s\n", bulkProp);
+				status = false;
+				break;
+			}
+		}
+
+		// total size of cached directory listings; 0 disables the cache
+		server.listing_cache_size = DEFAULT_LISTING_CACHE_SIZE;
+		char listingCacheProp[MAX_PROP_VAL];
+		if (findProperty(httpConfig, 0, "ListingCacheSize", listingCacheProp) != SIZE_MAX) {
+			if (sscanf(listingCacheProp, "%zu", &server.listing_cache_size) != 1) {
+				fprintf(stderr, "Invalid listing cache size %s\n", listingCacheProp);
+				status = false;
+				break;
+			}
+		}
+
+		// cached stat() results of found and missing content paths
+		size_t statCacheSize = DEFAULT_STAT_CACHE_SIZE;
+		unsigned statCacheTtl = DEFAULT_STAT_CACHE_TTL;
+		unsigned statCacheNegativeTtl = DEFAULT_STAT_CACHE_NEGATIVE_TTL;
+		char statCacheProp[MAX_PROP_VAL];
+		if (   (findProperty(httpConfig, 0, "StatCacheSize", statCacheProp) != SIZE_MAX)
+			&& (sscanf(statCacheProp, "%zu", &statCacheSize) != 1)) {
+			fprintf(stderr, "Invalid stat cache size %s\n", statCacheProp);
+			status = false;
+			break;
+		}
+		if (   (findProperty(httpConfig, 0, "StatCacheTTL", statCacheProp) != SIZE_MAX)
+			&& (sscanf(statCacheProp, "%u", &statCacheTtl) != 1)) {
+			fprintf(stderr, "Invalid stat cache TTL %s\n", statCacheProp);
+			status = false;
+			break;
+		}
+		if (   (findProperty(httpConfig, 0, "StatCacheNegativeTTL", statCacheProp) != SIZE_MAX)
+			&& (sscanf(statCacheProp, "%u", &statCacheNegativeTtl) != 1)) {
+			fprintf(stderr, "Invalid stat cache negative TTL %s\n", statCacheProp);
+			status = false;
+			break;
+		}
+		if (!initStatCache(statCacheSize, statCacheTtl, statCacheNegativeTtl)) {
+			fprintf(stderr, "Stat cache not used\n");
+		}
+		// without watching, changes made outside the server are seen when entries expire
+		strcpy(statCacheProp, "true");
+		findProperty(httpConfig, 0, "StatCacheWatch", statCacheProp);
+		if (   (statCacheSize > 0) && (strcasecmp(statCacheProp, "true") == 0)
+			&& !watchStatCache()) {
+			fprintf(stderr, "Stat cache not watching content changes\n");
+		}
+
+		// mid-sized files kept mapped and sent from their mappings
+		size_t mapCacheSize = DEFAULT_MAP_CACHE_SIZE;
+		size_t mapMinFileSize = DEFAULT_MAP_MIN_FILE_SIZE;
+		size_t mapMaxFileSize = DEFAULT_MAP_MAX_FILE_SIZE;
+		char mapCacheProp[MAX_PROP_VAL];
+		if (   (findProperty(httpConfig, 0, "MapCacheSize", mapCacheProp) != SIZE_MAX)
+			&& (sscanf(mapCacheProp, "%zu", &mapCacheSize) != 1)) {
+			fprintf(stderr, "Invalid map cache size %s\n", mapCacheProp);
+			status = false;
+			break;
+		}
+		if (   (findProperty(httpConfig, 0, "MapMinFileSize", mapCacheProp) != SIZE_MAX)
+			&& (sscanf(mapCacheProp, "%zu", &mapMinFileSize) != 1)) {
+			fprintf(stderr, "Invalid map min file size %s\n", mapCacheProp);
+			status = false;
+			break;
+		}
+		if (   (findProperty(httpConfig, 0, "MapMaxFileSize", mapCacheProp) != SIZE_MAX)
+			&& (sscanf(mapCacheProp, "%zu", &mapMaxFileSize) != 1)) {
+			fprintf(stderr, "Invalid map max file size %s\n", mapCacheProp);
+			status = false;
+			break;
+		}
+		// zero copy pays off for large sends to a network device
+		strcpy(mapCacheProp, "true");
+		findProperty(httpConfig, 0, "ZeroCopy", mapCacheProp);
+		if (   !initMapCache(mapCacheSize, mapMinFileSize, mapMaxFileSize, strcasecmp(mapCacheProp, "true") == 0)
+			&& (mapCacheSize > 0)) {
+			fprintf(stderr, "Map cache not used\n");
+		}
+
+		// bytes sent in each chunk of a chunked response
+		server.chunk_size = DEFAULT_CHUNK_SIZE;
+		char chunkSizeProp[MAX_PROP_VAL];
+		if (findProperty(httpConfig, 0, "ChunkSize", chunkSizeProp) != SIZE_MAX) {
+			if (   (sscanf(chunkSizeProp, "%zu", &server.chunk_size) != 1)
+				|| (server.chunk_size == 0)) {
+				fprintf(stderr, "Invalid chunk size %s\n", chunkSizeProp);
+				status = false;
+				break;
+			}
+		}
+
+		// largest request body accepted; 0 for no limit
+		server.max_body_size = 0;
+		char maxBodyProp[MAX_PROP_VAL];
+		if (findProperty(httpConfig, 0, "MaxBodySize", maxBodyProp) != SIZE_MAX) {
+			if (sscanf(maxBodyProp, "%llu", &server.max_body_size) != 1) {
+				fprintf(stderr, "Invalid max body size %s\n", maxBodyProp);
+				status = false;
+				break;
+			}
+		}
+
+		// how uploads are made durable before they are acknowledged
+		server.durability = DURABILITY_NONE;
+		char durabilityProp[MAX_PROP_VAL];
+		if (findProperty(httpConfig, 0, "Durability", durabilityProp) != SIZE_MAX) {
+			if (!parseDurability(durabilityProp, &server.durability)) {
+				fprintf(stderr, "Invalid durability %s\n", durabilityProp);
+				status = false;
+				break;
+			}
+		}
+
+		// time a group commit waits for more uploads to join the batch
+		server.group_commit_window = DEFAULT_GROUP_COMMIT_WINDOW;
+		char windowProp[MAX_PROP_VAL];
+		if (findProperty(httpConfig, 0, "GroupCommitWindow", windowProp) != SIZE_MAX) {
+			if (   (sscanf(windowProp, "%ld", &server.group_commit_window) != 1)
+				|| (server.group_commit_window < 0)) {
+				fprintf(stderr, "Invalid group commit window %s\n", windowProp);
+				status = false;
+				break;
+			}
+		}
+
+		// mode bits that new files are created without
+		server.file_mask = umask(0);
+		umask(server.file_mask);
+
 		// set content base property if specified or use default "content"
 		static char contentBaseProp[MAX_PROP_VAL] = "content";
 		server.content_base = contentBaseProp;
 		findProperty(httpConfig, 0, "ContentBase", contentBaseProp);
 
+		// request paths are opened beneath the content directory
+		if (!initContentRoot(server.content_base)) {
+			fprintf(stderr, "Invalid content base %s\n", server.content_base);
+			status = false;
+			break;
+		}
+
+		// quotas on content directories: "<uri path> <bytes>"
+		char quotaProp[MAX_PROP_VAL];
+		for (size_t i = 0; (i = findProperty(httpConfig, i, "DirectoryQuota", quotaProp)) != SIZE_MAX; i++) {
+			char quotaUri[MAX_PROP_VAL], quotaPath[PATH_MAX];
+			unsigned long long quotaLimit;
+			if (   (sscanf(quotaProp, "%s %llu", quotaUri, &quotaLimit) != 2)
+				|| (strlen(server.content_base) + strlen(quotaUri) >= sizeof(quotaPath))
+				|| !addDirectoryQuota(strcat(strcpy(quotaPath, server.content_base), quotaUri), quotaLimit)) {
+				fprintf(stderr, "Invalid directory quota %s\n", quotaProp);
+				status = false;
+				break;
+			}
+		}
+		if (!status) {
+			break;
+		}
+
+		// content-addressed store of POST bodies; empty to disable
+		static char blobStoreProp[MAX_PROP_VAL] = "blobs";
+		findProperty(httpConfig, 0, "BlobStore", blobStoreProp);
+		server.blob_store = NULL;
+		if (*blobStoreProp != '\0') {
+			if (initBlobStore(blobStoreProp, server.content_base)) {
+				server.blob_store = blobStoreProp;
+			} else {
+				fprintf(stderr, "Blob store %s not used: not a directory on the content file system\n", blobStoreProp);
+			}
+		}
+
+		// log-structured store for small POST bodies; empty to disable
+		static char segmentStoreProp[MAX_PROP_VAL] = "";
+		findProperty(httpConfig, 0, "SegmentStore", segmentStoreProp);
+		if (*segmentStoreProp != '\0') {
+			size_t segmentSize = DEFAULT_SEGMENT_SIZE, segmentMaxBody = DEFAULT_SEGMENT_MAX_BODY;
+			char segmentProp[MAX_PROP_VAL];
+			if (   (findProperty(httpConfig, 0, "SegmentSize", segmentProp) != SIZE_MAX)
+				&& (sscanf(segmentProp, "%zu", &segmentSize) != 1)) {
+				fprintf(stderr, "Invalid segment size %s\n", segmentProp);
+				status = false;
+				break;
+			}
+			if (   (findProperty(httpConfig, 0, "SegmentMaxBody", segmentProp) != SIZE_MAX)
+				&& (sscanf(segmentProp, "%zu", &segmentMaxBody) != 1)) {
+				fprintf(stderr, "Invalid segment max body %s\n", segmentProp);
+				status = false;
+				break;
+			}
+			if (!initSegmentStore(segmentStoreProp, segmentSize, segmentMaxBody)) {
+				fprintf(stderr, "Segment store %s not used\n", segmentStoreProp);
+			}
+		}
+
+		// directory where deleted trees wait to be reclaimed; empty to disable
+		static char trashDirProp[MAX_PROP_VAL] = "trash";
+		findProperty(httpConfig, 0, "TrashDir", trashDirProp);
+		server.trash_dir = NULL;
+		if (*trashDirProp != '\0') {
+			if (initTrash(trashDirProp, server.content_base)) {
+				server.trash_dir = trashDirProp;
+			} else {
+				fprintf(stderr, "Trash %s not used: not a directory on the content file system\n", trashDirProp);
+			}
+		}
+
+		// directory where resumable uploads are staged; empty to disable
+		static char uploadDirProp[MAX_PROP_VAL] = "uploads";
+		findProperty(httpConfig, 0, "UploadDir", uploadDirProp);
+		server.upload_dir = NULL;
+		if (*uploadDirProp != '\0') {
+			if (initUploadDir(uploadDirProp, server.content_base)) {
+				server.upload_dir = uploadDirProp;
+			} else {
+				fprintf(stderr, "Upload directory %s not used: not a directory on the content file system\n", uploadDirProp);
+			}
+		}
+
+		// media types compressed on the fly; empty to disable
+		char compressTypesProp[MAX_PROP_VAL] = DEFAULT_COMPRESS_TYPES;
+		findProperty(httpConfig, 0, "CompressTypes", compressTypesProp);
+		int compressLevel = DEFAULT_COMPRESS_LEVEL;
+		size_t compressMinSize = DEFAULT_COMPRESS_MIN_SIZE;
+		char compressProp[MAX_PROP_VAL];
+		if (   (findProperty(httpConfig, 0, "CompressLevel", compressProp) != SIZE_MAX)
+			&& (sscanf(compressProp, "%d", &compressLevel) != 1)) {
+			fprintf(stderr, "Invalid compress level %s\n", compressProp);
+			status = false;
+			break;
+		}
+		if (   (findProperty(httpConfig, 0, "CompressMinSize", compressProp) != SIZE_MAX)
+			&& (sscanf(compressProp, "%zu", &compressMinSize) != 1)) {
+			fprintf(stderr, "Invalid compress min size %s\n", compressProp);
+			status = false;
+			break;
+		}
+		if (!initCompression(compressTypesProp, compressLevel, compressMinSize)) {
+			fprintf(stderr, "Invalid compression settings\n");
+			status = false;
+			break;
+		}
+
+		// keep gzip copies of compressible files, made in the background
+		char precompressProp[MAX_PROP_VAL] = "false";
+		findProperty(httpConfig, 0, "Precompress", precompressProp);
+		if (   (strcasecmp(precompressProp, "true") == 0)
+			&& !initPrecompress(server.content_base)) {
+			fprintf(stderr, "Precompressor not started\n");
+		}
+
+		// gzip or deflate encoded uploads are decoded, or kept as sent
+		// with their coding recorded in an extended attribute
+		server.keep_encoded_uploads = false;
+		char encodedProp[MAX_PROP_VAL];
+		if (findProperty(httpConfig, 0, "EncodedUploads", encodedProp) != SIZE_MAX) {
+			if (strcasecmp(encodedProp, "keep") == 0) {
+				server.keep_encoded_uploads = supportsFileCoding(server.content_base);
+				if (!server.keep_encoded_uploads) {
+					fprintf(stderr, "Encoded uploads decoded: no extended attributes in %s\n", server.content_base);
+				}
+			} else if (strcasecmp(encodedProp, "decode") != 0) {
+				fprintf(stderr, "Invalid encoded uploads %s\n", encodedProp);
+				status = false;
+				break;
+			}
+		}
+		server.max_inflate_ratio = DEFAULT_MAX_INFLATE_RATIO;
+		if (   (findProperty(httpConfig, 0, "MaxInflateRatio", encodedProp) != SIZE_MAX)
+			&& (sscanf(encodedProp, "%u", &server.max_inflate_ratio) != 1)) {
+			fprintf(stderr, "Invalid max inflate ratio %s\n", encodedProp);
+			status = false;
+			break;
+		}
+
 		// set server host property or use default "localhost"
 		static char serverHostProp[MAX_PROP_VAL] = "localhost";
 		server.server_host = serverHostProp;
@@ -142,6 +472,10 @@ int main(int argc, char* argv[argc]) {
 		return EXIT_FAILURE;
 	}
 
+    // clients may close before reading a response, such as after
+    // a rejected 100-continue upload; report EPIPE instead of exiting
+    signal(SIGPIPE, SIG_IGN);
+
     // create listener socket for server with specified port
     int listen_sock_fd = get_listener_socket(server.server_port);
 	if (listen_sock_fd == -1) {
@@ -153,8 +487,14 @@ int main(int argc, char* argv[argc]) {
 		fprintf(stderr, "HttpServer running on port %d\n", server.server_port);
 	}
 
-    // init the thread pool
-    threadpool thpool = thpool_init(4);
+    // init the thread pool with threads reserved for small requests
+    threadpool thpool = thpool_init(server.num_threads);
+    if (thpool == NULL) {
+        close(listen_sock_fd);
+        return EXIT_FAILURE;
+    }
+    thpool_set_reserved(thpool, server.reserved_threads);
+    server.thpool = thpool;
 
 	while (true) {
         // accept client connection
@@ -181,7 +521,7 @@ int main(int argc, char* argv[argc]) {
             }
         }
 
-		// handle request
+		// handle request; starts in the high priority lane
         thpool_add_work(thpool, process_request_helper, (void *)(intptr_t)peer_socket_fd);
     }
 	 thpool_destroy(thpool);
@@ -11,7 +11,11 @@
 #define HTTP_SERVER_H_
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
 #include "properties.h"
+#include "sync_util.h"
+#include "thpool.h"
 
 /** maximum buffer size */
 #define MAXBUF 256
@@ -38,6 +42,51 @@ struct http_server_conf {
 
 	/** http response protocol */
 	const char* server_protocol;
+
+	/** number of request threads */
+	int num_threads;
+
+	/** threads reserved for small requests */
+	int reserved_threads;
+
+	/** body size above which a request moves to the bulk lane */
+	size_t bulk_threshold;
+
+	/** bytes buffered for each chunk of a chunked response */
+	size_t chunk_size;
+
+	/** maximum bytes of cached directory listings */
+	size_t listing_cache_size;
+
+	/** maximum bytes of a request body or 0 if none */
+	unsigned long long max_body_size;
+
+	/** true to store gzip or deflate encoded uploads as sent */
+	bool keep_encoded_uploads;
+
+	/** maximum ratio of decoded to encoded bytes of an upload or 0 if none */
+	unsigned max_inflate_ratio;
+
+	/** blob store directory or NULL if uploads are not deduplicated */
+	const char *blob_store;
+
+	/** trash directory or NULL if directory trees cannot be deleted */
+	const char *trash_dir;
+
+	/** directory of staged uploads or NULL if uploads cannot be resumed */
+	const char *upload_dir;
+
+	/** how uploads are made durable before they are acknowledged */
+	Durability durability;
+
+	/** microseconds a group commit waits for more uploads */
+	long group_commit_window;
+
+	/** file mode creation mask of the process */
+	mode_t file_mask;
+
+	/** request thread pool */
+	threadpool thpool;
 };
 
 /**  external declaration of server config */
@@ -7,10 +7,18 @@
  *  @author: Philip Gust
  */
 
+#define _GNU_SOURCE  /* for fopencookie() */
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include "properties.h"
 #include "file_util.h"
+#include "http_body.h"
+#include "compress_util.h"
 #include "string_util.h"
 #include "http_codes.h"
 #include "http_server.h"
@@ -215,46 +223,300 @@ void decodeQuery(const char *query, Properties *queryProps) {
 
 /**
  * Copy bytes from HTTP 1.1 chunked transfer-encoded
- * input stream to output stream.
+ * input stream to output stream. Chunk extensions are
+ * ignored and trailer fields are discarded.
  * See:
- * https://gist.github.com/CMCDragonkai/6bfade6431e9ffb7fe88
- * https://en.wikipedia.org/wiki/List_of_HTTP_header_fields
  * https://en.wikipedia.org/wiki/Chunked_transfer_encoding
  *
  * @param istream the chunk transfer-encoded input stream
  * @param ostream the output stream
  * @param return number of bytes copied or -1 if error
  */
-int copyFromChunkedFileStreamBytes(FILE *istream, FILE *ostream) {
-    char buf[MAXBUF];  // buffer for reading lines
-    int nbytes = 0; // number of bytes copied
-    int chunk_len; // length of next chunk
-
-    do { // copy next chunk
-        // get chunk length from first line
-        // note: ignores chunk extensions, where chunk length
-        // is delimited by ';' and extension name=value pairs,
-        // each delimited by ';' see
-        // https://www.wikipedia.org/Chunked_transfer_encoding
-        if (   (fgets(buf, MAXBUF, istream) == NULL)
-               || (sscanf(buf, "%x", &chunk_len) != 1)
-               || (chunk_len < 0)) {
-            return -1; // missing or invalid negative chunk_len
+long long copyFromChunkedFileStreamBytes(FILE *istream, FILE *ostream) {
+    return decodeChunkedStream(istream, fileStreamSink, ostream, NULL);
+}
+
+/**
+ * Determines whether an If-None-Match request header matches
+ * an entity tag. The header is a list of quoted entity tags,
+ * optionally weak ("W/"), or "*" to match any entity tag.
+ *
+ * @param requestHeaders the request headers
+ * @param etag the quoted entity tag
+ * @return true if the header is present and matches
+ */
+bool matchesIfNoneMatch(Properties *requestHeaders, const char *etag) {
+    char buf[MAX_PROP_VAL];
+    if (findProperty(requestHeaders, 0, "If-None-Match", buf) == SIZE_MAX) {
+        return false;
+    }
+    size_t etagLen = strlen(etag);
+    char *saveptr;  // for re-entrant strtok_r
+    for (char *tok = strtok_r(buf, ", \t", &saveptr); tok != NULL; tok = strtok_r(NULL, ", \t", &saveptr)) {
+        if (strcmp(tok, "*") == 0) {
+            return true;
+        }
+        if (strncmp(tok, "W/", 2) == 0) {  // weak comparison
+            tok += 2;
+        }
+        if (strlen(tok) == etagLen && strcmp(tok, etag) == 0) {
+            return true;
         }
+    }
+    return false;
+}
 
-        // copy chunk_len bytes to output stream
-        if (copyFileStreamBytes(istream, ostream, chunk_len) != 0) {
-            return -1; // unexpected copy error
+/**
+ * Get the length of a request body from its Content-Length or
+ * Transfer-Encoding header, and check it against the maximum
+ * body size. Lengths are 64-bit.
+ *
+ * @param requestHeaders the request headers
+ * @param len the body length, or -1 if chunked
+ * @return Http_OK if the body can be read, otherwise the error status
+ */
+int getRequestBodyLength(Properties *requestHeaders, long long *len) {
+    char buf[MAX_PROP_VAL];
+    if (findProperty(requestHeaders, 0, "Transfer-Encoding", buf) != SIZE_MAX) {
+        if (strcasecmp(buf, "chunked") != 0) {
+            return Http_MethodNotAllowed;
         }
-        nbytes += chunk_len;
+        *len = -1;  // limits are checked as the body arrives
+        return Http_OK;
+    }
+    if (findProperty(requestHeaders, 0, "Content-Length", buf) == SIZE_MAX) {
+        return Http_LengthRequired;
+    }
+    if (*buf == '\0') {
+        return Http_BadRequest;
+    }
+    long long n = 0;
+    for (const char *p = buf; *p != '\0'; p++) {
+        if (*p < '0' || *p > '9') {
+            return Http_BadRequest;
+        }
+        if (n > (LLONG_MAX - (*p - '0')) / 10) {
+            return Http_PayloadTooLarge;
+        }
+        n = n*10 + (*p - '0');
+    }
+    if (server.max_body_size > 0 && (unsigned long long)n > server.max_body_size) {
+        return Http_PayloadTooLarge;
+    }
+    *len = n;
+    return Http_OK;
+}
 
-        // skip past newline after chunk
-        if (fgets(buf, MAXBUF, istream) == NULL) {
-            return -1; // unexpected end of input
+/**
+ * Parse a decimal byte position at the start of a string.
+ *
+ * @param str the string
+ * @param n storage for the position
+ * @return the end of the digits, or NULL if none or too large
+ */
+static const char *parseBytePos(const char *str, long long *n) {
+    const char *p = str;
+    for (*n = 0; *p >= '0' && *p <= '9'; p++) {
+        if (*n > (LLONG_MAX - (*p - '0')) / 10) {
+            return NULL;
         }
-    } while (chunk_len > 0); // 0-length chunk ends chunk input stream
+        *n = *n*10 + (*p - '0');
+    }
+    return (p == str) ? NULL : p;
+}
 
-    return nbytes;
+/**
+ * Get the range of a partial PUT body from its Content-Range
+ * header, "bytes first-last/total". The total must be known.
+ *
+ * @param requestHeaders the request headers
+ * @param first the first byte position, or -1 if the body is not partial
+ * @param last the last byte position
+ * @param total the length of the complete body
+ * @return Http_OK if there is no range or it is valid, otherwise the error status
+ */
+int getRequestContentRange(Properties *requestHeaders, long long *first, long long *last, long long *total) {
+    char buf[MAX_PROP_VAL];
+    *first = -1;
+    if (findProperty(requestHeaders, 0, "Content-Range", buf) == SIZE_MAX) {
+        return Http_OK;
+    }
+    const char *p = buf;
+    if (   (strncasecmp(p, "bytes ", 6) != 0)
+        || ((p = parseBytePos(p + 6, first)) == NULL) || (*p++ != '-')
+        || ((p = parseBytePos(p, last)) == NULL) || (*p++ != '/')
+        || ((p = parseBytePos(p, total)) == NULL) || (*p != '\0')
+        || (*first > *last) || (*last >= *total)) {
+        *first = -1;
+        return Http_BadRequest;
+    }
+    if (server.max_body_size > 0 && (unsigned long long)*total > server.max_body_size) {
+        return Http_PayloadTooLarge;
+    }
+    return Http_OK;
+}
+
+/**
+ * Get the content coding of a request body from its
+ * Content-Encoding header. One gzip or deflate coding
+ * is supported.
+ *
+ * @param requestHeaders the request headers
+ * @param coding storage for the content coding; the identity
+ *   coding if the header is absent
+ * @return Http_OK if the coding is supported, otherwise the error status
+ */
+int getRequestContentCoding(Properties *requestHeaders, ContentCoding *coding) {
+    char buf[MAX_PROP_VAL];
+    *coding = CODING_IDENTITY;
+    if (findProperty(requestHeaders, 0, "Content-Encoding", buf) == SIZE_MAX) {
+        return Http_OK;
+    }
+    char *name = buf + strspn(buf, " \t");
+    name[strcspn(name, " \t")] = '\0';
+    return parseContentCoding(name, coding) ? Http_OK : Http_UnsupportedMediaType;
+}
+
+/**
+ * Answer the Expect header of a request once the request has
+ * been validated and its body is about to be read. A client that
+ * sent "Expect: 100-continue" waits for the interim 100 response
+ * before sending the body; other expectations are refused with 417.
+ *
+ * @param ostream the socket output stream
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @return true if the body should be read, false if a 417 response was sent
+ */
+bool sendContinue(FILE *ostream, Properties *requestHeaders, Properties *responseHeaders) {
+    char buf[MAX_PROP_VAL];
+    if (findProperty(requestHeaders, 0, "Expect", buf) == SIZE_MAX) {
+        return true;
+    }
+    if (strcasecmp(buf, "100-continue") != 0) {
+        sendStatusResponse(ostream, Http_ExpectationFailed, NULL, responseHeaders);
+        return false;
+    }
+    fprintf(ostream, "%s %d %s%s%s", server.server_protocol,
+            Http_Continue, httpCodeStr(Http_Continue), CRLF, CRLF);
+    fflush(ostream);
+    return true;
+}
+
+/** State of a chunked stream */
+typedef struct ChunkedStream {
+    FILE *ostream;      /** the underlying output stream */
+    int fd;             /** its descriptor, or -1 if a cookie stream */
+} ChunkedStream;
+
+/**
+ * Write bytes to the underlying output of a chunked stream. If it
+ * has a descriptor, the parts are written with one writev() after
+ * flushing the stream; otherwise they are written to the stream.
+ *
+ * @param chunked the chunked stream
+ * @param iov the parts to write
+ * @param iovcnt the number of parts
+ * @return 0 if successful, -1 if error
+ */
+static int chunkedStreamSend(ChunkedStream *chunked, struct iovec *iov, int iovcnt) {
+    if (chunked->fd >= 0) {
+        if (fflush(chunked->ostream) != 0) {
+            return -1;
+        }
+        return writevFully(chunked->fd, iov, iovcnt);
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (fwrite(iov[i].iov_base, sizeof(char), iov[i].iov_len, chunked->ostream) < iov[i].iov_len) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write function of a chunked stream: frames the bytes
+ * flushed from the stream buffer as one chunk, sending
+ * its size line, data and CRLF together.
+ *
+ * @param cookie the chunked stream
+ * @param buf the bytes to write
+ * @param size the number of bytes
+ * @return the number of bytes written or -1 if error
+ */
+static ssize_t chunkedStreamWrite(void *cookie, const char *buf, size_t size) {
+    if (size == 0) {  // an empty chunk would end the body
+        return 0;
+    }
+    char sizeLine[2*sizeof(size_t) + sizeof(CRLF)];
+    struct iovec iov[3] = {
+        { .iov_base = sizeLine, .iov_len = (size_t)sprintf(sizeLine, "%zx%s", size, CRLF) },
+        { .iov_base = (void *)buf, .iov_len = size },
+        { .iov_base = (void *)CRLF, .iov_len = strlen(CRLF) }
+    };
+    return (chunkedStreamSend(cookie, iov, 3) != 0) ? -1 : (ssize_t)size;
+}
+
+/**
+ * Close function of a chunked stream: writes the ending chunk.
+ *
+ * @param cookie the chunked stream
+ * @return 0 if successful, -1 if error
+ */
+static int chunkedStreamClose(void *cookie) {
+    ChunkedStream *chunked = cookie;
+    static const char lastChunk[] = "0" CRLF CRLF;
+    struct iovec iov = { .iov_base = (void *)lastChunk, .iov_len = strlen(lastChunk) };
+    int status = chunkedStreamSend(chunked, &iov, 1);
+    free(chunked);
+    return status;
+}
+
+/**
+ * Open a stream that writes HTTP 1.1 chunked transfer-encoded
+ * content to an output stream. Content is buffered and sent in
+ * chunks of server.chunk_size bytes; a larger write is sent as
+ * one chunk. Closing the returned stream writes the ending chunk
+ * but does not close ostream.
+ *
+ * @param ostream the the chunk transfer-encoded output stream
+ * @return the chunked stream or NULL if error
+ */
+FILE *openChunkedStream(FILE *ostream) {
+    cookie_io_functions_t chunkedFuncs = {
+        .read = NULL,
+        .write = chunkedStreamWrite,
+        .seek = NULL,
+        .close = chunkedStreamClose
+    };
+    ChunkedStream *chunked = malloc(sizeof(ChunkedStream));
+    if (chunked == NULL) {
+        return NULL;
+    }
+    chunked->ostream = ostream;
+    chunked->fd = fileno(ostream);
+    FILE *chunkedStream = fopencookie(chunked, "w", chunkedFuncs);
+    if (chunkedStream == NULL) {
+        free(chunked);
+        return NULL;
+    }
+    setvbuf(chunkedStream, NULL, _IOFBF, server.chunk_size);
+    return chunkedStream;
+}
+
+/**
+ * Abort a response whose body cannot be completed. The socket is
+ * shut down for writing, so closing a chunked stream on it does not
+ * end the body with the last chunk, and the client sees a truncated
+ * transfer instead of a complete response.
+ *
+ * @param ostream the socket stream
+ */
+void abortResponse(FILE *ostream) {
+    int fd = fileno(ostream);
+    if (fd >= 0) {
+        shutdown(fd, SHUT_WR);
+    }
 }
 
 /**
@@ -271,17 +533,11 @@ int copyFromChunkedFileStreamBytes(FILE *istream, FILE *ostream) {
  * @param return 0 if successful, -1 if error
  */
 int copyToChunkedFileStreamBytes(FILE *istream, FILE *ostream, int nbytes) {
-    static const int chunk_size = 4096;
-
-    while(nbytes > 0) {  // write next chunk
-        int nwrite = (nbytes > chunk_size) ? chunk_size : nbytes;
-        nbytes -= nwrite;
-        if (   (fprintf(ostream, "%x\r\n", nwrite) < 0)
-               || (copyFileStreamBytes(istream, ostream, nwrite) != 0)
-               || (fprintf(ostream, "\r\n") < 0)){
-            return -1;
-        }
+    FILE *chunkedStream = openChunkedStream(ostream);
+    if (chunkedStream == NULL) {
+        return -1;
     }
-    // write ending chunk
-    return ((fprintf(ostream, "0\n\r\n\r") < 0) ? -1 : 0);
+    int status = copyFileStreamBytes(istream, chunkedStream, nbytes);
+    // closing writes the last chunk
+    return (fclose(chunkedStream) != 0) ? -1 : status;
 }
\ No newline at end of file
@@ -10,7 +10,10 @@
 #ifndef HTTP_UTIL_H_
 #define HTTP_UTIL_H_
 
+#include <stdbool.h>
+#include <stdio.h>
 #include "properties.h"
+#include "compress_util.h"
 
 /**
  * Reads request headers from request stream until empty line.
@@ -85,17 +88,16 @@ void debugRequest(const char *request, Properties *requestHeaders);
 
 /**
  * Copy bytes from HTTP 1.1 chunked transfer-encoded
- * input stream to output stream.
+ * input stream to output stream. Chunk extensions are
+ * ignored and trailer fields are discarded.
  * See:
- * https://gist.github.com/CMCDragonkai/6bfade6431e9ffb7fe88
- * https://en.wikipedia.org/wiki/List_of_HTTP_header_fields
  * https://en.wikipedia.org/wiki/Chunked_transfer_encoding
  *
  * @param istream the chunk transfer-encoded input stream
  * @param ostream the output stream
  * @param return number of bytes copied or -1 if error
  */
-int copyFromChunkedFileStreamBytes(FILE *istream, FILE *ostream);
+long long copyFromChunkedFileStreamBytes(FILE *istream, FILE *ostream);
 
 /**
  * Copy bytes from input stream to HTTP 1.1 chunked transfer-encoded
@@ -112,4 +114,85 @@ int copyFromChunkedFileStreamBytes(FILE *istream, FILE *ostream);
  */
 int copyToChunkedFileStreamBytes(FILE *istream, FILE *ostream, int nbytes);
 
+/**
+ * Determines whether an If-None-Match request header matches
+ * an entity tag. The header is a list of quoted entity tags,
+ * optionally weak ("W/"), or "*" to match any entity tag.
+ *
+ * @param requestHeaders the request headers
+ * @param etag the quoted entity tag
+ * @return true if the header is present and matches
+ */
+bool matchesIfNoneMatch(Properties *requestHeaders, const char *etag);
+
+/**
+ * Open a stream that writes HTTP 1.1 chunked transfer-encoded
+ * content to an output stream. Content is buffered and sent in
+ * chunks of server.chunk_size bytes; a larger write is sent as
+ * one chunk. Closing the returned stream writes the ending chunk
+ * but does not close ostream.
+ *
+ * @param ostream the the chunk transfer-encoded output stream
+ * @return the chunked stream or NULL if error
+ */
+FILE *openChunkedStream(FILE *ostream);
+
+/**
+ * Abort a response whose body cannot be completed. The socket is
+ * shut down for writing, so closing a chunked stream on it does not
+ * end the body with the last chunk, and the client sees a truncated
+ * transfer instead of a complete response.
+ *
+ * @param ostream the socket stream
+ */
+void abortResponse(FILE *ostream);
+
+/**
+ * Get the length of a request body from its Content-Length or
+ * Transfer-Encoding header, and check it against the maximum
+ * body size. Lengths are 64-bit.
+ *
+ * @param requestHeaders the request headers
+ * @param len the body length, or -1 if chunked
+ * @return Http_OK if the body can be read, otherwise the error status
+ */
+int getRequestBodyLength(Properties *requestHeaders, long long *len);
+
+/**
+ * Get the range of a partial PUT body from its Content-Range
+ * header, "bytes first-last/total". The total must be known.
+ *
+ * @param requestHeaders the request headers
+ * @param first the first byte position, or -1 if the body is not partial
+ * @param last the last byte position
+ * @param total the length of the complete body
+ * @return Http_OK if there is no range or it is valid, otherwise the error status
+ */
+int getRequestContentRange(Properties *requestHeaders, long long *first, long long *last, long long *total);
+
+/**
+ * Get the content coding of a request body from its
+ * Content-Encoding header. One gzip or deflate coding
+ * is supported.
+ *
+ * @param requestHeaders the request headers
+ * @param coding storage for the content coding; the identity
+ *   coding if the header is absent
+ * @return Http_OK if the coding is supported, otherwise the error status
+ */
+int getRequestContentCoding(Properties *requestHeaders, ContentCoding *coding);
+
+/**
+ * Answer the Expect header of a request once the request has
+ * been validated and its body is about to be read. A client that
+ * sent "Expect: 100-continue" waits for the interim 100 response
+ * before sending the body; other expectations are refused with 417.
+ *
+ * @param ostream the socket output stream
+ * @param requestHeaders the request headers
+ * @param responseHeaders the response headers
+ * @return true if the body should be read, false if a 417 response was sent
+ */
+bool sendContinue(FILE *ostream, Properties *requestHeaders, Properties *responseHeaders);
+
 #endif /* HTTP_UTIL_H_ */
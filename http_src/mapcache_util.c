@@ -0,0 +1,556 @@
+/*
+ * mapcache_util.c
+ *
+ * Functions that keep mid-sized content files mapped into memory
+ * and send them from their mappings. A mapping is shared by the
+ * request threads and counted by reference. It is replaced when a
+ * request finds that its file has changed, and unmapped when the
+ * last request sending it is done. The least recently used mappings
+ * are removed to keep the mapped bytes within the configured total.
+ *
+ * On Linux, mappings are sent with MSG_ZEROCOPY, so the kernel pins
+ * the mapped pages instead of copying them to the socket buffer.
+ * The kernel reports on the socket error queue when it is done with
+ * the pages. A send does not wait for the reports: the connection
+ * counts its pending sends and holds their mappings, reads the
+ * reports on its next send, and releases the mappings when they are
+ * all reported or the connection is closed. Pages the kernel is
+ * still sending stay pinned after the mapping is released.
+ *
+ * Mapped bytes are only read by the kernel, never in user space, so
+ * a file truncated while it is sent fails the send with EFAULT
+ * instead of raising SIGBUS.
+ *
+ *  @since 2021-05-09
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#endif
+#include "hashmap.h"
+#include "mapcache_util.h"
+
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define MAP_ZEROCOPY 1
+#endif
+
+/** Most milliseconds a send waits for reports when they fill socket memory */
+#define ZEROCOPY_WAIT_MILLIS 200
+
+/** A content file mapped into memory, shared by the cache and requests */
+struct MappedFile {
+    const char *addr;           /** the mapped bytes */
+    size_t length;              /** length of the mapping */
+    dev_t dev;                  /** device of the file */
+    ino_t ino;                  /** inode of the file */
+    struct timespec mtim;       /** modification time of the file */
+    struct timespec ctim;       /** status change time of the file */
+    unsigned long lastUse;      /** use count when last acquired */
+    int refs;                   /** references from cache and requests */
+};
+
+/** Zerocopy sends of a connection that are not reported complete */
+typedef struct ZeroCopySends {
+    unsigned pending;           /** number of sends not reported complete */
+    MappedFile **maps;          /** mappings held for the sends */
+    size_t nmaps;               /** number of mappings held */
+} ZeroCopySends;
+
+/** Guards the map cache */
+static pthread_mutex_t mapLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Cached mappings by file path, or NULL if the cache is disabled */
+static HashMap *mapCache = NULL;
+
+/** Total bytes of cached mappings */
+static size_t mapCacheBytes = 0;
+
+/** Most bytes of cached mappings */
+static size_t mapCacheMaxBytes = 0;
+
+/** Smallest file that is mapped */
+static size_t mapMinFileSize = 0;
+
+/** Largest file that is mapped */
+static size_t mapMaxFileSize = 0;
+
+/** Count of mappings acquired, for least recently used eviction */
+static unsigned long mapUseCount = 0;
+
+/** true to send mappings with MSG_ZEROCOPY */
+static bool useZeroCopy = false;
+
+/** Pending zerocopy sends by socket descriptor */
+static HashMap *sendsByConn = NULL;
+
+/**
+ * Initialize the map cache.
+ *
+ * @param maxBytes the most bytes of files kept mapped; 0 disables the cache
+ * @param minFileSize the smallest file that is mapped
+ * @param maxFileSize the largest file that is mapped
+ * @param zeroCopy true to send mapped files with MSG_ZEROCOPY
+ * @return true if the cache is ready
+ */
+bool initMapCache(size_t maxBytes, size_t minFileSize, size_t maxFileSize, bool zeroCopy) {
+    pthread_mutex_lock(&mapLock);
+    mapCacheMaxBytes = maxBytes;
+    mapMinFileSize = (minFileSize > 0) ? minFileSize : 1;
+    mapMaxFileSize = MIN(maxFileSize, maxBytes);
+#if defined(MAP_ZEROCOPY)
+    useZeroCopy = zeroCopy;
+#else
+    useZeroCopy = false;
+    (void)zeroCopy;
+#endif
+    if (maxBytes > 0 && mapCache == NULL) {
+        mapCache = newHashMap(64);
+    }
+    if (useZeroCopy && sendsByConn == NULL) {
+        sendsByConn = newHashMap(64);
+        useZeroCopy = (sendsByConn != NULL);
+    }
+    bool ready = (maxBytes > 0) && (mapCache != NULL);
+    pthread_mutex_unlock(&mapLock);
+    return ready;
+}
+
+/**
+ * Drop a reference to a mapping, and unmap it when the last
+ * reference is dropped. Called with the cache locked.
+ *
+ * @param map the mapping
+ */
+static void dropMappedFile(MappedFile *map) {
+    if (--map->refs == 0) {
+        munmap((void*)map->addr, map->length);
+        free(map);
+    }
+}
+
+/**
+ * Determines whether a mapping is of the current version of a file.
+ *
+ * @param map the mapping
+ * @param sb the current file properties
+ * @return true if the file has not changed since it was mapped
+ */
+static bool isCurrentMap(const MappedFile *map, const struct stat *sb) {
+    return (map->dev == sb->st_dev) && (map->ino == sb->st_ino)
+        && (map->length == (size_t)sb->st_size)
+        && (map->mtim.tv_sec == sb->st_mtim.tv_sec) && (map->mtim.tv_nsec == sb->st_mtim.tv_nsec)
+        && (map->ctim.tv_sec == sb->st_ctim.tv_sec) && (map->ctim.tv_nsec == sb->st_ctim.tv_nsec);
+}
+
+/** Finds the least recently used mapping */
+typedef struct LeastUsed {
+    char key[MAXPATHLEN];       /** path of the mapping */
+    unsigned long lastUse;      /** use count when last acquired */
+    bool found;                 /** true if a mapping was found */
+} LeastUsed;
+
+/**
+ * Visitor that records the least recently used mapping.
+ *
+ * @param key the path of the mapping
+ * @param value the mapping
+ * @param ctx the LeastUsed record
+ * @return false to keep the entry
+ */
+static bool findLeastUsed(const char *key, void *value, void *ctx) {
+    MappedFile *map = value;
+    LeastUsed *least = ctx;
+    if (!least->found || map->lastUse < least->lastUse) {
+        snprintf(least->key, sizeof(least->key), "%s", key);
+        least->lastUse = map->lastUse;
+        least->found = true;
+    }
+    return false;
+}
+
+/**
+ * Remove least recently used mappings from the cache until more
+ * bytes fit. Called with the cache locked.
+ *
+ * @param needed the bytes to fit
+ */
+static void evictMappedFiles(size_t needed) {
+    while (mapCacheBytes + needed > mapCacheMaxBytes) {
+        LeastUsed least = { .found = false };
+        forEachHashMap(mapCache, findLeastUsed, &least);
+        if (!least.found) {
+            break;
+        }
+        MappedFile *map = removeHashMap(mapCache, least.key);
+        mapCacheBytes -= map->length;
+        dropMappedFile(map);
+    }
+}
+
+/**
+ * Get the mapping of an open content file from the map cache,
+ * mapping it if it is not cached or has changed. The mapping
+ * must be released with releaseMappedFile().
+ *
+ * @param filePath the content path of the file
+ * @param fd the open file descriptor
+ * @param sb the current file properties from fstat()
+ * @return the mapping, or NULL if the file is not mapped
+ */
+MappedFile *acquireMappedFile(const char *filePath, int fd, const struct stat *sb) {
+    if (!S_ISREG(sb->st_mode) || (size_t)sb->st_size < mapMinFileSize
+        || (size_t)sb->st_size > mapMaxFileSize || strlen(filePath) >= MAXPATHLEN) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mapLock);
+    if (mapCache == NULL) {
+        pthread_mutex_unlock(&mapLock);
+        return NULL;
+    }
+    MappedFile *map = getHashMap(mapCache, filePath);
+    if (map != NULL) {
+        if (isCurrentMap(map, sb)) {
+            map->refs++;
+            map->lastUse = ++mapUseCount;
+            pthread_mutex_unlock(&mapLock);
+            return map;
+        }
+        removeHashMap(mapCache, filePath);  // changed: unmap once no longer sent
+        mapCacheBytes -= map->length;
+        dropMappedFile(map);
+    }
+    pthread_mutex_unlock(&mapLock);
+
+    // map file outside lock
+    size_t length = (size_t)sb->st_size;
+    void *addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    map = malloc(sizeof(MappedFile));
+    if (map == NULL) {
+        munmap(addr, length);
+        return NULL;
+    }
+    *map = (MappedFile){
+        .addr = addr, .length = length, .dev = sb->st_dev, .ino = sb->st_ino,
+        .mtim = sb->st_mtim, .ctim = sb->st_ctim, .refs = 1
+    };
+
+    // cache mapping unless another request mapped the file first
+    pthread_mutex_lock(&mapLock);
+    MappedFile *cached = getHashMap(mapCache, filePath);
+    if (cached != NULL && isCurrentMap(cached, sb)) {
+        cached->refs++;
+        cached->lastUse = ++mapUseCount;
+        dropMappedFile(map);
+        map = cached;
+    } else {
+        evictMappedFiles(length);
+        MappedFile *old = NULL;
+        if (putHashMap(mapCache, filePath, map, (void**)&old)) {
+            map->refs++;
+            map->lastUse = ++mapUseCount;
+            mapCacheBytes += length;
+            if (old != NULL) {
+                mapCacheBytes -= old->length;
+                dropMappedFile(old);
+            }
+        }
+    }
+    pthread_mutex_unlock(&mapLock);
+    return map;
+}
+
+/**
+ * Release a mapping returned by acquireMappedFile().
+ *
+ * @param map the mapping
+ */
+void releaseMappedFile(MappedFile *map) {
+    pthread_mutex_lock(&mapLock);
+    dropMappedFile(map);
+    pthread_mutex_unlock(&mapLock);
+}
+
+#if defined(MAP_ZEROCOPY)
+/**
+ * Read the completion reports of MSG_ZEROCOPY sends from the
+ * error queue of a socket.
+ *
+ * @param sockfd the socket
+ * @param waitMillis milliseconds to wait for a report, or 0
+ * @return the number of sends reported complete
+ */
+static unsigned reapZeroCopy(int sockfd, int waitMillis) {
+    if (waitMillis > 0) {
+        struct pollfd pfd = { .fd = sockfd, .events = 0 };  // POLLERR is always reported
+        if (poll(&pfd, 1, waitMillis) <= 0) {
+            return 0;
+        }
+    }
+    unsigned completed = 0;
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + CMSG_SPACE(sizeof(struct sockaddr_in6))];
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;  // EAGAIN when the queue is empty
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (   !(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+            if (serr.ee_errno == 0 && serr.ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                // reports of consecutive sends are merged into a range
+                completed += serr.ee_data - serr.ee_info + 1;
+            }
+        }
+    }
+    return completed;
+}
+
+/**
+ * Get the pending zerocopy sends of a connection, adding an
+ * empty entry if it has none.
+ *
+ * @param sockfd the socket
+ * @return the pending sends, or NULL if no memory
+ */
+static ZeroCopySends *getZeroCopySends(int sockfd) {
+    char key[16];
+    snprintf(key, sizeof(key), "%d", sockfd);
+    pthread_mutex_lock(&mapLock);
+    ZeroCopySends *sends = getHashMap(sendsByConn, key);
+    if (sends == NULL && (sends = calloc(1, sizeof(ZeroCopySends))) != NULL) {
+        if (!putHashMap(sendsByConn, key, sends, NULL)) {
+            free(sends);
+            sends = NULL;
+        }
+    }
+    pthread_mutex_unlock(&mapLock);
+    return sends;
+}
+
+/**
+ * Drop the mappings held for the sends of a connection.
+ * Called with the cache locked.
+ *
+ * @param sends the pending sends
+ */
+static void dropSendMaps(ZeroCopySends *sends) {
+    for (size_t i = 0; i < sends->nmaps; i++) {
+        dropMappedFile(sends->maps[i]);
+    }
+    free(sends->maps);
+    sends->maps = NULL;
+    sends->nmaps = 0;
+}
+
+/**
+ * Read the completion reports of the pending sends of a
+ * connection, and drop its mappings when none are pending.
+ *
+ * @param sends the pending sends
+ * @param sockfd the socket
+ * @param waitMillis milliseconds to wait for a report, or 0
+ * @return the number of sends reported complete
+ */
+static unsigned reapZeroCopySends(ZeroCopySends *sends, int sockfd, int waitMillis) {
+    unsigned completed = reapZeroCopy(sockfd, waitMillis);
+    sends->pending -= MIN(completed, sends->pending);
+    if (sends->pending == 0 && sends->nmaps > 0) {
+        pthread_mutex_lock(&mapLock);
+        dropSendMaps(sends);
+        pthread_mutex_unlock(&mapLock);
+    }
+    return completed;
+}
+
+/**
+ * Hold a mapping for the pending sends of a connection. If there
+ * is no memory, the mapping is not held; the kernel keeps the
+ * pages it is sending pinned in any case.
+ *
+ * @param sends the pending sends
+ * @param map the mapping
+ */
+static void holdSendMap(ZeroCopySends *sends, MappedFile *map) {
+    for (size_t i = 0; i < sends->nmaps; i++) {
+        if (sends->maps[i] == map) {
+            return;
+        }
+    }
+    MappedFile **maps = realloc(sends->maps, (sends->nmaps + 1) * sizeof(MappedFile*));
+    if (maps != NULL) {
+        sends->maps = maps;
+        pthread_mutex_lock(&mapLock);
+        map->refs++;
+        sends->maps[sends->nmaps++] = map;
+        pthread_mutex_unlock(&mapLock);
+    }
+}
+#endif
+
+/**
+ * Send bytes of a mapped file to a socket stream. The stream is
+ * flushed and the bytes are sent from the mapping, with
+ * MSG_ZEROCOPY if enabled, so they are not copied through a
+ * buffer in user space. Zerocopy sends are not waited for; the
+ * connection holds the mapping until they are reported complete
+ * or releaseMappedSends() is called.
+ *
+ * @param map the mapping
+ * @param offset the offset of the first byte
+ * @param ostream the socket stream
+ * @param nbytes the number of bytes to send
+ * @return 0 if successful, -1 if error
+ */
+int sendMappedBytes(MappedFile *map, off_t offset, FILE *ostream, size_t nbytes) {
+    int sockfd = fileno(ostream);
+    if (sockfd < 0 || offset < 0 || (size_t)offset > map->length || nbytes > map->length - (size_t)offset) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fflush(ostream) != 0) {
+        return -1;
+    }
+    const char *bytes = map->addr + offset;
+    int flags = 0;
+#if defined(MAP_ZEROCOPY)
+    ZeroCopySends *sends = NULL;
+    int one = 1;
+    if (   useZeroCopy && setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0
+        && (sends = getZeroCopySends(sockfd)) != NULL) {
+        flags = MSG_ZEROCOPY;
+        if (sends->pending > 0) {  // reports of earlier sends on the connection
+            reapZeroCopySends(sends, sockfd, 0);
+        }
+    }
+#endif
+    int status = 0;
+    while (nbytes > 0) {
+        ssize_t n = send(sockfd, bytes, nbytes, flags);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+#if defined(MAP_ZEROCOPY)
+        if (n < 0 && errno == ENOBUFS && flags != 0) {
+            // reports fill the socket option memory: wait for some, or copy
+            unsigned completed = reapZeroCopySends(sends, sockfd, ZEROCOPY_WAIT_MILLIS);
+            if (completed == 0) {
+                flags = 0;
+            }
+            continue;
+        }
+#endif
+        if (n <= 0) {
+            status = -1;
+            break;
+        }
+        bytes += n;
+        nbytes -= (size_t)n;
+#if defined(MAP_ZEROCOPY)
+        if (flags != 0) {
+            sends->pending++;
+            reapZeroCopySends(sends, sockfd, 0);
+        }
+#endif
+    }
+#if defined(MAP_ZEROCOPY)
+    if (sends != NULL && sends->pending > 0) {
+        holdSendMap(sends, map);
+    }
+#endif
+    return status;
+}
+
+/**
+ * Release the mappings held for the zerocopy sends of a
+ * connection. Called before the socket is closed; pages the
+ * kernel is still sending stay pinned until it is done.
+ *
+ * @param sockfd the socket
+ */
+void releaseMappedSends(int sockfd) {
+#if defined(MAP_ZEROCOPY)
+    if (!useZeroCopy || sockfd < 0) {
+        return;
+    }
+    char key[16];
+    snprintf(key, sizeof(key), "%d", sockfd);
+    pthread_mutex_lock(&mapLock);
+    ZeroCopySends *sends = removeHashMap(sendsByConn, key);
+    if (sends != NULL) {
+        dropSendMaps(sends);
+    }
+    pthread_mutex_unlock(&mapLock);
+    free(sends);
+#else
+    (void)sockfd;
+#endif
+}
+
+/** Selects the mappings of a path and the paths below it */
+typedef struct MapPrefix {
+    const char *path;           /** the path */
+    size_t len;                 /** length of the path without trailing '/' */
+} MapPrefix;
+
+/**
+ * Visitor that removes the mappings of a path and the paths below it.
+ *
+ * @param key the path of the mapping
+ * @param value the mapping
+ * @param ctx the MapPrefix record
+ * @return true to remove the entry
+ */
+static bool removeMapPrefix(const char *key, void *value, void *ctx) {
+    MapPrefix *prefix = ctx;
+    if (strncmp(key, prefix->path, prefix->len) != 0 || (key[prefix->len] != '\0' && key[prefix->len] != '/')) {
+        return false;
+    }
+    MappedFile *map = value;
+    mapCacheBytes -= map->length;
+    dropMappedFile(map);
+    return true;
+}
+
+/**
+ * Remove the mappings of a path that was written or removed from
+ * the cache, together with the mappings of every path below it.
+ * Called by handlers that change the content.
+ *
+ * @param path the file or directory path
+ */
+void invalidateMappedFiles(const char *path) {
+    MapPrefix prefix = { .path = path, .len = strlen(path) };
+    while (prefix.len > 0 && path[prefix.len-1] == '/') {
+        prefix.len--;
+    }
+    pthread_mutex_lock(&mapLock);
+    if (mapCache != NULL && sizeHashMap(mapCache) > 0) {
+        forEachHashMap(mapCache, removeMapPrefix, &prefix);
+    }
+    pthread_mutex_unlock(&mapLock);
+}
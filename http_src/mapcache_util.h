@@ -0,0 +1,86 @@
+/*
+ * mapcache_util.h
+ *
+ * Functions that keep mid-sized content files mapped into memory,
+ * shared by request threads, and send them from their mappings.
+ *
+ *  @since 2021-05-09
+ */
+
+#ifndef MAPCACHE_UTIL_H_
+#define MAPCACHE_UTIL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/** A content file mapped into memory */
+typedef struct MappedFile MappedFile;
+
+/**
+ * Initialize the map cache.
+ *
+ * @param maxBytes the most bytes of files kept mapped; 0 disables the cache
+ * @param minFileSize the smallest file that is mapped
+ * @param maxFileSize the largest file that is mapped
+ * @param zeroCopy true to send mapped files with MSG_ZEROCOPY
+ * @return true if the cache is ready
+ */
+bool initMapCache(size_t maxBytes, size_t minFileSize, size_t maxFileSize, bool zeroCopy);
+
+/**
+ * Get the mapping of an open content file from the map cache,
+ * mapping it if it is not cached or has changed. The mapping
+ * must be released with releaseMappedFile().
+ *
+ * @param filePath the content path of the file
+ * @param fd the open file descriptor
+ * @param sb the current file properties from fstat()
+ * @return the mapping, or NULL if the file is not mapped
+ */
+MappedFile *acquireMappedFile(const char *filePath, int fd, const struct stat *sb);
+
+/**
+ * Release a mapping returned by acquireMappedFile().
+ *
+ * @param map the mapping
+ */
+void releaseMappedFile(MappedFile *map);
+
+/**
+ * Send bytes of a mapped file to a socket stream. The stream is
+ * flushed and the bytes are sent from the mapping, with
+ * MSG_ZEROCOPY if enabled, so they are not copied through a
+ * buffer in user space. Zerocopy sends are not waited for; the
+ * connection holds the mapping until they are reported complete
+ * or releaseMappedSends() is called.
+ *
+ * @param map the mapping
+ * @param offset the offset of the first byte
+ * @param ostream the socket stream
+ * @param nbytes the number of bytes to send
+ * @return 0 if successful, -1 if error
+ */
+int sendMappedBytes(MappedFile *map, off_t offset, FILE *ostream, size_t nbytes);
+
+/**
+ * Release the mappings held for the zerocopy sends of a
+ * connection. Called before the socket is closed; pages the
+ * kernel is still sending stay pinned until it is done.
+ *
+ * @param sockfd the socket
+ */
+void releaseMappedSends(int sockfd);
+
+/**
+ * Remove the mappings of a path that was written or removed from
+ * the cache, together with the mappings of every path below it.
+ * Called by handlers that change the content.
+ *
+ * @param path the file or directory path
+ */
+void invalidateMappedFiles(const char *path);
+
+#endif /* MAPCACHE_UTIL_H_ */
@@ -0,0 +1,373 @@
+/*
+ * multipart.c
+ *
+ * Functions that implement a streaming multipart/form-data parser.
+ * Part data is found with a Boyer-Moore-Horspool search for the
+ * delimiter, so most bytes of large parts are skipped rather than
+ * compared, and each byte is held only until it cannot be the
+ * start of a delimiter.
+ *
+ *  @since 2021-04-27
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "multipart.h"
+
+/** States of the parser */
+typedef enum MultipartState {
+    MP_PREAMBLE,                /** before first delimiter */
+    MP_DELIMITER,               /** after delimiter: CRLF or "--" */
+    MP_HEADERS,                 /** part header lines */
+    MP_DATA,                    /** part data */
+    MP_DONE,                    /** after closing delimiter */
+    MP_ERROR                    /** malformed body or handler failure */
+} MultipartState;
+
+/** Streaming multipart/form-data parser */
+struct MultipartParser {
+    MultipartState state;       /** current state */
+    const MultipartHandler *handler;  /** part handler */
+    void *ctx;                  /** handler context */
+    char delim[MULTIPART_MAX_BOUNDARY+5];  /** "\r\n--" boundary */
+    size_t delimLen;            /** length of delimiter */
+    size_t skip[256];           /** BMH shift by last byte of window */
+    char name[MULTIPART_MAX_HEADER];         /** name of current part */
+    char filename[MULTIPART_MAX_HEADER];     /** file name of current part */
+    bool hasFilename;           /** true if current part has a file name */
+    char contentType[MULTIPART_MAX_HEADER];  /** content type of current part */
+    size_t len;                 /** bytes in buffer */
+    char buf[MULTIPART_BUFSIZ]; /** unparsed bytes */
+};
+
+/**
+ * Find the first occurrence of the delimiter in a buffer
+ * with the Boyer-Moore-Horspool algorithm.
+ *
+ * @param parser the parser
+ * @param hay the buffer
+ * @param n the number of bytes in buffer
+ * @return offset of the delimiter or SIZE_MAX if not found
+ */
+static size_t findDelimiter(const MultipartParser *parser, const char *hay, size_t n) {
+    size_t m = parser->delimLen;
+    const unsigned char last = (unsigned char)parser->delim[m-1];
+    for (size_t i = 0; i + m <= n; ) {
+        unsigned char c = (unsigned char)hay[i+m-1];
+        if (c == last && memcmp(hay + i, parser->delim, m-1) == 0) {
+            return i;
+        }
+        i += parser->skip[c];
+    }
+    return SIZE_MAX;
+}
+
+/**
+ * Copy a header parameter value, removing quotes and
+ * backslash escapes and truncating to the buffer size.
+ *
+ * @param val the parameter value
+ * @param buf the buffer of MULTIPART_MAX_HEADER bytes
+ */
+static void copyParamValue(const char *val, char *buf) {
+    size_t n = 0;
+    if (*val == '"') {
+        for (val++; *val != '\0' && *val != '"'; val++) {
+            if (*val == '\\' && val[1] != '\0') {
+                val++;
+            }
+            if (n < MULTIPART_MAX_HEADER-1) {
+                buf[n++] = *val;
+            }
+        }
+    } else {
+        for (; *val != '\0' && *val != ';' && *val != ' ' && *val != '\t'; val++) {
+            if (n < MULTIPART_MAX_HEADER-1) {
+                buf[n++] = *val;
+            }
+        }
+    }
+    buf[n] = '\0';
+}
+
+/**
+ * Find a parameter of a header value, such as the name in
+ * 'form-data; name="field"'. Parameter names are not case sensitive.
+ *
+ * @param header the header value
+ * @param param the parameter name
+ * @return the parameter value or NULL if not found
+ */
+static const char *findParam(const char *header, const char *param) {
+    size_t paramLen = strlen(param);
+    const char *p = header;
+    while ((p = strchr(p, ';')) != NULL) {
+        for (p++; *p == ' ' || *p == '\t'; p++) {}
+        if (strncasecmp(p, param, paramLen) == 0 && p[paramLen] == '=') {
+            return p + paramLen + 1;
+        }
+        // skip quoted value that may contain ';'
+        const char *eq = strchr(p, '=');
+        if (eq != NULL && eq[1] == '"') {
+            for (p = eq+2; *p != '\0' && *p != '"'; p++) {
+                if (*p == '\\' && p[1] != '\0') {
+                    p++;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get the boundary parameter of a multipart/form-data content type.
+ *
+ * @param contentType the Content-Type header value
+ * @param boundary buffer for the boundary of MULTIPART_MAX_BOUNDARY+1 bytes
+ * @return true if the content type is multipart/form-data with a valid boundary
+ */
+bool getMultipartBoundary(const char *contentType, char *boundary) {
+    static const char type[] = "multipart/form-data";
+    if (strncasecmp(contentType, type, sizeof(type)-1) != 0) {
+        return false;
+    }
+    const char *val = findParam(contentType, "boundary");
+    if (val == NULL) {
+        return false;
+    }
+    char buf[MULTIPART_MAX_HEADER];
+    copyParamValue(val, buf);
+    size_t len = strlen(buf);
+    if (len == 0 || len > MULTIPART_MAX_BOUNDARY) {
+        return false;
+    }
+    strcpy(boundary, buf);
+    return true;
+}
+
+/**
+ * Create a new MultipartParser for a body with a boundary.
+ *
+ * @param boundary the boundary
+ * @param handler the part handler
+ * @param ctx context passed to the handler
+ * @return the new instance or NULL if no space
+ */
+MultipartParser *newMultipartParser(const char *boundary, const MultipartHandler *handler, void *ctx) {
+    if (strlen(boundary) > MULTIPART_MAX_BOUNDARY) {
+        return NULL;
+    }
+    MultipartParser *parser = malloc(sizeof(MultipartParser));
+    if (parser == NULL) {
+        return NULL;
+    }
+    parser->state = MP_PREAMBLE;
+    parser->handler = handler;
+    parser->ctx = ctx;
+    parser->delimLen = (size_t)sprintf(parser->delim, "\r\n--%s", boundary);
+
+    // shift by distance of last occurrence of byte from end of delimiter
+    size_t m = parser->delimLen;
+    for (int c = 0; c < 256; c++) {
+        parser->skip[c] = m;
+    }
+    for (size_t i = 0; i < m-1; i++) {
+        parser->skip[(unsigned char)parser->delim[i]] = m-1 - i;
+    }
+
+    // body begins with a delimiter that has no leading CRLF
+    memcpy(parser->buf, "\r\n", 2);
+    parser->len = 2;
+    return parser;
+}
+
+/**
+ * Delete a MultipartParser.
+ *
+ * @param parser the parser
+ */
+void deleteMultipartParser(MultipartParser *parser) {
+    free(parser);
+}
+
+/**
+ * Determines whether the parser has seen the closing boundary.
+ *
+ * @param parser the parser
+ * @return true if the body is complete
+ */
+bool isMultipartDone(const MultipartParser *parser) {
+    return parser->state == MP_DONE;
+}
+
+/**
+ * Parse one part header line.
+ *
+ * @param parser the parser
+ * @param line the header line without CRLF
+ */
+static void parseHeaderLine(MultipartParser *parser, char *line) {
+    char *val = strchr(line, ':');
+    if (val == NULL) {
+        return;  // not a header: ignore
+    }
+    for (*val++ = '\0'; *val == ' ' || *val == '\t'; val++) {}
+    if (strcasecmp(line, "Content-Disposition") == 0) {
+        const char *name = findParam(val, "name");
+        if (name != NULL) {
+            copyParamValue(name, parser->name);
+        }
+        const char *filename = findParam(val, "filename");
+        if (filename != NULL) {
+            copyParamValue(filename, parser->filename);
+            parser->hasFilename = true;
+        }
+    } else if (strcasecmp(line, "Content-Type") == 0) {
+        copyParamValue(val, parser->contentType);
+    }
+}
+
+/**
+ * Parse as much of the buffer as possible, passing part
+ * data to the handler, and keep the unparsed bytes.
+ *
+ * @param parser the parser
+ * @return 0 if successful, -1 if error
+ */
+static int parseBuffer(MultipartParser *parser) {
+    const MultipartHandler *handler = parser->handler;
+    size_t pos = 0;
+    bool more = true;
+    while (more && parser->state != MP_ERROR) {
+        char *p = parser->buf + pos;
+        size_t avail = parser->len - pos;
+        switch (parser->state) {
+        case MP_PREAMBLE:
+        case MP_DATA: {
+            bool inPart = (parser->state == MP_DATA);
+            size_t off = findDelimiter(parser, p, avail);
+            size_t n = (off != SIZE_MAX) ? off
+                     : (avail >= parser->delimLen) ? avail - (parser->delimLen-1) : 0;
+            if (inPart && n > 0 && handler->data(parser->ctx, p, n) != 0) {
+                parser->state = MP_ERROR;
+                break;
+            }
+            pos += n;
+            if (off == SIZE_MAX) {
+                more = false;  // keep bytes that may start a delimiter
+                break;
+            }
+            pos += parser->delimLen;
+            if (inPart && handler->end(parser->ctx) != 0) {
+                parser->state = MP_ERROR;
+                break;
+            }
+            parser->state = MP_DELIMITER;
+            break;
+        }
+
+        case MP_DELIMITER: {
+            size_t lws = 0;  // transport padding
+            while (lws < avail && (p[lws] == ' ' || p[lws] == '\t')) {
+                lws++;
+            }
+            if (avail - lws < 2) {
+                more = false;
+                break;
+            }
+            if (p[lws] == '-' && p[lws+1] == '-') {
+                parser->state = MP_DONE;
+            } else if (p[lws] == '\r' && p[lws+1] == '\n') {
+                parser->state = MP_HEADERS;
+                parser->name[0] = parser->filename[0] = parser->contentType[0] = '\0';
+                parser->hasFilename = false;
+            } else {
+                parser->state = MP_ERROR;
+            }
+            pos += lws + 2;
+            break;
+        }
+
+        case MP_HEADERS: {
+            char *eol = memchr(p, '\n', avail);
+            if (eol == NULL) {
+                more = false;
+                break;
+            }
+            size_t lineLen = eol - p;
+            pos += lineLen + 1;
+            if (lineLen > 0 && p[lineLen-1] == '\r') {
+                lineLen--;
+            }
+            p[lineLen] = '\0';
+            if (lineLen > 0) {
+                parseHeaderLine(parser, p);
+                break;
+            }
+            // empty line ends headers
+            MultipartPart part = {
+                .name = parser->name,
+                .filename = parser->hasFilename ? parser->filename : NULL,
+                .contentType = (parser->contentType[0] != '\0') ? parser->contentType : NULL
+            };
+            parser->state = (handler->begin(parser->ctx, &part) == 0) ? MP_DATA : MP_ERROR;
+            break;
+        }
+
+        case MP_DONE:  // ignore epilogue
+            pos = parser->len;
+            more = false;
+            break;
+
+        default:
+            more = false;
+            break;
+        }
+    }
+    if (parser->state == MP_ERROR) {
+        return -1;
+    }
+
+    // keep unparsed bytes at start of buffer
+    parser->len -= pos;
+    memmove(parser->buf, parser->buf + pos, parser->len);
+    if (parser->len == sizeof(parser->buf)) {  // header lines too long
+        parser->state = MP_ERROR;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Parse the next bytes of a multipart body. Input may be split
+ * anywhere. Part data is passed to the handler as soon as it
+ * cannot be the start of a boundary.
+ *
+ * @param parser the parser
+ * @param bytes the body bytes
+ * @param len the number of bytes
+ * @return 0 if successful, -1 if the body is malformed or the handler fails
+ */
+int feedMultipart(MultipartParser *parser, const char *bytes, size_t len) {
+    if (parser->state == MP_ERROR) {
+        return -1;
+    }
+    while (len > 0) {
+        size_t n = sizeof(parser->buf) - parser->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(parser->buf + parser->len, bytes, n);
+        parser->len += n;
+        bytes += n;
+        len -= n;
+        if (parseBuffer(parser) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
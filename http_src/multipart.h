@@ -0,0 +1,90 @@
+/*
+ * multipart.h
+ *
+ * Functions that implement a streaming multipart/form-data parser.
+ *
+ *  @since 2021-04-27
+ */
+
+#ifndef MULTIPART_H_
+#define MULTIPART_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Maximum length of a boundary (RFC 2046) */
+#define MULTIPART_MAX_BOUNDARY 70
+
+/** Size of the parser buffer; also the limit on the headers of a part */
+#define MULTIPART_BUFSIZ (64*1024)
+
+/** Maximum length of a part header value kept by the parser */
+#define MULTIPART_MAX_HEADER 256
+
+/** Streaming multipart/form-data parser */
+typedef struct MultipartParser MultipartParser;
+
+/** Headers of a part passed to the part handler */
+typedef struct MultipartPart {
+    const char *name;           /** form field name */
+    const char *filename;       /** file name or NULL if not a file */
+    const char *contentType;    /** content type or NULL if not given */
+} MultipartPart;
+
+/** Callbacks that receive the parts of a body as they are parsed */
+typedef struct MultipartHandler {
+    /** start of a part; returns 0 if successful, -1 to stop parsing */
+    int (*begin)(void *ctx, const MultipartPart *part);
+    /** next bytes of the current part; returns 0 if successful, -1 to stop parsing */
+    int (*data)(void *ctx, const char *bytes, size_t len);
+    /** end of the current part; returns 0 if successful, -1 to stop parsing */
+    int (*end)(void *ctx);
+} MultipartHandler;
+
+/**
+ * Get the boundary parameter of a multipart/form-data content type.
+ *
+ * @param contentType the Content-Type header value
+ * @param boundary buffer for the boundary of MULTIPART_MAX_BOUNDARY+1 bytes
+ * @return true if the content type is multipart/form-data with a valid boundary
+ */
+bool getMultipartBoundary(const char *contentType, char *boundary);
+
+/**
+ * Create a new MultipartParser for a body with a boundary.
+ *
+ * @param boundary the boundary
+ * @param handler the part handler
+ * @param ctx context passed to the handler
+ * @return the new instance or NULL if no space
+ */
+MultipartParser *newMultipartParser(const char *boundary, const MultipartHandler *handler, void *ctx);
+
+/**
+ * Delete a MultipartParser.
+ *
+ * @param parser the parser
+ */
+void deleteMultipartParser(MultipartParser *parser);
+
+/**
+ * Parse the next bytes of a multipart body. Input may be split
+ * anywhere. Part data is passed to the handler as soon as it
+ * cannot be the start of a boundary.
+ *
+ * @param parser the parser
+ * @param bytes the body bytes
+ * @param len the number of bytes
+ * @return 0 if successful, -1 if the body is malformed or the handler fails
+ */
+int feedMultipart(MultipartParser *parser, const char *bytes, size_t len);
+
+/**
+ * Determines whether the parser has seen the closing boundary.
+ *
+ * @param parser the parser
+ * @return true if the body is complete
+ */
+bool isMultipartDone(const MultipartParser *parser);
+
+#endif /* MULTIPART_H_ */
@@ -0,0 +1,444 @@
+/*
+ * precompress_util.c
+ *
+ * Functions that keep gzip copies of compressible content files.
+ * The copy of "file" is "file.gz" in the same directory, and it is
+ * sent instead of compressing "file" while it is current. A
+ * precompressor thread makes copies at
+ * the highest compression level, for files written by uploads and
+ * for files found out of date by a scan of the content directory
+ * at startup.
+ *
+ * A copy is marked with an extended attribute that records the
+ * inode and modification time of the file it was made from. Only
+ * marked copies are sent, replaced or removed, so a "file.gz" that
+ * was uploaded is left alone. A copy is current while the mark
+ * matches the file, so an out-of-date copy is not sent.
+ *
+ * Copies are not made for files under a directory quota, so they
+ * never count against it.
+ *
+ *  @since 2021-05-06
+ */
+
+#define _GNU_SOURCE  /* for O_DIRECTORY, O_NOFOLLOW */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <zlib.h>
+#include "http_server.h"
+#include "file_util.h"
+#include "media_util.h"
+#include "properties.h"
+#include "compress_util.h"
+#include "dir_util.h"
+#include "quota_util.h"
+#include "statcache_util.h"
+#include "precompress_util.h"
+
+/** I/O priority of the precompressor: idle class (linux/ioprio.h) */
+#define PRECOMPRESS_IOPRIO ((3 << 13) | 0)
+
+/** Extended attribute that marks a gzip copy made by the server */
+#define PRECOMPRESS_XATTR "user.http.precompressed"
+
+/** Size of the precompressor input and output buffers */
+#define PRECOMPRESS_BUFSIZ 65536
+
+/** File or directory tree waiting for the precompressor */
+typedef struct PrecompressEntry {
+    char path[MAXPATHLEN];      /** file path, or directory path to scan */
+    bool scan;                  /** true to scan a directory tree */
+    struct PrecompressEntry *next;  /** next entry in queue */
+} PrecompressEntry;
+
+/** Entries waiting for the precompressor, oldest first */
+static PrecompressEntry *queueHead = NULL, *queueTail = NULL;
+
+/** Guards the queue */
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signals the precompressor that the queue is not empty */
+static pthread_cond_t queuePending = PTHREAD_COND_INITIALIZER;
+
+/** true once the precompressor is started */
+static bool precompressEnabled = false;
+
+/**
+ * Make the path of the gzip copy of a file.
+ *
+ * @param filePath the file path
+ * @param gzPath buffer for the path of the copy of MAXPATHLEN bytes
+ * @return true if the path fits
+ */
+static bool makeGzPath(const char *filePath, char *gzPath) {
+    int n = snprintf(gzPath, MAXPATHLEN, "%s.gz", filePath);
+    return n > 0 && n < MAXPATHLEN;
+}
+
+/**
+ * Determines whether a file has a gzip copy: its media type
+ * is compressible, and it is not under a directory quota.
+ *
+ * @param filePath the file path
+ * @param len the file length, or -1 if not known
+ * @return true if the file has a gzip copy
+ */
+static bool isPrecompressed(const char *filePath, long long len) {
+    char mediaType[MAX_PROP_VAL];
+    getMediaType(filePath, mediaType);
+    return isCompressibleContent(mediaType, len) && !hasQuota(filePath);
+}
+
+/**
+ * Make the mark of a gzip copy: the inode and modification
+ * time of the file it is made from.
+ *
+ * @param sb the properties of the file
+ * @param mark buffer for the mark of MAXBUF bytes
+ * @return the length of the mark
+ */
+static size_t makeCopyMark(const struct stat *sb, char *mark) {
+    return (size_t)snprintf(mark, MAXBUF, "%llx:%llx.%lx", (unsigned long long)sb->st_ino,
+                            (unsigned long long)sb->st_mtim.tv_sec, (unsigned long)sb->st_mtim.tv_nsec);
+}
+
+/**
+ * Determines whether an open gzip copy was made by the server,
+ * and if the properties of the file are given, whether it was
+ * made from the current version of the file.
+ *
+ * @param gzFd the descriptor of the gzip copy
+ * @param sb the properties of the file, or NULL for any version
+ * @return true if the copy is marked, for the file if given
+ */
+static bool isMarkedCopy(int gzFd, const struct stat *sb) {
+    char mark[MAXBUF], expected[MAXBUF];
+    ssize_t n = fgetxattr(gzFd, PRECOMPRESS_XATTR, mark, sizeof(mark)-1);
+    if (n <= 0) {
+        return false;
+    }
+    mark[n] = '\0';
+    return (sb == NULL) || ((size_t)n == makeCopyMark(sb, expected) && strcmp(mark, expected) == 0);
+}
+
+/**
+ * Remove the gzip copy at a path if it was made by the server.
+ *
+ * @param gzPath the path of the copy
+ * @return true if a copy was removed
+ */
+static bool removeMarkedCopy(const char *gzPath) {
+    int gzFd = open(gzPath, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (gzFd < 0) {
+        return false;
+    }
+    struct stat gzSb, pathSb;
+    bool removed = (fstat(gzFd, &gzSb) == 0) && S_ISREG(gzSb.st_mode) && isMarkedCopy(gzFd, NULL)
+        && (lstat(gzPath, &pathSb) == 0)  // not replaced since it was opened
+        && (pathSb.st_ino == gzSb.st_ino) && (pathSb.st_dev == gzSb.st_dev)
+        && (unlink(gzPath) == 0);
+    close(gzFd);
+    if (removed) {
+        invalidateStat(gzPath);
+    }
+    return removed;
+}
+
+/**
+ * Compress a file to a temp file next to its gzip copy.
+ *
+ * @param fd the file descriptor
+ * @param gzFd the descriptor of the temp file
+ * @param len the file length
+ * @return the compressed length, or -1 if error
+ */
+static off_t compressFile(int fd, int gzFd, off_t len) {
+    z_stream zs = {.zalloc = Z_NULL};
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    static unsigned char in[PRECOMPRESS_BUFSIZ], out[PRECOMPRESS_BUFSIZ];  // one thread
+    off_t gzLen = 0;
+    int status = Z_OK, flush = Z_NO_FLUSH;
+    while (status != Z_STREAM_END) {
+        if (zs.avail_in == 0 && flush != Z_FINISH) {
+            ssize_t n = read(fd, in, sizeof(in));
+            if (n < 0) {
+                break;
+            }
+            len -= n;
+            zs.next_in = in;
+            zs.avail_in = (uInt)n;
+            if (n == 0 || len <= 0) {
+                flush = Z_FINISH;
+            }
+        }
+        zs.next_out = out;
+        zs.avail_out = sizeof(out);
+        status = deflate(&zs, flush);
+        size_t n = sizeof(out) - zs.avail_out;
+        if (status == Z_STREAM_ERROR || (n > 0 && write(gzFd, out, n) != (ssize_t)n)) {
+            break;
+        }
+        gzLen += (off_t)n;
+    }
+    deflateEnd(&zs);
+    return (status == Z_STREAM_END) ? gzLen : -1;
+}
+
+/**
+ * Make the gzip copy of a file if it is missing or out of date.
+ * A copy that is not smaller than the file is not kept.
+ *
+ * @param filePath the file path
+ */
+static void precompressFile(const char *filePath) {
+    char gzPath[MAXPATHLEN];
+    int fd = makeGzPath(filePath, gzPath) ? open(filePath, O_RDONLY | O_NOFOLLOW | O_CLOEXEC) : -1;
+    if (fd < 0) {
+        return;
+    }
+    struct stat sb;
+    if (   (fstat(fd, &sb) != 0) || !S_ISREG(sb.st_mode)
+        || !isPrecompressed(filePath, (long long)sb.st_size)
+        || (getFileCoding(filePath) != CODING_IDENTITY)) {  // kept encoded as uploaded
+        close(fd);
+        return;
+    }
+
+    // a current copy is kept; a "file.gz" the server did not make is not replaced
+    int oldFd = open(gzPath, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (oldFd >= 0) {
+        bool keep = !isMarkedCopy(oldFd, NULL) || isMarkedCopy(oldFd, &sb);
+        close(oldFd);
+        if (keep || !removeMarkedCopy(gzPath)) {
+            close(fd);
+            return;
+        }
+    } else if (errno != ENOENT) {
+        close(fd);
+        return;
+    }
+
+    char tempPath[MAXPATHLEN];
+    int gzFd = createTempFile(gzPath, tempPath);
+    if (gzFd < 0) {
+        close(fd);
+        return;
+    }
+    off_t gzLen = compressFile(fd, gzFd, sb.st_size);
+    char mark[MAXBUF];
+    size_t markLen = makeCopyMark(&sb, mark);
+    struct timespec times[2] = {sb.st_atim, sb.st_mtim};
+    bool installed = false;
+    if (   (gzLen >= 0 && gzLen < sb.st_size)
+        && (fchmod(gzFd, sb.st_mode & ALLPERMS) == 0)
+        && (futimens(gzFd, times) == 0)
+        && (fsetxattr(gzFd, PRECOMPRESS_XATTR, mark, markLen, 0) == 0)
+        && (fdatasync(gzFd) == 0)
+        && (link(tempPath, gzPath) == 0)) {  // not over a "file.gz" uploaded meanwhile
+        installed = true;
+    }
+    unlink(tempPath);
+    close(gzFd);
+
+    // an upload that replaced the file while it was compressed
+    // queued it again; remove the copy of the old version
+    struct stat pathSb;
+    if (   installed
+        && (   (stat(filePath, &pathSb) != 0)
+            || (pathSb.st_ino != sb.st_ino) || (pathSb.st_dev != sb.st_dev)
+            || (pathSb.st_mtim.tv_sec != sb.st_mtim.tv_sec)
+            || (pathSb.st_mtim.tv_nsec != sb.st_mtim.tv_nsec))) {
+        removeMarkedCopy(gzPath);
+        installed = false;
+    }
+    close(fd);
+    if (installed) {
+        invalidateStat(gzPath);
+        char dirPath[MAXPATHLEN];
+        if (getPath(filePath, dirPath) != NULL) {
+            invalidateListing(dirPath);
+        }
+        if (server.debug) {
+            fprintf(stderr, "precompressed %s: %lld to %lld bytes\n",
+                    filePath, (long long)sb.st_size, (long long)gzLen);
+        }
+    }
+}
+
+/**
+ * Make missing or out of date gzip copies of the files in a directory tree.
+ * Hidden entries, which include temp files, are skipped.
+ *
+ * @param dirPath the directory path
+ */
+static void precompressTree(const char *dirPath) {
+    DIR *dir = opendir(dirPath);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        char path[MAXPATHLEN];
+        int n = snprintf(path, sizeof(path), "%s/%s", dirPath, ent->d_name);
+        if (n < 0 || n >= (int)sizeof(path)) {
+            continue;
+        }
+        unsigned char type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat sb;
+            if (lstat(path, &sb) != 0) {
+                continue;
+            }
+            type = S_ISDIR(sb.st_mode) ? DT_DIR : S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            precompressTree(path);
+        } else if (type == DT_REG) {
+            precompressFile(path);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * Precompressor thread: makes queued gzip copies one at a time
+ * at idle I/O priority.
+ *
+ * @param arg unused
+ * @return never returns
+ */
+static void *precompressThread(void *arg) {
+    (void)arg;
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, PRECOMPRESS_IOPRIO);
+    for (;;) {
+        pthread_mutex_lock(&queueLock);
+        while (queueHead == NULL) {
+            pthread_cond_wait(&queuePending, &queueLock);
+        }
+        PrecompressEntry *entry = queueHead;
+        queueHead = entry->next;
+        if (queueHead == NULL) {
+            queueTail = NULL;
+        }
+        pthread_mutex_unlock(&queueLock);
+
+        if (entry->scan) {
+            precompressTree(entry->path);
+        } else {
+            precompressFile(entry->path);
+        }
+        free(entry);
+    }
+    return NULL;
+}
+
+/**
+ * Queue a file or directory tree for the precompressor.
+ *
+ * @param path the file or directory path
+ * @param scan true to scan a directory tree
+ */
+static void queuePrecompress(const char *path, bool scan) {
+    PrecompressEntry *entry = malloc(sizeof(PrecompressEntry));
+    if (entry == NULL || strlen(path) >= sizeof(entry->path)) {
+        free(entry);
+        return;
+    }
+    strcpy(entry->path, path);
+    entry->scan = scan;
+    entry->next = NULL;
+    pthread_mutex_lock(&queueLock);
+    if (queueTail == NULL) {
+        queueHead = entry;
+    } else {
+        queueTail->next = entry;
+    }
+    queueTail = entry;
+    pthread_cond_signal(&queuePending);
+    pthread_mutex_unlock(&queueLock);
+}
+
+/**
+ * Start the precompressor thread and queue a scan of the content
+ * directory for files whose gzip copy is missing or out of date.
+ *
+ * @param contentBase the content base directory
+ * @return true if the precompressor was started
+ */
+bool initPrecompress(const char *contentBase) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, precompressThread, NULL) != 0) {
+        return false;
+    }
+    pthread_detach(thread);
+    precompressEnabled = true;
+    queuePrecompress(contentBase, true);
+    return true;
+}
+
+/**
+ * Open the gzip copy of a file if the server made it from the
+ * current version of the file.
+ *
+ * @param filePath the file path
+ * @param sb the properties of the file
+ * @param gzSb storage for the properties of the gzip copy
+ * @return the descriptor of the gzip copy, or -1 if none or out of date
+ */
+int openPrecompressed(const char *filePath, const struct stat *sb, struct stat *gzSb) {
+    char gzPath[MAXPATHLEN];
+    if (!precompressEnabled || !makeGzPath(filePath, gzPath)) {
+        return -1;
+    }
+    int gzFd = open(gzPath, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (gzFd < 0) {
+        return -1;
+    }
+    if (fstat(gzFd, gzSb) != 0 || !S_ISREG(gzSb->st_mode) || !isMarkedCopy(gzFd, sb)) {
+        close(gzFd);
+        return -1;
+    }
+    return gzFd;
+}
+
+/**
+ * Remove the gzip copy of a file that was written and queue the
+ * file for the precompressor to make a new one.
+ *
+ * @param filePath the file path
+ */
+void refreshPrecompressed(const char *filePath) {
+    if (precompressEnabled && isPrecompressed(filePath, -1)) {
+        removePrecompressed(filePath);
+        queuePrecompress(filePath, false);
+    }
+}
+
+/**
+ * Remove the gzip copy of a file that was deleted. A "file.gz"
+ * that the server did not make is kept.
+ *
+ * @param filePath the file path
+ */
+void removePrecompressed(const char *filePath) {
+    char gzPath[MAXPATHLEN];
+    if (precompressEnabled && isPrecompressed(filePath, -1) && makeGzPath(filePath, gzPath)) {
+        removeMarkedCopy(gzPath);
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * precompress_util.h
+ *
+ * Functions that keep gzip copies of compressible content files,
+ * so they are sent compressed without compressing them each time.
+ *
+ *  @since 2021-05-06
+ */
+
+#ifndef PRECOMPRESS_UTIL_H_
+#define PRECOMPRESS_UTIL_H_
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+/**
+ * Start the precompressor thread and queue a scan of the content
+ * directory for files whose gzip copy is missing or out of date.
+ *
+ * @param contentBase the content base directory
+ * @return true if the precompressor was started
+ */
+bool initPrecompress(const char *contentBase);
+
+/**
+ * Open the gzip copy of a file if the server made it from the
+ * current version of the file.
+ *
+ * @param filePath the file path
+ * @param sb the properties of the file
+ * @param gzSb storage for the properties of the gzip copy
+ * @return the descriptor of the gzip copy, or -1 if none or out of date
+ */
+int openPrecompressed(const char *filePath, const struct stat *sb, struct stat *gzSb);
+
+/**
+ * Remove the gzip copy of a file that was written and queue the
+ * file for the precompressor to make a new one.
+ *
+ * @param filePath the file path
+ */
+void refreshPrecompressed(const char *filePath);
+
+/**
+ * Remove the gzip copy of a file that was deleted. A "file.gz"
+ * that the server did not make is kept.
+ *
+ * @param filePath the file path
+ */
+void removePrecompressed(const char *filePath);
+
+#endif /* PRECOMPRESS_UTIL_H_ */
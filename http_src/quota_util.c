@@ -0,0 +1,243 @@
+/*
+ * quota_util.c
+ *
+ * Functions that limit the bytes stored in content directories.
+ * Each quota keeps the bytes used and reserved in its directory
+ * tree; uploads reserve their size before writing, so a request
+ * that does not fit is refused before any bytes are stored.
+ *
+ *  @since 2021-04-30
+ */
+
+#define _GNU_SOURCE  /* for nftw() */
+#include <ftw.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include "file_util.h"
+#include "quota_util.h"
+#include "segment_util.h"
+
+/** Quota on a directory tree */
+typedef struct Quota {
+    char dirPath[MAXPATHLEN];   /** directory path without trailing '/' */
+    size_t dirLen;              /** length of directory path */
+    unsigned long long limit;   /** maximum bytes */
+    unsigned long long used;    /** bytes stored or reserved */
+    bool scanned;               /** true once usage has been scanned */
+} Quota;
+
+/** Configured quotas */
+static Quota *quotas = NULL;
+
+/** Number of configured quotas */
+static size_t nquotas = 0;
+
+/** Guards usage of the quotas */
+static pthread_mutex_t quotaLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Bytes found by the current usage scan; guarded by quotaLock */
+static unsigned long long scanBytes;
+
+/**
+ * Add a quota on the bytes of the regular files in a directory
+ * tree. Usage is found by scanning the tree the first time the
+ * quota is needed, then kept up to date as uploads and deletes
+ * are made through the server.
+ *
+ * @param dirPath the directory path
+ * @param limit the maximum number of bytes
+ * @return true if the quota was added
+ */
+bool addDirectoryQuota(const char *dirPath, unsigned long long limit) {
+    size_t len = strlen(dirPath);
+    while (len > 1 && dirPath[len-1] == '/') {
+        len--;
+    }
+    if (len == 0 || len >= MAXPATHLEN) {
+        return false;
+    }
+    Quota *q = realloc(quotas, (nquotas+1) * sizeof(Quota));
+    if (q == NULL) {
+        return false;
+    }
+    quotas = q;
+    q = &quotas[nquotas++];
+    memcpy(q->dirPath, dirPath, len);
+    q->dirPath[len] = '\0';
+    q->dirLen = len;
+    q->limit = limit;
+    q->used = 0;
+    q->scanned = false;
+    return true;
+}
+
+/**
+ * Determines whether a quota covers a path.
+ *
+ * @param q the quota
+ * @param path the path
+ * @return true if the path is the quota directory or below it
+ */
+static bool coversPath(const Quota *q, const char *path) {
+    return strncmp(path, q->dirPath, q->dirLen) == 0
+        && (path[q->dirLen] == '/' || path[q->dirLen] == '\0');
+}
+
+/**
+ * Add the size of a regular file to the scan total.
+ *
+ * @param path the file path
+ * @param sb the file status
+ * @param type the nftw entry type
+ * @param ftw the nftw position
+ * @return 0 to continue the walk
+ */
+static int addFileBytes(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+    (void)path; (void)ftw;
+    if (type == FTW_F && S_ISREG(sb->st_mode)) {
+        scanBytes += (unsigned long long)sb->st_size;
+    }
+    return 0;
+}
+
+/**
+ * Find the usage of a quota by scanning its directory tree and
+ * counting its bodies in the segment store the first time the
+ * quota is used. Called with quotaLock held.
+ *
+ * @param q the quota
+ */
+static void scanQuota(Quota *q) {
+    if (!q->scanned) {
+        scanBytes = 0;
+        nftw(q->dirPath, addFileBytes, 16, FTW_PHYS);
+        unsigned long long segmentBytes;
+        countSegmentTree(q->dirPath, &segmentBytes);  // bodies without files
+        q->used += scanBytes + segmentBytes;
+        q->scanned = true;
+    }
+}
+
+/**
+ * Determines whether any quota covers a path.
+ *
+ * @param path the path
+ * @return true if a quota covers the path
+ */
+bool hasQuota(const char *path) {
+    for (size_t i = 0; i < nquotas; i++) {
+        if (coversPath(&quotas[i], path)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Reserve bytes for a file against every quota on its directories.
+ *
+ * @param filePath the file path
+ * @param nbytes the number of bytes
+ * @return true if reserved, false if a quota would be exceeded
+ */
+bool reserveQuota(const char *filePath, unsigned long long nbytes) {
+    if (nquotas == 0) {
+        return true;
+    }
+    bool fits = true;
+    pthread_mutex_lock(&quotaLock);
+    for (size_t i = 0; i < nquotas && fits; i++) {
+        if (coversPath(&quotas[i], filePath)) {
+            scanQuota(&quotas[i]);
+            fits = (nbytes <= quotas[i].limit - MIN(quotas[i].used, quotas[i].limit));
+        }
+    }
+    for (size_t i = 0; i < nquotas && fits; i++) {
+        if (coversPath(&quotas[i], filePath)) {
+            quotas[i].used += nbytes;
+        }
+    }
+    pthread_mutex_unlock(&quotaLock);
+    return fits;
+}
+
+/**
+ * Release bytes of a file that were reserved or stored,
+ * for example when an upload fails or a file is deleted.
+ *
+ * @param filePath the file path
+ * @param nbytes the number of bytes
+ */
+void releaseQuota(const char *filePath, unsigned long long nbytes) {
+    if (nquotas == 0 || nbytes == 0) {
+        return;
+    }
+    pthread_mutex_lock(&quotaLock);
+    for (size_t i = 0; i < nquotas; i++) {
+        if (coversPath(&quotas[i], filePath) && quotas[i].scanned) {
+            quotas[i].used -= MIN(nbytes, quotas[i].used);
+        }
+    }
+    pthread_mutex_unlock(&quotaLock);
+}
+
+/**
+ * Initialize a limit sink.
+ *
+ * @param limit the limit sink
+ * @param sink the next sink
+ * @param ctx the context of the next sink
+ * @param filePath the file charged for the bytes
+ * @param maxBytes the maximum body size or 0 if none
+ */
+void initLimitSink(LimitSink *limit, int (*sink)(void *, const char *, size_t), void *ctx,
+                   const char *filePath, unsigned long long maxBytes) {
+    limit->sink = sink;
+    limit->ctx = ctx;
+    limit->filePath = filePath;
+    limit->maxBytes = maxBytes;
+    limit->total = limit->reserved = 0;
+    limit->tooLarge = limit->noSpace = false;
+}
+
+/**
+ * Body sink that checks the limits of a LimitSink before passing
+ * bytes on. Quota is reserved QUOTA_STEP bytes at a time.
+ *
+ * @param ctx the limit sink
+ * @param bytes the body bytes
+ * @param len the number of bytes
+ * @return 0 if successful, -1 if a limit is exceeded or the next sink fails
+ */
+int limitSink(void *ctx, const char *bytes, size_t len) {
+    LimitSink *limit = ctx;
+    unsigned long long total = limit->total + len;
+    if (limit->maxBytes > 0 && total > limit->maxBytes) {
+        limit->tooLarge = true;
+        return -1;
+    }
+    if (total > limit->reserved) {
+        // reserve a step ahead, or just what is needed near the quota
+        unsigned long long need = total - limit->reserved;
+        unsigned long long step = MAX(need, QUOTA_STEP);
+        char dirPath[MAXPATHLEN];
+        if (!hasFreeSpace(getPath(limit->filePath, dirPath) ? dirPath : ".", (off_t)need)) {
+            limit->noSpace = true;
+            return -1;
+        }
+        if (!reserveQuota(limit->filePath, step)) {
+            if (!reserveQuota(limit->filePath, need)) {
+                limit->tooLarge = true;
+                return -1;
+            }
+            step = need;
+        }
+        limit->reserved += step;
+    }
+    limit->total = total;
+    return limit->sink(limit->ctx, bytes, len);
+}
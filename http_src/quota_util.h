@@ -0,0 +1,95 @@
+/*
+ * quota_util.h
+ *
+ * Functions that limit the bytes stored in content directories.
+ *
+ *  @since 2021-04-30
+ */
+
+#ifndef QUOTA_UTIL_H_
+#define QUOTA_UTIL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** Bytes reserved at a time while a body of unknown length arrives */
+#define QUOTA_STEP (1024*1024)
+
+/**
+ * Add a quota on the bytes of the regular files in a directory
+ * tree. Usage is found by scanning the tree the first time the
+ * quota is needed, then kept up to date as uploads and deletes
+ * are made through the server.
+ *
+ * @param dirPath the directory path
+ * @param limit the maximum number of bytes
+ * @return true if the quota was added
+ */
+bool addDirectoryQuota(const char *dirPath, unsigned long long limit);
+
+/**
+ * Determines whether any quota covers a path.
+ *
+ * @param path the path
+ * @return true if a quota covers the path
+ */
+bool hasQuota(const char *path);
+
+/**
+ * Reserve bytes for a file against every quota on its directories.
+ *
+ * @param filePath the file path
+ * @param nbytes the number of bytes
+ * @return true if reserved, false if a quota would be exceeded
+ */
+bool reserveQuota(const char *filePath, unsigned long long nbytes);
+
+/**
+ * Release bytes of a file that were reserved or stored,
+ * for example when an upload fails or a file is deleted.
+ *
+ * @param filePath the file path
+ * @param nbytes the number of bytes
+ */
+void releaseQuota(const char *filePath, unsigned long long nbytes);
+
+/**
+ * Body sink that enforces the maximum body size, directory quotas
+ * and free disk space on a body of unknown length as it arrives,
+ * then passes the bytes on to another sink.
+ */
+typedef struct LimitSink {
+    int (*sink)(void *ctx, const char *bytes, size_t len);  /** next sink */
+    void *ctx;                  /** context of next sink */
+    const char *filePath;       /** file charged for the bytes */
+    unsigned long long maxBytes;  /** maximum body size or 0 if none */
+    unsigned long long total;   /** bytes passed on so far; at most reserved */
+    unsigned long long reserved;  /** bytes reserved against quotas */
+    bool tooLarge;              /** true if size or quota exceeded */
+    bool noSpace;               /** true if file system is full */
+} LimitSink;
+
+/**
+ * Initialize a limit sink.
+ *
+ * @param limit the limit sink
+ * @param sink the next sink
+ * @param ctx the context of the next sink
+ * @param filePath the file charged for the bytes
+ * @param maxBytes the maximum body size or 0 if none
+ */
+void initLimitSink(LimitSink *limit, int (*sink)(void *, const char *, size_t), void *ctx,
+                   const char *filePath, unsigned long long maxBytes);
+
+/**
+ * Body sink that checks the limits of a LimitSink before passing
+ * bytes on. Quota is reserved QUOTA_STEP bytes at a time.
+ *
+ * @param ctx the limit sink
+ * @param bytes the body bytes
+ * @param len the number of bytes
+ * @return 0 if successful, -1 if a limit is exceeded or the next sink fails
+ */
+int limitSink(void *ctx, const char *bytes, size_t len);
+
+#endif /* QUOTA_UTIL_H_ */
@@ -0,0 +1,1069 @@
+/*
+ * segment_util.c
+ *
+ * Functions that implement a log-structured store for small
+ * POST bodies. Rather than a file per body, bodies are appended as
+ * records to large segment files, and an in-memory index maps each
+ * file path to the segment, offset and length of its body, so many
+ * small uploads do not fill directories with inodes. Removing a
+ * body appends a delete record.
+ *
+ * A segment that reaches the segment size is sealed and a new one
+ * started. When more than half the bytes of the sealed segments are
+ * dead, a compactor thread copies the live records of the oldest
+ * segment to the end of the log and removes it. Only the oldest
+ * segment is compacted, so a delete record is never dropped while
+ * an older segment still holds the body it deleted.
+ *
+ * Each record has a CRC-32 of its header, path and body. At startup
+ * the index is rebuilt by replaying the segments in order; a record
+ * that fails its check ends its segment, and the newest segment is
+ * truncated there, so a write torn by a crash is discarded.
+ *
+ * Segments are stored as <store>/seg-<8 hex digits>.log.
+ *
+ *  @since 2021-05-03
+ */
+
+#define _GNU_SOURCE  /* for F_DUPFD_CLOEXEC */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#include "http_server.h"
+#include "file_util.h"
+#include "hashmap.h"
+#include "sync_util.h"
+#include "segment_util.h"
+
+/** Marks the start of a record: "RSEG" */
+#define SEGMENT_MAGIC 0x47455352u
+
+/** Record types */
+enum {
+    SEGMENT_BODY = 1,           /** body of a file path */
+    SEGMENT_DELETE = 2,         /** removes the body of a file path */
+    SEGMENT_DELETE_TREE = 3     /** removes the bodies in a directory tree */
+};
+
+/** Header of a record, followed by the path and the body */
+typedef struct SegmentRecord {
+    uint32_t magic;             /** SEGMENT_MAGIC */
+    uint32_t crc;               /** CRC-32 of the rest of the record */
+    uint64_t seq;               /** record number */
+    uint64_t length;            /** body length */
+    int64_t mtimeSec;           /** time stored: seconds */
+    uint32_t mtimeNsec;         /** time stored: nanoseconds */
+    uint16_t pathLen;           /** path length, relative to content base */
+    uint16_t type;              /** record type */
+} SegmentRecord;
+
+_Static_assert(sizeof(SegmentRecord) == 40, "segment record header is not packed");
+
+/** A segment file */
+typedef struct Segment {
+    unsigned int id;            /** segment number */
+    int fd;                     /** segment descriptor */
+    off_t size;                 /** bytes of valid records */
+    unsigned long long liveBytes;  /** bytes of records in the index */
+} Segment;
+
+/** Index entry of a body */
+typedef struct IndexedBody {
+    unsigned int segment;       /** segment number */
+    off_t offset;               /** offset of record in segment */
+    size_t recordLen;           /** length of record */
+    size_t length;              /** body length */
+    unsigned long long seq;     /** record number */
+    struct timespec mtime;      /** time stored */
+} IndexedBody;
+
+/** Path of the segment store directory */
+static char segmentStore[MAXPATHLEN];
+
+/** Size at which a segment is sealed */
+static size_t segmentSize;
+
+/** Largest body stored in a segment */
+static size_t maxSegmentRecord;
+
+/** Segments in order; the last one is appended to */
+static Segment *segments = NULL;
+
+/** Number of segments */
+static size_t nsegments = 0;
+
+/** Index: directory path -> (file name -> IndexedBody); NULL if disabled */
+static HashMap *segmentDirs = NULL;
+
+/** Last record number used */
+static unsigned long long lastSeq = 0;
+
+/** Guards the segments, the index and lastSeq */
+static pthread_mutex_t segmentLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signals the compactor that dead bytes have grown */
+static pthread_cond_t segmentGarbage = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Make the path of a segment file.
+ *
+ * @param id the segment number
+ * @param path buffer for the path of MAXPATHLEN bytes
+ * @return the path
+ */
+static char *segmentPath(unsigned int id, char *path) {
+    snprintf(path, MAXPATHLEN, "%s/seg-%08x.log", segmentStore, id);
+    return path;
+}
+
+/**
+ * Find a segment by number. Called with segmentLock held.
+ *
+ * @param id the segment number
+ * @return the segment or NULL if removed
+ */
+static Segment *findSegment(unsigned int id) {
+    size_t lo = 0, hi = nsegments;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (segments[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo < nsegments && segments[lo].id == id) ? &segments[lo] : NULL;
+}
+
+/**
+ * Compute the checksum of a record.
+ *
+ * @param rec the record header
+ * @param path the record path
+ * @param body the record body
+ * @return the CRC-32 of the header after the crc field, the path and the body
+ */
+static uint32_t recordCrc(const SegmentRecord *rec, const char *path, const char *body) {
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef*)&rec->seq, sizeof(SegmentRecord) - offsetof(SegmentRecord, seq));
+    crc = crc32(crc, (const Bytef*)path, rec->pathLen);
+    crc = crc32_z(crc, (const Bytef*)body, (z_size_t)rec->length);
+    return (uint32_t)crc;
+}
+
+/**
+ * Split a file path into its directory path and name.
+ *
+ * @param filePath the file path
+ * @param dirPath buffer for the directory path of MAXPATHLEN bytes
+ * @return the name within filePath, or NULL if the path has no directory
+ */
+static const char *splitPath(const char *filePath, char *dirPath) {
+    const char *name = strrchr(filePath, '/');
+    if (name == NULL || name[1] == '\0' || (size_t)(name - filePath) >= MAXPATHLEN) {
+        return NULL;
+    }
+    memcpy(dirPath, filePath, (size_t)(name - filePath));
+    dirPath[name - filePath] = '\0';
+    return name + 1;
+}
+
+/**
+ * Get the index entry of a file path. Called with segmentLock held.
+ *
+ * @param filePath the file path
+ * @return the entry or NULL if not stored
+ */
+static IndexedBody *findBody(const char *filePath) {
+    char dirPath[MAXPATHLEN];
+    const char *name = splitPath(filePath, dirPath);
+    if (name == NULL) {
+        return NULL;
+    }
+    HashMap *names = getHashMap(segmentDirs, dirPath);
+    return (names == NULL) ? NULL : getHashMap(names, name);
+}
+
+/**
+ * Remove a body from the live bytes of its segment.
+ * Called with segmentLock held.
+ *
+ * @param body the index entry
+ */
+static void killBody(const IndexedBody *body) {
+    Segment *seg = findSegment(body->segment);
+    if (seg != NULL) {
+        seg->liveBytes -= body->recordLen;
+    }
+}
+
+/**
+ * Add a body to the index, replacing any body at its path.
+ * Called with segmentLock held.
+ *
+ * @param filePath the file path
+ * @param body the index entry; owned by the index if successful
+ * @return true if added, false if no space
+ */
+static bool indexBody(const char *filePath, IndexedBody *body) {
+    char dirPath[MAXPATHLEN];
+    const char *name = splitPath(filePath, dirPath);
+    if (name == NULL) {
+        return false;
+    }
+    HashMap *names = getHashMap(segmentDirs, dirPath);
+    if (names == NULL) {
+        if ((names = newHashMap(64)) == NULL) {
+            return false;
+        }
+        if (!putHashMap(segmentDirs, dirPath, names, NULL)) {
+            deleteHashMap(names, NULL);
+            return false;
+        }
+    }
+    IndexedBody *old = NULL;
+    if (!putHashMap(names, name, body, (void**)&old)) {
+        return false;
+    }
+    if (old != NULL) {
+        killBody(old);
+        free(old);
+    }
+    Segment *seg = findSegment(body->segment);
+    if (seg != NULL) {
+        seg->liveBytes += body->recordLen;
+    }
+    return true;
+}
+
+/**
+ * Remove a body from the index. Called with segmentLock held.
+ *
+ * @param filePath the file path
+ * @param nbytes storage for the body length; may be NULL
+ * @return true if removed, false if not stored
+ */
+static bool unindexBody(const char *filePath, unsigned long long *nbytes) {
+    char dirPath[MAXPATHLEN];
+    const char *name = splitPath(filePath, dirPath);
+    HashMap *names = (name == NULL) ? NULL : getHashMap(segmentDirs, dirPath);
+    IndexedBody *body = (names == NULL) ? NULL : removeHashMap(names, name);
+    if (body == NULL) {
+        return false;
+    }
+    if (nbytes != NULL) {
+        *nbytes = body->length;
+    }
+    killBody(body);
+    free(body);
+    if (sizeHashMap(names) == 0) {
+        removeHashMap(segmentDirs, dirPath);
+        deleteHashMap(names, NULL);
+    }
+    return true;
+}
+
+/** Directory tree being visited and the totals of its bodies */
+typedef struct TreeVisit {
+    const char *dirPath;        /** directory path without trailing '/' */
+    size_t dirLen;              /** length of directory path */
+    bool remove;                /** true to remove the bodies */
+    size_t count;               /** number of bodies */
+    unsigned long long nbytes;  /** total length of bodies */
+} TreeVisit;
+
+/**
+ * Add a body to the totals of a tree visit; remove it if requested.
+ *
+ * @param key the file name
+ * @param value the index entry
+ * @param ctx the tree visit
+ * @return true to remove the entry
+ */
+static bool visitTreeBody(const char *key, void *value, void *ctx) {
+    (void)key;
+    TreeVisit *visit = ctx;
+    IndexedBody *body = value;
+    visit->count++;
+    visit->nbytes += body->length;
+    if (visit->remove) {
+        killBody(body);
+        free(body);
+    }
+    return visit->remove;
+}
+
+/**
+ * Visit the bodies of a directory if it is in the tree.
+ *
+ * @param key the directory path
+ * @param value the name map of the directory
+ * @param ctx the tree visit
+ * @return true to remove the directory
+ */
+static bool visitTreeDir(const char *key, void *value, void *ctx) {
+    TreeVisit *visit = ctx;
+    if (   strncmp(key, visit->dirPath, visit->dirLen) != 0
+        || (key[visit->dirLen] != '/' && key[visit->dirLen] != '\0')) {
+        return false;
+    }
+    forEachHashMap(value, visitTreeBody, visit);
+    if (visit->remove) {
+        deleteHashMap(value, NULL);
+    }
+    return visit->remove;
+}
+
+/**
+ * Count or remove the bodies of a directory tree.
+ * Called with segmentLock held.
+ *
+ * @param visit the tree visit
+ */
+static void visitTree(TreeVisit *visit) {
+    visit->dirLen = strlen(visit->dirPath);
+    while (visit->dirLen > 1 && visit->dirPath[visit->dirLen-1] == '/') {
+        visit->dirLen--;
+    }
+    forEachHashMap(segmentDirs, visitTreeDir, visit);
+}
+
+/**
+ * Create a new empty segment to append to. Called with segmentLock held.
+ *
+ * @return 0 if successful, otherwise the errno of the failure
+ */
+static int startSegment(void) {
+    Segment *grown = realloc(segments, (nsegments+1) * sizeof(Segment));
+    if (grown == NULL) {
+        return ENOMEM;
+    }
+    segments = grown;
+    unsigned int id = (nsegments == 0) ? 1 : segments[nsegments-1].id + 1;
+    char path[MAXPATHLEN];
+    int fd = open(segmentPath(id, path), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return errno;
+    }
+    segments[nsegments++] = (Segment){.id = id, .fd = fd, .size = 0, .liveBytes = 0};
+    return 0;
+}
+
+/**
+ * Write a record at the end of the log, sealing the current segment
+ * and starting a new one if the record does not fit.
+ * Called with segmentLock held.
+ *
+ * @param rec the record header
+ * @param path the record path
+ * @param body the record body
+ * @param loc storage for the segment and offset of the record; may be NULL
+ * @return 0 if successful, otherwise the errno of the failure
+ */
+static int writeRecord(const SegmentRecord *rec, const char *path, const char *body, IndexedBody *loc) {
+    size_t recordLen = sizeof(SegmentRecord) + rec->pathLen + rec->length;
+    Segment *seg = &segments[nsegments-1];
+    if (seg->size > 0 && (size_t)seg->size + recordLen > segmentSize) {
+        int err = startSegment();
+        if (err != 0) {
+            return err;
+        }
+        seg = &segments[nsegments-1];
+    }
+
+    // a failed write leaves the end of the log where it was
+    struct iovec iov[3] = {
+        {(void*)rec, sizeof(SegmentRecord)}, {(void*)path, rec->pathLen}, {(void*)body, rec->length}
+    };
+    ssize_t n;
+    while ((n = pwritev(seg->fd, iov, 3, seg->size)) < 0 && errno == EINTR) {
+    }
+    if (n < 0) {
+        return errno;
+    }
+    if ((size_t)n < recordLen) {
+        return ENOSPC;
+    }
+    if (loc != NULL) {
+        loc->segment = seg->id;
+        loc->offset = seg->size;
+        loc->recordLen = recordLen;
+    }
+    seg->size += (off_t)recordLen;
+    return 0;
+}
+
+/**
+ * Determines whether the oldest segment should be compacted:
+ * it has no live bytes, or more than half the bytes of the
+ * sealed segments are dead. Called with segmentLock held.
+ *
+ * @return true if the oldest segment should be compacted
+ */
+static bool needsCompaction(void) {
+    if (nsegments < 2) {
+        return false;
+    }
+    if (segments[0].liveBytes == 0) {
+        return true;
+    }
+    unsigned long long live = 0, dead = 0;
+    for (size_t i = 0; i < nsegments-1; i++) {
+        live += segments[i].liveBytes;
+        dead += (unsigned long long)segments[i].size - segments[i].liveBytes;
+    }
+    return dead > live;
+}
+
+/**
+ * Make a record durable as configured. Called without segmentLock;
+ * fd is a duplicate of the segment descriptor and is closed.
+ *
+ * @param fd the segment descriptor
+ * @return 0 if successful, -1 if error
+ */
+static int commitRecord(int fd) {
+    int status = commitFiles(&fd, 1, segmentStore);
+    close(fd);
+    return status;
+}
+
+/**
+ * Append a delete record for a path or a directory tree and make it
+ * durable as configured. Called with segmentLock held; it is released.
+ *
+ * @param filePath the file or directory path
+ * @param type SEGMENT_DELETE or SEGMENT_DELETE_TREE
+ * @return 0 if successful, -1 with errno set if error
+ */
+static int writeDelete(const char *filePath, uint16_t type) {
+    const char *path = filePath + strlen(server.content_base);
+    SegmentRecord rec = {
+        .magic = SEGMENT_MAGIC, .seq = ++lastSeq, .length = 0,
+        .pathLen = (uint16_t)strlen(path), .type = type
+    };
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec.mtimeSec = now.tv_sec;
+    rec.mtimeNsec = (uint32_t)now.tv_nsec;
+    rec.crc = recordCrc(&rec, path, "");
+    int err = writeRecord(&rec, path, "", NULL);
+    int fd = (err == 0) ? fcntl(segments[nsegments-1].fd, F_DUPFD_CLOEXEC, 0) : -1;
+    if (err == 0 && fd < 0) {
+        err = errno;
+    }
+    pthread_mutex_unlock(&segmentLock);
+    if (err != 0 || commitRecord(fd) != 0) {
+        errno = (err != 0) ? err : EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Apply a record read from a segment to the index.
+ * Called with segmentLock held.
+ *
+ * @param rec the record header
+ * @param path the record path
+ * @param seg the segment
+ * @param offset the offset of the record
+ */
+static void replayRecord(const SegmentRecord *rec, const char *path, const Segment *seg, off_t offset) {
+    char filePath[MAXPATHLEN];
+    snprintf(filePath, sizeof(filePath), "%s%.*s", server.content_base, (int)rec->pathLen, path);
+    if (rec->seq > lastSeq) {
+        lastSeq = rec->seq;
+    }
+    if (rec->type == SEGMENT_BODY) {
+        IndexedBody *body = malloc(sizeof(IndexedBody));
+        if (body != NULL) {
+            *body = (IndexedBody){
+                .segment = seg->id, .offset = offset,
+                .recordLen = sizeof(SegmentRecord) + rec->pathLen + rec->length,
+                .length = rec->length, .seq = rec->seq,
+                .mtime = {.tv_sec = rec->mtimeSec, .tv_nsec = rec->mtimeNsec}
+            };
+            if (!indexBody(filePath, body)) {
+                free(body);
+            }
+        }
+    } else if (rec->type == SEGMENT_DELETE) {
+        unindexBody(filePath, NULL);
+    } else {
+        TreeVisit visit = {.dirPath = filePath, .remove = true};
+        visitTree(&visit);
+    }
+}
+
+/**
+ * Rebuild the index from the records of a segment, stopping at
+ * the first record that is incomplete or fails its checksum.
+ * Called with segmentLock held.
+ *
+ * @param seg the segment; its size is set to the bytes of valid records
+ * @param isLast true if this is the newest segment, which is
+ *   truncated after its last valid record
+ */
+static void replaySegment(Segment *seg, bool isLast) {
+    struct stat sb;
+    int fd = fcntl(seg->fd, F_DUPFD_CLOEXEC, 0);
+    FILE *in = (fd < 0) ? NULL : fdopen(fd, "r");
+    if (in == NULL || fstat(seg->fd, &sb) != 0) {
+        if (in != NULL) {
+            fclose(in);
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        seg->size = 0;
+        return;
+    }
+
+    char path[UINT16_MAX];
+    char *body = NULL;
+    size_t bodyCap = 0;
+    off_t offset = 0;
+    SegmentRecord rec;
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        off_t recordLen = (off_t)sizeof(rec) + rec.pathLen + (off_t)rec.length;
+        if (   (rec.magic != SEGMENT_MAGIC)
+            || (rec.type < SEGMENT_BODY || rec.type > SEGMENT_DELETE_TREE)
+            || (rec.pathLen == 0 && rec.type != SEGMENT_DELETE_TREE)
+            || (rec.length > (uint64_t)(sb.st_size - offset))
+            || (offset + recordLen > sb.st_size)) {
+            break;
+        }
+        if (rec.length > bodyCap) {
+            char *grown = realloc(body, rec.length);
+            if (grown == NULL) {
+                break;
+            }
+            body = grown;
+            bodyCap = rec.length;
+        }
+        if (   (fread(path, 1, rec.pathLen, in) != rec.pathLen)
+            || (fread(body, 1, rec.length, in) != rec.length)
+            || (recordCrc(&rec, path, body) != rec.crc)) {
+            break;
+        }
+        replayRecord(&rec, path, seg, offset);
+        offset += recordLen;
+    }
+    fclose(in);
+    free(body);
+
+    seg->size = offset;
+    if (offset < sb.st_size) {
+        char segPath[MAXPATHLEN];
+        fprintf(stderr, "Segment %s: discarding %lld bytes after offset %lld\n",
+                segmentPath(seg->id, segPath), (long long)(sb.st_size - offset), (long long)offset);
+        if (isLast && ftruncate(seg->fd, offset) != 0) {
+            perror("ftruncate");
+        }
+    }
+}
+
+/**
+ * Copy a record of the oldest segment to the end of the log if its
+ * body is still live. Called with segmentLock held.
+ *
+ * @param rec the record header
+ * @param path the record path
+ * @param body the record body
+ * @param id the segment number
+ * @param offset the offset of the record
+ * @return 0 if successful, otherwise the errno of the failure
+ */
+static int moveRecord(const SegmentRecord *rec, const char *path, const char *body,
+                      unsigned int id, off_t offset) {
+    char filePath[MAXPATHLEN];
+    snprintf(filePath, sizeof(filePath), "%s%.*s", server.content_base, (int)rec->pathLen, path);
+    IndexedBody *live = findBody(filePath);
+    if (live == NULL || live->segment != id || live->offset != offset) {
+        return 0;  // removed or replaced
+    }
+    IndexedBody loc;
+    int err = writeRecord(rec, path, body, &loc);  // unchanged, so checksum still holds
+    if (err == 0) {
+        killBody(live);
+        live->segment = loc.segment;
+        live->offset = loc.offset;
+        findSegment(loc.segment)->liveBytes += live->recordLen;
+    }
+    return err;
+}
+
+/**
+ * Compact the oldest segment: copy its live records to the end
+ * of the log, make the copies durable, then remove the segment.
+ * Records are read without the lock; a sealed segment does not
+ * change, and only the compactor removes segments.
+ */
+static void compactOldest(void) {
+    pthread_mutex_lock(&segmentLock);
+    Segment oldest = segments[0];
+    unsigned int firstNew = segments[nsegments-1].id;
+    pthread_mutex_unlock(&segmentLock);
+
+    char *buf = malloc(sizeof(SegmentRecord) + UINT16_MAX + maxSegmentRecord);
+    int err = (buf == NULL) ? ENOMEM : 0;
+    for (off_t offset = 0; err == 0 && oldest.liveBytes > 0 && offset < oldest.size; ) {
+        SegmentRecord rec;
+        if (pread(oldest.fd, &rec, sizeof(rec), offset) != (ssize_t)sizeof(rec)) {
+            err = EIO;
+            break;
+        }
+        size_t recordLen = sizeof(rec) + rec.pathLen + rec.length;
+        if (rec.type == SEGMENT_BODY) {  // delete records are dropped
+            size_t dataLen = rec.pathLen + rec.length;
+            if (dataLen > UINT16_MAX + maxSegmentRecord) {  // stored under a larger limit
+                char *grown = realloc(buf, sizeof(rec) + dataLen);
+                if (grown == NULL) {
+                    err = ENOMEM;
+                    break;
+                }
+                buf = grown;
+            }
+            if (pread(oldest.fd, buf, dataLen, offset + (off_t)sizeof(rec)) != (ssize_t)dataLen) {
+                err = EIO;
+                break;
+            }
+            pthread_mutex_lock(&segmentLock);
+            err = moveRecord(&rec, buf, buf + rec.pathLen, oldest.id, offset);
+            pthread_mutex_unlock(&segmentLock);
+        }
+        offset += (off_t)recordLen;
+    }
+    free(buf);
+
+    // copies must be durable before the originals are removed
+    pthread_mutex_lock(&segmentLock);
+    size_t nsync = 0;
+    int fds[nsegments];
+    for (size_t i = 0; i < nsegments && err == 0; i++) {
+        if (segments[i].id >= firstNew && (fds[nsync] = fcntl(segments[i].fd, F_DUPFD_CLOEXEC, 0)) >= 0) {
+            nsync++;
+        }
+    }
+    pthread_mutex_unlock(&segmentLock);
+    for (size_t i = 0; i < nsync; i++) {
+        if (fdatasync(fds[i]) != 0) {
+            err = errno;
+        }
+        close(fds[i]);
+    }
+
+    char path[MAXPATHLEN];
+    segmentPath(oldest.id, path);
+    pthread_mutex_lock(&segmentLock);
+    if (err == 0 && segments[0].liveBytes == 0) {
+        unlink(path);
+        close(segments[0].fd);
+        memmove(&segments[0], &segments[1], (nsegments-1) * sizeof(Segment));
+        nsegments--;
+    } else {
+        err = (err != 0) ? err : EAGAIN;
+    }
+    pthread_mutex_unlock(&segmentLock);
+
+    if (err == 0) {
+        if (nsegments > 0 && server.durability != DURABILITY_NONE) {
+            commitFiles(NULL, 0, segmentStore);
+        }
+        if (server.debug) {
+            fprintf(stderr, "compacted %s: moved %llu of %lld bytes\n", path, oldest.liveBytes, (long long)oldest.size);
+        }
+    } else {
+        fprintf(stderr, "Compacting %s failed: %s\n", path, strerror(err));
+        sleep(1);  // retry later
+    }
+}
+
+/**
+ * Compactor thread: compacts the oldest segment while more than
+ * half the bytes of the sealed segments are dead.
+ *
+ * @param arg unused
+ * @return never returns
+ */
+static void *compactThread(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&segmentLock);
+        while (!needsCompaction()) {
+            pthread_cond_wait(&segmentGarbage, &segmentLock);
+        }
+        pthread_mutex_unlock(&segmentLock);
+        compactOldest();
+    }
+    return NULL;
+}
+
+/**
+ * Compare segment numbers for qsort().
+ *
+ * @param a the first segment
+ * @param b the second segment
+ * @return <0, 0, >0 if a is before, same, or after b
+ */
+static int compareSegments(const void *a, const void *b) {
+    unsigned int ia = ((const Segment*)a)->id, ib = ((const Segment*)b)->id;
+    return (ia < ib) ? -1 : (ia > ib);
+}
+
+/**
+ * Initialize the segment store and rebuild its index from the
+ * records of its segments. A record that fails its checksum ends
+ * its segment, and the newest segment is truncated there.
+ *
+ * @param storeDir the segment store directory
+ * @param size the size at which a segment is sealed
+ * @param maxRecord the largest body stored in a segment
+ * @return true if the segment store can be used
+ */
+bool initSegmentStore(const char *storeDir, size_t size, size_t maxRecord) {
+    if (   (strlen(storeDir) >= sizeof(segmentStore) - 32)
+        || (mkdirs(storeDir, 0700) != 0)
+        || (size == 0) || (maxRecord > size)) {
+        return false;
+    }
+    strcpy(segmentStore, storeDir);
+    segmentSize = size;
+    maxSegmentRecord = maxRecord;
+    if ((segmentDirs = newHashMap(1024)) == NULL) {
+        return false;
+    }
+
+    // open existing segments in order
+    DIR *dir = opendir(segmentStore);
+    if (dir == NULL) {
+        return false;
+    }
+    struct dirent *ent;
+    unsigned int id;
+    char tail;
+    while ((ent = readdir(dir)) != NULL) {
+        if (sscanf(ent->d_name, "seg-%8x.lo%c", &id, &tail) != 2 || tail != 'g') {
+            continue;
+        }
+        char path[MAXPATHLEN];
+        int fd = open(segmentPath(id, path), O_RDWR | O_CLOEXEC);
+        Segment *grown = (fd < 0) ? NULL : realloc(segments, (nsegments+1) * sizeof(Segment));
+        if (grown == NULL) {
+            perror(path);
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+        segments = grown;
+        segments[nsegments++] = (Segment){.id = id, .fd = fd};
+    }
+    closedir(dir);
+    if (nsegments > 0) {
+        qsort(segments, nsegments, sizeof(Segment), compareSegments);
+    }
+
+    // rebuild index by replaying records in the order they were written
+    pthread_mutex_lock(&segmentLock);
+    for (size_t i = 0; i < nsegments; i++) {
+        replaySegment(&segments[i], i == nsegments-1);
+    }
+    int err = (nsegments == 0) ? startSegment() : 0;
+    pthread_mutex_unlock(&segmentLock);
+    if (err != 0) {
+        return false;
+    }
+    if (server.debug) {
+        fprintf(stderr, "segment store %s: %zu segments, %llu records\n", segmentStore, nsegments, lastSeq);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, compactThread, NULL) != 0) {
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+/**
+ * Determines whether a body of a given length is stored
+ * in the segment store.
+ *
+ * @param len the body length or -1 if unknown
+ * @return true if the store is enabled and the body is small enough
+ */
+bool isSegmentBody(long long len) {
+    return (segmentDirs != NULL) && (len >= 0) && ((unsigned long long)len <= maxSegmentRecord);
+}
+
+/**
+ * Append a body to the segment store under a unique file path.
+ * Like mkstemps(), the path is a template whose last six characters
+ * before a suffix are "XXXXXX"; they are replaced to make a path
+ * that names neither a stored body nor a file.
+ *
+ * @param filePath the path template; replaced by the path of the body
+ * @param suffixLen the length of the suffix after "XXXXXX"
+ * @param body the body
+ * @param len the body length
+ * @return 0 if successful, otherwise the errno of the failure
+ */
+int appendSegmentBody(char *filePath, int suffixLen, const char *body, size_t len) {
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    size_t pathLen = strlen(filePath);
+    size_t baseLen = strlen(server.content_base);
+    if (   (pathLen < baseLen + 6 + (size_t)suffixLen) || (pathLen - baseLen > UINT16_MAX)
+        || (strncmp(filePath, server.content_base, baseLen) != 0)
+        || (strncmp(filePath + pathLen - suffixLen - 6, "XXXXXX", 6) != 0)) {
+        return EINVAL;
+    }
+    char *xs = filePath + pathLen - suffixLen - 6;
+    IndexedBody *indexed = malloc(sizeof(IndexedBody));
+    if (indexed == NULL) {
+        return ENOMEM;
+    }
+
+    pthread_mutex_lock(&segmentLock);
+    int err = EEXIST;
+    for (int tries = 0; tries < 100 && err == EEXIST; tries++) {
+        unsigned char rnd[6];
+        if (getrandom(rnd, sizeof(rnd), 0) != (ssize_t)sizeof(rnd)) {
+            for (int i = 0; i < 6; i++) {
+                rnd[i] = (unsigned char)rand();
+            }
+        }
+        for (int i = 0; i < 6; i++) {
+            xs[i] = letters[rnd[i] % (sizeof(letters)-1)];
+        }
+        struct stat sb;
+        if (findBody(filePath) == NULL && lstat(filePath, &sb) != 0 && errno == ENOENT) {
+            err = 0;
+        }
+    }
+    int fd = -1;
+    if (err == 0) {
+        const char *path = filePath + baseLen;
+        SegmentRecord rec = {
+            .magic = SEGMENT_MAGIC, .seq = ++lastSeq, .length = len,
+            .pathLen = (uint16_t)(pathLen - baseLen), .type = SEGMENT_BODY
+        };
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        rec.mtimeSec = now.tv_sec;
+        rec.mtimeNsec = (uint32_t)now.tv_nsec;
+        rec.crc = recordCrc(&rec, path, body);
+        *indexed = (IndexedBody){.length = len, .seq = rec.seq, .mtime = now};
+        err = writeRecord(&rec, path, body, indexed);
+    }
+    if (err == 0 && !indexBody(filePath, indexed)) {
+        err = ENOMEM;  // record is replayed at the next start
+    }
+    if (err != 0) {
+        pthread_mutex_unlock(&segmentLock);
+        free(indexed);
+        return err;
+    }
+    fd = fcntl(segments[nsegments-1].fd, F_DUPFD_CLOEXEC, 0);
+    pthread_mutex_unlock(&segmentLock);
+    return (fd >= 0 && commitRecord(fd) == 0) ? 0 : EIO;
+}
+
+/**
+ * Find a body in the segment store.
+ *
+ * @param filePath the file path
+ * @param entry storage for the location of the body
+ * @return true if found, false if not stored or error
+ */
+bool openSegmentEntry(const char *filePath, SegmentEntry *entry) {
+    if (segmentDirs == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&segmentLock);
+    IndexedBody *body = findBody(filePath);
+    Segment *seg = (body == NULL) ? NULL : findSegment(body->segment);
+    entry->fd = (seg == NULL) ? -1 : fcntl(seg->fd, F_DUPFD_CLOEXEC, 0);
+    if (entry->fd >= 0) {  // duplicate stays readable if the segment is compacted
+        entry->offset = body->offset + (off_t)(body->recordLen - body->length);
+        entry->length = body->length;
+        entry->seq = body->seq;
+        entry->mtime = body->mtime;
+    }
+    pthread_mutex_unlock(&segmentLock);
+    return entry->fd >= 0;
+}
+
+/**
+ * Remove a body from the segment store.
+ *
+ * @param filePath the file path
+ * @param nbytes storage for the length of the removed body
+ * @return 0 if successful, -1 with errno ENOENT if not stored,
+ *   or another errno if the removal could not be recorded
+ */
+int removeSegmentEntry(const char *filePath, unsigned long long *nbytes) {
+    if (segmentDirs == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    pthread_mutex_lock(&segmentLock);
+    if (!unindexBody(filePath, nbytes)) {
+        pthread_mutex_unlock(&segmentLock);
+        errno = ENOENT;
+        return -1;
+    }
+    if (needsCompaction()) {
+        pthread_cond_signal(&segmentGarbage);
+    }
+    return writeDelete(filePath, SEGMENT_DELETE);
+}
+
+/**
+ * Count the bodies stored in a directory tree.
+ *
+ * @param dirPath the directory path without trailing '/'
+ * @param nbytes storage for the total length of the bodies; may be NULL
+ * @return the number of bodies
+ */
+size_t countSegmentTree(const char *dirPath, unsigned long long *nbytes) {
+    TreeVisit visit = {.dirPath = dirPath, .remove = false};
+    if (segmentDirs != NULL) {
+        pthread_mutex_lock(&segmentLock);
+        visitTree(&visit);
+        pthread_mutex_unlock(&segmentLock);
+    }
+    if (nbytes != NULL) {
+        *nbytes = visit.nbytes;
+    }
+    return visit.count;
+}
+
+/**
+ * Remove the bodies stored in a directory tree.
+ *
+ * @param dirPath the directory path without trailing '/'
+ * @param nbytes storage for the total length of the removed bodies
+ * @return 0 if successful, -1 if the removal could not be recorded
+ */
+int removeSegmentTree(const char *dirPath, unsigned long long *nbytes) {
+    *nbytes = 0;
+    if (segmentDirs == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&segmentLock);
+    TreeVisit visit = {.dirPath = dirPath, .remove = true};
+    visitTree(&visit);
+    *nbytes = visit.nbytes;
+    if (visit.count == 0) {
+        pthread_mutex_unlock(&segmentLock);
+        return 0;
+    }
+    if (needsCompaction()) {
+        pthread_cond_signal(&segmentGarbage);
+    }
+    char treePath[MAXPATHLEN];
+    snprintf(treePath, sizeof(treePath), "%.*s", (int)visit.dirLen, dirPath);
+    return writeDelete(treePath, SEGMENT_DELETE_TREE);
+}
+
+/** Entries of a directory being copied for a listing */
+typedef struct DirCopy {
+    SegmentDirEntry *entries;   /** entries copied so far */
+    size_t count;               /** number of entries copied */
+    char *names;                /** names copied so far */
+    size_t namesLen;            /** bytes of names */
+} DirCopy;
+
+/**
+ * Add the length of a name to the bytes of names to copy.
+ *
+ * @param key the file name
+ * @param value the index entry
+ * @param ctx the directory copy
+ * @return false to keep the entry
+ */
+static bool measureDirEntry(const char *key, void *value, void *ctx) {
+    (void)value;
+    ((DirCopy*)ctx)->namesLen += strlen(key) + 1;
+    return false;
+}
+
+/**
+ * Copy an index entry and its name for a listing.
+ *
+ * @param key the file name
+ * @param value the index entry
+ * @param ctx the directory copy
+ * @return false to keep the entry
+ */
+static bool copyDirEntry(const char *key, void *value, void *ctx) {
+    DirCopy *copy = ctx;
+    const IndexedBody *body = value;
+    size_t nameLen = strlen(key) + 1;
+    char *name = memcpy(copy->names + copy->namesLen, key, nameLen);
+    copy->namesLen += nameLen;
+    copy->entries[copy->count++] = (SegmentDirEntry){
+        .name = name, .length = body->length, .seq = body->seq, .mtime = body->mtime
+    };
+    return false;
+}
+
+/**
+ * Get the bodies stored directly in a directory.
+ *
+ * @param dirPath the directory path with or without trailing '/'
+ * @param entries storage for the entries, freed by the caller
+ *   with free(); NULL if none
+ * @return the number of entries
+ */
+size_t listSegmentDir(const char *dirPath, SegmentDirEntry **entries) {
+    *entries = NULL;
+    if (segmentDirs == NULL) {
+        return 0;
+    }
+    char key[MAXPATHLEN];
+    size_t keyLen = strlen(dirPath);
+    while (keyLen > 1 && dirPath[keyLen-1] == '/') {
+        keyLen--;
+    }
+    if (keyLen >= sizeof(key)) {
+        return 0;
+    }
+    memcpy(key, dirPath, keyLen);
+    key[keyLen] = '\0';
+
+    pthread_mutex_lock(&segmentLock);
+    HashMap *names = getHashMap(segmentDirs, key);
+    size_t count = (names == NULL) ? 0 : sizeHashMap(names);
+    if (count > 0) {
+        // entries and their names in one block
+        DirCopy copy = {.count = 0, .namesLen = 0};
+        forEachHashMap(names, measureDirEntry, &copy);
+        copy.entries = malloc(count * sizeof(SegmentDirEntry) + copy.namesLen);
+        if (copy.entries != NULL) {
+            copy.names = (char*)(copy.entries + count);
+            copy.namesLen = 0;
+            forEachHashMap(names, copyDirEntry, &copy);
+            *entries = copy.entries;
+        } else {
+            count = 0;
+        }
+    }
+    pthread_mutex_unlock(&segmentLock);
+    return count;
+}
@@ -0,0 +1,117 @@
+/*
+ * segment_util.h
+ *
+ * Functions that implement a log-structured store for small
+ * POST bodies, so they do not each need a file of their own.
+ *
+ *  @since 2021-05-03
+ */
+
+#ifndef SEGMENT_UTIL_H_
+#define SEGMENT_UTIL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+/** Location of a body in the segment store */
+typedef struct SegmentEntry {
+    int fd;                     /** descriptor of segment; closed by the caller */
+    off_t offset;               /** offset of body in segment */
+    size_t length;              /** body length */
+    unsigned long long seq;     /** record number; identifies the body */
+    struct timespec mtime;      /** time the body was stored */
+} SegmentEntry;
+
+/** A body in a directory of the segment store */
+typedef struct SegmentDirEntry {
+    const char *name;           /** file name */
+    size_t length;              /** body length */
+    unsigned long long seq;     /** record number; identifies the body */
+    struct timespec mtime;      /** time the body was stored */
+} SegmentDirEntry;
+
+/**
+ * Initialize the segment store and rebuild its index from the
+ * records of its segments. A record that fails its checksum ends
+ * its segment, and the newest segment is truncated there.
+ *
+ * @param storeDir the segment store directory
+ * @param segmentSize the size at which a segment is sealed
+ * @param maxRecord the largest body stored in a segment
+ * @return true if the segment store can be used
+ */
+bool initSegmentStore(const char *storeDir, size_t segmentSize, size_t maxRecord);
+
+/**
+ * Determines whether a body of a given length is stored
+ * in the segment store.
+ *
+ * @param len the body length or -1 if unknown
+ * @return true if the store is enabled and the body is small enough
+ */
+bool isSegmentBody(long long len);
+
+/**
+ * Append a body to the segment store under a unique file path.
+ * Like mkstemps(), the path is a template whose last six characters
+ * before a suffix are "XXXXXX"; they are replaced to make a path
+ * that names neither a stored body nor a file.
+ *
+ * @param filePath the path template; replaced by the path of the body
+ * @param suffixLen the length of the suffix after "XXXXXX"
+ * @param body the body
+ * @param len the body length
+ * @return 0 if successful, otherwise the errno of the failure
+ */
+int appendSegmentBody(char *filePath, int suffixLen, const char *body, size_t len);
+
+/**
+ * Find a body in the segment store.
+ *
+ * @param filePath the file path
+ * @param entry storage for the location of the body
+ * @return true if found, false if not stored or error
+ */
+bool openSegmentEntry(const char *filePath, SegmentEntry *entry);
+
+/**
+ * Remove a body from the segment store.
+ *
+ * @param filePath the file path
+ * @param nbytes storage for the length of the removed body
+ * @return 0 if successful, -1 with errno ENOENT if not stored,
+ *   or another errno if the removal could not be recorded
+ */
+int removeSegmentEntry(const char *filePath, unsigned long long *nbytes);
+
+/**
+ * Count the bodies stored in a directory tree.
+ *
+ * @param dirPath the directory path without trailing '/'
+ * @param nbytes storage for the total length of the bodies; may be NULL
+ * @return the number of bodies
+ */
+size_t countSegmentTree(const char *dirPath, unsigned long long *nbytes);
+
+/**
+ * Remove the bodies stored in a directory tree.
+ *
+ * @param dirPath the directory path without trailing '/'
+ * @param nbytes storage for the total length of the removed bodies
+ * @return 0 if successful, -1 if the removal could not be recorded
+ */
+int removeSegmentTree(const char *dirPath, unsigned long long *nbytes);
+
+/**
+ * Get the bodies stored directly in a directory.
+ *
+ * @param dirPath the directory path with or without trailing '/'
+ * @param entries storage for the entries, freed by the caller
+ *   with free(); NULL if none
+ * @return the number of entries
+ */
+size_t listSegmentDir(const char *dirPath, SegmentDirEntry **entries);
+
+#endif /* SEGMENT_UTIL_H_ */
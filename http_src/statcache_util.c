@@ -0,0 +1,612 @@
+/*
+ * statcache_util.c
+ *
+ * Functions that cache the properties of content paths. Each path
+ * is cached with the result of stat(): its properties for a time,
+ * or for a shorter time the error if it does not exist, so clients
+ * probing for missing files are answered from memory.
+ *
+ * The cache is split into shards by path hash, each with its own
+ * lock, so request threads rarely wait for each other. Handlers
+ * that change the content remove the paths they change. Changes
+ * made outside the server are seen when the entries expire, or
+ * sooner if the directories of cached paths, and cached directories
+ * themselves, are watched with inotify.
+ *
+ * Paths are cached as requested, with repeated '/' and "."
+ * components removed. Paths with ".." components are not cached,
+ * so a path is only ever cached under one name.
+ *
+ *  @since 2021-05-07
+ */
+
+#define _GNU_SOURCE  /* for strchrnul() */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+#include "hashmap.h"
+#include "statcache_util.h"
+
+/** Number of independently locked shards */
+#define STAT_CACHE_SHARDS 16
+
+/** Cached result of stat() for a path */
+typedef struct StatEntry {
+    struct stat sb;             /** the properties if err is 0 */
+    int err;                    /** the stat() errno, or 0 if found */
+    long long expires;          /** monotonic expiry time in ms */
+} StatEntry;
+
+/** A shard of the cache */
+typedef struct StatShard {
+    pthread_mutex_t lock;       /** guards the shard */
+    HashMap *entries;           /** entries by path */
+    unsigned long generation;   /** count of removals, so a result read
+                                    before a removal is not cached */
+} StatShard;
+
+/** The shards of the cache */
+static StatShard shards[STAT_CACHE_SHARDS];
+
+/** Most entries of a shard, or 0 if the cache is disabled */
+static size_t shardCapacity = 0;
+
+/** Milliseconds the properties of a path are cached */
+static unsigned statTtl = 0;
+
+/** Milliseconds a missing path is cached */
+static unsigned negativeTtl = 0;
+
+#if defined(__linux__)
+/** Events that change the entries or properties of a watched directory */
+#define STAT_WATCH_EVENTS (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MODIFY \
+                           | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+/** inotify descriptor, or -1 if directories are not watched */
+static int watchFd = -1;
+
+/** Guards the watch maps */
+static pthread_mutex_t watchLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Watch descriptor + 1 by directory path */
+static HashMap *watchDescriptors = NULL;
+
+/** Directory path by watch descriptor */
+static HashMap *watchDirs = NULL;
+#endif
+
+/**
+ * Get the current monotonic time.
+ *
+ * @return the time in milliseconds
+ */
+static long long monotonicMillis(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Make the cache key of a path: repeated '/' and "." components
+ * are removed, and a trailing '/' is kept, since stat() of a file
+ * fails with a trailing '/'.
+ *
+ * @param path the path
+ * @param key buffer for the key of MAXPATHLEN bytes
+ * @return true if the path can be cached
+ */
+static bool makeStatKey(const char *path, char *key) {
+    size_t n = 0;
+    const char *p = path;
+    while (*p != '\0') {
+        const char *end = strchrnul(p, '/');
+        size_t len = (size_t)(end - p);
+        if (len == 2 && p[0] == '.' && p[1] == '.') {
+            return false;
+        }
+        if (len > 0 && !(len == 1 && p[0] == '.')) {
+            if (n + len + 2 > MAXPATHLEN) {
+                return false;
+            }
+            memcpy(key + n, p, len);
+            n += len;
+            if (*end == '/') {
+                key[n++] = '/';
+            }
+        } else if (n == 0 && p == path && *end == '/') {
+            key[n++] = '/';  // absolute path
+        }
+        p = (*end == '/') ? end + 1 : end;
+    }
+    key[n] = '\0';
+    return n > 0;
+}
+
+/**
+ * Get the shard of a key by its FNV-1a hash.
+ *
+ * @param key the key
+ * @return the shard
+ */
+static StatShard *statShard(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return &shards[hash % STAT_CACHE_SHARDS];
+}
+
+/**
+ * Remove the entry of a key, if cached, in its shard.
+ *
+ * @param key the key
+ */
+static void removeStatKey(const char *key) {
+    StatShard *shard = statShard(key);
+    pthread_mutex_lock(&shard->lock);
+    free(removeHashMap(shard->entries, key));
+    shard->generation++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Remove the entries of a path with and without trailing '/'.
+ *
+ * @param key the key of the path without trailing '/'
+ */
+static void removeStatPath(const char *key) {
+    char slashKey[MAXPATHLEN + 1];
+    snprintf(slashKey, sizeof(slashKey), "%s/", key);
+    removeStatKey(key);
+    removeStatKey(slashKey);
+}
+
+/**
+ * Remove the entries of a path and of its ancestor directories.
+ *
+ * @param key the key of the path
+ */
+static void removeStatAncestors(char *key) {
+    size_t len = strlen(key);
+    while (len > 1 && key[len-1] == '/') {
+        key[--len] = '\0';
+    }
+    for (;;) {
+        removeStatPath(key);
+        char *slash = strrchr(key, '/');
+        if (slash == NULL || slash == key) {
+            break;
+        }
+        *slash = '\0';
+    }
+}
+
+/**
+ * Visitor that removes the entries of a directory tree.
+ *
+ * @param key the key of the entry
+ * @param value the entry
+ * @param ctx the key of the directory without trailing '/',
+ *   or an empty key for all entries
+ * @return true if the entry was removed
+ */
+static bool removeTreeEntry(const char *key, void *value, void *ctx) {
+    const char *dirKey = ctx;
+    size_t dirLen = strlen(dirKey);
+    if (   (strncmp(key, dirKey, dirLen) != 0)
+        || (dirLen > 0 && key[dirLen] != '\0' && key[dirLen] != '/')) {
+        return false;
+    }
+    free(value);
+    return true;
+}
+
+/**
+ * Remove the entries of a directory and every path below it.
+ *
+ * @param key the key of the directory without trailing '/', or an
+ *   empty key for all entries
+ */
+static void removeStatTree(const char *key) {
+    for (int i = 0; i < STAT_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        forEachHashMap(shards[i].entries, removeTreeEntry, (void *)key);
+        shards[i].generation++;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
+
+/** Context of the visitor that evicts entries of a full shard */
+typedef struct EvictContext {
+    long long now;              /** the current time */
+    size_t excess;              /** unexpired entries still to evict */
+} EvictContext;
+
+/**
+ * Visitor that evicts expired entries, and other entries
+ * while there are too many.
+ *
+ * @param key the key of the entry
+ * @param value the entry
+ * @param ctx the eviction context
+ * @return true if the entry was evicted
+ */
+static bool evictStatEntry(const char *key, void *value, void *ctx) {
+    (void)key;
+    EvictContext *evict = ctx;
+    StatEntry *entry = value;
+    if (entry->expires > evict->now) {
+        if (evict->excess == 0) {
+            return false;
+        }
+        evict->excess--;
+    }
+    free(entry);
+    return true;
+}
+
+#if defined(__linux__)
+/**
+ * Watch a directory for changes, if it is not already watched.
+ * If the watch cannot be added, the entries of the directory are
+ * only refreshed when they expire.
+ *
+ * @param dirKey the key of the directory without trailing '/'
+ * @return true if a watch was added
+ */
+static bool addStatWatch(const char *dirKey) {
+    bool added = false;
+    pthread_mutex_lock(&watchLock);
+    if (getHashMap(watchDescriptors, dirKey) == NULL) {
+        int wd = inotify_add_watch(watchFd, dirKey, STAT_WATCH_EVENTS);
+        if (wd >= 0) {
+            char wdKey[16];
+            sprintf(wdKey, "%d", wd);
+            char *dirPath = strdup(dirKey);
+            void *oldPath = NULL;
+            if (dirPath != NULL && putHashMap(watchDirs, wdKey, dirPath, &oldPath)) {
+                // a directory moved or linked under another path keeps its descriptor
+                if (oldPath != NULL) {
+                    removeHashMap(watchDescriptors, oldPath);
+                    free(oldPath);
+                }
+                putHashMap(watchDescriptors, dirKey, (void *)(intptr_t)(wd + 1), NULL);
+                added = true;
+            } else {
+                free(dirPath);
+                inotify_rm_watch(watchFd, wd);
+            }
+        }
+    }
+    pthread_mutex_unlock(&watchLock);
+    return added;
+}
+
+/**
+ * Make the key of a cached path without trailing '/'.
+ *
+ * @param key the key of the cached path
+ * @param dirKey buffer for the key of MAXPATHLEN bytes
+ * @return the length of the key
+ */
+static size_t trimStatKey(const char *key, char *dirKey) {
+    strcpy(dirKey, key);
+    size_t len = strlen(dirKey);
+    while (len > 1 && dirKey[len-1] == '/') {
+        dirKey[--len] = '\0';
+    }
+    return len;
+}
+
+/**
+ * Watch the directory that contains a cached path, so the entry
+ * is removed when the path is created, removed or changed.
+ *
+ * @param key the key of the cached path
+ */
+static void watchStatParent(const char *key) {
+    char dirKey[MAXPATHLEN];
+    trimStatKey(key, dirKey);
+    char *slash = strrchr(dirKey, '/');
+    if (slash == NULL || slash == dirKey) {
+        return;
+    }
+    *slash = '\0';
+    addStatWatch(dirKey);
+}
+
+/**
+ * Watch a cached directory itself, so its entry is removed when
+ * entries are created or removed in it, which change its mtime
+ * and ctime.
+ *
+ * @param key the key of the cached directory
+ * @return true if a watch was added
+ */
+static bool watchStatSelf(const char *key) {
+    char dirKey[MAXPATHLEN];
+    trimStatKey(key, dirKey);
+    return addStatWatch(dirKey);
+}
+
+/**
+ * Stop tracking a watch descriptor removed by the kernel.
+ *
+ * @param wd the watch descriptor
+ */
+static void forgetStatWatch(int wd) {
+    char wdKey[16];
+    sprintf(wdKey, "%d", wd);
+    pthread_mutex_lock(&watchLock);
+    char *dirPath = removeHashMap(watchDirs, wdKey);
+    if (dirPath != NULL) {
+        removeHashMap(watchDescriptors, dirPath);
+        free(dirPath);
+    }
+    pthread_mutex_unlock(&watchLock);
+}
+
+/**
+ * Remove the entries changed by an inotify event.
+ *
+ * @param event the event
+ */
+static void handleStatEvent(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        removeStatTree("");  // events were lost
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        forgetStatWatch(event->wd);
+        return;
+    }
+
+    char path[MAXPATHLEN];
+    char wdKey[16];
+    sprintf(wdKey, "%d", event->wd);
+    pthread_mutex_lock(&watchLock);
+    const char *dirPath = getHashMap(watchDirs, wdKey);
+    bool known = (dirPath != NULL) && (strlen(dirPath) < sizeof(path));
+    if (known) {
+        strcpy(path, dirPath);
+    }
+    pthread_mutex_unlock(&watchLock);
+    if (!known) {
+        return;
+    }
+
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        // a moved directory is watched again under its new path
+        removeStatTree(path);
+        if (event->mask & IN_MOVE_SELF) {
+            inotify_rm_watch(watchFd, event->wd);
+        }
+    } else if (event->len > 0 && strlen(path) + strlen(event->name) + 2 <= sizeof(path)) {
+        removeStatPath(path);  // the directory changes with its entries
+        strcat(path, "/");
+        strcat(path, event->name);
+        if (event->mask & IN_ISDIR) {
+            removeStatTree(path);
+        } else {
+            removeStatPath(path);
+        }
+    } else {
+        removeStatPath(path);
+    }
+}
+
+/**
+ * Thread that removes the entries of watched directories
+ * as inotify reports changes.
+ *
+ * @param arg not used
+ * @return NULL
+ */
+static void *statWatchThread(void *arg) {
+    (void)arg;
+    char buf[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(watchFd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            handleStatEvent(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Watch the directories of cached paths with inotify, so changes
+ * made outside the server are seen before the entries expire.
+ *
+ * @return true if directories are watched
+ */
+bool watchStatCache(void) {
+    watchDescriptors = newHashMap(64);
+    watchDirs = newHashMap(64);
+    watchFd = inotify_init1(IN_CLOEXEC);
+    pthread_t thread;
+    if (   (watchDescriptors == NULL) || (watchDirs == NULL) || (watchFd < 0)
+        || (pthread_create(&thread, NULL, statWatchThread, NULL) != 0)) {
+        if (watchFd >= 0) {
+            close(watchFd);
+        }
+        watchFd = -1;
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+#else
+/**
+ * Watch the directories of cached paths with inotify, so changes
+ * made outside the server are seen before the entries expire.
+ *
+ * @return true if directories are watched
+ */
+bool watchStatCache(void) {
+    return false;
+}
+#endif
+
+/**
+ * Initialize the stat cache.
+ *
+ * @param maxEntries the most paths cached; 0 disables the cache
+ * @param ttlMillis milliseconds the properties of a path are cached
+ * @param negativeTtlMillis milliseconds a missing path is cached
+ * @return true if the cache is ready
+ */
+bool initStatCache(size_t maxEntries, unsigned ttlMillis, unsigned negativeTtlMillis) {
+    if (maxEntries == 0) {
+        return true;
+    }
+    for (int i = 0; i < STAT_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].entries = newHashMap(64);
+        shards[i].generation = 0;
+        if (shards[i].entries == NULL) {
+            return false;
+        }
+    }
+    statTtl = ttlMillis;
+    negativeTtl = negativeTtlMillis;
+    shardCapacity = (maxEntries + STAT_CACHE_SHARDS - 1) / STAT_CACHE_SHARDS;
+    return true;
+}
+
+/**
+ * Get the properties of a path like stat(), from the cache if they
+ * are current. A path that does not exist is also cached.
+ *
+ * @param path the path
+ * @param sb storage for the properties
+ * @return 0 if successful, -1 with errno set if error
+ */
+int cachedStat(const char *path, struct stat *sb) {
+    char key[MAXPATHLEN];
+    if (shardCapacity == 0 || !makeStatKey(path, key)) {
+        return stat(path, sb);
+    }
+
+    StatShard *shard = statShard(key);
+    long long now = monotonicMillis();
+    pthread_mutex_lock(&shard->lock);
+    StatEntry *entry = getHashMap(shard->entries, key);
+    if (entry != NULL && entry->expires > now) {
+        int err = entry->err;
+        if (err == 0) {
+            *sb = entry->sb;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        errno = err;
+        return (err == 0) ? 0 : -1;
+    }
+    unsigned long generation = shard->generation;
+    pthread_mutex_unlock(&shard->lock);
+
+#if defined(__linux__)
+    // watch before reading, so a change after the read is seen
+    if (watchFd >= 0) {
+        watchStatParent(key);
+    }
+#endif
+
+    // only found paths and missing paths are cached
+    int status = stat(path, sb);
+#if defined(__linux__)
+    // a directory also changes with its entries; read it
+    // again if it was not watched when it was read
+    if (status == 0 && S_ISDIR(sb->st_mode) && watchFd >= 0 && watchStatSelf(key)) {
+        status = stat(path, sb);
+    }
+#endif
+    int err = (status == 0) ? 0 : errno;
+    if (err != 0 && err != ENOENT && err != ENOTDIR) {
+        return status;
+    }
+    unsigned ttl = (err == 0) ? statTtl : negativeTtl;
+    if (ttl == 0) {
+        errno = err;
+        return status;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    // not cached if the path changed while it was read
+    if (shard->generation == generation) {
+        if (sizeHashMap(shard->entries) >= shardCapacity) {
+            EvictContext evict = { .now = now, .excess = shardCapacity / 4 + 1 };
+            forEachHashMap(shard->entries, evictStatEntry, &evict);
+        }
+        entry = malloc(sizeof(StatEntry));
+        if (entry != NULL) {
+            if (err == 0) {
+                entry->sb = *sb;
+            }
+            entry->err = err;
+            entry->expires = now + ttl;
+            void *oldEntry = NULL;
+            if (putHashMap(shard->entries, key, entry, &oldEntry)) {
+                free(oldEntry);
+            } else {
+                free(entry);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    errno = err;
+    return status;
+}
+
+/**
+ * Remove a path that was written or removed from the cache,
+ * together with its ancestor directories, whose properties
+ * change with their entries. Called by handlers that change
+ * the content.
+ *
+ * @param path the path
+ */
+void invalidateStat(const char *path) {
+    char key[MAXPATHLEN];
+    if (shardCapacity == 0 || !makeStatKey(path, key)) {
+        return;
+    }
+    removeStatAncestors(key);
+}
+
+/**
+ * Remove a directory that was removed or replaced from the cache,
+ * together with every path below it and its ancestor directories.
+ *
+ * @param dirPath the directory path with or without trailing '/'
+ */
+void invalidateStatTree(const char *dirPath) {
+    char key[MAXPATHLEN];
+    if (shardCapacity == 0 || !makeStatKey(dirPath, key)) {
+        return;
+    }
+    size_t len = strlen(key);
+    while (len > 1 && key[len-1] == '/') {
+        key[--len] = '\0';
+    }
+    removeStatTree(key);
+    removeStatAncestors(key);
+}
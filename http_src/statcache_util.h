@@ -0,0 +1,64 @@
+/*
+ * statcache_util.h
+ *
+ * Functions that cache the properties of content paths, so repeated
+ * requests for the same file, or for a missing one, do not walk the
+ * path in the kernel each time.
+ *
+ *  @since 2021-05-07
+ */
+
+#ifndef STATCACHE_UTIL_H_
+#define STATCACHE_UTIL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+/**
+ * Initialize the stat cache.
+ *
+ * @param maxEntries the most paths cached; 0 disables the cache
+ * @param ttlMillis milliseconds the properties of a path are cached
+ * @param negativeTtlMillis milliseconds a missing path is cached
+ * @return true if the cache is ready
+ */
+bool initStatCache(size_t maxEntries, unsigned ttlMillis, unsigned negativeTtlMillis);
+
+/**
+ * Watch the directories of cached paths with inotify, so changes
+ * made outside the server are seen before the entries expire.
+ *
+ * @return true if directories are watched
+ */
+bool watchStatCache(void);
+
+/**
+ * Get the properties of a path like stat(), from the cache if they
+ * are current. A path that does not exist is also cached.
+ *
+ * @param path the path
+ * @param sb storage for the properties
+ * @return 0 if successful, -1 with errno set if error
+ */
+int cachedStat(const char *path, struct stat *sb);
+
+/**
+ * Remove a path that was written or removed from the cache,
+ * together with its ancestor directories, whose properties
+ * change with their entries. Called by handlers that change
+ * the content.
+ *
+ * @param path the path
+ */
+void invalidateStat(const char *path);
+
+/**
+ * Remove a directory that was removed or replaced from the cache,
+ * together with every path below it and its ancestor directories.
+ *
+ * @param dirPath the directory path with or without trailing '/'
+ */
+void invalidateStatTree(const char *dirPath);
+
+#endif /* STATCACHE_UTIL_H_ */
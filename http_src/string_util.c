@@ -70,3 +70,35 @@ bool trim_newline(char *src) {
 
     return trimmed;
 }
+
+/**
+ * Quote bytes as a JSON string. Quotes, backslashes and
+ * control characters (including NUL) are escaped; other
+ * bytes are copied as they are.
+ *
+ * @param bytes the bytes to quote
+ * @param len the number of bytes
+ * @param buf buffer for the quoted string of 6*len+3 bytes
+ * @return the length of the quoted string
+ */
+size_t quoteJsonString(const char *bytes, size_t len, char *buf) {
+    static const char hex[] = "0123456789abcdef";
+    size_t n = 0;
+    buf[n++] = '"';
+    for (const unsigned char *p = (const unsigned char*)bytes; p < (const unsigned char*)bytes + len; p++) {
+        if (*p == '"' || *p == '\\') {
+            buf[n++] = '\\';
+            buf[n++] = *p;
+        } else if (*p < 0x20) {
+            memcpy(buf + n, "\\u00", 4);
+            buf[n+4] = hex[*p >> 4];
+            buf[n+5] = hex[*p & 0xf];
+            n += 6;
+        } else {
+            buf[n++] = *p;
+        }
+    }
+    buf[n++] = '"';
+    buf[n] = '\0';
+    return n;
+}
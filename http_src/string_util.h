@@ -11,6 +11,7 @@
 #define STRING_UTIL_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifndef strlcpy
 #include <stdio.h>
@@ -48,4 +49,16 @@ bool strendswith(const char *src, const char *endswith);
  */
 bool trim_newline(char *src);
 
+/**
+ * Quote bytes as a JSON string. Quotes, backslashes and
+ * control characters (including NUL) are escaped; other
+ * bytes are copied as they are.
+ *
+ * @param bytes the bytes to quote
+ * @param len the number of bytes
+ * @param buf buffer for the quoted string of 6*len+3 bytes
+ * @return the length of the quoted string
+ */
+size_t quoteJsonString(const char *bytes, size_t len, char *buf);
+
 #endif /* STRING_UTIL_H_ */
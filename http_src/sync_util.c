@@ -0,0 +1,278 @@
+/*
+ * sync_util.c
+ *
+ * Functions that make uploaded files durable. In group mode,
+ * requests queue their files and wait; a background thread takes
+ * all queued requests as one batch and syncs each file system they
+ * use once, so concurrent uploads share one journal commit and
+ * device cache flush.
+ *
+ *  @since 2021-04-29
+ */
+
+#define _GNU_SOURCE  /* for syncfs() */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "http_server.h"
+#include "sync_util.h"
+
+/** Files of one request waiting for a group commit */
+typedef struct CommitRequest {
+    const int *fds;             /** descriptors of the files */
+    size_t nfds;                /** number of descriptors */
+    const char *dirPath;        /** directory containing the files */
+    dev_t dev;                  /** device of the file system of the files */
+    int status;                 /** 0 if synced, -1 if error */
+    bool done;                  /** true when the batch has been synced */
+    struct CommitRequest *next; /** next request in queue or batch */
+} CommitRequest;
+
+/** Requests waiting for the next batch */
+static CommitRequest *commitQueue = NULL;
+
+/** Guards the queue and the done flags */
+static pthread_mutex_t commitLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signals the commit thread that the queue is not empty */
+static pthread_cond_t commitPending = PTHREAD_COND_INITIALIZER;
+
+/** Signals waiting requests that a batch is done */
+static pthread_cond_t commitDone = PTHREAD_COND_INITIALIZER;
+
+/** Starts the commit thread once */
+static pthread_once_t commitOnce = PTHREAD_ONCE_INIT;
+
+/** Result of starting the commit thread */
+static bool commitThreadRunning = false;
+
+/**
+ * Parse a Durability setting: "none", "fdatasync" or "group".
+ *
+ * @param name the setting
+ * @param durability the durability result
+ * @return true if the setting is valid
+ */
+bool parseDurability(const char *name, Durability *durability) {
+    if (strcasecmp(name, "none") == 0) {
+        *durability = DURABILITY_NONE;
+    } else if (strcasecmp(name, "fdatasync") == 0) {
+        *durability = DURABILITY_SYNC;
+    } else if (strcasecmp(name, "group") == 0) {
+        *durability = DURABILITY_GROUP;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Returns the microseconds elapsed since a start time.
+ *
+ * @param start the monotonic start time
+ * @return the elapsed microseconds
+ */
+static long elapsedMicros(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * Sync a directory so that new and renamed entries are durable.
+ *
+ * @param dirPath the directory path
+ * @return 0 if successful, -1 if error
+ */
+static int syncDirectory(const char *dirPath) {
+    int fd = open(dirPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int status = fsync(fd);
+    close(fd);
+    return status;
+}
+
+/**
+ * Sync the files of a request, then their directory.
+ *
+ * @param req the request
+ */
+static void syncRequest(CommitRequest *req) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    req->status = 0;
+    for (size_t i = 0; i < req->nfds; i++) {
+        if (fdatasync(req->fds[i]) != 0) {
+            req->status = -1;
+        }
+    }
+    if (syncDirectory(req->dirPath) != 0) {
+        req->status = -1;
+    }
+    if (server.debug) {
+        fprintf(stderr, "commit: %zu files in %ld us\n", req->nfds, elapsedMicros(&start));
+    }
+}
+
+/**
+ * Sync a batch of requests with one syncfs() per file system
+ * and record the status of each request. On a journaling file
+ * system, one journal commit and one device cache flush then
+ * cover the data, inodes and directory entries of every file in
+ * the batch, where an fdatasync() per file would commit each in
+ * turn. syncfs() also writes back other dirty data, such as
+ * uploads still in progress.
+ *
+ * Before Linux 5.8, syncfs() does not report writeback errors,
+ * so each file is then checked with fdatasync(), which reports
+ * an error on the file and costs little once its data is clean.
+ *
+ * @param batch the requests in the batch
+ */
+static void syncBatch(CommitRequest *batch) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t nrequests = 0, nfiles = 0, nfs = 0;
+    for (CommitRequest *req = batch; req != NULL; req = req->next) {
+        struct stat sb;
+        req->status = (stat(req->dirPath, &sb) == 0) ? 0 : -1;
+        req->dev = (req->status == 0) ? sb.st_dev : 0;
+        nrequests++;
+        nfiles += req->nfds;
+    }
+    for (CommitRequest *req = batch; req != NULL; req = req->next) {
+        // an earlier request in the batch already synced the file system
+        CommitRequest *prev = batch;
+        while (prev != req && (prev->status != 0 || prev->dev != req->dev)) {
+            prev = prev->next;
+        }
+        if (prev == req && req->status == 0) {
+            nfs++;
+            int fd = open(req->dirPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            int status = (fd < 0) ? -1 : syncfs(fd);
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (status != 0) {
+                for (CommitRequest *r = req; r != NULL; r = r->next) {
+                    if (r->dev == req->dev) {
+                        r->status = -1;
+                    }
+                }
+            }
+        }
+    }
+    for (CommitRequest *req = batch; req != NULL; req = req->next) {
+        for (size_t i = 0; i < req->nfds && req->status == 0; i++) {
+            if (fdatasync(req->fds[i]) != 0) {
+                req->status = -1;
+            }
+        }
+    }
+    if (server.debug) {
+        fprintf(stderr, "group commit: %zu requests, %zu files, %zu file systems in %ld us\n",
+                nrequests, nfiles, nfs, elapsedMicros(&start));
+    }
+}
+
+/**
+ * Commit thread: waits for queued requests, lets more arrive
+ * for the group commit window, then syncs them as one batch.
+ * Requests that arrive during a sync form the next batch.
+ *
+ * @param arg unused
+ * @return never returns
+ */
+static void *commitThread(void *arg) {
+    (void)arg;
+    const struct timespec window = {
+        server.group_commit_window / 1000000, (server.group_commit_window % 1000000) * 1000
+    };
+    pthread_mutex_lock(&commitLock);
+    for (;;) {
+        while (commitQueue == NULL) {
+            pthread_cond_wait(&commitPending, &commitLock);
+        }
+        if (server.group_commit_window > 0) {
+            pthread_mutex_unlock(&commitLock);
+            nanosleep(&window, NULL);
+            pthread_mutex_lock(&commitLock);
+        }
+        CommitRequest *batch = commitQueue;
+        commitQueue = NULL;
+        pthread_mutex_unlock(&commitLock);
+
+        syncBatch(batch);
+
+        // requests may return as soon as they are marked done
+        pthread_mutex_lock(&commitLock);
+        while (batch != NULL) {
+            CommitRequest *next = batch->next;
+            batch->done = true;
+            batch = next;
+        }
+        pthread_cond_broadcast(&commitDone);
+    }
+    return NULL;
+}
+
+/**
+ * Start the detached commit thread.
+ */
+static void startCommitThread(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, commitThread, NULL) == 0) {
+        pthread_detach(thread);
+        commitThreadRunning = true;
+    }
+}
+
+/**
+ * Make the data of files and their entries in a directory durable,
+ * as configured by the server durability. The files must already be
+ * linked into the directory. In group mode the request waits while
+ * a background thread syncs the files of all requests that commit
+ * within the group commit window together.
+ *
+ * @param fds descriptors of the files
+ * @param nfds the number of descriptors, 0 to sync only the directory
+ * @param dirPath path of the directory containing the files
+ * @return 0 if successful, -1 if a file or the directory failed to sync
+ */
+int commitFiles(const int fds[], size_t nfds, const char *dirPath) {
+    switch (server.durability) {
+    case DURABILITY_NONE:
+        return 0;
+
+    case DURABILITY_GROUP:
+        pthread_once(&commitOnce, startCommitThread);
+        if (commitThreadRunning) {
+            CommitRequest req = {fds, nfds, dirPath, 0, 0, false, NULL};
+            pthread_mutex_lock(&commitLock);
+            req.next = commitQueue;
+            commitQueue = &req;
+            pthread_cond_signal(&commitPending);
+            while (!req.done) {
+                pthread_cond_wait(&commitDone, &commitLock);
+            }
+            pthread_mutex_unlock(&commitLock);
+            return req.status;
+        }
+        // no commit thread: sync in the request
+        // fall through
+
+    default: {
+        CommitRequest req = {fds, nfds, dirPath, 0, 0, false, NULL};
+        syncRequest(&req);
+        return req.status;
+    }
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * sync_util.h
+ *
+ * Functions that make uploaded files durable.
+ *
+ *  @since 2021-04-29
+ */
+
+#ifndef SYNC_UTIL_H_
+#define SYNC_UTIL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/** How uploads are made durable before they are acknowledged */
+typedef enum Durability {
+    DURABILITY_NONE,            /** leave writeback to the kernel */
+    DURABILITY_SYNC,            /** fdatasync each upload in its request */
+    DURABILITY_GROUP            /** batch the syncs of concurrent uploads */
+} Durability;
+
+/**
+ * Parse a Durability setting: "none", "fdatasync" or "group".
+ *
+ * @param name the setting
+ * @param durability the durability result
+ * @return true if the setting is valid
+ */
+bool parseDurability(const char *name, Durability *durability);
+
+/**
+ * Make the data of files and their entries in a directory durable,
+ * as configured by the server durability. The files must already be
+ * linked into the directory. In group mode the request waits while
+ * a background thread syncs the files of all requests that commit
+ * within the group commit window together.
+ *
+ * @param fds descriptors of the files
+ * @param nfds the number of descriptors, 0 to sync only the directory
+ * @param dirPath path of the directory containing the files
+ * @return 0 if successful, -1 if a file or the directory failed to sync
+ */
+int commitFiles(const int fds[], size_t nfds, const char *dirPath);
+
+#endif /* SYNC_UTIL_H_ */
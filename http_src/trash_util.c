@@ -0,0 +1,249 @@
+/*
+ * trash_util.c
+ *
+ * Functions that delete directory trees in the background. A tree
+ * is renamed into the trash directory, which is atomic and takes
+ * constant time, and a reclaimer thread then removes its entries
+ * with unlinkat() relative to open directory descriptors, so paths
+ * are never resolved again from the root of the tree.
+ *
+ *  @since 2021-05-02
+ */
+
+#define _GNU_SOURCE  /* for O_DIRECTORY, O_NOFOLLOW */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "http_server.h"
+#include "file_util.h"
+#include "quota_util.h"
+#include "trash_util.h"
+
+/** I/O priority of the reclaimer: idle class (linux/ioprio.h) */
+#define RECLAIM_IOPRIO ((3 << 13) | 0)
+
+/** Tree waiting to be reclaimed */
+typedef struct TrashEntry {
+    char trashPath[MAXPATHLEN]; /** path of tree in trash */
+    char dirPath[MAXPATHLEN];   /** original path, for quotas */
+    struct TrashEntry *next;    /** next entry in queue */
+} TrashEntry;
+
+/** Path of the trash directory */
+static char trashDir[MAXPATHLEN];
+
+/** Trees waiting to be reclaimed, oldest first */
+static TrashEntry *trashHead = NULL, *trashTail = NULL;
+
+/** Guards the queue */
+static pthread_mutex_t trashLock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Signals the reclaimer that the queue is not empty */
+static pthread_cond_t trashPending = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Remove the entries of an open directory and its subdirectories.
+ * The directory itself is left for the caller to remove.
+ *
+ * @param dirFd the directory descriptor; closed by this function
+ * @param countBytes true to count bytes of the regular files removed
+ * @param nbytes the bytes removed so far
+ * @return 0 if successful, -1 if an entry could not be removed
+ */
+static int removeEntries(int dirFd, bool countBytes, unsigned long long *nbytes) {
+    DIR *dir = fdopendir(dirFd);
+    if (dir == NULL) {
+        close(dirFd);
+        return -1;
+    }
+    int status = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        const char *name = ent->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        bool isDir = (ent->d_type == DT_DIR);
+        struct stat sb;
+        if (ent->d_type == DT_UNKNOWN || (countBytes && ent->d_type == DT_REG)) {
+            if (fstatat(dirFd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+                status = -1;
+                continue;
+            }
+            isDir = S_ISDIR(sb.st_mode);
+            if (countBytes && S_ISREG(sb.st_mode)) {
+                *nbytes += (unsigned long long)sb.st_size;
+            }
+        }
+        if (isDir) {
+            int subFd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (subFd < 0 || removeEntries(subFd, countBytes, nbytes) != 0) {
+                status = -1;
+            }
+        }
+        if (unlinkat(dirFd, name, isDir ? AT_REMOVEDIR : 0) != 0) {
+            status = -1;
+        }
+    }
+    closedir(dir);
+    return status;
+}
+
+/**
+ * Remove a tree from the trash and release its bytes from
+ * the quotas of its original directory.
+ *
+ * @param entry the trash entry
+ */
+static void reclaimTree(const TrashEntry *entry) {
+    bool countBytes = hasQuota(entry->dirPath);
+    unsigned long long nbytes = 0;
+    int fd = open(entry->trashPath, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    int status = (fd < 0) ? -1 : removeEntries(fd, countBytes, &nbytes);
+    if (rmdir(entry->trashPath) != 0) {
+        status = -1;
+    }
+    if (countBytes) {
+        releaseQuota(entry->dirPath, nbytes);
+    }
+    if (server.debug) {
+        fprintf(stderr, "reclaimed %s: %llu bytes%s\n",
+                entry->trashPath, nbytes, (status == 0) ? "" : " (incomplete)");
+    }
+}
+
+/**
+ * Reclaimer thread: removes queued trees one at a time
+ * at idle I/O priority.
+ *
+ * @param arg unused
+ * @return never returns
+ */
+static void *reclaimThread(void *arg) {
+    (void)arg;
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, RECLAIM_IOPRIO);
+    for (;;) {
+        pthread_mutex_lock(&trashLock);
+        while (trashHead == NULL) {
+            pthread_cond_wait(&trashPending, &trashLock);
+        }
+        TrashEntry *entry = trashHead;
+        trashHead = entry->next;
+        if (trashHead == NULL) {
+            trashTail = NULL;
+        }
+        pthread_mutex_unlock(&trashLock);
+
+        reclaimTree(entry);
+        free(entry);
+    }
+    return NULL;
+}
+
+/**
+ * Queue a tree in the trash to be reclaimed.
+ *
+ * @param trashPath the path of the tree in the trash
+ * @param dirPath the original path of the tree, or "" if not known
+ * @return 0 if successful, -1 if no space
+ */
+static int queueTrash(const char *trashPath, const char *dirPath) {
+    TrashEntry *entry = malloc(sizeof(TrashEntry));
+    if (entry == NULL) {
+        return -1;
+    }
+    strcpy(entry->trashPath, trashPath);
+    strcpy(entry->dirPath, dirPath);
+    entry->next = NULL;
+    pthread_mutex_lock(&trashLock);
+    if (trashTail == NULL) {
+        trashHead = entry;
+    } else {
+        trashTail->next = entry;
+    }
+    trashTail = entry;
+    pthread_cond_signal(&trashPending);
+    pthread_mutex_unlock(&trashLock);
+    return 0;
+}
+
+/**
+ * Initialize the trash directory. Trees are renamed into it, so
+ * it must be on the same file system as the content directory.
+ * Trees left in it by an earlier run are queued for reclamation.
+ *
+ * @param trashDirPath the trash directory
+ * @param contentBase the content base directory
+ * @return true if the trash directory can be used
+ */
+bool initTrash(const char *trashDirPath, const char *contentBase) {
+    struct stat trashSb, contentSb;
+    if (   (strlen(trashDirPath) >= sizeof(trashDir) - 32)
+        || (mkdirs(trashDirPath, 0700) != 0)
+        || (stat(trashDirPath, &trashSb) != 0)
+        || (stat(contentBase, &contentSb) != 0)
+        || (trashSb.st_dev != contentSb.st_dev)) {
+        return false;
+    }
+    strcpy(trashDir, trashDirPath);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reclaimThread, NULL) != 0) {
+        return false;
+    }
+    pthread_detach(thread);
+
+    // finish deletions interrupted by a restart
+    DIR *dir = opendir(trashDir);
+    if (dir != NULL) {
+        struct dirent *ent;
+        while ((ent = readdir(dir)) != NULL) {
+            if (strncmp(ent->d_name, "del.", 4) == 0) {
+                char trashPath[MAXPATHLEN];
+                snprintf(trashPath, sizeof(trashPath), "%s/%s", trashDir, ent->d_name);
+                queueTrash(trashPath, "");
+            }
+        }
+        closedir(dir);
+    }
+    return true;
+}
+
+/**
+ * Move a directory tree to the trash and queue it to be removed
+ * by the reclaimer thread. The tree disappears from its path at
+ * once; its space is reclaimed later.
+ *
+ * @param dirPath the directory path without trailing '/'
+ * @return 0 if successful, -1 if error
+ */
+int moveToTrash(const char *dirPath) {
+    if (*trashDir == '\0' || strlen(dirPath) >= MAXPATHLEN) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // an empty directory with a unique name is replaced by the tree
+    char trashPath[MAXPATHLEN];
+    snprintf(trashPath, sizeof(trashPath), "%s/del.XXXXXX", trashDir);
+    if (mkdtemp(trashPath) == NULL) {
+        return -1;
+    }
+    if (rename(dirPath, trashPath) != 0) {
+        int err = errno;
+        rmdir(trashPath);
+        errno = err;
+        return -1;
+    }
+    queueTrash(trashPath, dirPath);  // if no space, reclaimed at next startup
+    return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * trash_util.h
+ *
+ * Functions that delete directory trees in the background.
+ *
+ *  @since 2021-05-02
+ */
+
+#ifndef TRASH_UTIL_H_
+#define TRASH_UTIL_H_
+
+#include <stdbool.h>
+
+/**
+ * Initialize the trash directory. Trees are renamed into it, so
+ * it must be on the same file system as the content directory.
+ * Trees left in it by an earlier run are queued for reclamation.
+ *
+ * @param trashDir the trash directory
+ * @param contentBase the content base directory
+ * @return true if the trash directory can be used
+ */
+bool initTrash(const char *trashDir, const char *contentBase);
+
+/**
+ * Move a directory tree to the trash and queue it to be removed
+ * by the reclaimer thread. The tree disappears from its path at
+ * once; its space is reclaimed later.
+ *
+ * @param dirPath the directory path without trailing '/'
+ * @return 0 if successful, -1 if error
+ */
+int moveToTrash(const char *dirPath);
+
+#endif /* TRASH_UTIL_H_ */
@@ -0,0 +1,249 @@
+/*
+ * upload_util.c
+ *
+ * Functions that stage resumable uploads. A PUT with a Content-Range
+ * header writes its range to a staged file in the upload directory.
+ * Bytes are written in order, so the size of the staged file is the
+ * offset a client resumes from after a dropped connection. When the
+ * last range arrives, the staged file is renamed over the target.
+ *
+ * A staged file is named by the SHA-256 of its target path, so it
+ * is found again by a later request for the same path. The length
+ * of the complete upload is recorded in an extended attribute of
+ * the staged file, so ranges of a different upload of the same
+ * path are not mixed into it.
+ *
+ *  @since 2021-05-04
+ */
+
+#define _GNU_SOURCE  /* for fallocate() */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <openssl/evp.h>
+#include "file_util.h"
+#include "upload_util.h"
+
+/** Extended attribute that records the length of the complete upload */
+#define UPLOAD_TOTAL_XATTR "user.http.upload-total"
+
+/** Path of the upload directory */
+static char uploadDir[MAXPATHLEN];
+
+/**
+ * Make the path of the staged file of a target file.
+ *
+ * @param filePath the target file path
+ * @param stagedPath buffer for the staged file path of MAXPATHLEN bytes
+ * @return 0 if successful, -1 if no upload directory or error
+ */
+static int makeStagedPath(const char *filePath, char *stagedPath) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLen;
+    if (   (*uploadDir == '\0')
+        || (EVP_Digest(filePath, strlen(filePath), digest, &digestLen, EVP_sha256(), NULL) != 1)) {
+        return -1;
+    }
+    int n = snprintf(stagedPath, MAXPATHLEN, "%s/", uploadDir);
+    for (unsigned int i = 0; i < digestLen; i++) {
+        n += sprintf(stagedPath + n, "%02x", digest[i]);
+    }
+    return 0;
+}
+
+/**
+ * Initialize the directory of staged uploads. A completed upload
+ * is renamed into place, so the directory must be on the same
+ * file system as the content directory.
+ *
+ * @param uploadDirPath the upload directory
+ * @param contentBase the content base directory
+ * @return true if the upload directory can be used
+ */
+bool initUploadDir(const char *uploadDirPath, const char *contentBase) {
+    struct stat uploadSb, contentSb;
+    if (   (strlen(uploadDirPath) >= sizeof(uploadDir) - 2*EVP_MAX_MD_SIZE - 2)
+        || (mkdirs(uploadDirPath, 0700) != 0)
+        || (stat(uploadDirPath, &uploadSb) != 0)
+        || (stat(contentBase, &contentSb) != 0)
+        || (uploadSb.st_dev != contentSb.st_dev)) {
+        return false;
+    }
+    char total[32];  // staged files must record their total length
+    if (getxattr(uploadDirPath, UPLOAD_TOTAL_XATTR, total, sizeof(total)) < 0 && errno != ENODATA) {
+        return false;
+    }
+    strcpy(uploadDir, uploadDirPath);
+    return true;
+}
+
+/**
+ * Get the bytes received so far by the staged upload of a file.
+ *
+ * @param filePath the file path
+ * @return the bytes received, or -1 if no upload is staged
+ */
+off_t getStagedOffset(const char *filePath) {
+    char stagedPath[MAXPATHLEN];
+    struct stat sb;
+    if (makeStagedPath(filePath, stagedPath) != 0 || stat(stagedPath, &sb) != 0) {
+        return -1;
+    }
+    return sb.st_size;
+}
+
+/**
+ * Get the length of the complete upload recorded for a staged file.
+ *
+ * @param fd the descriptor of the staged file
+ * @return the recorded length, or -1 if none
+ */
+static off_t getStagedTotal(int fd) {
+    char buf[32];
+    ssize_t n = fgetxattr(fd, UPLOAD_TOTAL_XATTR, buf, sizeof(buf)-1);
+    long long total;
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    return (sscanf(buf, "%lld", &total) == 1 && total >= 0) ? (off_t)total : -1;
+}
+
+/**
+ * Open the staged upload of a file, creating it if there is none,
+ * and lock it so that only one request adds to it at a time. The
+ * length of the complete upload is recorded if nothing is staged;
+ * otherwise the recorded length is returned in the upload, and a
+ * range for a different length must not be added.
+ *
+ * @param filePath the file path
+ * @param total the length of the complete upload
+ * @param upload the staged upload
+ * @return 0 if successful, EWOULDBLOCK if another request has it open,
+ *   or the errno of the failure
+ */
+int openStagedUpload(const char *filePath, off_t total, StagedUpload *upload) {
+    if (makeStagedPath(filePath, upload->path) != 0) {
+        return ENOTSUP;
+    }
+    for (;;) {
+        upload->fd = open(upload->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (upload->fd < 0) {
+            return errno;
+        }
+        if (flock(upload->fd, LOCK_EX | LOCK_NB) != 0) {
+            int err = errno;
+            close(upload->fd);
+            upload->fd = -1;
+            return err;
+        }
+
+        // retry if the upload completed or was cancelled before the lock
+        struct stat fdSb, pathSb;
+        if (fstat(upload->fd, &fdSb) != 0) {
+            int err = errno;
+            closeStagedUpload(upload);
+            return err;
+        }
+        if (stat(upload->path, &pathSb) == 0 && pathSb.st_ino == fdSb.st_ino && pathSb.st_dev == fdSb.st_dev) {
+            upload->offset = fdSb.st_size;
+            upload->total = getStagedTotal(upload->fd);
+            if (upload->offset == 0 || upload->total < 0) {  // new upload
+                char buf[32];
+                int n = snprintf(buf, sizeof(buf), "%lld", (long long)total);
+                if (fsetxattr(upload->fd, UPLOAD_TOTAL_XATTR, buf, (size_t)n, 0) != 0) {
+                    int err = errno;
+                    closeStagedUpload(upload);
+                    return err;
+                }
+                upload->total = total;
+            }
+            return 0;
+        }
+        closeStagedUpload(upload);
+    }
+}
+
+/**
+ * Prepare a staged upload for a range that starts at or before
+ * the bytes received so far. Bytes from the first position on are
+ * discarded, and space is reserved for the rest of the upload.
+ *
+ * @param upload the staged upload
+ * @param first the first byte position of the range
+ * @param total the length of the complete upload
+ * @return 0 if successful, or the errno of the failure
+ */
+int resumeStagedUpload(StagedUpload *upload, off_t first, off_t total) {
+    if (first > upload->offset) {
+        return EINVAL;
+    }
+    if (first < upload->offset) {
+        if (ftruncate(upload->fd, first) != 0) {
+            return errno;
+        }
+        upload->offset = first;
+    }
+#if defined(__linux__)
+    // reserve the rest without changing the size, which is the offset received
+    if (   (total > first)
+        && (fallocate(upload->fd, FALLOC_FL_KEEP_SIZE, first, total - first) != 0)
+        && (errno != EOPNOTSUPP && errno != ENOSYS)) {
+        return errno;
+    }
+#else
+    (void)total;
+#endif
+    return (lseek(upload->fd, first, SEEK_SET) < 0) ? errno : 0;
+}
+
+/**
+ * Close a staged upload, which keeps the bytes received so far.
+ *
+ * @param upload the staged upload
+ */
+void closeStagedUpload(StagedUpload *upload) {
+    if (upload->fd >= 0) {
+        close(upload->fd);  // releases the lock
+    }
+    upload->fd = -1;
+}
+
+/**
+ * Cancel the staged upload of a file and remove its bytes.
+ *
+ * @param filePath the file path
+ * @param nbytes storage for the bytes that were received
+ * @return 0 if successful, -1 with errno set if none or error
+ */
+int cancelStagedUpload(const char *filePath, off_t *nbytes) {
+    StagedUpload upload;
+    if (makeStagedPath(filePath, upload.path) != 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    upload.fd = open(upload.path, O_RDWR | O_CLOEXEC);
+    if (upload.fd < 0) {
+        return -1;
+    }
+    // wait for a request adding to the upload to finish; it may complete it
+    struct stat fdSb, pathSb;
+    int status = -1;
+    if (   (flock(upload.fd, LOCK_EX) == 0) && (fstat(upload.fd, &fdSb) == 0)
+        && (stat(upload.path, &pathSb) == 0)
+        && (pathSb.st_ino == fdSb.st_ino) && (pathSb.st_dev == fdSb.st_dev)) {
+        *nbytes = fdSb.st_size;
+        status = unlink(upload.path);
+    } else {
+        errno = ENOENT;
+    }
+    closeStagedUpload(&upload);
+    return status;
+}
@@ -0,0 +1,86 @@
+/*
+ * upload_util.h
+ *
+ * Functions that stage resumable uploads.
+ *
+ *  @since 2021-05-04
+ */
+
+#ifndef UPLOAD_UTIL_H_
+#define UPLOAD_UTIL_H_
+
+#include <stdbool.h>
+#include <sys/param.h>
+#include <sys/types.h>
+
+/** Upload staged while its ranges arrive */
+typedef struct StagedUpload {
+    char path[MAXPATHLEN];      /** path of the staged file */
+    int fd;                     /** descriptor of the staged file; locked while open */
+    off_t offset;               /** bytes received so far */
+    off_t total;                /** length of the complete upload */
+} StagedUpload;
+
+/**
+ * Initialize the directory of staged uploads. A completed upload
+ * is renamed into place, so the directory must be on the same
+ * file system as the content directory.
+ *
+ * @param uploadDir the upload directory
+ * @param contentBase the content base directory
+ * @return true if the upload directory can be used
+ */
+bool initUploadDir(const char *uploadDir, const char *contentBase);
+
+/**
+ * Get the bytes received so far by the staged upload of a file.
+ *
+ * @param filePath the file path
+ * @return the bytes received, or -1 if no upload is staged
+ */
+off_t getStagedOffset(const char *filePath);
+
+/**
+ * Open the staged upload of a file, creating it if there is none,
+ * and lock it so that only one request adds to it at a time. The
+ * length of the complete upload is recorded if nothing is staged;
+ * otherwise the recorded length is returned in the upload, and a
+ * range for a different length must not be added.
+ *
+ * @param filePath the file path
+ * @param total the length of the complete upload
+ * @param upload the staged upload
+ * @return 0 if successful, EWOULDBLOCK if another request has it open,
+ *   or the errno of the failure
+ */
+int openStagedUpload(const char *filePath, off_t total, StagedUpload *upload);
+
+/**
+ * Prepare a staged upload for a range that starts at or before
+ * the bytes received so far. Bytes from the first position on are
+ * discarded, and space is reserved for the rest of the upload.
+ *
+ * @param upload the staged upload
+ * @param first the first byte position of the range
+ * @param total the length of the complete upload
+ * @return 0 if successful, or the errno of the failure
+ */
+int resumeStagedUpload(StagedUpload *upload, off_t first, off_t total);
+
+/**
+ * Close a staged upload, which keeps the bytes received so far.
+ *
+ * @param upload the staged upload
+ */
+void closeStagedUpload(StagedUpload *upload);
+
+/**
+ * Cancel the staged upload of a file and remove its bytes.
+ *
+ * @param filePath the file path
+ * @param nbytes storage for the bytes that were received
+ * @return 0 if successful, -1 with errno set if none or error
+ */
+int cancelStagedUpload(const char *filePath, off_t *nbytes);
+
+#endif /* UPLOAD_UTIL_H_ */
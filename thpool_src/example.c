@@ -12,6 +12,7 @@
  * */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
 #include "thpool.h"
 
@@ -9,6 +9,9 @@
  ********************************/
 
 #define _POSIX_C_SOURCE 200809L
+#if defined(__linux__)
+#define _DEFAULT_SOURCE  /* for syscall() */
+#endif
 #include <unistd.h>
 #include <signal.h>
 #include <stdio.h>
@@ -19,8 +22,12 @@ int pthread_setname_np (pthread_t, const char *) __attribute__((__nonnull__(2)))
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
+#include <limits.h>
+#include <stdatomic.h>
 #if defined(__linux__)
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #endif
 #if defined(__APPLE__) && defined(__MACH__)
 // should be defined in pthread.h but is not
@@ -42,6 +49,14 @@ int	pthread_setname_np(const char*);
 #define err(str)
 #endif
 
+/* Spin iterations bounds for an idle thread before it parks */
+#ifndef THPOOL_SPIN_MIN
+#define THPOOL_SPIN_MIN 64
+#endif
+#ifndef THPOOL_SPIN_MAX
+#define THPOOL_SPIN_MAX 4096
+#endif
+
 static volatile int threads_keepalive;
 static volatile int threads_on_hold;
 
@@ -50,12 +65,22 @@ static volatile int threads_on_hold;
 /* ========================== STRUCTURES ============================ */
 
 
-/* Binary semaphore */
-typedef struct bsem {
-	pthread_mutex_t mutex;
-	pthread_cond_t   cond;
-	int v;
-} bsem;
+/* Parking lot for idle threads (eventcount)
+ *
+ * A thread that finds no runnable job first spins, then reads the
+ * epoch and sleeps on it until another thread bumps the epoch. On
+ * Linux the epoch is a futex word; elsewhere a mutex and condition
+ * variable stand in for the futex.
+ */
+typedef struct parking {
+	atomic_uint epoch;                   /* bumped on every wakeup    */
+	atomic_int  spinning;                /* threads spinning for work */
+	atomic_int  sleeping;                /* threads asleep on epoch   */
+#if !defined(__linux__)
+	pthread_mutex_t mutex;               /* guards cond               */
+	pthread_cond_t  cond;                /* signals epoch change      */
+#endif
+} parking;
 
 
 /* Job */
@@ -63,22 +88,28 @@ typedef struct job{
 	struct job*  prev;                   /* pointer to previous job   */
 	void   (*function)(void* arg);       /* function pointer          */
 	void*  arg;                          /* function's argument       */
+	thpool_prio prio;                    /* priority class of job     */
 } job;
 
 
-/* Job queue */
+/* Job queue with one FIFO lane per priority class */
 typedef struct jobqueue{
 	pthread_mutex_t rwmutex;             /* used for queue r/w access */
-	job  *front;                         /* pointer to front of queue */
-	job  *rear;                          /* pointer to rear  of queue */
-	bsem *has_jobs;                      /* flag as binary semaphore  */
+	job  *front[THPOOL_NUM_PRIO];        /* pointer to front of lanes */
+	job  *rear[THPOOL_NUM_PRIO];         /* pointer to rear  of lanes */
+	int   lane_len[THPOOL_NUM_PRIO];     /* number of jobs in lanes   */
+	atomic_int ready;                    /* jobs that can be pulled   */
+	parking parking;                     /* idle threads              */
 	int   len;                           /* number of jobs in queue   */
+	int   low_working;                   /* low prio jobs running     */
+	int   low_limit;                     /* max low prio jobs running */
 } jobqueue;
 
 
 /* Thread */
 typedef struct thread{
 	int       id;                        /* friendly id               */
+	int       spin_limit;                /* adaptive spin iterations  */
 	pthread_t pthread;                   /* pointer to actual thread  */
 	struct thpool_* thpool_p;            /* access to thpool          */
 } thread;
@@ -105,18 +136,21 @@ static int  thread_init(thpool_* thpool_p, struct thread** thread_p, int id);
 static void* thread_do(struct thread* thread_p);
 static void  thread_hold(int sig_id);
 static void  thread_destroy(struct thread* thread_p);
+static void  thread_park(struct thread* thread_p);
 
 static int   jobqueue_init(jobqueue* jobqueue_p);
 static void  jobqueue_clear(jobqueue* jobqueue_p);
 static void  jobqueue_push(jobqueue* jobqueue_p, struct job* newjob_p);
 static struct job* jobqueue_pull(jobqueue* jobqueue_p);
+static void  jobqueue_done(jobqueue* jobqueue_p, struct job* job_p);
+static void  jobqueue_update_ready(jobqueue* jobqueue_p);
+static void  jobqueue_notify(jobqueue* jobqueue_p);
 static void  jobqueue_destroy(jobqueue* jobqueue_p);
 
-static void  bsem_init(struct bsem *bsem_p, int value);
-static void  bsem_reset(struct bsem *bsem_p);
-static void  bsem_post(struct bsem *bsem_p);
-static void  bsem_post_all(struct bsem *bsem_p);
-static void  bsem_wait(struct bsem *bsem_p);
+static void  parking_init(parking* parking_p);
+static void  parking_wait(parking* parking_p, unsigned int key);
+static void  parking_wake(parking* parking_p, int num_threads);
+static void  parking_destroy(parking* parking_p);
 
 
 
@@ -147,10 +181,11 @@ struct thpool_* thpool_init(int num_threads){
 
 	/* Initialise the job queue */
 	if (jobqueue_init(&thpool_p->jobqueue) == -1){
-		err("thpool_init(): Could not allocate memory for job queue\n");
+		err("thpool_init(): Could not initialize job queue\n");
 		free(thpool_p);
 		return NULL;
 	}
+	thpool_p->jobqueue.low_limit = (num_threads > 0) ? num_threads : 1;
 
 	/* Make threads in pool */
 	thpool_p->threads = (struct thread**)malloc(num_threads * sizeof(struct thread *));
@@ -182,8 +217,19 @@ struct thpool_* thpool_init(int num_threads){
 
 /* Add work to the thread pool */
 int thpool_add_work(thpool_* thpool_p, void (*function_p)(void*), void* arg_p){
+	return thpool_add_work_prio(thpool_p, function_p, arg_p, THPOOL_PRIO_HIGH);
+}
+
+
+/* Add work to the thread pool lane for a priority class */
+int thpool_add_work_prio(thpool_* thpool_p, void (*function_p)(void*), void* arg_p, thpool_prio prio){
 	job* newjob;
 
+	if (prio < THPOOL_PRIO_HIGH || prio >= THPOOL_NUM_PRIO){
+		err("thpool_add_work_prio(): Invalid priority class\n");
+		return -1;
+	}
+
 	newjob=(struct job*)malloc(sizeof(struct job));
 	if (newjob==NULL){
 		err("thpool_add_work(): Could not allocate memory for new job\n");
@@ -193,6 +239,7 @@ int thpool_add_work(thpool_* thpool_p, void (*function_p)(void*), void* arg_p){
 	/* add function and argument */
 	newjob->function=function_p;
 	newjob->arg=arg_p;
+	newjob->prio=prio;
 
 	/* add job to queue */
 	jobqueue_push(&thpool_p->jobqueue, newjob);
@@ -227,14 +274,14 @@ void thpool_destroy(thpool_* thpool_p){
 	double tpassed = 0.0;
 	time (&start);
 	while (tpassed < TIMEOUT && thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue.has_jobs);
+		parking_wake(&thpool_p->jobqueue.parking, INT_MAX);
 		time (&end);
 		tpassed = difftime(end,start);
 	}
 
 	/* Poll remaining threads */
 	while (thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue.has_jobs);
+		parking_wake(&thpool_p->jobqueue.parking, INT_MAX);
 		sleep(1);
 	}
 
@@ -275,6 +322,23 @@ int thpool_num_threads_working(thpool_* thpool_p){
 }
 
 
+/* Reserve threads for high priority jobs */
+void thpool_set_reserved(thpool_* thpool_p, int num_reserved){
+	int num_threads = thpool_p->num_threads_alive;
+	if (num_reserved < 0){
+		num_reserved = 0;
+	}
+
+	pthread_mutex_lock(&thpool_p->jobqueue.rwmutex);
+	thpool_p->jobqueue.low_limit = (num_threads - num_reserved > 0) ? num_threads - num_reserved : 1;
+	jobqueue_update_ready(&thpool_p->jobqueue);
+	pthread_mutex_unlock(&thpool_p->jobqueue.rwmutex);
+
+	/* a raised limit may make waiting low priority jobs runnable */
+	parking_wake(&thpool_p->jobqueue.parking, INT_MAX);
+}
+
+
 
 
 
@@ -297,6 +361,7 @@ static int thread_init (thpool_* thpool_p, struct thread** thread_p, int id){
 
 	(*thread_p)->thpool_p = thpool_p;
 	(*thread_p)->id       = id;
+	(*thread_p)->spin_limit = THPOOL_SPIN_MIN;
 
 	pthread_create(&(*thread_p)->pthread, NULL, (void *)thread_do, (*thread_p));
 	pthread_detach((*thread_p)->pthread);
@@ -358,7 +423,12 @@ static void* thread_do(struct thread* thread_p){
 
 	while(threads_keepalive){
 
-		bsem_wait(thpool_p->jobqueue.has_jobs);
+		/* Read job from queue or park until one is pushed */
+		job* job_p = jobqueue_pull(&thpool_p->jobqueue);
+		if (job_p == NULL){
+			thread_park(thread_p);
+			continue;
+		}
 
 		if (threads_keepalive){
 
@@ -366,16 +436,14 @@ static void* thread_do(struct thread* thread_p){
 			thpool_p->num_threads_working++;
 			pthread_mutex_unlock(&thpool_p->thcount_lock);
 
-			/* Read job from queue and execute it */
+			/* Execute job */
 			void (*func_buff)(void*);
 			void*  arg_buff;
-			job* job_p = jobqueue_pull(&thpool_p->jobqueue);
-			if (job_p) {
-				func_buff = job_p->function;
-				arg_buff  = job_p->arg;
-				func_buff(arg_buff);
-				free(job_p);
-			}
+			func_buff = job_p->function;
+			arg_buff  = job_p->arg;
+			func_buff(arg_buff);
+			jobqueue_done(&thpool_p->jobqueue, job_p);
+			free(job_p);
 
 			pthread_mutex_lock(&thpool_p->thcount_lock);
 			thpool_p->num_threads_working--;
@@ -384,6 +452,9 @@ static void* thread_do(struct thread* thread_p){
 			}
 			pthread_mutex_unlock(&thpool_p->thcount_lock);
 
+		} else {
+			jobqueue_done(&thpool_p->jobqueue, job_p);
+			free(job_p);
 		}
 	}
 	pthread_mutex_lock(&thpool_p->thcount_lock);
@@ -394,6 +465,51 @@ static void* thread_do(struct thread* thread_p){
 }
 
 
+/* Park an idle thread until a job may be runnable
+ *
+ * The thread first spins for up to spin_limit iterations watching the
+ * ready count, so that a job pushed shortly after costs no futex round
+ * trip. The spin limit adapts: it doubles when spinning found work and
+ * halves when the thread had to sleep anyway. While a thread spins,
+ * pushers do not wake sleepers for jobs the spinner will take.
+ */
+static void thread_park(thread* thread_p){
+	jobqueue* jobqueue_p = &thread_p->thpool_p->jobqueue;
+	parking* parking_p = &jobqueue_p->parking;
+
+	atomic_fetch_add(&parking_p->spinning, 1);
+	int n;
+	for (n=0; n<thread_p->spin_limit; n++){
+		if (atomic_load(&jobqueue_p->ready) > 0 || !threads_keepalive){
+			atomic_fetch_sub(&parking_p->spinning, 1);
+			if (thread_p->spin_limit < THPOOL_SPIN_MAX){
+				thread_p->spin_limit *= 2;
+			}
+			return;
+		}
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		__asm__ __volatile__("yield");
+#endif
+	}
+	if (thread_p->spin_limit > THPOOL_SPIN_MIN){
+		thread_p->spin_limit /= 2;
+	}
+
+	/* Announce sleep before giving up spinning, then re-check for
+	 * jobs pushed in between; a wakeup after reading the key makes
+	 * parking_wait() return immediately */
+	unsigned int key = atomic_load(&parking_p->epoch);
+	atomic_fetch_add(&parking_p->sleeping, 1);
+	atomic_fetch_sub(&parking_p->spinning, 1);
+	if (atomic_load(&jobqueue_p->ready) == 0 && threads_keepalive){
+		parking_wait(parking_p, key);
+	}
+	atomic_fetch_sub(&parking_p->sleeping, 1);
+}
+
+
 /* Frees a thread  */
 static void thread_destroy (thread* thread_p){
 	free(thread_p);
@@ -408,17 +524,19 @@ static void thread_destroy (thread* thread_p){
 
 /* Initialize queue */
 static int jobqueue_init(jobqueue* jobqueue_p){
-	jobqueue_p->len = 0;
-	jobqueue_p->front = NULL;
-	jobqueue_p->rear  = NULL;
-
-	jobqueue_p->has_jobs = (struct bsem*)malloc(sizeof(struct bsem));
-	if (jobqueue_p->has_jobs == NULL){
-		return -1;
+	int prio;
+	for (prio=0; prio<THPOOL_NUM_PRIO; prio++){
+		jobqueue_p->front[prio]    = NULL;
+		jobqueue_p->rear[prio]     = NULL;
+		jobqueue_p->lane_len[prio] = 0;
 	}
+	jobqueue_p->len = 0;
+	jobqueue_p->low_working = 0;
+	jobqueue_p->low_limit = 1;
+	atomic_init(&jobqueue_p->ready, 0);
 
 	pthread_mutex_init(&(jobqueue_p->rwmutex), NULL);
-	bsem_init(jobqueue_p->has_jobs, 0);
+	parking_init(&jobqueue_p->parking);
 
 	return 0;
 }
@@ -427,18 +545,48 @@ static int jobqueue_init(jobqueue* jobqueue_p){
 /* Clear the queue */
 static void jobqueue_clear(jobqueue* jobqueue_p){
 
-	while(jobqueue_p->len){
-		free(jobqueue_pull(jobqueue_p));
+	int prio;
+	for (prio=0; prio<THPOOL_NUM_PRIO; prio++){
+		while (jobqueue_p->front[prio]){
+			job* job_p = jobqueue_p->front[prio];
+			jobqueue_p->front[prio] = job_p->prev;
+			free(job_p);
+		}
+		jobqueue_p->rear[prio]     = NULL;
+		jobqueue_p->lane_len[prio] = 0;
 	}
 
-	jobqueue_p->front = NULL;
-	jobqueue_p->rear  = NULL;
-	bsem_reset(jobqueue_p->has_jobs);
+	atomic_store(&jobqueue_p->ready, 0);
 	jobqueue_p->len = 0;
 
 }
 
 
+/* Update the number of jobs that can be pulled now
+ *
+ * Notice: Caller MUST hold rwmutex
+ */
+static void jobqueue_update_ready(jobqueue* jobqueue_p){
+	int low_free = jobqueue_p->low_limit - jobqueue_p->low_working;
+	int low_ready = jobqueue_p->lane_len[THPOOL_PRIO_LOW];
+	if (low_ready > low_free){
+		low_ready = (low_free > 0) ? low_free : 0;
+	}
+	atomic_store(&jobqueue_p->ready, jobqueue_p->lane_len[THPOOL_PRIO_HIGH] + low_ready);
+}
+
+
+/* Wake a sleeping thread if there are more ready jobs than
+ * spinning threads that will pick them up */
+static void jobqueue_notify(jobqueue* jobqueue_p){
+	parking* parking_p = &jobqueue_p->parking;
+	if (   atomic_load(&jobqueue_p->ready) > atomic_load(&parking_p->spinning)
+	    && atomic_load(&parking_p->sleeping) > 0){
+		parking_wake(parking_p, 1);
+	}
+}
+
+
 /* Add (allocated) job to queue
  */
 static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
@@ -446,65 +594,97 @@ static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
 	pthread_mutex_lock(&jobqueue_p->rwmutex);
 	newjob->prev = NULL;
 
-	switch(jobqueue_p->len){
+	thpool_prio prio = newjob->prio;
+	switch(jobqueue_p->lane_len[prio]){
 
-		case 0:  /* if no jobs in queue */
-					jobqueue_p->front = newjob;
-					jobqueue_p->rear  = newjob;
+		case 0:  /* if no jobs in lane */
+					jobqueue_p->front[prio] = newjob;
+					jobqueue_p->rear[prio]  = newjob;
 					break;
 
-		default: /* if jobs in queue */
-					jobqueue_p->rear->prev = newjob;
-					jobqueue_p->rear = newjob;
+		default: /* if jobs in lane */
+					jobqueue_p->rear[prio]->prev = newjob;
+					jobqueue_p->rear[prio] = newjob;
 
 	}
+	jobqueue_p->lane_len[prio]++;
 	jobqueue_p->len++;
+	jobqueue_update_ready(jobqueue_p);
 
-	bsem_post(jobqueue_p->has_jobs);
 	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	jobqueue_notify(jobqueue_p);
 }
 
 
-/* Get first job from queue(removes it from queue)
-<<<<<<< HEAD
+/* Get first runnable job from queue(removes it from queue)
  *
- * Notice: Caller MUST hold a mutex
-=======
->>>>>>> da2c0fe45e43ce0937f272c8cd2704bdc0afb490
+ * High priority jobs are taken first. A low priority job is only
+ * taken while fewer than low_limit low priority jobs are running.
+ * Returns NULL if no job is runnable.
  */
 static struct job* jobqueue_pull(jobqueue* jobqueue_p){
 
 	pthread_mutex_lock(&jobqueue_p->rwmutex);
-	job* job_p = jobqueue_p->front;
 
-	switch(jobqueue_p->len){
+	thpool_prio prio = THPOOL_PRIO_HIGH;
+	if (jobqueue_p->lane_len[THPOOL_PRIO_HIGH] == 0){
+		prio = THPOOL_PRIO_LOW;
+		if (jobqueue_p->low_working >= jobqueue_p->low_limit){
+			pthread_mutex_unlock(&jobqueue_p->rwmutex);
+			return NULL;
+		}
+	}
+	job* job_p = jobqueue_p->front[prio];
+
+	switch(jobqueue_p->lane_len[prio]){
 
-		case 0:  /* if no jobs in queue */
+		case 0:  /* if no jobs in lane */
 		  			break;
 
-		case 1:  /* if one job in queue */
-					jobqueue_p->front = NULL;
-					jobqueue_p->rear  = NULL;
-					jobqueue_p->len = 0;
+		case 1:  /* if one job in lane */
+					jobqueue_p->front[prio] = NULL;
+					jobqueue_p->rear[prio]  = NULL;
+					jobqueue_p->lane_len[prio] = 0;
+					jobqueue_p->len--;
 					break;
 
-		default: /* if >1 jobs in queue */
-					jobqueue_p->front = job_p->prev;
+		default: /* if >1 jobs in lane */
+					jobqueue_p->front[prio] = job_p->prev;
+					jobqueue_p->lane_len[prio]--;
 					jobqueue_p->len--;
-					/* more than one job in queue -> post it */
-					bsem_post(jobqueue_p->has_jobs);
 
 	}
+	if (job_p && prio == THPOOL_PRIO_LOW){
+		jobqueue_p->low_working++;
+	}
+
+	jobqueue_update_ready(jobqueue_p);
 
 	pthread_mutex_unlock(&jobqueue_p->rwmutex);
 	return job_p;
 }
 
 
+/* Mark a pulled job as finished */
+static void jobqueue_done(jobqueue* jobqueue_p, struct job* job_p){
+	if (job_p->prio != THPOOL_PRIO_LOW){
+		return;
+	}
+
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+	jobqueue_p->low_working--;
+	jobqueue_update_ready(jobqueue_p);
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+
+	/* a low priority slot was freed -> wake for waiting low priority job */
+	jobqueue_notify(jobqueue_p);
+}
+
+
 /* Free all queue resources back to the system */
 static void jobqueue_destroy(jobqueue* jobqueue_p){
 	jobqueue_clear(jobqueue_p);
-	free(jobqueue_p->has_jobs);
+	parking_destroy(&jobqueue_p->parking);
 }
 
 
@@ -514,48 +694,55 @@ static void jobqueue_destroy(jobqueue* jobqueue_p){
 /* ======================== SYNCHRONISATION ========================= */
 
 
-/* Init semaphore to 1 or 0 */
-static void bsem_init(bsem *bsem_p, int value) {
-	if (value < 0 || value > 1) {
-		err("bsem_init(): Binary semaphore can take only values 1 or 0");
-		exit(1);
-	}
-	pthread_mutex_init(&(bsem_p->mutex), NULL);
-	pthread_cond_init(&(bsem_p->cond), NULL);
-	bsem_p->v = value;
-}
-
-
-/* Reset semaphore to 0 */
-static void bsem_reset(bsem *bsem_p) {
-	bsem_init(bsem_p, 0);
+/* Init parking lot with no spinning or sleeping threads */
+static void parking_init(parking* parking_p) {
+	atomic_init(&parking_p->epoch, 0);
+	atomic_init(&parking_p->spinning, 0);
+	atomic_init(&parking_p->sleeping, 0);
+#if !defined(__linux__)
+	pthread_mutex_init(&(parking_p->mutex), NULL);
+	pthread_cond_init(&(parking_p->cond), NULL);
+#endif
 }
 
 
-/* Post to at least one thread */
-static void bsem_post(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_signal(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+/* Sleep until the epoch no longer has the value key */
+static void parking_wait(parking* parking_p, unsigned int key) {
+#if defined(__linux__)
+	syscall(SYS_futex, (unsigned int*)&parking_p->epoch, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&parking_p->mutex);
+	while (atomic_load(&parking_p->epoch) == key) {
+		pthread_cond_wait(&parking_p->cond, &parking_p->mutex);
+	}
+	pthread_mutex_unlock(&parking_p->mutex);
+#endif
 }
 
 
-/* Post to all threads */
-static void bsem_post_all(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_broadcast(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+/* Bump the epoch and wake up to num_threads sleeping threads */
+static void parking_wake(parking* parking_p, int num_threads) {
+	atomic_fetch_add(&parking_p->epoch, 1);
+#if defined(__linux__)
+	syscall(SYS_futex, (unsigned int*)&parking_p->epoch, FUTEX_WAKE_PRIVATE, num_threads, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&parking_p->mutex);
+	if (num_threads == 1) {
+		pthread_cond_signal(&parking_p->cond);
+	} else {
+		pthread_cond_broadcast(&parking_p->cond);
+	}
+	pthread_mutex_unlock(&parking_p->mutex);
+#endif
 }
 
 
-/* Wait on semaphore until semaphore has value 0 */
-static void bsem_wait(bsem* bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	while (bsem_p->v != 1) {
-		pthread_cond_wait(&bsem_p->cond, &bsem_p->mutex);
-	}
-	bsem_p->v = 0;
-	pthread_mutex_unlock(&bsem_p->mutex);
+/* Free parking lot resources */
+static void parking_destroy(parking* parking_p) {
+#if !defined(__linux__)
+	pthread_mutex_destroy(&parking_p->mutex);
+	pthread_cond_destroy(&parking_p->cond);
+#else
+	(void)parking_p;
+#endif
 }
@@ -17,6 +17,14 @@ extern "C" {
 typedef struct thpool_* threadpool;
 
 
+/* Job priority classes, highest priority first */
+typedef enum thpool_prio {
+	THPOOL_PRIO_HIGH = 0,                /* short interactive jobs    */
+	THPOOL_PRIO_LOW  = 1,                /* long-running bulk jobs    */
+	THPOOL_NUM_PRIO  = 2
+} thpool_prio;
+
+
 
 /**
  * @brief  Initialize threadpool
@@ -68,6 +76,47 @@ threadpool thpool_init(int num_threads);
 int thpool_add_work(threadpool, void (*function_p)(void*), void* arg_p);
 
 
+/**
+ * @brief Add work to the job queue with a priority class
+ *
+ * Same as thpool_add_work() but places the job in the lane for the
+ * specified priority class. Idle threads always take THPOOL_PRIO_HIGH
+ * jobs first. THPOOL_PRIO_LOW jobs only run on threads that are not
+ * reserved for high priority work (see thpool_set_reserved()), so a
+ * backlog of long-running bulk jobs cannot starve short jobs.
+ *
+ * @example
+ *
+ *    thpool_add_work_prio(thpool, upload, (void*)req, THPOOL_PRIO_LOW);
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @param  prio          priority class of the job
+ * @return 0 on successs, -1 otherwise.
+ */
+int thpool_add_work_prio(threadpool, void (*function_p)(void*), void* arg_p, thpool_prio prio);
+
+
+/**
+ * @brief Reserve threads for high priority work
+ *
+ * At most (number of threads - num_reserved) threads will run
+ * THPOOL_PRIO_LOW jobs at the same time. At least one thread is
+ * always allowed to run low priority jobs. The default is 0.
+ *
+ * @example
+ *
+ *    threadpool thpool = thpool_init(8);
+ *    thpool_set_reserved(thpool, 2);   // 2 threads only run high priority jobs
+ *
+ * @param  threadpool    the threadpool
+ * @param  num_reserved  number of threads reserved for high priority jobs
+ * @return nothing
+ */
+void thpool_set_reserved(threadpool, int num_reserved);
+
+
 /**
  * @brief Wait for all queued jobs to finish
  *